@@ -0,0 +1,777 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * lksmith-analyze: check a trace written with LKSMITH_TRACE=file:/path.
+ *
+ * We replay the trace through Locksmith itself.  Every traced thread gets a
+ * replay thread, and we hand the events to the replay threads one at a time,
+ * in the order they happened, so Locksmith sees the same sequence of lock
+ * operations that the traced program performed.  Lock-order problems and
+ * misuse are reported the same way they would have been if Locksmith had
+ * been checking the program as it ran.  We also work out how long each lock
+ * was waited for and held, from the timestamps.
+ */
+
+#include "error.h"
+#include "handler.h"
+#include "lksmith.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Default number of locks to report in the contention summary.
+ */
+#define ANALYZE_DEFAULT_TOP 10
+
+struct analyze_sym {
+	/** The return address */
+	uint64_t addr;
+	/** Its name */
+	char *name;
+};
+
+struct analyze_stack {
+	/** Number of frames */
+	int nframes;
+	/** The return addresses */
+	uint64_t *frames;
+};
+
+struct analyze_event {
+	/** The record */
+	const struct lksmith_trace_rec *rec;
+	/** The position of the record in the file */
+	uint64_t seq;
+};
+
+struct analyze_lock {
+	/** The lock, or 0 if this slot is empty */
+	uint64_t ptr;
+	/** The first call site which took the lock */
+	uint64_t site;
+	/** Number of attempts to take the lock */
+	uint64_t acquisitions;
+	/** Number of attempts which didn't get the lock */
+	uint64_t failures;
+	/** Total and longest time spent waiting for the lock */
+	uint64_t wait_total, wait_max;
+	/** Total and longest time the lock was held */
+	uint64_t hold_total, hold_max;
+};
+
+struct analyze_held {
+	/** The lock */
+	uint64_t ptr;
+	/** When we got it */
+	uint64_t acquired;
+};
+
+struct analyze_thread {
+	/** The traced thread's ID */
+	uint32_t tid;
+	/** The replay thread */
+	pthread_t thread;
+	/** Posted when rec is ready to be replayed */
+	sem_t go;
+	/** The event to replay, or NULL if the replay thread should exit */
+	const struct lksmith_trace_rec *rec;
+	/** The stack of the last lock operation which had one */
+	uint32_t last_stack;
+	/** When the lock acquisition in progress started */
+	uint64_t pre_ts;
+	/** The call site of the lock acquisition in progress */
+	uint64_t pre_site;
+	/** Locks held, in the order they were taken */
+	struct analyze_held *held;
+	/** Number of locks held, and room for them */
+	size_t num_held, held_cap;
+	/** Next thread in g_threads */
+	struct analyze_thread *next;
+};
+
+/** Symbols from the .syms file, sorted by address */
+static struct analyze_sym *g_syms;
+static size_t g_num_syms;
+
+/** Stacks, indexed by ID */
+static struct analyze_stack *g_stacks;
+static size_t g_num_stacks;
+
+/** Events, in the order they happened */
+static struct analyze_event *g_events;
+static size_t g_num_events;
+
+/** Hash table of locks.  The size is a power of 2. */
+static struct analyze_lock *g_locks;
+static size_t g_num_locks, g_lock_slots;
+
+/** Replay threads */
+static struct analyze_thread *g_threads;
+static size_t g_num_threads;
+
+/** Posted when a replay thread has finished an event */
+static sem_t g_done;
+
+/** The stack of the event being replayed, or 0 */
+static uint32_t g_cur_stack;
+
+/** Number of problems Locksmith has reported */
+static uint64_t g_num_problems;
+
+static char g_log_env[128];
+
+static void usage(void)
+{
+	fprintf(stderr,
+"lksmith-analyze: check a trace written with LKSMITH_TRACE.\n"
+"\n"
+"usage: lksmith-analyze [-t <num>] <trace file>\n"
+"\n"
+"-t <num>     Report the <num> most contended locks (default %d).\n"
+"\n"
+"The other Locksmith settings, such as LKSMITH_CLASS_BY_SITE and\n"
+"LKSMITH_IGNORED_FRAMES, apply to the analysis.\n",
+		ANALYZE_DEFAULT_TOP);
+}
+
+static int compare_syms(const void *a, const void *b)
+{
+	const struct analyze_sym *sa = a, *sb = b;
+
+	if (sa->addr != sb->addr)
+		return (sa->addr < sb->addr) ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Load the frame names which the traced process wrote out when it exited.
+ *
+ * @param path		The path of the trace file.
+ *
+ * @return		0 on success, or if there is no symbol file; error
+ *			code otherwise
+ */
+static int load_syms(const char *path)
+{
+	char fname[4096], line[4096], *end;
+	struct analyze_sym *syms;
+	size_t cap = 0;
+	uint64_t addr;
+	FILE *fp;
+
+	snprintf(fname, sizeof(fname), "%s.syms", path);
+	fp = fopen(fname, "r");
+	if (!fp) {
+		fprintf(stderr, "lksmith-analyze: no symbols in %s, so stacks "
+			"will be shown as addresses.\n", fname);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		addr = strtoull(line, &end, 16);
+		if (*end != ' ')
+			continue;
+		if (g_num_syms == cap) {
+			cap = cap ? (cap * 2) : 256;
+			syms = realloc(g_syms, sizeof(*syms) * cap);
+			if (!syms)
+				goto oom;
+			g_syms = syms;
+		}
+		g_syms[g_num_syms].addr = addr;
+		g_syms[g_num_syms].name = strdup(end + 1);
+		if (!g_syms[g_num_syms].name)
+			goto oom;
+		g_num_syms++;
+	}
+	fclose(fp);
+	qsort(g_syms, g_num_syms, sizeof(*g_syms), compare_syms);
+	return 0;
+oom:
+	fclose(fp);
+	return ENOMEM;
+}
+
+/**
+ * Get the name of a return address in the traced process.
+ *
+ * @param addr		The address.
+ * @param buf		(out param) buffer for the name, if we don't have
+ *			one.
+ * @param buf_len	Length of buf.
+ *
+ * @return		The name.
+ */
+static const char *sym_name(uint64_t addr, char *buf, size_t buf_len)
+{
+	struct analyze_sym key, *sym;
+
+	key.addr = addr;
+	sym = bsearch(&key, g_syms, g_num_syms, sizeof(*g_syms), compare_syms);
+	if (sym)
+		return sym->name;
+	snprintf(buf, buf_len, "0x%"PRIx64, addr);
+	return buf;
+}
+
+/**
+ * Print a stack from the trace.
+ *
+ * @param id		The stack ID, or 0.
+ */
+static void print_stack(uint32_t id)
+{
+	const struct analyze_stack *st;
+	char buf[32];
+	int i;
+
+	if ((id == 0) || (id >= g_num_stacks) || (!g_stacks[id].frames)) {
+		printf("    (no stack was traced)\n");
+		return;
+	}
+	st = &g_stacks[id];
+	printf("    traced stack:\n");
+	for (i = 0; i < st->nframes; i++)
+		printf("        %s\n", sym_name(st->frames[i], buf,
+			sizeof(buf)));
+}
+
+/**
+ * The Locksmith error callback.  Locksmith calls this from the replay
+ * thread, while the main thread is waiting for it.
+ */
+static void analyze_error_cb(int code, const char * __restrict msg)
+{
+	if (code == 0)
+		return;
+	g_num_problems++;
+	/* The rest of the message is the stack of the replay thread, which
+	 * isn't interesting.  We show the traced stack instead. */
+	printf("%.*s\n", (int)strcspn(msg, "\n"), msg);
+	print_stack(g_cur_stack);
+}
+
+/**
+ * Add a frame to the stack table.
+ *
+ * @param rec		The LKSMITH_TRACE_FRAME record.
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int add_frame(const struct lksmith_trace_rec *rec)
+{
+	struct analyze_stack *stacks, *st;
+	size_t num;
+
+	if (rec->stack >= g_num_stacks) {
+		num = rec->stack + 1;
+		if (num < g_num_stacks * 2)
+			num = g_num_stacks * 2;
+		stacks = realloc(g_stacks, sizeof(*stacks) * num);
+		if (!stacks)
+			return ENOMEM;
+		memset(stacks + g_num_stacks, 0,
+			sizeof(*stacks) * (num - g_num_stacks));
+		g_stacks = stacks;
+		g_num_stacks = num;
+	}
+	st = &g_stacks[rec->stack];
+	if (!st->frames) {
+		st->frames = calloc(rec->flags, sizeof(uint64_t));
+		if (!st->frames)
+			return ENOMEM;
+		st->nframes = rec->flags;
+	}
+	if ((rec->err >= 0) && (rec->err < st->nframes))
+		st->frames[rec->err] = rec->ptr;
+	return 0;
+}
+
+static int compare_events(const void *a, const void *b)
+{
+	const struct analyze_event *ea = a, *eb = b;
+
+	if (ea->rec->ts != eb->rec->ts)
+		return (ea->rec->ts < eb->rec->ts) ? -1 : 1;
+	if (ea->seq != eb->seq)
+		return (ea->seq < eb->seq) ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Read the trace file.
+ *
+ * @param path		The path of the trace file.
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int load_trace(const char *path)
+{
+	const struct lksmith_trace_header *hdr;
+	const struct lksmith_trace_rec *rec;
+	struct analyze_event *events;
+	size_t cap = 0, num_segs, seg, i, per_seg;
+	struct stat st;
+	const char *base;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = errno;
+		fprintf(stderr, "lksmith-analyze: failed to open %s: %s\n",
+			path, terror(ret));
+		return ret;
+	}
+	if (fstat(fd, &st)) {
+		ret = errno;
+		close(fd);
+		return ret;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		fprintf(stderr, "lksmith-analyze: %s is too short to be a "
+			"trace.\n", path);
+		return EINVAL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return errno;
+	hdr = (const struct lksmith_trace_header*)base;
+	if ((hdr->magic != LKSMITH_TRACE_MAGIC) ||
+			(hdr->version != LKSMITH_TRACE_VERSION) ||
+			(hdr->rec_size != sizeof(*rec)) ||
+			(hdr->segment_size < sizeof(*rec))) {
+		fprintf(stderr, "lksmith-analyze: %s is not a trace written "
+			"by this version of Locksmith.\n", path);
+		return EINVAL;
+	}
+	num_segs = (st.st_size - hdr->header_size) / hdr->segment_size;
+	per_seg = hdr->segment_size / hdr->rec_size;
+	for (seg = 0; seg < num_segs; seg++) {
+		rec = (const struct lksmith_trace_rec*)(base +
+			hdr->header_size + (seg * hdr->segment_size));
+		for (i = 0; (i < per_seg) && (rec[i].op != LKSMITH_TRACE_NONE);
+				i++) {
+			if (rec[i].op == LKSMITH_TRACE_FRAME) {
+				ret = add_frame(&rec[i]);
+				if (ret)
+					return ret;
+				continue;
+			}
+			if (g_num_events == cap) {
+				cap = cap ? (cap * 2) : 4096;
+				events = realloc(g_events,
+					sizeof(*events) * cap);
+				if (!events)
+					return ENOMEM;
+				g_events = events;
+			}
+			g_events[g_num_events].rec = &rec[i];
+			g_events[g_num_events].seq = g_num_events;
+			g_num_events++;
+		}
+	}
+	/* Each thread's events are in order in the file, and the timestamps
+	 * put the threads' events in order relative to one another. */
+	qsort(g_events, g_num_events, sizeof(*g_events), compare_events);
+	return 0;
+}
+
+/**
+ * Find a lock's slot in the contention table, adding it if necessary.
+ *
+ * @param ptr		The lock.
+ *
+ * @return		The slot, or NULL if we ran out of memory.
+ */
+static struct analyze_lock *lock_get(uint64_t ptr)
+{
+	struct analyze_lock *slots, *old;
+	size_t i, j, num_old;
+
+	if ((g_num_locks + 1) * 2 > g_lock_slots) {
+		old = g_locks;
+		num_old = g_lock_slots;
+		g_lock_slots = g_lock_slots ? (g_lock_slots * 2) : 256;
+		slots = calloc(g_lock_slots, sizeof(*slots));
+		if (!slots)
+			return NULL;
+		g_locks = slots;
+		for (i = 0; i < num_old; i++) {
+			if (!old[i].ptr)
+				continue;
+			j = (old[i].ptr * 0x9e3779b97f4a7c15ULL) >> 20;
+			for (j &= g_lock_slots - 1; g_locks[j].ptr;
+					j = (j + 1) & (g_lock_slots - 1))
+				;
+			g_locks[j] = old[i];
+		}
+		free(old);
+	}
+	i = (ptr * 0x9e3779b97f4a7c15ULL) >> 20;
+	for (i &= g_lock_slots - 1; g_locks[i].ptr;
+			i = (i + 1) & (g_lock_slots - 1)) {
+		if (g_locks[i].ptr == ptr)
+			return &g_locks[i];
+	}
+	g_locks[i].ptr = ptr;
+	g_num_locks++;
+	return &g_locks[i];
+}
+
+/**
+ * Account for a lock acquisition in the contention table.
+ *
+ * @param th		The thread.
+ * @param rec		The LKSMITH_TRACE_POSTLOCK or LKSMITH_TRACE_POSTRDLOCK
+ *			record.
+ */
+static void note_acquired(struct analyze_thread *th,
+		const struct lksmith_trace_rec *rec)
+{
+	struct analyze_lock *lk;
+	struct analyze_held *held;
+	uint64_t wait;
+
+	lk = lock_get(rec->ptr);
+	if (!lk)
+		return;
+	if (!lk->site)
+		lk->site = th->pre_site;
+	lk->acquisitions++;
+	wait = (rec->ts > th->pre_ts) ? (rec->ts - th->pre_ts) : 0;
+	lk->wait_total += wait;
+	if (wait > lk->wait_max)
+		lk->wait_max = wait;
+	if (rec->err) {
+		lk->failures++;
+		return;
+	}
+	if (th->num_held == th->held_cap) {
+		th->held_cap = th->held_cap ? (th->held_cap * 2) : 16;
+		held = realloc(th->held, sizeof(*held) * th->held_cap);
+		if (!held)
+			return;
+		th->held = held;
+	}
+	th->held[th->num_held].ptr = rec->ptr;
+	th->held[th->num_held].acquired = rec->ts;
+	th->num_held++;
+}
+
+/**
+ * Account for a lock release in the contention table.
+ *
+ * @param th		The thread.
+ * @param rec		The LKSMITH_TRACE_UNLOCK record.
+ */
+static void note_released(struct analyze_thread *th,
+		const struct lksmith_trace_rec *rec)
+{
+	struct analyze_lock *lk;
+	uint64_t hold;
+	size_t i;
+
+	for (i = th->num_held; i > 0; i--) {
+		if (th->held[i - 1].ptr == rec->ptr)
+			break;
+	}
+	if (i == 0)
+		return;
+	hold = rec->ts - th->held[i - 1].acquired;
+	memmove(&th->held[i - 1], &th->held[i],
+		sizeof(*th->held) * (th->num_held - i));
+	th->num_held--;
+	lk = lock_get(rec->ptr);
+	if (!lk)
+		return;
+	lk->hold_total += hold;
+	if (hold > lk->hold_max)
+		lk->hold_max = hold;
+}
+
+/**
+ * Replay an event on the current replay thread.
+ *
+ * @param th		The replay thread.
+ * @param rec		The event.
+ */
+static void replay(struct analyze_thread *th,
+		const struct lksmith_trace_rec *rec)
+{
+	const void *ptr = (const void*)(uintptr_t)rec->ptr;
+	const void *site = (const void*)(uintptr_t)rec->site;
+	int sleeper = !!(rec->flags & LKSMITH_TRACE_SLEEPER);
+
+	switch (rec->op) {
+	case LKSMITH_TRACE_INIT:
+		lksmith_optional_init(ptr,
+			!!(rec->flags & LKSMITH_TRACE_RECURSIVE), sleeper,
+			site);
+		break;
+	case LKSMITH_TRACE_DESTROY:
+		lksmith_destroy(ptr);
+		break;
+	case LKSMITH_TRACE_PRELOCK:
+		th->pre_ts = rec->ts;
+		th->pre_site = rec->site;
+		lksmith_prelock(ptr, sleeper, site);
+		break;
+	case LKSMITH_TRACE_PRERDLOCK:
+		th->pre_ts = rec->ts;
+		th->pre_site = rec->site;
+		lksmith_prerdlock(ptr, site);
+		break;
+	case LKSMITH_TRACE_POSTLOCK:
+		lksmith_postlock(ptr, rec->err);
+		note_acquired(th, rec);
+		break;
+	case LKSMITH_TRACE_POSTRDLOCK:
+		lksmith_postrdlock(ptr, rec->err);
+		note_acquired(th, rec);
+		break;
+	case LKSMITH_TRACE_UNLOCK:
+		if (lksmith_preunlock(ptr) == 0)
+			lksmith_postunlock(ptr);
+		note_released(th, rec);
+		break;
+	case LKSMITH_TRACE_WAIT:
+		lksmith_prewait(ptr, site);
+		break;
+	case LKSMITH_TRACE_POST:
+		lksmith_prepost(ptr, site);
+		break;
+	case LKSMITH_TRACE_BARRIER:
+		lksmith_barrier_wait(ptr, site);
+		break;
+	default:
+		break;
+	}
+}
+
+static void *replay_thread_main(void *v)
+{
+	struct analyze_thread *th = v;
+	char name[LKSMITH_THREAD_NAME_MAX];
+
+	snprintf(name, sizeof(name), "traced_%"PRIu32, th->tid);
+	lksmith_set_thread_name(name);
+	while (1) {
+		while (r_sem_wait(&th->go) && (errno == EINTR))
+			;
+		if (!th->rec)
+			break;
+		replay(th, th->rec);
+		r_sem_post(&g_done);
+	}
+	return NULL;
+}
+
+/**
+ * Get the replay thread for a traced thread, starting it if necessary.
+ *
+ * @param tid		The traced thread's ID.
+ *
+ * @return		The replay thread, or NULL on error.
+ */
+static struct analyze_thread *thread_get(uint32_t tid)
+{
+	struct analyze_thread *th;
+
+	for (th = g_threads; th; th = th->next) {
+		if (th->tid == tid)
+			return th;
+	}
+	th = calloc(1, sizeof(*th));
+	if (!th)
+		return NULL;
+	th->tid = tid;
+	if (r_sem_init(&th->go, 0, 0))
+		goto error;
+	if (pthread_create(&th->thread, NULL, replay_thread_main, th)) {
+		r_sem_destroy(&th->go);
+		goto error;
+	}
+	th->next = g_threads;
+	g_threads = th;
+	g_num_threads++;
+	return th;
+error:
+	free(th);
+	return NULL;
+}
+
+/**
+ * Replay every event in the trace.
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int replay_all(void)
+{
+	const struct lksmith_trace_rec *rec;
+	struct analyze_thread *th;
+	size_t i;
+
+	for (i = 0; i < g_num_events; i++) {
+		rec = g_events[i].rec;
+		th = thread_get(rec->tid);
+		if (!th) {
+			fprintf(stderr, "lksmith-analyze: failed to start a "
+				"replay thread.\n");
+			return ENOMEM;
+		}
+		if (rec->stack)
+			th->last_stack = rec->stack;
+		g_cur_stack = rec->stack ? rec->stack : th->last_stack;
+		th->rec = rec;
+		r_sem_post(&th->go);
+		while (r_sem_wait(&g_done) && (errno == EINTR))
+			;
+	}
+	/* The replay threads still hold whatever their traced threads held
+	 * at the end, so we leave them be until we exit. */
+	return 0;
+}
+
+static int compare_locks(const void *a, const void *b)
+{
+	const struct analyze_lock *la = a, *lb = b;
+
+	if (la->wait_total != lb->wait_total)
+		return (la->wait_total > lb->wait_total) ? -1 : 1;
+	if (la->acquisitions != lb->acquisitions)
+		return (la->acquisitions > lb->acquisitions) ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Report the most contended locks.
+ *
+ * @param top_n		The number of locks to report.
+ */
+static void report_contention(int top_n)
+{
+	struct analyze_lock *locks;
+	size_t i, num = 0;
+	char buf[32];
+
+	locks = malloc(sizeof(*locks) * (g_num_locks + 1));
+	if (!locks)
+		return;
+	for (i = 0; i < g_lock_slots; i++) {
+		if (g_locks[i].ptr)
+			locks[num++] = g_locks[i];
+	}
+	qsort(locks, num, sizeof(*locks), compare_locks);
+	printf("The %d most contended of %zu locks, by total wait time:\n",
+		((size_t)top_n < num) ? top_n : (int)num, num);
+	for (i = 0; (i < num) && (i < (size_t)top_n); i++) {
+		printf("lock 0x%"PRIx64": %"PRIu64" acquisitions, %"PRIu64
+			" failed, wait total %.1fus max %.1fus, hold total "
+			"%.1fus max %.1fus\n", locks[i].ptr,
+			locks[i].acquisitions, locks[i].failures,
+			locks[i].wait_total / 1000.0,
+			locks[i].wait_max / 1000.0,
+			locks[i].hold_total / 1000.0,
+			locks[i].hold_max / 1000.0);
+		if (locks[i].site) {
+			printf("    first taken at %s\n",
+				sym_name(locks[i].site, buf, sizeof(buf)));
+		}
+	}
+	free(locks);
+}
+
+int main(int argc, char **argv)
+{
+	int c, ret, top_n = ANALYZE_DEFAULT_TOP;
+
+	while ((c = getopt(argc, argv, "ht:")) != -1) {
+		switch (c) {
+		case 't':
+			top_n = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind + 1 != argc) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	/* This has to happen before Locksmith is initialized, which is the
+	 * first time we call into it. */
+	unsetenv("LKSMITH_TRACE");
+	setenv("LKSMITH_BACKTRACE_MODE", "never", 1);
+	snprintf(g_log_env, sizeof(g_log_env), "callback://0x%"PRIxPTR,
+		(uintptr_t)analyze_error_cb);
+	setenv("LKSMITH_LOG", g_log_env, 1);
+	ret = load_syms(argv[optind]);
+	if (!ret)
+		ret = load_trace(argv[optind]);
+	if (ret) {
+		fprintf(stderr, "lksmith-analyze: failed to read the trace: "
+			"%s\n", terror(ret));
+		return EXIT_FAILURE;
+	}
+	/* The replay threads hold the replayed locks while they wait for
+	 * their next event.  We use the real semaphore functions for that, so
+	 * that Locksmith doesn't order our handoffs against the traced locks.
+	 * They are loaded when Locksmith initializes. */
+	if (init_tls() || r_sem_init(&g_done, 0, 0)) {
+		fprintf(stderr, "lksmith-analyze: sem_init failed.\n");
+		return EXIT_FAILURE;
+	}
+	if (replay_all())
+		return EXIT_FAILURE;
+	lksmith_flush_edges();
+	printf("Replayed %zu events from %zu threads.  Found %"PRIu64
+		" problems.\n", g_num_events, g_num_threads,
+		g_num_problems);
+	report_contention(top_n);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "backtrace.h"
+#include "handler.h"
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Symbol cache shared by all backtrace backends.
+ *
+ * Symbolizing a frame means a dladdr or an unwinder lookup, plus some
+ * allocation.  We only do it when printing an error, but the same addresses
+ * tend to show up in error after error, so each name is cached forever once
+ * it has been looked up.
+ */
+
+#define INITIAL_SYMBOL_CACHE_SIZE 256
+
+/** Name we print when we can't look up a frame. */
+#define UNKNOWN_FRAME_NAME "(unknown)"
+
+struct bt_symbol {
+	/** The return address, or NULL if this slot is empty. */
+	void *frame;
+	/** The malloc'ed name for the address. */
+	char *name;
+};
+
+/**
+ * Protects the symbol cache.
+ */
+static pthread_mutex_t g_symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Open-addressed hash table of cached symbols.
+ */
+static struct bt_symbol *g_symbols;
+
+/**
+ * Number of slots in g_symbols.  Always a power of 2.
+ */
+static size_t g_symbols_size;
+
+/**
+ * Number of used slots in g_symbols.
+ */
+static size_t g_symbols_used;
+
+static struct bt_symbol *bt_symbol_slot(struct bt_symbol *syms,
+		size_t size, void *frame)
+{
+	size_t i;
+
+	for (i = ptr_hash(frame) & (size - 1); ;
+			i = (i + 1) & (size - 1)) {
+		if ((syms[i].frame == frame) || (!syms[i].frame))
+			return &syms[i];
+	}
+}
+
+/**
+ * Double the size of the symbol cache.
+ * Note: you must call this function with g_symbol_lock held.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int bt_symbols_grow(void)
+{
+	size_t i, nsize;
+	struct bt_symbol *nsyms, *slot;
+
+	nsize = g_symbols_size ? (g_symbols_size * 2) :
+		INITIAL_SYMBOL_CACHE_SIZE;
+	nsyms = calloc(nsize, sizeof(*nsyms));
+	if (!nsyms)
+		return ENOMEM;
+	for (i = 0; i < g_symbols_size; i++) {
+		if (!g_symbols[i].frame)
+			continue;
+		slot = bt_symbol_slot(nsyms, nsize, g_symbols[i].frame);
+		*slot = g_symbols[i];
+	}
+	free(g_symbols);
+	g_symbols = nsyms;
+	g_symbols_size = nsize;
+	return 0;
+}
+
+const char *bt_frame_name(void *frame)
+{
+	struct bt_symbol *slot;
+	const char *name = UNKNOWN_FRAME_NAME;
+	char *nname;
+
+	r_pthread_mutex_lock(&g_symbol_lock);
+	if (g_symbols_size) {
+		slot = bt_symbol_slot(g_symbols, g_symbols_size, frame);
+		if (slot->frame) {
+			name = slot->name;
+			goto done;
+		}
+	}
+	if ((g_symbols_used + 1) * 2 > g_symbols_size) {
+		if (bt_symbols_grow())
+			goto done;
+	}
+	nname = bt_frame_symbolize(frame);
+	if (!nname)
+		goto done;
+	slot = bt_symbol_slot(g_symbols, g_symbols_size, frame);
+	slot->frame = frame;
+	slot->name = nname;
+	g_symbols_used++;
+	name = nname;
+done:
+	r_pthread_mutex_unlock(&g_symbol_lock);
+	return name;
+}
@@ -31,22 +31,43 @@
 #define LKSMITH_BACKTRACE_H
 
 /**
- * Create a backtrace
+ * Capture the raw return addresses of the current call stack.
  *
- * @param scratch         (inout) Thread-local scratch area.
+ * No symbol lookup is done here.  Symbolization is expensive, so we put it
+ * off until we actually need to print something; see bt_frame_name.
+ *
+ * @param scratch         (inout) Thread-local scratch area.  On success, the
+ *                        frames are stored here.
  * @param scratch_len     (inout) Thread-local scratch area length.
- * @param out             (out) The backtrace frames.
  *
  * @return                the number of frames on success; a negative error
  *                        code otherwise
  */
-int bt_frames_create(void ***scratch, int *scratch_len, char ***out);
+int bt_frames_create(void ***scratch, int *scratch_len);
 
 /**
- * Free backtrace frames.
+ * Look up the symbol for a single stack frame.
+ *
+ * This is implemented by each backtrace backend.  It is slow, so most code
+ * should use the caching bt_frame_name instead.
+ *
+ * @param frame           The return address to look up.
+ *
+ * @return                A malloc'ed human-readable string, or NULL on OOM.
+ */
+char *bt_frame_symbolize(void *frame);
+
+/**
+ * Get the human-readable name of a stack frame.
+ *
+ * Names are cached per address for the lifetime of the process, so each
+ * address is only symbolized once.
+ *
+ * @param frame           The return address to look up.
  *
- * @param backtrace       The frames to free
+ * @return                The name.  This string is never freed, so it is
+ *                        safe to hold on to it.  Never NULL.
  */
-void bt_frames_free(char **backtrace);
+const char *bt_frame_name(void *frame);
 
 #endif
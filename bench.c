@@ -0,0 +1,424 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Locksmith benchmarks.
+ *
+ * These aren't run as part of "make test".  lksmith_bench is linked with
+ * Locksmith, and lksmith_bench_raw is the same program built with
+ * LKSMITH_BENCH_RAW and without Locksmith; "make bench" runs both.  Every result is printed as a line of key=value pairs:
+ *
+ * bench=NAME mode=lksmith|raw threads=N param=P ops=N ns_per_op=X ops_per_sec=Y
+ *
+ * ns_per_op is the average time each thread spent on one operation, and
+ * ops_per_sec is the total throughput of all threads.
+ */
+
+#define DEFAULT_ITERATIONS 20000
+
+#define MAX_BENCH_THREADS 256
+
+#define MAX_NESTING_DEPTH 16
+
+static const char *g_mode;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+struct bench_shared {
+	/** Lock shared by all threads */
+	pthread_mutex_t lock;
+	/** Condition variable used with lock */
+	pthread_cond_t cond;
+	/** The thread whose turn it is, for ping-pong */
+	int turn;
+	/** Number of locks to nest, or 1 */
+	int depth;
+	/** Number of threads running the benchmark */
+	int num_threads;
+	/** Number of iterations each thread runs */
+	int iterations;
+	/** Barrier which starts all threads at once */
+	pthread_barrier_t start;
+};
+
+struct bench_thread;
+
+typedef int (*bench_fn_t)(struct bench_thread *bt);
+
+struct bench_thread {
+	pthread_t thread;
+	/** Index of this thread */
+	int idx;
+	/** Locks private to this thread */
+	pthread_mutex_t locks[MAX_NESTING_DEPTH];
+	/** State shared by all threads */
+	struct bench_shared *sh;
+	/** The benchmark loop */
+	bench_fn_t fn;
+	/** Number of operations this thread did */
+	uint64_t ops;
+	/** When this thread started and finished its loop */
+	uint64_t start, end;
+};
+
+static int run_uncontended(struct bench_thread *bt)
+{
+	int i;
+
+	for (i = 0; i < bt->sh->iterations; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&bt->locks[0]));
+		EXPECT_ZERO(pthread_mutex_unlock(&bt->locks[0]));
+	}
+	bt->ops = bt->sh->iterations;
+	return 0;
+}
+
+static int run_nested(struct bench_thread *bt)
+{
+	int i, j, depth = bt->sh->depth;
+
+	for (i = 0; i < bt->sh->iterations; i++) {
+		for (j = 0; j < depth; j++)
+			EXPECT_ZERO(pthread_mutex_lock(&bt->locks[j]));
+		for (j = depth - 1; j >= 0; j--)
+			EXPECT_ZERO(pthread_mutex_unlock(&bt->locks[j]));
+	}
+	bt->ops = (uint64_t)bt->sh->iterations * depth;
+	return 0;
+}
+
+/* Each thread takes its own lock, but not through the private fast path:
+ * every thread takes its neighbour's lock once first, so all the locks are
+ * shared.  The lock records were created one after another, so this is
+ * where threads writing to neighbouring records would show up. */
+static int run_shared(struct bench_thread *bt)
+{
+	struct bench_thread *next;
+	int i;
+
+	next = (bt->idx + 1 < bt->sh->num_threads) ? (bt + 1) : (bt - bt->idx);
+	EXPECT_ZERO(pthread_mutex_lock(&next->locks[0]));
+	EXPECT_ZERO(pthread_mutex_unlock(&next->locks[0]));
+	for (i = 0; i < bt->sh->iterations; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&bt->locks[0]));
+		EXPECT_ZERO(pthread_mutex_unlock(&bt->locks[0]));
+	}
+	bt->ops = bt->sh->iterations;
+	return 0;
+}
+
+static int run_contended(struct bench_thread *bt)
+{
+	int i;
+
+	for (i = 0; i < bt->sh->iterations; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&bt->sh->lock));
+		EXPECT_ZERO(pthread_mutex_unlock(&bt->sh->lock));
+	}
+	bt->ops = bt->sh->iterations;
+	return 0;
+}
+
+static int run_ping_pong(struct bench_thread *bt)
+{
+	struct bench_shared *sh = bt->sh;
+	int i;
+
+	for (i = 0; i < sh->iterations; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&sh->lock));
+		while (sh->turn != bt->idx)
+			EXPECT_ZERO(pthread_cond_wait(&sh->cond, &sh->lock));
+		sh->turn = !bt->idx;
+		EXPECT_ZERO(pthread_cond_signal(&sh->cond));
+		EXPECT_ZERO(pthread_mutex_unlock(&sh->lock));
+	}
+	bt->ops = sh->iterations;
+	return 0;
+}
+
+static int run_churn(struct bench_thread *bt)
+{
+	pthread_mutex_t lock;
+	int i;
+
+	for (i = 0; i < bt->sh->iterations; i++) {
+		EXPECT_ZERO(pthread_mutex_init(&lock, NULL));
+		EXPECT_ZERO(pthread_mutex_lock(&lock));
+		EXPECT_ZERO(pthread_mutex_unlock(&lock));
+		EXPECT_ZERO(pthread_mutex_destroy(&lock));
+	}
+	bt->ops = bt->sh->iterations;
+	return 0;
+}
+
+static int run_trylock(struct bench_thread *bt)
+{
+	int i, ret;
+
+	for (i = 0; i < bt->sh->iterations; i++) {
+		ret = pthread_mutex_trylock(&bt->sh->lock);
+		if (ret == 0) {
+			EXPECT_ZERO(pthread_mutex_unlock(&bt->sh->lock));
+		} else {
+			EXPECT_EQ(ret, EBUSY);
+		}
+	}
+	bt->ops = bt->sh->iterations;
+	return 0;
+}
+
+static void *bench_thread_wrap(void *v)
+{
+	struct bench_thread *bt = v;
+
+	int ret;
+
+	pthread_barrier_wait(&bt->sh->start);
+	bt->start = now_ns();
+	ret = bt->fn(bt);
+	bt->end = now_ns();
+	return (void*)(intptr_t)ret;
+}
+
+/**
+ * Run a benchmark and print the results.
+ *
+ * @param name		The name of the benchmark.
+ * @param fn		The benchmark loop to run in each thread.
+ * @param num_threads	Number of threads to run.
+ * @param depth		Number of locks each thread nests, for run_nested.
+ *			This is printed as the benchmark parameter.
+ * @param iterations	Number of iterations each thread runs.
+ *
+ * @return		0 on success; an error code otherwise.
+ */
+static int bench_run(const char *name, bench_fn_t fn, int num_threads,
+		int depth, int iterations)
+{
+	int i, j;
+	uint64_t start = UINT64_MAX, end = 0, elapsed, ops = 0;
+	void *rval;
+	struct bench_thread *bt;
+	struct bench_shared sh;
+
+	bt = calloc(num_threads, sizeof(*bt));
+	if (!bt)
+		return ENOMEM;
+	memset(&sh, 0, sizeof(sh));
+	EXPECT_ZERO(pthread_mutex_init(&sh.lock, NULL));
+	EXPECT_ZERO(pthread_cond_init(&sh.cond, NULL));
+	sh.depth = depth;
+	sh.num_threads = num_threads;
+	sh.iterations = iterations;
+	EXPECT_ZERO(pthread_barrier_init(&sh.start, NULL, num_threads + 1));
+	for (i = 0; i < num_threads; i++) {
+		for (j = 0; j < depth; j++)
+			EXPECT_ZERO(pthread_mutex_init(&bt[i].locks[j], NULL));
+		bt[i].idx = i;
+		bt[i].sh = &sh;
+		bt[i].fn = fn;
+		EXPECT_ZERO(pthread_create(&bt[i].thread, NULL,
+			bench_thread_wrap, &bt[i]));
+	}
+	pthread_barrier_wait(&sh.start);
+	/* The threads time themselves, since we may not be scheduled again
+	 * until they are done. */
+	for (i = 0; i < num_threads; i++) {
+		EXPECT_ZERO(pthread_join(bt[i].thread, &rval));
+		EXPECT_EQ(rval, NULL);
+		ops += bt[i].ops;
+		if (bt[i].start < start)
+			start = bt[i].start;
+		if (bt[i].end > end)
+			end = bt[i].end;
+	}
+	elapsed = end - start;
+	if (elapsed == 0)
+		elapsed = 1;
+	if (ops == 0)
+		ops = 1;
+	printf("bench=%s mode=%s threads=%d param=%d ops=%"PRIu64" "
+		"ns_per_op=%.1f ops_per_sec=%.0f\n", name, g_mode,
+		num_threads, depth, ops,
+		((double)elapsed * num_threads) / ops,
+		(ops * 1000000000.0) / elapsed);
+	for (i = 0; i < num_threads; i++) {
+		for (j = 0; j < depth; j++)
+			EXPECT_ZERO(pthread_mutex_destroy(&bt[i].locks[j]));
+	}
+	EXPECT_ZERO(pthread_barrier_destroy(&sh.start));
+	EXPECT_ZERO(pthread_cond_destroy(&sh.cond));
+	EXPECT_ZERO(pthread_mutex_destroy(&sh.lock));
+	free(bt);
+	return 0;
+}
+
+/**
+ * Run a benchmark with 1, 2, 4, ... threads, up to max_threads.
+ */
+static int bench_sweep(const char *name, bench_fn_t fn, int max_threads,
+		int iterations)
+{
+	int n;
+
+	for (n = 1; n < max_threads; n *= 2) {
+		EXPECT_ZERO(bench_run(name, fn, n, 1, iterations));
+	}
+	EXPECT_ZERO(bench_run(name, fn, max_threads, 1, iterations));
+	return 0;
+}
+
+struct startup_thread {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_barrier_t *start;
+	uint64_t begun;
+	uint64_t done;
+};
+
+static void *startup_thread_wrap(void *v)
+{
+	struct startup_thread *st = v;
+
+	pthread_barrier_wait(st->start);
+	st->begun = now_ns();
+	if (pthread_mutex_lock(&st->lock))
+		return (void*)(intptr_t)1;
+	st->done = now_ns();
+	if (pthread_mutex_unlock(&st->lock))
+		return (void*)(intptr_t)1;
+	return NULL;
+}
+
+/**
+ * Measure how long it takes many new threads to take their first lock at
+ * the same moment.
+ *
+ * A thread's first lock operation sets up its Locksmith thread-local state,
+ * which is where threads used to serialize during program startup.
+ */
+static int bench_startup(int num_threads)
+{
+	int i;
+	uint64_t start = UINT64_MAX, lat, max = 0, total = 0;
+	void *rval;
+	struct startup_thread *st;
+	pthread_barrier_t barrier;
+
+	st = calloc(num_threads, sizeof(*st));
+	if (!st)
+		return ENOMEM;
+	EXPECT_ZERO(pthread_barrier_init(&barrier, NULL, num_threads + 1));
+	for (i = 0; i < num_threads; i++) {
+		/* Statically initialize the locks, so that creating them
+		 * doesn't set up the threads' state early. */
+		st[i].lock = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+		st[i].start = &barrier;
+		EXPECT_ZERO(pthread_create(&st[i].thread, NULL,
+			startup_thread_wrap, &st[i]));
+	}
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < num_threads; i++) {
+		EXPECT_ZERO(pthread_join(st[i].thread, &rval));
+		EXPECT_EQ(rval, NULL);
+		if (st[i].begun < start)
+			start = st[i].begun;
+	}
+	for (i = 0; i < num_threads; i++) {
+		lat = (st[i].done > start) ? (st[i].done - start) : 0;
+		total += lat;
+		if (lat > max)
+			max = lat;
+	}
+	printf("bench=startup mode=%s threads=%d param=0 "
+		"mean_first_lock_ns=%.0f max_first_lock_ns=%"PRIu64"\n",
+		g_mode, num_threads, (double)total / num_threads, max);
+	EXPECT_ZERO(pthread_barrier_destroy(&barrier));
+	free(st);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads, iterations = DEFAULT_ITERATIONS, depth;
+
+	max_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 1)
+		max_threads = atoi(argv[1]);
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+	if ((max_threads < 1) || (max_threads > MAX_BENCH_THREADS) ||
+			(iterations < 1)) {
+		fprintf(stderr, "usage: %s [max-threads] [iterations]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+	/* lksmith_bench_raw isn't linked with Locksmith, but someone might
+	 * still load it with LD_PRELOAD. */
+	g_mode = dlsym(RTLD_DEFAULT, "lksmith_prelock") ? "lksmith" : "raw";
+#ifndef LKSMITH_BENCH_RAW
+	set_error_cb(die_on_error);
+#endif
+	EXPECT_ZERO(bench_sweep("uncontended", run_uncontended,
+		max_threads, iterations));
+	for (depth = 1; depth <= MAX_NESTING_DEPTH; depth *= 2) {
+		EXPECT_ZERO(bench_run("nested", run_nested, 1, depth,
+			iterations));
+	}
+	EXPECT_ZERO(bench_sweep("shared", run_shared, max_threads,
+		iterations));
+	EXPECT_ZERO(bench_sweep("contended", run_contended,
+		max_threads, iterations));
+	EXPECT_ZERO(bench_run("ping_pong", run_ping_pong, 2, 1, iterations));
+	EXPECT_ZERO(bench_sweep("churn", run_churn, max_threads, iterations));
+	EXPECT_ZERO(bench_sweep("trylock", run_trylock,
+		max_threads, iterations));
+	EXPECT_ZERO(bench_startup(MAX_BENCH_THREADS));
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_CONNS 100
+
+#define CONN_CLASS 1
+#define SESSION_CLASS 2
+#define TABLE_CLASS 3
+
+#define CONN_LEVEL 10
+#define SESSION_LEVEL 20
+#define TABLE_LEVEL 30
+
+static pthread_mutex_t g_conns[NUM_CONNS];
+static pthread_mutex_t g_session = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_table = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_other = PTHREAD_MUTEX_INITIALIZER;
+
+static int setup_classes(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_CONNS; i++) {
+		EXPECT_ZERO(pthread_mutex_init(&g_conns[i], NULL));
+		EXPECT_ZERO(lksmith_set_lock_class(&g_conns[i], CONN_CLASS,
+			CONN_LEVEL));
+	}
+	EXPECT_ZERO(lksmith_set_lock_class(&g_session, SESSION_CLASS,
+		SESSION_LEVEL));
+	EXPECT_ZERO(lksmith_set_lock_class(&g_table, TABLE_CLASS,
+		TABLE_LEVEL));
+	EXPECT_EQ(lksmith_set_lock_class(&g_other, TABLE_CLASS, 1), EINVAL);
+	EXPECT_EQ(find_recorded_error(EINVAL), 1);
+	EXPECT_EQ(lksmith_set_lock_class(&g_other, 0, 1), EINVAL);
+	EXPECT_EQ(find_recorded_error(EINVAL), 1);
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_hierarchy(void)
+{
+	struct lksmith_stats before, after;
+	int i;
+
+	EXPECT_ZERO(lksmith_get_stats(&before, sizeof(before)));
+	for (i = 0; i < NUM_CONNS; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&g_conns[i]));
+		EXPECT_ZERO(pthread_mutex_lock(&g_session));
+		EXPECT_ZERO(pthread_mutex_lock(&g_table));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_table));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_session));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_conns[i]));
+	}
+	EXPECT_ZERO(num_recorded_errors());
+	/* None of that needed the lock-order graph. */
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.edges, before.edges);
+	EXPECT_EQ(after.search_steps, before.search_steps);
+
+	EXPECT_ZERO(pthread_mutex_lock(&g_table));
+	EXPECT_ZERO(pthread_mutex_lock(&g_conns[0]));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_conns[0]));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_table));
+
+	/* Two locks of the same class can't be nested. */
+	EXPECT_ZERO(pthread_mutex_lock(&g_conns[1]));
+	EXPECT_ZERO(pthread_mutex_lock(&g_conns[2]));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_conns[2]));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_conns[1]));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_mixed_with_unclassed(void)
+{
+	struct lksmith_stats before, after;
+
+	EXPECT_ZERO(lksmith_get_stats(&before, sizeof(before)));
+	EXPECT_ZERO(pthread_mutex_lock(&g_conns[3]));
+	EXPECT_ZERO(pthread_mutex_lock(&g_other));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_other));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_conns[3]));
+	EXPECT_ZERO(pthread_mutex_lock(&g_conns[4]));
+	EXPECT_ZERO(pthread_mutex_lock(&g_other));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_other));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_conns[4]));
+	EXPECT_ZERO(num_recorded_errors());
+	/* Every connection lock is the same graph node. */
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.edges - before.edges, 1);
+	/* So the ordering applies even to connections which have never
+	 * been taken with g_other. */
+	EXPECT_ZERO(pthread_mutex_lock(&g_other));
+	EXPECT_ZERO(pthread_mutex_lock(&g_conns[5]));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_conns[5]));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_other));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_held_class_change(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_conns[6]));
+	EXPECT_EQ(lksmith_set_lock_class(&g_conns[6], SESSION_CLASS,
+		SESSION_LEVEL), EBUSY);
+	EXPECT_EQ(find_recorded_error(EBUSY), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_conns[6]));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+int main(void)
+{
+	int i;
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(setup_classes());
+	EXPECT_ZERO(test_hierarchy());
+	EXPECT_ZERO(test_mixed_with_unclassed());
+	EXPECT_ZERO(test_held_class_change());
+	for (i = 0; i < NUM_CONNS; i++) {
+		EXPECT_ZERO(pthread_mutex_destroy(&g_conns[i]));
+	}
+	EXPECT_ZERO(num_recorded_errors());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,125 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREAD_WRAPPER_VOID(fn) \
+static void *fn##_wrap(void *v __attribute__((unused))) { \
+	return (void*)(intptr_t)fn(); \
+}
+
+static pthread_mutex_t g_lock_a = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock_b = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock_c = PTHREAD_MUTEX_INITIALIZER;
+
+static char g_last_report[4096];
+
+static void save_report(int code, const char *msg)
+{
+	record_error(code, msg);
+	if (code == EDEADLK)
+		snprintf(g_last_report, sizeof(g_last_report), "%s", msg);
+}
+
+__attribute__((noinline)) int cycle_unit_take_a_then_b(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock_a));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock_b));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock_b));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock_a));
+	return 0;
+}
+
+THREAD_WRAPPER_VOID(cycle_unit_take_a_then_b);
+
+__attribute__((noinline)) int cycle_unit_take_b_then_c(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock_b));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock_c));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock_c));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock_b));
+	return 0;
+}
+
+THREAD_WRAPPER_VOID(cycle_unit_take_b_then_c);
+
+static int run_thread(void *(*fn)(void *))
+{
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(pthread_create(&thread, NULL, fn, NULL));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	return 0;
+}
+
+/**
+ * Test that an inversion through two edges is reported with the whole cycle
+ * and the stacks which created each edge, even though the threads which
+ * created them have exited.
+ */
+static int test_cycle_report(void)
+{
+	char path[256];
+
+	EXPECT_ZERO(run_thread(cycle_unit_take_a_then_b_wrap));
+	EXPECT_ZERO(run_thread(cycle_unit_take_b_then_c_wrap));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock_c));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock_a));
+	/* In case LKSMITH_DEFER_EDGES is set. */
+	lksmith_flush_edges();
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock_a));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock_c));
+	snprintf(path, sizeof(path), "The opposite order was seen before: "
+		"lock %p -> lock %p -> lock %p\n", (void*)&g_lock_a,
+		(void*)&g_lock_b, (void*)&g_lock_c);
+	EXPECT_NOT_EQ(strstr(g_last_report, path), NULL);
+	EXPECT_NOT_EQ(strstr(g_last_report, "cycle_unit_take_a_then_b"), NULL);
+	EXPECT_NOT_EQ(strstr(g_last_report, "cycle_unit_take_b_then_c"), NULL);
+	EXPECT_EQ(num_recorded_errors(), 0);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(save_report);
+	EXPECT_ZERO(test_cycle_report());
+
+	return EXIT_SUCCESS;
+}
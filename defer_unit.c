@@ -0,0 +1,162 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * This test runs with LKSMITH_DEFER_EDGES set to a long interval, so edges
+ * only reach the lock-order graph when we call lksmith_flush_edges.
+ */
+
+#define THREAD_WRAPPER_VOID(fn) \
+static void *fn##_wrap(void *v __attribute__((unused))) { \
+	return (void*)(intptr_t)fn(); \
+}
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock3 = PTHREAD_MUTEX_INITIALIZER;
+
+static int take_in_order(pthread_mutex_t *a, pthread_mutex_t *b)
+{
+	EXPECT_ZERO(pthread_mutex_lock(a));
+	EXPECT_ZERO(pthread_mutex_lock(b));
+	EXPECT_ZERO(pthread_mutex_unlock(b));
+	EXPECT_ZERO(pthread_mutex_unlock(a));
+	return 0;
+}
+
+static int test_inversion_reported_on_flush(void)
+{
+	struct lksmith_stats before, after;
+
+	EXPECT_ZERO(lksmith_get_stats(&before, sizeof(before)));
+	EXPECT_ZERO(take_in_order(&g_lock1, &g_lock2));
+	EXPECT_ZERO(take_in_order(&g_lock2, &g_lock1));
+	/* Nothing has been merged yet. */
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.edges, before.edges);
+	lksmith_flush_edges();
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.edges, before.edges + 1);
+	/* Both edges are in our edge cache now, so taking the locks again
+	 * doesn't log anything. */
+	EXPECT_ZERO(take_in_order(&g_lock2, &g_lock1));
+	lksmith_flush_edges();
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_destroyed_lock_edges_dropped(void)
+{
+	struct lksmith_stats before, after;
+	pthread_mutex_t mutex;
+
+	EXPECT_ZERO(lksmith_get_stats(&before, sizeof(before)));
+	EXPECT_ZERO(pthread_mutex_init(&mutex, NULL));
+	EXPECT_ZERO(take_in_order(&g_lock3, &mutex));
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex));
+	/* A new lock at the same address doesn't inherit the old edge. */
+	EXPECT_ZERO(pthread_mutex_init(&mutex, NULL));
+	EXPECT_ZERO(take_in_order(&mutex, &g_lock3));
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex));
+	lksmith_flush_edges();
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.edges, before.edges);
+	return 0;
+}
+
+static int test_merged_lock_edges_dropped(void)
+{
+	struct lksmith_stats before, after;
+	pthread_mutex_t mutex;
+
+	EXPECT_ZERO(lksmith_get_stats(&before, sizeof(before)));
+	EXPECT_ZERO(pthread_mutex_init(&mutex, NULL));
+	EXPECT_ZERO(take_in_order(&g_lock3, &mutex));
+	lksmith_flush_edges();
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.edges, before.edges + 1);
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex));
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.edges, before.edges);
+	EXPECT_ZERO(pthread_mutex_init(&mutex, NULL));
+	EXPECT_ZERO(take_in_order(&mutex, &g_lock3));
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex));
+	lksmith_flush_edges();
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int exiting_thread(void)
+{
+	EXPECT_ZERO(take_in_order(&g_lock3, &g_lock1));
+	return 0;
+}
+
+THREAD_WRAPPER_VOID(exiting_thread);
+
+static int test_thread_exit_merges_edges(void)
+{
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(pthread_create(&thread, NULL, exiting_thread_wrap, NULL));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	/* The thread merged its own edges when it exited. */
+	EXPECT_ZERO(take_in_order(&g_lock1, &g_lock3));
+	EXPECT_ZERO(num_recorded_errors());
+	lksmith_flush_edges();
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_inversion_reported_on_flush());
+	EXPECT_ZERO(test_destroyed_lock_edges_dropped());
+	EXPECT_ZERO(test_merged_lock_edges_dropped());
+	EXPECT_ZERO(test_thread_exit_merges_edges());
+	EXPECT_ZERO(num_recorded_errors());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,303 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "depot.h"
+#include "util.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Number of hash buckets.  Must be a power of 2.
+ */
+#define DEPOT_BUCKETS 16384
+
+/**
+ * Number of stacks in each chunk of the ID table.
+ */
+#define DEPOT_CHUNK_SIZE 4096
+
+/**
+ * Maximum number of chunks in the ID table.
+ */
+#define DEPOT_MAX_CHUNKS 16384
+
+/**
+ * The highest stack ID the ID table has room for.
+ */
+#define DEPOT_MAX_ID ((DEPOT_MAX_CHUNKS * DEPOT_CHUNK_SIZE) - 1)
+
+/**
+ * The ID of an entry which is in a hash chain, but hasn't been given an ID
+ * yet.
+ */
+#define DEPOT_ID_PENDING UINT32_MAX
+
+struct depot_entry {
+	/** Next stack in this hash bucket */
+	struct depot_entry *next;
+	/** Hash of the frames */
+	uint64_t hash;
+	/** The stack ID, 0 if we ran out of IDs for it, or DEPOT_ID_PENDING
+	 * while the thread which added it is still choosing one */
+	uint32_t id;
+	/** Number of frames */
+	int nframes;
+	/** The return addresses */
+	void *frames[0];
+};
+
+/**
+ * The hash buckets.  Entries are pushed onto the heads of the chains with
+ * compare-and-swap, and never removed.
+ */
+static struct depot_entry *g_depot_buckets[DEPOT_BUCKETS];
+
+/**
+ * The ID table.  Chunks are allocated as they are needed.
+ */
+static struct depot_entry **g_depot_chunks[DEPOT_MAX_CHUNKS];
+
+/**
+ * The highest stack ID that has been handed out.
+ */
+static uint32_t g_depot_last_id;
+
+/**
+ * Number of bytes used by entries and chunks.
+ */
+static uint64_t g_depot_bytes;
+
+/**
+ * Hash a stack.
+ *
+ * @param frames	The return addresses.
+ * @param nframes	The number of return addresses.
+ *
+ * @return		The hash.
+ */
+static uint64_t depot_hash(void **frames, int nframes)
+{
+	uint64_t h = nframes;
+	int i;
+
+	for (i = 0; i < nframes; i++)
+		h = (h * 31) ^ ptr_hash(frames[i]);
+	return h;
+}
+
+/**
+ * Search part of a hash chain for a stack.
+ *
+ * @param e		The first entry to look at.
+ * @param stop		The entry to stop at, or NULL to search the whole
+ *			chain.
+ * @param hash		The hash of the stack.
+ * @param frames	The return addresses.
+ * @param nframes	The number of return addresses.
+ *
+ * @return		The entry, or NULL if it wasn't found.
+ */
+static struct depot_entry *depot_find(struct depot_entry *e,
+		struct depot_entry *stop, uint64_t hash, void **frames,
+		int nframes)
+{
+	for (; e != stop; e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE)) {
+		if ((e->hash == hash) && (e->nframes == nframes) &&
+			    (!memcmp(e->frames, frames,
+				sizeof(void*) * nframes)))
+			return e;
+	}
+	return NULL;
+}
+
+/**
+ * Get the ID of an entry in a hash chain.
+ *
+ * The thread which added the entry chooses its ID right after adding it, so
+ * we never wait long.
+ *
+ * @param e		The entry.
+ *
+ * @return		The stack ID, or 0 if the entry didn't get one.
+ */
+static uint32_t depot_entry_id(struct depot_entry *e)
+{
+	uint32_t id;
+
+	while ((id = __atomic_load_n(&e->id, __ATOMIC_ACQUIRE)) ==
+			DEPOT_ID_PENDING)
+		sched_yield();
+	return id;
+}
+
+/**
+ * Reserve a new stack ID.
+ *
+ * @return		The ID, or 0 if the ID table is full.
+ */
+static uint32_t depot_next_id(void)
+{
+	uint32_t id = __atomic_load_n(&g_depot_last_id, __ATOMIC_RELAXED);
+
+	do {
+		if (id >= DEPOT_MAX_ID)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&g_depot_last_id, &id, id + 1,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return id + 1;
+}
+
+/**
+ * Get the slot in the ID table for a stack ID, allocating its chunk if
+ * necessary.
+ *
+ * @param id		The stack ID.
+ *
+ * @return		The slot, or NULL if we ran out of memory.
+ */
+static struct depot_entry **depot_slot(uint32_t id)
+{
+	struct depot_entry **chunk, **expected = NULL;
+	uint32_t c = id / DEPOT_CHUNK_SIZE;
+
+	if (c >= DEPOT_MAX_CHUNKS)
+		return NULL;
+	chunk = __atomic_load_n(&g_depot_chunks[c], __ATOMIC_ACQUIRE);
+	if (!chunk) {
+		chunk = calloc(DEPOT_CHUNK_SIZE, sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+		if (__atomic_compare_exchange_n(&g_depot_chunks[c], &expected,
+				chunk, 0, __ATOMIC_ACQ_REL,
+				__ATOMIC_ACQUIRE)) {
+			__atomic_add_fetch(&g_depot_bytes, sizeof(*chunk) *
+				DEPOT_CHUNK_SIZE, __ATOMIC_RELAXED);
+		} else {
+			/* Somebody else got there first. */
+			free(chunk);
+			chunk = expected;
+		}
+	}
+	return &chunk[id % DEPOT_CHUNK_SIZE];
+}
+
+uint32_t depot_put(void **frames, int nframes, int *created)
+{
+	struct depot_entry **bucket, *head, *old, *dup, *e, **slot;
+	uint64_t hash;
+	uint32_t id;
+	size_t size;
+
+	if (created)
+		*created = 0;
+	if (nframes <= 0)
+		return 0;
+	hash = depot_hash(frames, nframes);
+	bucket = &g_depot_buckets[hash & (DEPOT_BUCKETS - 1)];
+	head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+	e = depot_find(head, NULL, hash, frames, nframes);
+	if (e)
+		return depot_entry_id(e);
+	/* Once the ID table is full, a stack we haven't seen can't get an
+	 * ID, so don't bother copying it. */
+	if (depot_max_id() >= DEPOT_MAX_ID)
+		return 0;
+	size = sizeof(*e) + (sizeof(void*) * nframes);
+	e = malloc(size);
+	if (!e)
+		return 0;
+	e->hash = hash;
+	e->id = DEPOT_ID_PENDING;
+	e->nframes = nframes;
+	memcpy(e->frames, frames, sizeof(void*) * nframes);
+	while (1) {
+		old = head;
+		e->next = old;
+		if (__atomic_compare_exchange_n(bucket, &head, e, 0,
+				__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+			break;
+		/* Someone else added to this bucket.  If they added our
+		 * stack, use theirs.  Nobody else has seen our entry yet. */
+		dup = depot_find(head, old, hash, frames, nframes);
+		if (dup) {
+			free(e);
+			return depot_entry_id(dup);
+		}
+	}
+	__atomic_add_fetch(&g_depot_bytes, size, __ATOMIC_RELAXED);
+	/* Only the thread whose entry made it into the chain takes an ID, so
+	 * IDs are never wasted on duplicates.  If we can't get one, the entry
+	 * stays in the chain with ID 0, and the stack is never recorded. */
+	id = depot_next_id();
+	if (id) {
+		slot = depot_slot(id);
+		if (slot) {
+			/* The entry goes into the ID table before anyone
+			 * learns its ID, so every ID which has been handed
+			 * out can be looked up. */
+			__atomic_store_n(slot, e, __ATOMIC_RELEASE);
+		} else {
+			id = 0;
+		}
+	}
+	__atomic_store_n(&e->id, id, __ATOMIC_RELEASE);
+	if (created && id)
+		*created = 1;
+	return id;
+}
+
+int depot_get(uint32_t id, void ***frames)
+{
+	struct depot_entry **chunk, *e;
+	uint32_t c = id / DEPOT_CHUNK_SIZE;
+
+	if ((id == 0) || (c >= DEPOT_MAX_CHUNKS))
+		return 0;
+	chunk = __atomic_load_n(&g_depot_chunks[c], __ATOMIC_ACQUIRE);
+	if (!chunk)
+		return 0;
+	e = __atomic_load_n(&chunk[id % DEPOT_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+	if (!e)
+		return 0;
+	*frames = e->frames;
+	return e->nframes;
+}
+
+uint32_t depot_max_id(void)
+{
+	return __atomic_load_n(&g_depot_last_id, __ATOMIC_RELAXED);
+}
+
+uint64_t depot_bytes(void)
+{
+	return __atomic_load_n(&g_depot_bytes, __ATOMIC_RELAXED);
+}
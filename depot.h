@@ -0,0 +1,84 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_DEPOT_H
+#define LKSMITH_DEPOT_H
+
+#include <stdint.h> /* for uint32_t */
+
+/**
+ * The stack depot.
+ *
+ * Most lock acquisitions come from a small number of distinct stacks, so
+ * instead of every lock holder and edge keeping its own copy of a stack, we
+ * keep one copy of each stack here, and refer to it by a 32-bit ID.  The
+ * depot only ever grows, and neither looking up a stack nor adding one takes
+ * a lock.  ID 0 means "no stack."
+ */
+
+/**
+ * Get the ID of a stack, adding it to the depot if it isn't there.
+ *
+ * @param frames	The return addresses.
+ * @param nframes	The number of return addresses.
+ * @param created	(out param) set to 1 if the stack was added; 0 if
+ *			it was already there.  May be NULL.
+ *
+ * @return		The stack ID, or 0 if nframes <= 0, we ran out of
+ *			memory, or the depot has no more room for IDs.
+ */
+uint32_t depot_put(void **frames, int nframes, int *created);
+
+/**
+ * Get a stack from the depot.
+ *
+ * @param id		The stack ID.
+ * @param frames	(out param) the return addresses.  These are never
+ *			freed, so it's safe to hold on to them.
+ *
+ * @return		The number of return addresses, or 0 if there is no
+ *			such stack.
+ */
+int depot_get(uint32_t id, void ***frames);
+
+/**
+ * Get the highest stack ID that has been handed out.
+ *
+ * @return		The highest ID, or 0 if the depot is empty.
+ */
+uint32_t depot_max_id(void);
+
+/**
+ * Get the number of bytes used by the depot.
+ *
+ * @return		The number of bytes.
+ */
+uint64_t depot_bytes(void);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "depot.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_STACKS 500
+
+#define NUM_THREADS 4
+
+#define STACK_DEPTH 8
+
+static uint32_t g_ids[NUM_THREADS][NUM_STACKS];
+
+static char g_last_report[4096];
+
+static void make_stack(void **frames, int n)
+{
+	int i;
+
+	for (i = 0; i < STACK_DEPTH; i++)
+		frames[i] = (void*)(uintptr_t)(0x1000 + (n * 16) + i);
+}
+
+static int test_depot_interns(void)
+{
+	void *a[STACK_DEPTH], *b[STACK_DEPTH], **frames;
+	uint32_t ida, idb;
+	int created;
+
+	make_stack(a, 100000);
+	make_stack(b, 100001);
+	ida = depot_put(a, STACK_DEPTH, &created);
+	EXPECT_NOT_EQ(ida, 0);
+	EXPECT_EQ(created, 1);
+	EXPECT_EQ(depot_put(a, STACK_DEPTH, &created), ida);
+	EXPECT_EQ(created, 0);
+	idb = depot_put(b, STACK_DEPTH, &created);
+	EXPECT_NOT_EQ(idb, 0);
+	EXPECT_NOT_EQ(idb, ida);
+	EXPECT_EQ(created, 1);
+	/* A prefix of a stack is a different stack. */
+	EXPECT_NOT_EQ(depot_put(a, STACK_DEPTH - 1, NULL), ida);
+	EXPECT_EQ(depot_get(ida, &frames), STACK_DEPTH);
+	EXPECT_ZERO(memcmp(frames, a, sizeof(a)));
+	EXPECT_EQ(depot_get(idb, &frames), STACK_DEPTH);
+	EXPECT_ZERO(memcmp(frames, b, sizeof(b)));
+	EXPECT_GE(depot_max_id(), idb);
+	EXPECT_POSITIVE(depot_bytes());
+	EXPECT_ZERO(depot_put(a, 0, NULL));
+	EXPECT_ZERO(depot_get(0, &frames));
+	EXPECT_ZERO(depot_get(depot_max_id() + 1, &frames));
+	return 0;
+}
+
+static void *depot_put_thread(void *v)
+{
+	uint32_t *ids = v;
+	void *frames[STACK_DEPTH];
+	int i;
+
+	for (i = 0; i < NUM_STACKS; i++) {
+		make_stack(frames, i);
+		ids[i] = depot_put(frames, STACK_DEPTH, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * Test that threads adding the same stacks at the same time agree on their
+ * IDs, and that the threads which lose the race don't use up IDs.
+ */
+static int test_depot_threads(void)
+{
+	pthread_t threads[NUM_THREADS];
+	void **frames, *expect[STACK_DEPTH];
+	uint32_t max_id;
+	int i, j;
+
+	max_id = depot_max_id();
+	for (i = 0; i < NUM_THREADS; i++) {
+		EXPECT_ZERO(pthread_create(&threads[i], NULL,
+			depot_put_thread, g_ids[i]));
+	}
+	for (i = 0; i < NUM_THREADS; i++)
+		EXPECT_ZERO(pthread_join(threads[i], NULL));
+	EXPECT_EQ(depot_max_id(), max_id + NUM_STACKS);
+	for (j = 0; j < NUM_STACKS; j++) {
+		EXPECT_NOT_EQ(g_ids[0][j], 0);
+		for (i = 1; i < NUM_THREADS; i++)
+			EXPECT_EQ(g_ids[i][j], g_ids[0][j]);
+		make_stack(expect, j);
+		EXPECT_EQ(depot_get(g_ids[0][j], &frames), STACK_DEPTH);
+		EXPECT_ZERO(memcmp(frames, expect, sizeof(expect)));
+	}
+	return 0;
+}
+
+static void save_report(int code, const char *msg)
+{
+	record_error(code, msg);
+	if (code == EDEADLK)
+		snprintf(g_last_report, sizeof(g_last_report), "%s", msg);
+}
+
+static pthread_mutex_t g_lock_a = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock_b = PTHREAD_MUTEX_INITIALIZER;
+
+__attribute__((noinline)) int depot_unit_take_b_after_a(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock_a));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock_b));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock_b));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock_a));
+	return 0;
+}
+
+/**
+ * Test that an inversion report includes the stack which first took the
+ * locks in the opposite order.
+ */
+static int test_inversion_report(void)
+{
+	EXPECT_ZERO(depot_unit_take_b_after_a());
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock_b));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock_a));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock_a));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock_b));
+	EXPECT_NOT_EQ(strstr(g_last_report, "The opposite order was seen "
+		"before:"), NULL);
+	EXPECT_NOT_EQ(strstr(g_last_report, "depot_unit_take_b_after_a"),
+		NULL);
+	clear_recorded_errors();
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(save_report);
+	EXPECT_ZERO(test_depot_interns());
+	EXPECT_ZERO(test_depot_threads());
+	EXPECT_ZERO(test_inversion_report());
+
+	return EXIT_SUCCESS;
+}
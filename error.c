@@ -27,17 +27,22 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "backtrace.h"
+#include "config.h"
 #include "error.h"
 #include "handler.h"
 #include "util.h"
 
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 
 enum lksmith_log_type {
 	LKSMITH_LOG_UNINIT = 0,
@@ -69,6 +74,47 @@ static FILE *g_log_file;
  */
 static pthread_mutex_t g_error_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/**
+ * 1 once the log target has been set up.
+ */
+static int g_log_ready;
+
+/**
+ * 1 if reports are being written asynchronously.  Set by lksmith_log_init.
+ */
+static int g_async;
+
+/**
+ * Number of error codes that we count separately.  Errors with other codes
+ * are only counted in g_err_total.
+ */
+#define ERR_COUNT_CODES 256
+
+/**
+ * Number of errors reported with each code.
+ */
+static uint64_t g_err_counts[ERR_COUNT_CODES];
+
+/**
+ * Number of errors reported with any code.
+ */
+static uint64_t g_err_total;
+
+/**
+ * Count a reported error.  Code 0 is used for messages which are not errors,
+ * and isn't counted.
+ *
+ * @param err		The error code.
+ */
+static void err_count(int err)
+{
+	if (err == 0)
+		return;
+	if ((err > 0) && (err < ERR_COUNT_CODES))
+		__atomic_add_fetch(&g_err_counts[err], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g_err_total, 1, __ATOMIC_RELAXED);
+}
+
 static void lksmith_log_init_file(const char *name)
 {
 	int err;
@@ -138,6 +184,23 @@ static void lksmith_log_init(void)
 		g_log_type = LKSMITH_LOG_FILE;
 		g_log_file = stderr;
 	}
+	g_async = (g_log_type != LKSMITH_LOG_CALLBACK) &&
+		(!getenv("LKSMITH_LOG_SYNC"));
+	__atomic_store_n(&g_log_ready, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Make sure the log target has been set up.
+ */
+static void lksmith_log_ensure_init(void)
+{
+	if (__atomic_load_n(&g_log_ready, __ATOMIC_ACQUIRE))
+		return;
+	r_pthread_mutex_lock(&g_error_lock);
+	if (g_log_type == LKSMITH_LOG_UNINIT) {
+		lksmith_log_init();
+	}
+	r_pthread_mutex_unlock(&g_error_lock);
 }
 
 static void lksmith_errora_unlocked(int err, const char *fmt, va_list ap)
@@ -165,6 +228,483 @@ static void lksmith_error_unlocked(int err, const char *fmt, ...)
 	va_end(ap);
 }
 
+/******************************************************************
+ *  Asynchronous reports
+ *
+ *  Writing to a file or to syslog can be slow, and a burst of reports from
+ *  many threads would otherwise serialize all of them on g_error_lock.  So
+ *  each thread formats its reports into its own ring buffer, and a
+ *  background writer thread drains the rings to the log target.  Rings are
+ *  also drained when the process exits, and by lksmith_error_flush.
+ *
+ *  If a ring is full, the report is dropped and counted.  Reports with a
+ *  backtrace are also deduplicated: a report with the same error code,
+ *  format string, and stack as an earlier one is just counted, and the
+ *  writer prints the count later.
+ *
+ *  Callback targets are always synchronous, since the callback may want to
+ *  see each report as it happens.  LKSMITH_LOG_SYNC makes the other targets
+ *  synchronous too.
+ *****************************************************************/
+#ifdef HAVE_IMPROVED_TLS
+#define LKSMITH_ASYNC_REPORTS
+#endif
+
+#ifdef LKSMITH_ASYNC_REPORTS
+
+/** Size of each thread's report ring, in bytes.  Must be a power of 2. */
+#define ERR_RING_SIZE 65536
+
+/** Maximum length of a single formatted report. */
+#define ERR_REPORT_MAX 4096
+
+/** Number of entries in the deduplication table.  Must be a power of 2. */
+#define ERR_DEDUP_SIZE 1024
+
+/** Number of deduplication table entries we probe before giving up. */
+#define ERR_DEDUP_PROBES 8
+
+/** Length of the report summary we keep for each deduplication entry. */
+#define ERR_SUMMARY_LEN 128
+
+/** Shortest and longest time the writer sleeps between drains. */
+#define ERR_WRITER_MIN_MS 10
+#define ERR_WRITER_MAX_MS 500
+
+struct err_record {
+	/** Length of the report text which follows */
+	uint32_t len;
+	/** The error code */
+	int32_t err;
+};
+
+struct err_ring {
+	/** Next ring in g_rings.  Never changes once the ring is in the
+	 * list. */
+	struct err_ring *next;
+	/** 1 if a thread is using this ring */
+	int owned;
+	/** Total bytes ever written.  Only the owning thread writes this. */
+	uint64_t head __attribute__((aligned(LKSMITH_CACHE_LINE)));
+	/** Total bytes ever consumed.  Only the drainer writes this. */
+	uint64_t tail __attribute__((aligned(LKSMITH_CACHE_LINE)));
+	/** The ring buffer */
+	char buf[ERR_RING_SIZE];
+};
+
+struct err_dedup {
+	/** Deduplication key, or 0 if this entry is unused */
+	uint64_t key;
+	/** Number of duplicates which haven't been reported yet */
+	uint64_t dups;
+	/** 1 once summary has been filled in */
+	int ready;
+	/** The first line of the report */
+	char summary[ERR_SUMMARY_LEN];
+};
+
+/**
+ * All the report rings, including ones no thread owns any more.  Rings are
+ * never freed.  New rings are pushed onto the front with g_ring_lock held;
+ * the list can be walked without it.
+ */
+static struct err_ring *g_rings;
+
+/**
+ * Protects ring creation and writer startup.
+ */
+static pthread_mutex_t g_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Serializes draining the rings and writing to the log target.
+ */
+static pthread_mutex_t g_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Key used to find out when a thread that owns a ring exits.
+ * Protected by g_ring_lock.
+ */
+static pthread_key_t g_ring_key;
+
+/**
+ * 1 if g_ring_key has been created.  Protected by g_ring_lock.
+ */
+static int g_ring_key_created;
+
+/**
+ * 1 if the writer thread has been started.  Protected by g_ring_lock.
+ */
+static int g_writer_started;
+
+/**
+ * The number of reports dropped because a ring was full.
+ */
+static uint64_t g_dropped;
+
+/**
+ * The number of dropped reports we have already told the user about.
+ * Protected by g_drain_lock.
+ */
+static uint64_t g_dropped_reported;
+
+/**
+ * The deduplication table.
+ */
+static struct err_dedup g_dedup[ERR_DEDUP_SIZE];
+
+/**
+ * This thread's report ring.
+ */
+static __thread struct err_ring *t_ring;
+
+/**
+ * Write out a drained report.
+ * Note: you must call this function with g_drain_lock held.
+ *
+ * @param text		The report text.
+ */
+static void err_output(char *text)
+{
+	char *line, *saveptr = NULL;
+
+	if (g_log_type == LKSMITH_LOG_SYSLOG) {
+		for (line = strtok_r(text, "\n", &saveptr); line;
+				line = strtok_r(NULL, "\n", &saveptr)) {
+			syslog(LOG_USER | LOG_INFO, "%s", line);
+		}
+	} else {
+		fputs(text, g_log_file);
+	}
+}
+
+/**
+ * Copy bytes out of a ring, handling wraparound.
+ */
+static void err_ring_read(const struct err_ring *ring, uint64_t off,
+		void *out, size_t len)
+{
+	size_t start = off & (ERR_RING_SIZE - 1), first;
+
+	first = ERR_RING_SIZE - start;
+	if (first > len)
+		first = len;
+	memcpy(out, ring->buf + start, first);
+	memcpy((char*)out + first, ring->buf, len - first);
+}
+
+/**
+ * Copy bytes into a ring, handling wraparound.
+ */
+static void err_ring_write(struct err_ring *ring, uint64_t off,
+		const void *in, size_t len)
+{
+	size_t start = off & (ERR_RING_SIZE - 1), first;
+
+	first = ERR_RING_SIZE - start;
+	if (first > len)
+		first = len;
+	memcpy(ring->buf + start, in, first);
+	memcpy(ring->buf, (const char*)in + first, len - first);
+}
+
+/**
+ * Drain all the rings to the log target.
+ *
+ * @return		the number of reports written.
+ */
+static int err_drain(void)
+{
+	struct err_ring *ring;
+	struct err_record rec;
+	uint64_t head, tail, dropped, dups;
+	char text[ERR_REPORT_MAX + 1];
+	int i, num = 0;
+
+	r_pthread_mutex_lock(&g_drain_lock);
+	for (ring = __atomic_load_n(&g_rings, __ATOMIC_ACQUIRE); ring;
+			ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		tail = ring->tail;
+		while (tail < head) {
+			err_ring_read(ring, tail, &rec, sizeof(rec));
+			err_ring_read(ring, tail + sizeof(rec), text, rec.len);
+			text[rec.len] = '\0';
+			tail += sizeof(rec) + rec.len;
+			err_output(text);
+			num++;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	for (i = 0; i < ERR_DEDUP_SIZE; i++) {
+		if (!__atomic_load_n(&g_dedup[i].ready, __ATOMIC_ACQUIRE))
+			continue;
+		dups = __atomic_exchange_n(&g_dedup[i].dups, 0,
+			__ATOMIC_RELAXED);
+		if (dups == 0)
+			continue;
+		snprintf(text, sizeof(text), "Locksmith suppressed %llu more "
+			"copies of: %s\n", (unsigned long long)dups,
+			g_dedup[i].summary);
+		err_output(text);
+		num++;
+	}
+	dropped = __atomic_load_n(&g_dropped, __ATOMIC_RELAXED);
+	if (dropped != g_dropped_reported) {
+		snprintf(text, sizeof(text), "Locksmith dropped %llu reports "
+			"because its report buffers were full.\n",
+			(unsigned long long)(dropped - g_dropped_reported));
+		err_output(text);
+		g_dropped_reported = dropped;
+		num++;
+	}
+	if ((num > 0) && (g_log_type == LKSMITH_LOG_FILE))
+		fflush(g_log_file);
+	r_pthread_mutex_unlock(&g_drain_lock);
+	return num;
+}
+
+static void *err_writer_thread(void *v __attribute__((unused)))
+{
+	struct timespec ts;
+	unsigned int delay_ms = ERR_WRITER_MIN_MS;
+
+	while (1) {
+		if (err_drain() > 0) {
+			delay_ms = ERR_WRITER_MIN_MS;
+		} else if (delay_ms < ERR_WRITER_MAX_MS) {
+			delay_ms *= 2;
+		}
+		ts.tv_sec = delay_ms / 1000;
+		ts.tv_nsec = (delay_ms % 1000) * 1000000;
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * Reset the asynchronous report state in a forked child.
+ *
+ * The writer thread doesn't exist in the child, and neither do the threads
+ * which owned the other rings.  Anything still in the rings will be written
+ * by the parent.
+ */
+static void err_atfork_child(void)
+{
+	struct err_ring *ring;
+
+	r_pthread_mutex_init(&g_ring_lock, NULL);
+	r_pthread_mutex_init(&g_drain_lock, NULL);
+	g_writer_started = 0;
+	for (ring = g_rings; ring; ring = ring->next) {
+		ring->tail = ring->head;
+		if (ring != t_ring)
+			ring->owned = 0;
+	}
+}
+
+/**
+ * Called when a thread which owns a ring exits.  The ring's reports will
+ * still be written, and then it can be reused.
+ */
+static void err_ring_release(void *v)
+{
+	struct err_ring *ring = v;
+
+	__atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Start the writer thread.
+ * Note: you must call this function with g_ring_lock held.
+ */
+static void err_writer_start(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	sigset_t all, old;
+	int ret;
+
+	g_writer_started = 1;
+	atexit(lksmith_error_flush);
+	pthread_atfork(NULL, NULL, err_atfork_child);
+	/* The writer inherits our signal mask.  Block everything, so that
+	 * the program's signal handlers never run on our thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, err_writer_thread, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		/* Reports will still be written at exit, or by
+		 * lksmith_error_flush. */
+		fprintf(stderr, "Locksmith: failed to start the report writer "
+			"thread: error %d: %s\n", ret, terror(ret));
+	}
+}
+
+/**
+ * Get this thread's report ring, creating it if needed.
+ *
+ * @return		The ring, or NULL if we ran out of memory.
+ */
+static struct err_ring *err_ring_get(void)
+{
+	struct err_ring *ring;
+	int zero;
+
+	if (t_ring)
+		return t_ring;
+	r_pthread_mutex_lock(&g_ring_lock);
+	if (!g_ring_key_created) {
+		if (pthread_key_create(&g_ring_key, err_ring_release)) {
+			r_pthread_mutex_unlock(&g_ring_lock);
+			return NULL;
+		}
+		g_ring_key_created = 1;
+	}
+	for (ring = g_rings; ring; ring = ring->next) {
+		zero = 0;
+		if (__atomic_compare_exchange_n(&ring->owned, &zero, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!ring) {
+		ring = calloc(1, sizeof(*ring));
+		if (!ring) {
+			r_pthread_mutex_unlock(&g_ring_lock);
+			return NULL;
+		}
+		ring->owned = 1;
+		ring->next = g_rings;
+		__atomic_store_n(&g_rings, ring, __ATOMIC_RELEASE);
+	}
+	pthread_setspecific(g_ring_key, ring);
+	if (!g_writer_started)
+		err_writer_start();
+	r_pthread_mutex_unlock(&g_ring_lock);
+	t_ring = ring;
+	return ring;
+}
+
+/**
+ * Format a report into a buffer of ERR_REPORT_MAX bytes.
+ *
+ * @return		The length of the report.
+ */
+static size_t err_format(char *buf, const char *fmt, va_list ap)
+{
+	int res;
+
+	res = vsnprintf(buf, ERR_REPORT_MAX, fmt, ap);
+	if (res < 0)
+		return 0;
+	else if (res >= ERR_REPORT_MAX)
+		return ERR_REPORT_MAX - 1;
+	return res;
+}
+
+/**
+ * Put a formatted report into this thread's ring.
+ *
+ * @param err		The error code.
+ * @param text		The report.
+ * @param len		Length of the report.
+ */
+static void err_ring_push(int err, const char *text, size_t len)
+{
+	struct err_ring *ring;
+	struct err_record rec;
+	uint64_t head, tail;
+
+	ring = err_ring_get();
+	if (!ring) {
+		__atomic_add_fetch(&g_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail + sizeof(rec) + len > ERR_RING_SIZE) {
+		__atomic_add_fetch(&g_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	rec.len = len;
+	rec.err = err;
+	err_ring_write(ring, head, &rec, sizeof(rec));
+	err_ring_write(ring, head + sizeof(rec), text, len);
+	__atomic_store_n(&ring->head, head + sizeof(rec) + len,
+		__ATOMIC_RELEASE);
+}
+
+/**
+ * Compute the deduplication key of a report.
+ */
+static uint64_t err_dedup_key(int err, const char *fmt, void **frames,
+		int frames_len)
+{
+	uint64_t key;
+	int i;
+
+	key = ptr_hash(fmt) ^ ptr_hash((void*)(uintptr_t)err);
+	for (i = 0; i < frames_len; i++) {
+		key = ptr_hash((void*)(uintptr_t)(key ^ (uintptr_t)frames[i]));
+	}
+	/* 0 means "unused" in the table. */
+	return key | 1;
+}
+
+/**
+ * Look up a report in the deduplication table, adding it if it isn't there.
+ *
+ * @param key		The deduplication key.
+ * @param entry		(out param) the new entry, if we added one.  The
+ *			caller must fill in its summary.
+ *
+ * @return		1 if this is a duplicate; 0 otherwise.
+ */
+static int err_dedup_check(uint64_t key, struct err_dedup **entry)
+{
+	struct err_dedup *ent;
+	uint64_t cur;
+	int i;
+
+	*entry = NULL;
+	for (i = 0; i < ERR_DEDUP_PROBES; i++) {
+		ent = &g_dedup[(key + i) & (ERR_DEDUP_SIZE - 1)];
+		cur = __atomic_load_n(&ent->key, __ATOMIC_RELAXED);
+		if (cur == 0) {
+			if (__atomic_compare_exchange_n(&ent->key, &cur, key,
+				    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*entry = ent;
+				return 0;
+			}
+		}
+		if (cur == key) {
+			__atomic_add_fetch(&ent->dups, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+	/* The table is full around here.  Just log the report. */
+	return 0;
+}
+
+#endif
+
+void lksmith_error_flush(void)
+{
+#ifdef LKSMITH_ASYNC_REPORTS
+	if (g_async) {
+		err_drain();
+		return;
+	}
+#endif
+	r_pthread_mutex_lock(&g_error_lock);
+	if (g_log_type == LKSMITH_LOG_FILE)
+		fflush(g_log_file);
+	r_pthread_mutex_unlock(&g_error_lock);
+}
+
 void lksmith_error(int err, const char *fmt, ...)
 {
 	va_list ap;
@@ -176,34 +716,94 @@ void lksmith_error(int err, const char *fmt, ...)
 
 void lksmith_errora(int err, const char *fmt, va_list ap)
 {
+#ifdef LKSMITH_ASYNC_REPORTS
+	char buf[ERR_REPORT_MAX];
+#endif
+
+	err_count(err);
+#ifdef LKSMITH_ASYNC_REPORTS
+
+	lksmith_log_ensure_init();
+	if (g_async) {
+		err_ring_push(err, buf, err_format(buf, fmt, ap));
+		return;
+	}
+#endif
 	r_pthread_mutex_lock(&g_error_lock);
 	lksmith_errora_unlocked(err, fmt, ap);
 	r_pthread_mutex_unlock(&g_error_lock);
 }
 
-void lksmith_errora_with_bt(int err, char **frames, int frames_len,
+void lksmith_errora_with_bt(int err, void **frames, int frames_len,
 			const char *fmt, va_list ap)
 {
 	int i;
+	const char **names = NULL;
+#ifdef LKSMITH_ASYNC_REPORTS
+	struct err_dedup *entry;
+	char buf[ERR_REPORT_MAX];
+	size_t off = 0, len;
+#endif
 
+	err_count(err);
+#ifdef LKSMITH_ASYNC_REPORTS
+	lksmith_log_ensure_init();
+	if (g_async) {
+		if (err_dedup_check(err_dedup_key(err, fmt, frames,
+				frames_len), &entry))
+			return;
+		off = err_format(buf, fmt, ap);
+		if (entry) {
+			len = strcspn(buf, "\n");
+			if (len >= ERR_SUMMARY_LEN)
+				len = ERR_SUMMARY_LEN - 1;
+			memcpy(entry->summary, buf, len);
+			entry->summary[len] = '\0';
+			__atomic_store_n(&entry->ready, 1, __ATOMIC_RELEASE);
+		}
+		for (i = 0; i < frames_len; i++) {
+			fwdprintf(buf, &off, sizeof(buf), "%s\n",
+				bt_frame_name(frames[i]));
+		}
+		err_ring_push(err, buf, off);
+		return;
+	}
+#endif
+	if (frames_len > 0) {
+		names = malloc(sizeof(const char*) * frames_len);
+		if (!names)
+			frames_len = 0;
+	}
+	for (i = 0; i < frames_len; i++) {
+		names[i] = bt_frame_name(frames[i]);
+	}
 	r_pthread_mutex_lock(&g_error_lock);
 	lksmith_errora_unlocked(err, fmt, ap);
 	for (i = 0; i < frames_len; i++) { 
-		lksmith_error_unlocked(0, "%s\n", frames[i]);
+		lksmith_error_unlocked(0, "%s\n", names[i]);
 	}
 	r_pthread_mutex_unlock(&g_error_lock);
+	free(names);
+}
+
+uint64_t lksmith_error_count(int err)
+{
+	if (err == -1)
+		return __atomic_load_n(&g_err_total, __ATOMIC_RELAXED);
+	if ((err <= 0) || (err >= ERR_COUNT_CODES))
+		return 0;
+	return __atomic_load_n(&g_err_counts[err], __ATOMIC_RELAXED);
 }
 
 const char *terror(int err)
 {
 #ifdef HAVE_IMPROVED_TLS
 	static __thread char buf[4096];
-	int ret;
 
-	ret = strerror_r(err, buf, sizeof(buf));
-	if (ret)
-		return "unknown error";
-	return buf;
+	/* We build with _GNU_SOURCE, so this is the GNU strerror_r, which
+	 * returns a pointer to the message rather than an error code.  The
+	 * message may or may not have been copied into buf. */
+	return strerror_r(err, buf, sizeof(buf));
 #else
 	if ((err < 0) || (err >= sys_nerr)) {
 		return "unknown error";
@@ -32,6 +32,7 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 /**
  * The type signature for a Locksmith error reporting callback.
@@ -66,16 +67,38 @@ void lksmith_errora(int err, const char *fmt, va_list ap);
 /**
  * Log a Locksmith error message together with a backtrace.
  *
+ * The frames are raw return addresses.  They will be symbolized here,
+ * before the error lock is taken.
+ *
  * @param err		The error code.
- * @param frames	string array
- * @param frames_len	length of string array.  If this is <= 0, the array
- *			will be ignored.
+ * @param frames	return address array
+ * @param frames_len	length of return address array.  If this is <= 0, the
+ *			array will be ignored.
  * @param fmt		printf-style format string.
  * @param ap 		printf-style arguments.
  */
-void lksmith_errora_with_bt(int err, char **frames, int frames_len,
+void lksmith_errora_with_bt(int err, void **frames, int frames_len,
 			const char *fmt, va_list ap);
 
+/**
+ * Write out any reports which are still buffered.
+ *
+ * File and syslog reports are normally written by a background thread.  This
+ * function writes out everything reported so far, and returns once it has
+ * been written.  It is called automatically when the process exits.
+ */
+void lksmith_error_flush(void);
+
+/**
+ * Get the number of errors which have been reported with an error code.
+ *
+ * @param err		The error code, or -1 for the number of errors
+ *			reported with any code.
+ *
+ * @return		The number of errors.
+ */
+uint64_t lksmith_error_count(int err);
+
 /**
  * Look up the error message associated with a POSIX error code.
  *
@@ -369,6 +369,91 @@ static int test_recursion_on_nonrecursive(void)
 	return 0;
 }
 
+static int test_destroy_forgets_edges(void)
+{
+	pthread_mutex_t mutex1, mutex2;
+
+	EXPECT_ZERO(pthread_mutex_init(&mutex1, NULL));
+	EXPECT_ZERO(pthread_mutex_init(&mutex2, NULL));
+	EXPECT_ZERO(pthread_mutex_lock(&mutex1));
+	EXPECT_ZERO(pthread_mutex_lock(&mutex2));
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex2));
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex1));
+
+	/* This is a new lock, so the old 1 -> 2 ordering no longer applies. */
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex2));
+	EXPECT_ZERO(pthread_mutex_init(&mutex2, NULL));
+	EXPECT_ZERO(pthread_mutex_lock(&mutex2));
+	EXPECT_ZERO(pthread_mutex_lock(&mutex1));
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex1));
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex2));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 0);
+
+	/* Now 1 -> 2 is an inversion. */
+	EXPECT_ZERO(pthread_mutex_lock(&mutex1));
+	EXPECT_ZERO(pthread_mutex_lock(&mutex2));
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex2));
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex1));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex1));
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex2));
+	clear_recorded_errors();
+	return 0;
+}
+
+static pthread_mutex_t g_private1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_private2 = PTHREAD_MUTEX_INITIALIZER;
+
+static int private_thread(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_private2));
+	EXPECT_ZERO(pthread_mutex_lock(&g_private1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_private1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_private2));
+	return 0;
+}
+
+THREAD_WRAPPER_VOID(private_thread);
+
+static int test_private_locks(void)
+{
+	pthread_mutex_t mutex;
+	pthread_t thread;
+	void *rval;
+	int i;
+
+	/* After the first acquisition, these take the private fast path. */
+	for (i = 0; i < 10; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&g_private1));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_private1));
+	}
+	EXPECT_ZERO(pthread_mutex_init(&mutex, NULL));
+	EXPECT_ZERO(pthread_mutex_lock(&mutex));
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex));
+	EXPECT_ZERO(pthread_mutex_lock(&mutex));
+	EXPECT_EQ(pthread_mutex_destroy(&mutex), EBUSY);
+	EXPECT_EQ(find_recorded_error(EBUSY), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex));
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex));
+
+	/* Private locks still take part in lock ordering. */
+	EXPECT_ZERO(pthread_mutex_lock(&g_private1));
+	EXPECT_ZERO(pthread_mutex_lock(&g_private2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_private2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_private1));
+	EXPECT_ZERO(pthread_create(&thread, NULL, private_thread_wrap, NULL));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+
+	/* Now that another thread has used them, they are shared. */
+	EXPECT_ZERO(pthread_mutex_lock(&g_private1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_private1));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
 static pthread_cond_t g_tbcw_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t g_tbcw_lock1 = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t g_tbcw_lock2 = PTHREAD_MUTEX_INITIALIZER;
@@ -450,6 +535,10 @@ int main(void)
 
 	EXPECT_ZERO(test_recursion_on_nonrecursive());
 
+	EXPECT_ZERO(test_destroy_forgets_edges());
+
+	EXPECT_ZERO(test_private_locks());
+
 	EXPECT_ZERO(test_bad_cond_wait());
 
 	return EXIT_SUCCESS;
@@ -0,0 +1,120 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* This test is run with LKSMITH_MAX_LOCKS=64. */
+
+#define NUM_CHURN 10000
+
+#define NUM_PRIVATE_ITERS 100000
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Take and forget a lot of locks, the way a program does when it frees
+ * memory which holds mutexes without destroying them.
+ */
+static int churn_locks(void)
+{
+	pthread_mutex_t *lock;
+	const pthread_mutex_t init = PTHREAD_MUTEX_INITIALIZER;
+	int i;
+
+	for (i = 0; i < NUM_CHURN; i++) {
+		lock = malloc(sizeof(*lock));
+		EXPECT_NOT_EQ(lock, NULL);
+		memcpy(lock, &init, sizeof(init));
+		EXPECT_ZERO(pthread_mutex_lock(lock));
+		EXPECT_ZERO(pthread_mutex_unlock(lock));
+		free(lock);
+	}
+	return 0;
+}
+
+static void *churn_locks_wrap(void *v __attribute__((unused)))
+{
+	return (void*)(intptr_t)churn_locks();
+}
+
+static int test_held_locks_kept(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+	EXPECT_ZERO(churn_locks());
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(num_recorded_errors());
+	/* lock1 and lock2 were held the whole time, so the edge between
+	 * them is still there. */
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	clear_recorded_errors();
+	return 0;
+}
+
+static int test_evict_during_private_locking(void)
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	void *rval;
+	int i;
+
+	EXPECT_ZERO(pthread_mutex_init(&lock, NULL));
+	EXPECT_ZERO(pthread_create(&thread, NULL, churn_locks_wrap, NULL));
+	for (i = 0; i < NUM_PRIVATE_ITERS; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&lock));
+		EXPECT_ZERO(pthread_mutex_unlock(&lock));
+	}
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_held_locks_kept());
+	EXPECT_ZERO(test_evict_during_private_locking());
+
+	return EXIT_SUCCESS;
+}
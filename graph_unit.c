@@ -0,0 +1,214 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LONG_CHAIN_LOCKS 100000
+
+#define REVERSED_CHAIN_LOCKS 2000
+
+#define RANDOM_DAG_LOCKS 5000
+
+#define RANDOM_DAG_EDGES 20000
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * Take lock a, then lock b.
+ */
+static int lock_pair(pthread_mutex_t *locks, int a, int b)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&locks[a]));
+	EXPECT_ZERO(pthread_mutex_lock(&locks[b]));
+	EXPECT_ZERO(pthread_mutex_unlock(&locks[b]));
+	EXPECT_ZERO(pthread_mutex_unlock(&locks[a]));
+	return 0;
+}
+
+static void report_cost(const char *name, uint64_t start, int acquisitions)
+{
+	printf("%s: %d acquisitions, %.0f ns/acquisition\n", name,
+		acquisitions, (double)(now_ns() - start) / acquisitions);
+}
+
+static pthread_mutex_t *init_locks(int num_locks)
+{
+	int i;
+	pthread_mutex_t *locks;
+
+	locks = calloc(num_locks, sizeof(pthread_mutex_t));
+	if (!locks)
+		return NULL;
+	for (i = 0; i < num_locks; i++) {
+		if (pthread_mutex_init(&locks[i], NULL)) {
+			free(locks);
+			return NULL;
+		}
+	}
+	return locks;
+}
+
+static int destroy_locks(const char *name, pthread_mutex_t *locks,
+		int num_locks)
+{
+	int i;
+	uint64_t start;
+
+	start = now_ns();
+	for (i = 0; i < num_locks; i++) {
+		EXPECT_ZERO(pthread_mutex_destroy(&locks[i]));
+	}
+	printf("%s: %d destroys, %.0f ns/destroy\n", name, num_locks,
+		(double)(now_ns() - start) / num_locks);
+	free(locks);
+	return 0;
+}
+
+/**
+ * Build a chain of locks, where every edge agrees with the order the locks
+ * were created in.  Then close the chain into a very long cycle.
+ */
+static int test_long_chain(void)
+{
+	int i;
+	uint64_t start;
+	pthread_mutex_t *locks;
+
+	locks = init_locks(LONG_CHAIN_LOCKS);
+	EXPECT_NOT_EQ(locks, NULL);
+	start = now_ns();
+	for (i = 0; i < LONG_CHAIN_LOCKS - 1; i++) {
+		EXPECT_ZERO(lock_pair(locks, i, i + 1));
+	}
+	report_cost("long_chain", start, 2 * (LONG_CHAIN_LOCKS - 1));
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(lock_pair(locks, LONG_CHAIN_LOCKS - 1, 0));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	clear_recorded_errors();
+	EXPECT_ZERO(destroy_locks("long_chain", locks, LONG_CHAIN_LOCKS));
+	return 0;
+}
+
+/**
+ * Build a chain of locks, where every edge disagrees with the order the
+ * locks were created in.
+ */
+static int test_reversed_chain(void)
+{
+	int i;
+	uint64_t start;
+	pthread_mutex_t *locks;
+
+	locks = init_locks(REVERSED_CHAIN_LOCKS);
+	EXPECT_NOT_EQ(locks, NULL);
+	start = now_ns();
+	for (i = 0; i < REVERSED_CHAIN_LOCKS - 1; i++) {
+		EXPECT_ZERO(lock_pair(locks, i + 1, i));
+	}
+	report_cost("reversed_chain", start, 2 * (REVERSED_CHAIN_LOCKS - 1));
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(lock_pair(locks, 0, REVERSED_CHAIN_LOCKS - 1));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	clear_recorded_errors();
+	EXPECT_ZERO(destroy_locks("reversed_chain", locks, REVERSED_CHAIN_LOCKS));
+	return 0;
+}
+
+/**
+ * Add random edges which all agree with a hidden order that has nothing to
+ * do with the order the locks were created in.  None of them should be
+ * reported.  Then take one of the pairs the other way around.
+ */
+static int test_random_dag(void)
+{
+	int i, j, tmp, a = 0, b = 0;
+	int *rank;
+	unsigned int seed = 12345;
+	uint64_t start;
+	pthread_mutex_t *locks;
+
+	rank = calloc(RANDOM_DAG_LOCKS, sizeof(int));
+	EXPECT_NOT_EQ(rank, NULL);
+	for (i = 0; i < RANDOM_DAG_LOCKS; i++) {
+		rank[i] = i;
+	}
+	for (i = RANDOM_DAG_LOCKS - 1; i > 0; i--) {
+		j = rand_r(&seed) % (i + 1);
+		tmp = rank[i];
+		rank[i] = rank[j];
+		rank[j] = tmp;
+	}
+	locks = init_locks(RANDOM_DAG_LOCKS);
+	EXPECT_NOT_EQ(locks, NULL);
+	start = now_ns();
+	for (i = 0; i < RANDOM_DAG_EDGES; i++) {
+		a = rand_r(&seed) % RANDOM_DAG_LOCKS;
+		b = rand_r(&seed) % RANDOM_DAG_LOCKS;
+		if (a == b)
+			continue;
+		if (rank[a] > rank[b]) {
+			tmp = a;
+			a = b;
+			b = tmp;
+		}
+		EXPECT_ZERO(lock_pair(locks, a, b));
+	}
+	report_cost("random_dag", start, 2 * RANDOM_DAG_EDGES);
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(lock_pair(locks, b, a));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	clear_recorded_errors();
+	EXPECT_ZERO(destroy_locks("random_dag", locks, RANDOM_DAG_LOCKS));
+	free(rank);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_long_chain());
+	EXPECT_ZERO(test_reversed_chain());
+	EXPECT_ZERO(test_random_dag());
+
+	return EXIT_SUCCESS;
+}
@@ -45,6 +45,11 @@
  * Handler functions used to redirect pthreads calls to Locksmith.
  */
 
+/**
+ * The call site of the pthreads function we are in.
+ */
+#define LKSMITH_CALLER __builtin_return_address(0)
+
 /**
  * A list of mutex types that are compatible with error checking mutexes.
  * Note that recursive mutexes are NOT compatible.
@@ -183,7 +188,8 @@ int pthread_mutex_init(pthread_mutex_t *mutex,
 			"failed with error %s (%d)", mutex, terror(ret), ret);
 		return ret;
 	}
-	ret = lksmith_optional_init((const void*)mutex, recursive, 1);
+	ret = lksmith_optional_init((const void*)mutex, recursive, 1,
+		LKSMITH_CALLER);
 	if (ret) {
 		pthread_mutex_destroy(mutex);
 		return ret;
@@ -216,7 +222,7 @@ int pthread_mutex_destroy(pthread_mutex_t *mutex)
 
 int pthread_mutex_trylock(pthread_mutex_t *mutex)
 {
-	int ret = lksmith_prelock(mutex, 1);
+	int ret = lksmith_prelock(mutex, 1, LKSMITH_CALLER);
 	if (ret)
 		return ret;
 	ret = r_pthread_mutex_trylock(mutex);
@@ -226,7 +232,7 @@ int pthread_mutex_trylock(pthread_mutex_t *mutex)
 
 int pthread_mutex_lock(pthread_mutex_t *mutex)
 {
-	int ret = lksmith_prelock(mutex, 1);
+	int ret = lksmith_prelock(mutex, 1, LKSMITH_CALLER);
 	if (ret)
 		return ret;
 	ret = r_pthread_mutex_lock(mutex);
@@ -237,7 +243,7 @@ int pthread_mutex_lock(pthread_mutex_t *mutex)
 int pthread_mutex_timedlock(pthread_mutex_t *__restrict mutex,
 		__const struct timespec *__restrict ts)
 {
-	int ret = lksmith_prelock(mutex, 1);
+	int ret = lksmith_prelock(mutex, 1, LKSMITH_CALLER);
 	if (ret)
 		return ret;
 	ret = r_pthread_mutex_timedlock(mutex, ts);
@@ -257,12 +263,125 @@ int pthread_mutex_unlock(pthread_mutex_t *__restrict mutex)
 	return 0;
 }
 
-// TODO: pthread_rwlock stuff
+int pthread_rwlock_init(pthread_rwlock_t *__restrict lock,
+		const pthread_rwlockattr_t *__restrict attr)
+{
+	int ret;
+
+	ret = init_tls();
+	if (ret)
+		return ret;
+	ret = r_pthread_rwlock_init(lock, attr);
+	if (ret) {
+		lksmith_error(ret, "pthread_rwlock_init(lock=%p): "
+			"failed with error %s (%d)", lock, terror(ret), ret);
+		return ret;
+	}
+	ret = lksmith_optional_init((const void*)lock, 0, 1, LKSMITH_CALLER);
+	if (ret) {
+		r_pthread_rwlock_destroy(lock);
+		return ret;
+	}
+	return 0;
+}
+
+int pthread_rwlock_destroy(pthread_rwlock_t *lock)
+{
+	int ret;
+
+	ret = lksmith_destroy((const void*)lock);
+	if ((ret != 0) && (ret != ENOENT)) {
+		/* As with mutexes, ENOENT just means the lock was statically
+		 * initialized and never used. */
+		return ret;
+	}
+	ret = r_pthread_rwlock_destroy(lock);
+	if (ret) {
+		lksmith_error(ret, "pthread_rwlock_destroy(lock=%p): "
+			"failed with error %s (%d)", lock, terror(ret), ret);
+	}
+	return ret;
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t *lock)
+{
+	int ret = lksmith_prerdlock((const void*)lock, LKSMITH_CALLER);
+	if (ret)
+		return ret;
+	ret = r_pthread_rwlock_rdlock(lock);
+	lksmith_postrdlock((const void*)lock, ret);
+	return ret;
+}
+
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *lock)
+{
+	int ret = lksmith_prerdlock((const void*)lock, LKSMITH_CALLER);
+	if (ret)
+		return ret;
+	ret = r_pthread_rwlock_tryrdlock(lock);
+	lksmith_postrdlock((const void*)lock, ret);
+	return ret;
+}
+
+int pthread_rwlock_timedrdlock(pthread_rwlock_t *__restrict lock,
+		const struct timespec *__restrict ts)
+{
+	int ret = lksmith_prerdlock((const void*)lock, LKSMITH_CALLER);
+	if (ret)
+		return ret;
+	ret = r_pthread_rwlock_timedrdlock(lock, ts);
+	lksmith_postrdlock((const void*)lock, ret);
+	return ret;
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t *lock)
+{
+	int ret = lksmith_prelock((const void*)lock, 1, LKSMITH_CALLER);
+	if (ret)
+		return ret;
+	ret = r_pthread_rwlock_wrlock(lock);
+	lksmith_postlock((const void*)lock, ret);
+	return ret;
+}
+
+int pthread_rwlock_trywrlock(pthread_rwlock_t *lock)
+{
+	int ret = lksmith_prelock((const void*)lock, 1, LKSMITH_CALLER);
+	if (ret)
+		return ret;
+	ret = r_pthread_rwlock_trywrlock(lock);
+	lksmith_postlock((const void*)lock, ret);
+	return ret;
+}
+
+int pthread_rwlock_timedwrlock(pthread_rwlock_t *__restrict lock,
+		const struct timespec *__restrict ts)
+{
+	int ret = lksmith_prelock((const void*)lock, 1, LKSMITH_CALLER);
+	if (ret)
+		return ret;
+	ret = r_pthread_rwlock_timedwrlock(lock, ts);
+	lksmith_postlock((const void*)lock, ret);
+	return ret;
+}
+
+int pthread_rwlock_unlock(pthread_rwlock_t *lock)
+{
+	int ret = lksmith_preunlock((const void*)lock);
+	if (ret)
+		return ret;
+	ret = r_pthread_rwlock_unlock(lock);
+	if (ret)
+		return ret;
+	lksmith_postunlock((const void*)lock);
+	return 0;
+}
+
 int pthread_spin_init(pthread_spinlock_t *lock, int pshared)
 {
 	int ret;
 
-	ret = lksmith_optional_init((const void*)lock, 0, 0);
+	ret = lksmith_optional_init((const void*)lock, 0, 0, LKSMITH_CALLER);
 	if (ret)
 		return ret;
 	ret = r_pthread_spin_init(lock, pshared);
@@ -287,7 +406,7 @@ int pthread_spin_destroy(pthread_spinlock_t *lock)
 
 int pthread_spin_lock(pthread_spinlock_t *lock)
 {
-	int ret = lksmith_prelock((const void*)lock, 0);
+	int ret = lksmith_prelock((const void*)lock, 0, LKSMITH_CALLER);
 	if (ret)
 		return ret;
 	ret = r_pthread_spin_lock(lock);
@@ -297,7 +416,7 @@ int pthread_spin_lock(pthread_spinlock_t *lock)
 
 int pthread_spin_trylock(pthread_spinlock_t *lock)
 {
-	int ret = lksmith_prelock((const void*)lock, 0);
+	int ret = lksmith_prelock((const void*)lock, 0, LKSMITH_CALLER);
 	if (ret)
 		return ret;
 	ret = r_pthread_spin_trylock(lock);
@@ -387,7 +506,166 @@ int pthread_cond_destroy(pthread_cond_t *cond)
 	return ret;
 }
 
-// TODO: support barriers
+int pthread_barrier_init(pthread_barrier_t *__restrict barrier,
+	const pthread_barrierattr_t *__restrict attr, unsigned int count)
+{
+	int ret;
+
+	ret = init_tls();
+	if (ret)
+		return ret;
+	ret = r_pthread_barrier_init(barrier, attr, count);
+	if (ret) {
+		lksmith_error(ret, "pthread_barrier_init(barrier=%p): "
+			"failed with error %s (%d)", barrier, terror(ret), ret);
+		return ret;
+	}
+	ret = lksmith_optional_init((const void*)barrier, 1, 1,
+		LKSMITH_CALLER);
+	if (ret) {
+		r_pthread_barrier_destroy(barrier);
+		return ret;
+	}
+	return 0;
+}
+
+int pthread_barrier_destroy(pthread_barrier_t *barrier)
+{
+	int ret;
+
+	ret = lksmith_destroy(barrier);
+	if ((ret != 0) && (ret != ENOENT))
+		return ret;
+	ret = r_pthread_barrier_destroy(barrier);
+	if (ret) {
+		lksmith_error(ret, "pthread_barrier_destroy(barrier=%p): "
+			"failed with error %s (%d)", barrier, terror(ret), ret);
+	}
+	return ret;
+}
+
+int pthread_barrier_wait(pthread_barrier_t *barrier)
+{
+	int ret = lksmith_barrier_wait((const void*)barrier, LKSMITH_CALLER);
+	if (ret)
+		return ret;
+	return r_pthread_barrier_wait(barrier);
+}
+
+int pthread_once(pthread_once_t *once, void (*init)(void))
+{
+	int ret;
+
+	/* Once the routine has finished, pthread_once never waits, so there
+	 * is nothing to check.  The real pthread_once still makes the
+	 * routine's effects visible to us. */
+	if (lksmith_once_done((const void*)once))
+		return r_pthread_once(once, init);
+	/* Other callers wait for the init routine to finish, so we treat
+	 * the once control as a lock which is held while it runs.  Locks
+	 * taken by the routine come after it, and locks held by callers
+	 * come before it. */
+	ret = lksmith_prelock((const void*)once, 1, LKSMITH_CALLER);
+	if (ret)
+		return ret;
+	lksmith_postlock((const void*)once, 0);
+	ret = r_pthread_once(once, init);
+	if (lksmith_preunlock((const void*)once) == 0)
+		lksmith_postunlock((const void*)once);
+	if (ret == 0)
+		lksmith_once_finish((const void*)once);
+	return ret;
+}
+
+int sem_init(sem_t *sem, int pshared, unsigned int value)
+{
+	int ret;
+
+	ret = init_tls();
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+	if (r_sem_init(sem, pshared, value))
+		return -1;
+	ret = lksmith_optional_init((const void*)sem, 1, 1, LKSMITH_CALLER);
+	if (ret) {
+		r_sem_destroy(sem);
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+int sem_destroy(sem_t *sem)
+{
+	int ret;
+
+	ret = lksmith_destroy(sem);
+	if ((ret != 0) && (ret != ENOENT)) {
+		/* As with mutexes, a semaphore we have never seen is fine. */
+		errno = ret;
+		return -1;
+	}
+	return r_sem_destroy(sem);
+}
+
+int sem_wait(sem_t *sem)
+{
+	int ret = lksmith_prewait((const void*)sem, LKSMITH_CALLER);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return r_sem_wait(sem);
+}
+
+int sem_trywait(sem_t *sem)
+{
+	int ret;
+
+	/* sem_trywait never blocks, so it can't deadlock, and there is
+	 * nothing to check.  We only need Locksmith itself if this is the
+	 * first pthreads call the program makes, since that is what looks up
+	 * the real sem_trywait. */
+	if (!__atomic_load_n(&r_sem_trywait, __ATOMIC_ACQUIRE)) {
+		ret = init_tls();
+		if (ret) {
+			errno = -ret;
+			return -1;
+		}
+	}
+	return r_sem_trywait(sem);
+}
+
+int sem_timedwait(sem_t *__restrict sem,
+	const struct timespec *__restrict abstime)
+{
+	int ret = lksmith_prewait((const void*)sem, LKSMITH_CALLER);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return r_sem_timedwait(sem, abstime);
+}
+
+/* sem_post is async-signal-safe, so it is often called from signal
+ * handlers.  If the handler interrupted this thread inside Locksmith,
+ * lksmith_prepost skips its bookkeeping, since our internal locks or the
+ * heap may be in use.  Otherwise the post is checked as usual.  Any locks
+ * the interrupted code holds are then treated as held while posting, which
+ * can report lock orders the program never uses.  Posts from a module
+ * skipped by LKSMITH_IGNORED_MODULES or LKSMITH_TRACKED_MODULES aren't
+ * checked at all. */
+int sem_post(sem_t *sem)
+{
+	int ret = lksmith_prepost((const void*)sem, LKSMITH_CALLER);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return r_sem_post(sem);
+}
 
 #define LOAD_FUNC(fn) do { \
 	r_##fn = get_dlsym_next(#fn); \
@@ -409,10 +687,29 @@ int lksmith_handler_init(void)
 	LOAD_FUNC(pthread_spin_lock);
 	LOAD_FUNC(pthread_spin_trylock);
 	LOAD_FUNC(pthread_spin_unlock);
+	LOAD_FUNC(pthread_rwlock_init);
+	LOAD_FUNC(pthread_rwlock_destroy);
+	LOAD_FUNC(pthread_rwlock_rdlock);
+	LOAD_FUNC(pthread_rwlock_tryrdlock);
+	LOAD_FUNC(pthread_rwlock_timedrdlock);
+	LOAD_FUNC(pthread_rwlock_wrlock);
+	LOAD_FUNC(pthread_rwlock_trywrlock);
+	LOAD_FUNC(pthread_rwlock_timedwrlock);
+	LOAD_FUNC(pthread_rwlock_unlock);
 	LOAD_FUNC(pthread_cond_init);
 	LOAD_FUNC(pthread_cond_wait);
 	LOAD_FUNC(pthread_cond_timedwait);
 	LOAD_FUNC(pthread_cond_destroy);
+	LOAD_FUNC(pthread_barrier_init);
+	LOAD_FUNC(pthread_barrier_destroy);
+	LOAD_FUNC(pthread_barrier_wait);
+	LOAD_FUNC(pthread_once);
+	LOAD_FUNC(sem_init);
+	LOAD_FUNC(sem_destroy);
+	LOAD_FUNC(sem_wait);
+	LOAD_FUNC(sem_trywait);
+	LOAD_FUNC(sem_timedwait);
+	LOAD_FUNC(sem_post);
 
 	return 0;
 }
@@ -31,6 +31,7 @@
 #define LKSMITH_HANDLER_H
 
 #include <pthread.h>
+#include <semaphore.h>
 
 /******************************************************************
  * The raw pthreads functions.
@@ -65,6 +66,27 @@ EXTERN int (*r_pthread_spin_trylock)(pthread_spinlock_t *lock);
 
 EXTERN int (*r_pthread_spin_unlock)(pthread_spinlock_t *lock);
 
+EXTERN int (*r_pthread_rwlock_init)(pthread_rwlock_t *__restrict lock,
+	const pthread_rwlockattr_t *__restrict attr);
+
+EXTERN int (*r_pthread_rwlock_destroy)(pthread_rwlock_t *lock);
+
+EXTERN int (*r_pthread_rwlock_rdlock)(pthread_rwlock_t *lock);
+
+EXTERN int (*r_pthread_rwlock_tryrdlock)(pthread_rwlock_t *lock);
+
+EXTERN int (*r_pthread_rwlock_timedrdlock)(pthread_rwlock_t *__restrict lock,
+	const struct timespec *__restrict ts);
+
+EXTERN int (*r_pthread_rwlock_wrlock)(pthread_rwlock_t *lock);
+
+EXTERN int (*r_pthread_rwlock_trywrlock)(pthread_rwlock_t *lock);
+
+EXTERN int (*r_pthread_rwlock_timedwrlock)(pthread_rwlock_t *__restrict lock,
+	const struct timespec *__restrict ts);
+
+EXTERN int (*r_pthread_rwlock_unlock)(pthread_rwlock_t *lock);
+
 EXTERN int (*r_pthread_cond_init)(pthread_cond_t *__restrict cond,
 		const pthread_condattr_t *__restrict attr);
 
@@ -77,6 +99,28 @@ EXTERN int (*r_pthread_cond_timedwait)(pthread_cond_t *__restrict cond,
 
 EXTERN int (*r_pthread_cond_destroy)(pthread_cond_t *cond);
 
+EXTERN int (*r_pthread_barrier_init)(pthread_barrier_t *__restrict barrier,
+	const pthread_barrierattr_t *__restrict attr, unsigned int count);
+
+EXTERN int (*r_pthread_barrier_destroy)(pthread_barrier_t *barrier);
+
+EXTERN int (*r_pthread_barrier_wait)(pthread_barrier_t *barrier);
+
+EXTERN int (*r_pthread_once)(pthread_once_t *once, void (*init)(void));
+
+EXTERN int (*r_sem_init)(sem_t *sem, int pshared, unsigned int value);
+
+EXTERN int (*r_sem_destroy)(sem_t *sem);
+
+EXTERN int (*r_sem_wait)(sem_t *sem);
+
+EXTERN int (*r_sem_trywait)(sem_t *sem);
+
+EXTERN int (*r_sem_timedwait)(sem_t *__restrict sem,
+	const struct timespec *__restrict abstime);
+
+EXTERN int (*r_sem_post)(sem_t *sem);
+
 /******************************************************************
  * Functions
  *****************************************************************/
@@ -39,11 +39,6 @@
 
 #define MAX_SCRATCH_SIZE 8192
 
-void bt_frames_free(char **backtrace)
-{
-	free(backtrace);
-}
-
 static int try_backtrace(void **scratch, int scratch_len)
 {
 	int num_symbols;
@@ -57,11 +52,10 @@ static int try_backtrace(void **scratch, int scratch_len)
 	return num_symbols;
 }
 
-int bt_frames_create(void ***scratch, int *scratch_len, char ***out)
+int bt_frames_create(void ***scratch, int *scratch_len)
 {
 	int num_symbols;
 	void **next;
-	char **symbols;
 
 	while (((num_symbols = try_backtrace(*scratch, *scratch_len))) < 0) {
 		int next_size = (*scratch_len == 0) ?
@@ -76,10 +70,19 @@ int bt_frames_create(void ***scratch, int *scratch_len, char ***out)
 		*scratch = next;
 		*scratch_len = next_size;
 	}
-	symbols = backtrace_symbols(*scratch, num_symbols);
-	if (!symbols) {
-		return -ENOMEM;
-	}
-	*out = symbols;
 	return num_symbols;
 }
+
+char *bt_frame_symbolize(void *frame)
+{
+	char **symbols, *name;
+
+	/* backtrace_symbols returns a single malloc'ed block holding both the
+	 * array and the strings, so we have to copy the string out. */
+	symbols = backtrace_symbols(&frame, 1);
+	if (!symbols)
+		return NULL;
+	name = strdup(symbols[0]);
+	free(symbols);
+	return name;
+}
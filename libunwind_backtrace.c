@@ -30,81 +30,25 @@
 #include "error.h"
 #include "backtrace.h"
 
+#include <dlfcn.h>
 #include <libunwind.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#define STACK_BUF_SZ 512
+#define INITIAL_SCRATCH_SIZE 32
 
-static int do_get_proc_fname(unw_cursor_t *cursor, char **out_fname,
-		char **heap_buf, size_t *heap_buf_len)
-{
-	int ret;
-	unw_word_t  offset;
-	char *next_heap_buf = NULL, *stack_buf = NULL, *fname;
-	size_t len = *heap_buf_len;
-
-	while (1) {
-		if (!len) {
-			stack_buf = alloca(STACK_BUF_SZ);
-			ret = unw_get_proc_name(cursor, stack_buf,
-				STACK_BUF_SZ, &offset);
-		} else {
-			ret = unw_get_proc_name(cursor, *heap_buf,
-				len, &offset);
-		}
-		if (ret == 0) {
-			break;
-		} else if (ret != -UNW_ENOMEM) {
-			lksmith_error(ENOMEM, "create_backtrace "
-				"failed: unw_get_proc_name failed "
-				"with error %d\n", ret);
-			return EIO;
-		}
-		len = len ? (len * 2) : (STACK_BUF_SZ * 2);
-		next_heap_buf = realloc(*heap_buf, len);
-		if (!next_heap_buf) {
-			lksmith_error(ENOMEM, "create_backtrace "
-				"failed: failed to allocate buffer of "
-					"size %zd to hold proc name\n", len);
-			return ENOMEM;
-		}
-		*heap_buf = next_heap_buf;
-		*heap_buf_len = len;
-	}
-	fname = strdup(len ? *heap_buf : stack_buf);
-	if (!fname) {
-		lksmith_error(ENOMEM, "create_backtrace failed: failed "
-			"to allocate buffer to hold proc name\n");
-		return ENOMEM;
-	}
-	*out_fname = fname;
-	return 0;
-}
-
-void bt_frames_free(char **backtrace)
-{
-	char **b;
+#define MAX_SCRATCH_SIZE 8192
 
-	if (!backtrace)
-		return;
-	for (b = backtrace; *b; b++) {
-		free(*b);
-	}
-	free(backtrace);
-}
-
-int bt_frames_create(void ***scratch __attribute__((__unused__)),
-	int *scratch_len __attribute__((__unused__)), char ***out)
+int bt_frames_create(void ***scratch, int *scratch_len)
 {
-	int ret;
+	int ret, num_frames = 0;
 	unw_cursor_t cursor;
 	unw_context_t context;
-	char *heap_buf = NULL;
-	size_t heap_buf_len = 0;
-	char **backtrace = NULL, **backtrace_new;
-	size_t backtrace_len = 0, cap = 0;
+	unw_word_t ip;
+	void **next;
 
 	if (unw_getcontext(&context)) {
 		lksmith_error(ENOMEM, "bt_frames_create failed: "
@@ -118,38 +62,42 @@ int bt_frames_create(void ***scratch __attribute__((__unused__)),
 		return -EIO;
 	}
 	while (unw_step(&cursor) > 0) {
-		if (++backtrace_len > cap) {
-			size_t new_cap = cap ? cap * 2 : 32;
-			backtrace_new = realloc(backtrace, 
-						sizeof(char*) * new_cap);
-			if (!backtrace_new) {
+		if (num_frames >= *scratch_len) {
+			int next_size = (*scratch_len == 0) ?
+				INITIAL_SCRATCH_SIZE : (*scratch_len * 2);
+			if (next_size > MAX_SCRATCH_SIZE)
+				return -ENOMEM;
+			next = realloc(*scratch, next_size * sizeof(void*));
+			if (!next) {
 				lksmith_error(ENOMEM, "bt_frames_create "
-					"failed: failed to allocate char* "
-					"array of length %zd\n", new_cap);
-				ret = -EIO;
-				goto done;
+					"failed: failed to allocate void* "
+					"array of length %d\n", next_size);
+				return -ENOMEM;
 			}
-			backtrace = backtrace_new;
-			cap = new_cap;
+			*scratch = next;
+			*scratch_len = next_size;
 		}
-		ret = do_get_proc_fname(&cursor, &backtrace[backtrace_len - 1],
-					&heap_buf, &heap_buf_len);
-		if (ret != 0) {
-			lksmith_error(ENOMEM, "bt_frames_create failed: "
-				"do_get_proc_fname failed with error %d\n",
-				ret);
-			ret = -EIO;
-			goto done;
+		ret = unw_get_reg(&cursor, UNW_REG_IP, &ip);
+		if (ret) {
+			lksmith_error(EIO, "bt_frames_create failed: "
+				"unw_get_reg failed with error %d\n", ret);
+			return -EIO;
 		}
+		(*scratch)[num_frames++] = (void*)(uintptr_t)ip;
 	}
-	backtrace[backtrace_len] = NULL;
-	ret = backtrace_len;
-done:
-	free(heap_buf);
-	if (ret < 0) {
-		bt_frames_free(backtrace);
-		return ret;
-	}
-	*out = backtrace;
-	return ret;
+	return num_frames;
+}
+
+char *bt_frame_symbolize(void *frame)
+{
+	Dl_info info;
+	char buf[64];
+
+	/* A local unwind cursor can only name the frames it is currently
+	 * walking, and by the time we want a name the stack is long gone.  So
+	 * we ask the dynamic linker instead. */
+	if (dladdr(frame, &info) && info.dli_sname)
+		return strdup(info.dli_sname);
+	snprintf(buf, sizeof(buf), "%p", frame);
+	return strdup(buf);
 }
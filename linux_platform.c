@@ -31,6 +31,8 @@
 
 #include <dlfcn.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <link.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/syscall.h>
@@ -80,3 +82,42 @@ void* get_dlsym_next(const char *fname)
 	 */
 	return v;
 }
+
+struct segment_iter {
+	platform_segment_cb_t cb;
+	void *data;
+	/** The path of the program, which the dynamic linker doesn't give us */
+	char exe[PATH_MAX];
+};
+
+static int for_each_segment_cb(struct dl_phdr_info *info,
+		size_t size __attribute__((unused)), void *v)
+{
+	struct segment_iter *it = v;
+	const char *name;
+	uintptr_t start;
+	int i;
+
+	name = info->dlpi_name[0] ? info->dlpi_name : it->exe;
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		if (info->dlpi_phdr[i].p_type != PT_LOAD)
+			continue;
+		start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+		it->cb(name, start, start + info->dlpi_phdr[i].p_memsz,
+			it->data);
+	}
+	return 0;
+}
+
+int platform_for_each_segment(platform_segment_cb_t cb, void *data)
+{
+	struct segment_iter it;
+	ssize_t len;
+
+	it.cb = cb;
+	it.data = data;
+	len = readlink("/proc/self/exe", it.exe, sizeof(it.exe) - 1);
+	it.exe[(len < 0) ? 0 : len] = '\0';
+	dl_iterate_phdr(for_each_segment_cb, &it);
+	return 0;
+}
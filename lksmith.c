@@ -29,107 +29,415 @@
 
 #include "backtrace.h"
 #include "config.h"
+#include "depot.h"
 #include "error.h"
 #include "handler.h"
 #include "lksmith.h"
+#include "matcher.h"
+#include "module.h"
 #include "platform.h"
-#include "tree.h"
+#include "pool.h"
+#include "profile.h"
+#include "trace.h"
 #include "util.h"
 
 #include <errno.h>
 #include <execinfo.h>
-#include <fnmatch.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /******************************************************************
  *  Locksmith private data structures
  *****************************************************************/
-#define MAX_NLOCK 0x1fffffffffffffffULL
+/**
+ * Number of shared holders of a lock that we keep holder records for.
+ * Beyond this, shared holders are only counted.
+ */
+#define LKSMITH_READER_SAMPLES 4
 
 struct lksmith_lock_props {
-	/** The number of times this mutex has been locked. */
-	uint64_t nlock : 61;
 	/** 1 if we should allow recursive locks. */
-	uint64_t recursive : 1;
+	uint32_t recursive : 1;
 	/** 1 if this mutex is a sleeping lock */
-	uint64_t sleeper : 1;
+	uint32_t sleeper : 1;
 	/** 1 if we have already warned about taking this lock while
 	 * a spin lock is held. */
-	uint64_t spin_warn : 1;
+	uint32_t spin_warn : 1;
+	/** 1 if this is the graph node for the locks initialized at a
+	 * site.  Its ptr is the site. */
+	uint32_t site_class : 1;
+	/** 1 if this is a pthread_once control whose init routine has
+	 * finished */
+	uint32_t once_done : 1;
 };
 
 struct lksmith_holder {
-	/** Name of the thread holding the lock */
-	char name[LKSMITH_THREAD_NAME_MAX];
-	/** Stack frames */
-	char** bt_frames;
-	/** Number of stack frames */
-	int bt_len;
-	/** Next in singly-linked list */
+	/** ID of the thread holding the lock.  Its name is looked up in the
+	 * thread registry when we need it. */
+	uint64_t tid;
+	/** Depot ID of the stack which took the lock, or 0 if we didn't
+	 * capture one.  Only the holding thread sets this, but other threads
+	 * may read it. */
+	uint32_t stack;
+	/** Next in the lock's doubly-linked list of holders */
 	struct lksmith_holder *next;
+	/** Previous in the lock's doubly-linked list of holders */
+	struct lksmith_holder *prev;
+};
+
+/**
+ * What we know about how an edge in the lock-order graph was first seen.
+ */
+struct lksmith_edge_info {
+	/** Depot ID of the stack which took the lock that was held, or 0 if
+	 * we didn't record one */
+	uint32_t held_stack;
+	/** Depot ID of the stack which took the second lock while holding
+	 * the first, or 0 if we didn't record one */
+	uint32_t stack;
 };
 
+/**
+ * The data for a lock.
+ *
+ * The first part is read on every acquisition, but only changes when the
+ * lock is created or the lock-order graph changes.  The second part is
+ * written on every acquisition by whichever thread takes the lock.  It starts
+ * on its own cache line, so those writes don't keep evicting the first part
+ * from the caches of threads which are just looking the lock up.  Lock
+ * records come from a pool whose records are cache-line aligned, so the
+ * second part never shares a line with the next record either.
+ */
 struct lksmith_lock {
-	RB_ENTRY(lksmith_lock) entry;
+	/** Next lock in this registry hash bucket */
+	struct lksmith_lock *next;
 	/** The lock pointer */
 	const void *ptr;
 	struct lksmith_lock_props props;
-	/** The color that this node has been painted (used in traversal) */
-	uint64_t color;
-	/** Lock holders */
-	struct lksmith_holder *holders;
+	/** Dense ID of this lock; see lk_of.  Never 0. */
+	uint32_t id;
+	/** Position of this lock in the topological order of the lock-order
+	 * graph.  Every lock in the before list has a lower ord than this
+	 * lock, and every lock in the after list has a higher one. */
+	uint64_t ord;
+	/** Incremented whenever this record is freed or reused, so that
+	 * stale pointers to it can be recognized.  Pool records stay mapped,
+	 * so this can be read even after the record is freed. */
+	uint32_t gen;
+	/** 1 if this lock has ever been on either end of an edge in the
+	 * lock-order graph.  Only set with g_graph_lock held, by a thread
+	 * which holds this lock. */
+	int in_graph;
+	/** Number of entries naming this lock in the edge logs which the
+	 * merger hasn't looked at yet.  Only used with LKSMITH_DEFER_EDGES.
+	 * Incremented by threads which hold this lock, or its shard lock, and
+	 * decremented by the merger with g_graph_lock held. */
+	uint32_t logged_edges;
 	/** Size of the before list. */
-	int before_size;
-	/** list of locks that have been taken before this lock */
-	struct lksmith_lock **before;
+	uint32_t before_size;
+	/** Number of entries the before list has room for. */
+	uint32_t before_cap;
+	/** Size of the after list. */
+	uint32_t after_size;
+	/** Number of entries the after list has room for. */
+	uint32_t after_cap;
+	/** The lock class set by lksmith_set_lock_class, or 0.  For a class
+	 * node, the class it stands for. */
+	uint32_t class_id;
+	/** The level of the lock class, if class_id is set */
+	uint32_t level;
+	/** The node which stands for all the locks of this class in the
+	 * lock-order graph, or NULL.  Locks can have a class node without a
+	 * class ID if they are classed by their initialization site. */
+	struct lksmith_lock *class_node;
+	/** IDs of the locks that have been taken before this lock, sorted */
+	uint32_t *before;
+	/** How this lock was first taken while holding each of the locks in
+	 * the before list.  Parallel to before, with the same capacity. */
+	struct lksmith_edge_info *before_edges;
+	/** IDs of the locks that have been taken after this lock, sorted */
+	uint32_t *after;
+
+	/** The number of times this lock has been taken outside of the
+	 * private fast path.  Protected by the shard lock. */
+	uint64_t nlock __attribute__((aligned(LKSMITH_CACHE_LINE)));
+	/** ID of the first thread to take this lock, or 0 if nobody has
+	 * taken it yet.  Protected by the shard lock. */
+	uint64_t owner;
+	/** Number of times the owner holds this lock through the private
+	 * fast path.  Only the owner changes this. */
+	uint32_t fast_held;
+	/** 1 once a second thread has taken this lock.  Never goes back to
+	 * 0.  Set with the shard lock held. */
+	int promoted;
+	/** Set whenever the lock is taken, and cleared by the eviction clock
+	 * hand as it passes.  See lksmith_evict. */
+	int referenced;
+	/** Number of threads holding this lock shared, counting recursive
+	 * acquisitions */
+	uint32_t num_readers;
+	/** Number of shared holders in the readers list */
+	uint32_t num_sampled;
+	/** Exclusive lock holders */
+	struct lksmith_holder *holders;
+	/** Some of the shared holders.  This list never has more than
+	 * LKSMITH_READER_SAMPLES entries, no matter how many readers there
+	 * are. */
+	struct lksmith_holder *readers;
+};
+
+/**
+ * A growable array of locks.
+ */
+struct lk_vec {
+	/** The locks */
+	struct lksmith_lock **arr;
+	/** Number of locks in the array */
+	size_t len;
+	/** Number of locks we have space for */
+	size_t cap;
 };
 
+/**
+ * A shard of the lock registry.
+ *
+ * Locks are assigned to shards by hashing their address.  Each shard has its
+ * own mutex, so threads working on unrelated locks don't contend with each
+ * other.
+ */
+struct lksmith_shard {
+	/** Protects the hash table, and the holders and props of every lock
+	 * in this shard. */
+	pthread_mutex_t lock;
+	/** Hash buckets */
+	struct lksmith_lock **buckets;
+	/** Number of hash buckets.  Always 0 or a power of 2. */
+	size_t num_buckets;
+	/** Number of locks in this shard */
+	size_t num_locks;
+} __attribute__((aligned(LKSMITH_CACHE_LINE)));
+
 struct lksmith_cond {
-	RB_ENTRY(lksmith_cond) entry;
+	/** Next condition variable in this hash bucket */
+	struct lksmith_cond *next;
 	/** The condition variable pointer */
 	const void *ptr;
-	/** When a pthread_cond_wait is in progress on this condition variable,
-	 * this is the lock that is being used. */
-	const void *lock;
-	/** Number of waiters */
-	uint64_t refcnt;
+	/** While a pthread_cond_wait is in progress on this condition
+	 * variable, the ID of the lock that is being used in the high 32
+	 * bits, and the number of waiters in the low 32 bits.  0 when nobody
+	 * is waiting.  Only changed with compare-and-swap. */
+	uint64_t state;
+};
+
+/**
+ * Number of entries in the per-thread edge cache.  Must be a power of 2.
+ */
+#define LKSMITH_EDGE_CACHE_SIZE 256
+
+/**
+ * An edge in the lock-order graph which a thread has already checked.
+ */
+struct lksmith_edge {
+	/** The lock that was held */
+	const void *held;
+	/** The lock that was taken while holding it */
+	const void *ptr;
+	/** The value of g_graph_epoch when the edge was checked */
+	uint64_t epoch;
+};
+
+/**
+ * An edge which a thread has seen, waiting to be merged into the lock-order
+ * graph.  See LKSMITH_DEFER_EDGES.
+ */
+struct lksmith_logged_edge {
+	/** The graph node of the lock that was held */
+	struct lksmith_lock *from;
+	/** The graph node of the lock that was taken while holding it */
+	struct lksmith_lock *to;
+	/** The generations of from and to when the edge was seen.  If either
+	 * lock has been destroyed or evicted since then, we drop the edge. */
+	uint32_t from_gen, to_gen;
+	/** The lock that was held */
+	const void *held;
+	/** The lock that was taken while holding it */
+	const void *ptr;
+	/** The stacks which took held and ptr */
+	struct lksmith_edge_info info;
+};
+
+/**
+ * Number of held locks we can track without allocating memory.
+ */
+#define LKSMITH_INLINE_HELD 8
+
+/**
+ * Number of entries in the per-thread cache of private locks.  Must be a
+ * power of 2.
+ */
+#define LKSMITH_PRIVATE_CACHE_SIZE 64
+
+/**
+ * A lock which only this thread has ever taken.
+ */
+struct lksmith_private {
+	/** The lock pointer */
+	const void *ptr;
+	/** The lock data */
+	struct lksmith_lock *lk;
+	/** lk->gen when this entry was made */
+	uint32_t gen;
+};
+
+/**
+ * A lock held by a thread.
+ */
+struct lksmith_held {
+	/** The lock pointer */
+	const void *ptr;
+	/** 1 if the lock is held shared (a read lock on a rwlock) */
+	int shared;
+	/** 1 if we took the lock through the private fast path */
+	int fast;
+	/** The lock data.  Locks can't be destroyed while they are held, so
+	 * this stays valid. */
+	struct lksmith_lock *lk;
+	/** Our holder record in the lock's holders or readers list, or NULL
+	 * if we don't have one */
+	struct lksmith_holder *holder;
+	/** The call site which took the lock, if we are profiling */
+	const void *site;
+	/** When we took the lock, if we are profiling */
+	uint64_t acquired;
+};
+
+/**
+ * Statistics kept by each thread.
+ *
+ * Only the owning thread changes these, with relaxed atomic stores, so that
+ * other threads can add them up without stopping it.  See stat_inc.
+ */
+struct lksmith_thread_stats {
+	/** Number of lock acquisitions */
+	uint64_t acquisitions;
+	/** Number of lock acquisitions which took the private fast path */
+	uint64_t fast;
+	/** Number of backtraces captured */
+	uint64_t backtraces;
+	/** Number of acquisitions whose ordering checks were skipped
+	 * because of the ignore lists */
+	uint64_t ignored;
+	/** Number of acquisitions which the module filters skipped */
+	uint64_t filtered;
 };
 
 struct lksmith_tls {
 	/** The name of this thread. */
 	char name[LKSMITH_THREAD_NAME_MAX];
+	/** A unique, nonzero ID for this thread */
+	uint64_t tid;
+	/** The lock we are taking through the private fast path, between
+	 * prelock and postlock */
+	struct lksmith_lock *fast_pending;
+	/** The lock we are taking through the slow path, between prelock and
+	 * postlock */
+	struct lksmith_lock *pending;
+	/** Our holder record for the pending lock, or NULL */
+	struct lksmith_holder *pending_holder;
+	/** Statistics for this thread */
+	struct lksmith_thread_stats stats;
+	/** Previous and next threads in g_threads.  Protected by
+	 * g_threads_lock. */
+	struct lksmith_tls *prev, *next;
 	/** Size of the held list. */
 	unsigned int num_held;
-	/** Unsorted list of locks held */
-	const void **held;
+	/** Number of entries the held list has room for. */
+	unsigned int held_cap;
+	/** Locks held, in the order they were taken.  This points to
+	 * inline_held until we hold more than LKSMITH_INLINE_HELD locks; after
+	 * that, it points to a heap buffer which never shrinks. */
+	struct lksmith_held *held;
+	/** Storage for the first few held locks */
+	struct lksmith_held inline_held[LKSMITH_INLINE_HELD];
 	/** Number of spin locks currently held. */
 	uint64_t num_spins : 63;
 	/** 1 if we should intercept pthreads calls; 0 otherwise */
 	uint64_t intercept : 1;
+	/** LKSMITH_BUSY_* flags.  A signal handler which interrupts this
+	 * thread while any are set, and calls something we intercept, is
+	 * not checked; see lksmith_enter. */
+	int busy;
+	/** Number of prelocks which were skipped because they re-entered
+	 * Locksmith, and whose postlocks haven't come yet */
+	unsigned int skipped_locks;
+	/** Why the module filters skipped the lock between prelock and
+	 * postlock (a LKSMITH_FILTER_* value), or 0 */
+	int skip_pending;
+	/** Number of locks we hold which the module filters skipped because
+	 * of where they were taken */
+	unsigned int num_skipped;
+	/** Number of entries the skipped list has room for */
+	unsigned int skipped_cap;
+	/** The locks we hold which the module filters skipped because of
+	 * where they were taken, in the order they were taken.  Locks skipped
+	 * because of their address aren't in here, since their unlocks are
+	 * skipped the same way. */
+	const void **skipped;
 	/** scratch area for backtraces */
 	void **backtrace_scratch;
 	/** length of scratch area for backtraces */
 	int backtrace_scratch_len;
+	/** Number of frames of the current lock acquisition's stack stored in
+	 * backtrace_scratch, or -1 if it doesn't hold that stack */
+	int backtrace_scratch_frames;
+	/** Number of acquisitions, for LKSMITH_BACKTRACE_MODE=sample */
+	unsigned int bt_sample_count;
+	/** Our lock profiling table, or NULL if we haven't profiled
+	 * anything yet */
+	struct prof_table *prof;
+	/** The call site of the lock acquisition in progress, if we are
+	 * profiling */
+	const void *prof_site;
+	/** When the lock acquisition in progress started waiting, if we are
+	 * profiling */
+	uint64_t prof_start;
+	/** Cache of free lock records */
+	struct lksmith_pool_cache lock_cache;
+	/** Cache of free lock holders */
+	struct lksmith_pool_cache holder_cache;
+	/** Direct-mapped cache of edges which this thread has already added
+	 * to the lock-order graph */
+	struct lksmith_edge edge_cache[LKSMITH_EDGE_CACHE_SIZE];
+	/** Direct-mapped cache of locks which only this thread has taken */
+	struct lksmith_private private_cache[LKSMITH_PRIVATE_CACHE_SIZE];
+	/** Protects the edge log.  Only the merger ever contends for it. */
+	pthread_mutex_t edge_log_lock;
+	/** Edges waiting to be merged into the graph, if LKSMITH_DEFER_EDGES
+	 * is set */
+	struct lksmith_logged_edge *edge_log;
+	/** Number of edges in the edge log. */
+	unsigned int edge_log_len;
+	/** Number of edges the edge log has room for. */
+	unsigned int edge_log_cap;
+	/** Our position in the trace, if LKSMITH_TRACE is set */
+	struct trace_writer trace;
 };
 
 /******************************************************************
  *  Locksmith prototypes
  *****************************************************************/
-static int lksmith_lock_compare(const struct lksmith_lock *a,
-		const struct lksmith_lock *b) __attribute__((const));
-RB_HEAD(lock_tree, lksmith_lock);
-RB_GENERATE(lock_tree, lksmith_lock, entry, lksmith_lock_compare);
-static int lksmith_cond_compare(const struct lksmith_cond *a,
-		const struct lksmith_cond *b) __attribute__((const));
-RB_HEAD(cond_tree, lksmith_cond);
-RB_GENERATE(cond_tree, lksmith_cond, entry, lksmith_cond_compare);
 static void lksmith_tls_destroy(void *v);
+static struct lksmith_tls *get_or_create_tls(void);
+static void lksmith_merge_thread_edges(struct lksmith_tls *tls);
+static void *lksmith_merger_thread(void *v);
 static void lk_dump_to_stderr(struct lksmith_lock *lk) __attribute__((unused));
 static void tree_print(void) __attribute__((unused));
 static int compare_strings(const void *a, const void *b)
@@ -155,1092 +463,5051 @@ static int g_init_state_lock;
 static pthread_key_t g_tls_key;
 
 /**
- * Mutex which protects g_tree
+ * Number of lock registry shards.  Must be a power of 2.
  */
-static pthread_mutex_t g_tree_lock;
+#define LKSMITH_NUM_SHARDS 64
 
 /**
- * Tree of mutexes sorted by pointer
+ * Initial number of hash buckets in each shard.  Must be a power of 2.
  */
-struct lock_tree g_tree;
+#define LKSMITH_SHARD_INITIAL_BUCKETS 16
 
 /**
- * Mutex which protects g_cond_tree
+ * The lock registry: all the locks we know about, hashed by pointer.
  */
-static pthread_mutex_t g_cond_tree_lock;
+static struct lksmith_shard g_shards[LKSMITH_NUM_SHARDS];
 
 /**
- * Tree of condition variables sorted by pointer
+ * Mutex which protects the lock-order graph: the before and after lists of
+ * all locks, their ords, and the search scratch space.
+ *
+ * Lock ordering: if you need both, take g_graph_lock before a shard lock.
+ * Locks are unlinked from the graph with g_graph_lock held before they are
+ * freed, so holding it also keeps any lock reachable from the graph alive.
  */
-struct cond_tree g_cond_tree;
+static pthread_mutex_t g_graph_lock;
 
 /**
- * The latest color that has been used in graph traversal
+ * Number of lock IDs in one chunk of the ID table.  Must be a power of 2.
  */
-static uint64_t g_color;
+#define LKSMITH_ID_CHUNK_SIZE 4096
 
 /**
- * A sorted list of frames to ignore.
+ * Number of chunks in the ID table.
  */
-static char **g_ignored_frames;
+#define LKSMITH_ID_NUM_CHUNKS 65536
 
 /**
- * The number of ignored frames.
+ * The ID table: maps lock IDs to lock data.
+ *
+ * Chunks are allocated on demand and never freed, so lk_of doesn't need any
+ * lock.  A slot is set before its lock is published in the registry and
+ * cleared when the lock is destroyed.
  */
-static int g_num_ignored_frames;
+static struct lksmith_lock **g_id_chunks[LKSMITH_ID_NUM_CHUNKS];
 
 /**
- * A list of frame patterns to ignore.
+ * Mutex which protects g_next_id, g_free_ids and the allocation of ID
+ * table chunks.
  */
-static char **g_ignored_frame_patterns;
+static pthread_mutex_t g_id_lock;
 
 /**
- * The number of ignored frame patterns.
+ * The next lock ID which has never been used.  ID 0 is never used.
  */
-static int g_num_ignored_frame_patterns;
+static uint32_t g_next_id = 1;
 
-/******************************************************************
- *  Initialization
- *****************************************************************/
-static int compare_strings(const void *a, const void *b)
-{
-	const char *sa = *(const char **)a;
-	const char *sb = *(const char **)b;
-	return strcmp(sa, sb);
-}
+/**
+ * IDs of destroyed locks, which can be handed out again.
+ */
+static uint32_t *g_free_ids;
 
-static int lksmith_init_ignored(const char *env, char ***out, int *out_len)
-{
-	int ret, num_ignored = 0;
-	const char *ignored_env;
-	char *ignored = NULL, **ignored_arr = 0, *saveptr = NULL;
-	const char *str;
+/**
+ * Number of entries in g_free_ids.
+ */
+static uint32_t g_num_free_ids;
 
-	ignored_env = getenv(env);
-	if (!ignored_env) {
-		ret = 0;
-		goto done;
-	}
-	ignored = strdup(ignored_env);
-	if (!ignored) {
-		ret = ENOMEM;
-		goto done;
-	}
-	for (str = strtok_r(ignored, ":", &saveptr);
-			str; str = strtok_r(NULL, ":", &saveptr)) {
-		num_ignored++;
-	}
-	strcpy(ignored, ignored_env);
-	ignored_arr = calloc(num_ignored, sizeof(char*));
-	if (!ignored_arr) {
-		ret = ENOMEM;
-		goto done;
-	}
-	num_ignored = 0;
-	for (str = strtok_r(ignored, ":", &saveptr);
-			str; str = strtok_r(NULL, ":", &saveptr)) {
-		ignored_arr[num_ignored] = strdup(str);
-		if (!ignored_arr[num_ignored]) {
-			ret = ENOMEM;
-			goto done;
-		}
-		num_ignored++;
-	}
-	qsort(ignored_arr, num_ignored, sizeof(char*), compare_strings);
-	ret = 0;
+/**
+ * Capacity of g_free_ids.
+ */
+static uint32_t g_free_ids_cap;
 
-done:
-	free(ignored);
-	if (ret) {
-		if (ignored_arr) {
-			char **i;
-			for (i = ignored_arr; *i; i++) {
-				free(*i);
-			}
-			free(ignored_arr);
-		}
-		return ret;
-	}
-	*out = ignored_arr;
-	*out_len = num_ignored;
-	return 0;
-}
+/**
+ * Maximum number of locks to keep track of, or 0 for no limit.
+ * Set from LKSMITH_MAX_LOCKS at startup.
+ */
+static uint64_t g_max_locks;
 
 /**
- * Initialize the locksmith library.
+ * Maximum number of bytes to use for lock data and lock-order graph edges,
+ * or 0 for no limit.  Set from LKSMITH_MAX_MEMORY at startup.
  */
-static void lksmith_init(void)
-{
-	int ret;
+static uint64_t g_max_mem;
 
-	ret = lksmith_handler_init();
-	if (ret) {
-		/* can't use lksmith_error before handler */
-		fprintf(stderr, "lksmith_init: lksmith_handler_init failed.  "
-			"Can't find the real pthreads functions.\n");
-		abort();
-	}
-	ret = lksmith_init_ignored("LKSMITH_IGNORED_FRAMES",
-			&g_ignored_frames, &g_num_ignored_frames);
-	if (ret) {
-		lksmith_error(ret, "lksmith_init: lksmith_init_ignored_frames("
-			"frames) failed: error %d: %s\n", ret, terror(ret));
-		abort();
-	}
-	ret = lksmith_init_ignored("LKSMITH_IGNORED_FRAME_PATTERNS",
-			&g_ignored_frame_patterns,
-			&g_num_ignored_frame_patterns);
-	if (ret) {
-		lksmith_error(ret, "lksmith_init: lksmith_init_ignored_frames("
-			"patterns) failed: error %d: %s\n", ret, terror(ret));
-		abort();
-	}
-	ret = pthread_key_create(&g_tls_key, lksmith_tls_destroy);
-	if (ret) {
-		lksmith_error(ret, "lksmith_init: pthread_key_create("
-			"g_tls_key) failed: error %d: %s\n", ret, terror(ret));
-		abort();
-	}
-	ret = r_pthread_mutex_init(&g_tree_lock, NULL);
-	if (ret) {
-		lksmith_error(ret, "lksmith_init: pthread_mutex_init "
-			"g_tree_lock) failed: error %d: %s\n", ret, terror(ret));
-		abort();
-	}
-	ret = r_pthread_mutex_init(&g_cond_tree_lock, NULL);
-	if (ret) {
-		lksmith_error(ret, "lksmith_init: pthread_mutex_init "
-			"g_cond_tree_lock) failed: error %d: %s\n",
-			ret, terror(ret));
-		abort();
-	}
-	lksmith_error(0, "Locksmith has been initialized for process %lld\n",
-		      (long long)getpid());
-	g_initialized = 1;
-}
+/**
+ * Number of locks in the registry.
+ */
+static uint64_t g_num_locks;
 
-/******************************************************************
- *  Thread-local storage
- *****************************************************************/
 /**
- * Callback which destroys thread-local storage.
- *
- * This callback will be invoked whenever a thread exits.
- *
- * @param v		The TLS object.
+ * Number of bytes used by the lock data in the registry and their before
+ * and after lists.
  */
-static void lksmith_tls_destroy(void *v)
-{
-	struct lksmith_tls *tls = v;
-	free(tls->held);
-	free(tls);
-}
+static uint64_t g_lock_mem;
 
 /**
- * Get or create the thread-local storage associated with this thread.
- *
- * The problem with POSIX thread-local storage is that in order to use it,
- * you must first initialize a 'key'.  But how do you initialize this key
- * prior to use?  There's no good way to do it.
- *
- * gcc provides the non-portable __attribute__((constructor)), which seems like
- * it could be useful.  Unfortunately, the order in which these constructor
- * functions are called between shared libraries is not defined.
- * If another shared library defines some constructor functions which invoke
- * pthreads functions, and it gets run before we initialize, it's game over.
- * C++ global constructors have the same issues.
- *
- * We could force Locksmith users to call an init function before calling any
- * other Locksmith functions.  Then, this init function could initialize the
- * key.  But that would be painful for many users.  This is especially true
- * in C++, where global constructors often make use of mutexes long before
- * main() runs.
- *
- * The other approach, which we have taken here, is to protect the key with a
- * mutex.  This is somewhat slow, since it means that we have to take this
- * mutex before every access to thread-local data.  Luckily, on platforms
- * that support the __thread keyword, we can bypass this slowness.
- * Thread-local variables declared using __thread don't need to be manually
- * intialized before use.  They're ready to go before any code has been run.
- *
- * One advantage that POSIX thread-local variables have over __thread
- * variables is that the former can declare "destructors" which are run when
- * the thread is destroyed.  (These have no relation to the C++ concept of
- * the same name.) We make use of that ability here, to clean up our
- * malloc()ed thread-local data when the thread in question exits.
- * By combining the __thread keyword and POSIX thread-local variables, we can
- * get the best of each.
- *
- * @return			NULL on OOM, the TLS otherwise.
+ * Number of locks which have been evicted to stay under g_max_locks or
+ * g_max_mem.
  */
-static struct lksmith_tls *get_or_create_tls(void)
-{
-	int ret = 0;
-	struct lksmith_tls *tls;
+static uint64_t g_num_evictions;
 
-#ifdef HAVE_IMPROVED_TLS
-	static __thread struct lksmith_tls *t_improved_tls = NULL;
-	if (t_improved_tls) {
-		return t_improved_tls;
-	}
-#endif
-	simple_spin_lock(&g_init_state_lock);
-	if (!g_initialized) {
-		lksmith_init();
-	}
-	simple_spin_unlock(&g_init_state_lock);
-#ifndef HAVE_IMPROVED_TLS
-	tls = pthread_getspecific(g_tls_key);
-	if (tls) {
-		return tls;
-	}
-#endif
-	tls = calloc(1, sizeof(*tls));
-	if (!tls) {
-		lksmith_error(ENOMEM,
-			"get_or_create_tls(): failed to allocate "
-			"memory for thread-local storage.\n");
+/**
+ * Mutex which protects g_evict_hand.  Only one thread evicts at a time.
+ */
+static pthread_mutex_t g_evict_lock;
+
+/**
+ * The lock ID that the eviction clock hand will look at next.
+ */
+static uint32_t g_evict_hand = 1;
+
+/**
+ * Maximum number of ID table slots to look at in one call to lksmith_evict.
+ */
+#define LKSMITH_EVICT_MAX_SCAN 4096
+
+/**
+ * Number of buckets in g_classes.  Must be a power of 2.
+ */
+#define LKSMITH_CLASS_BUCKETS 256
+
+/**
+ * Lock class nodes, hashed by class ID and chained through their next
+ * pointers.  Class nodes are never freed.  Protected by g_class_lock.
+ */
+static struct lksmith_lock *g_classes[LKSMITH_CLASS_BUCKETS];
+
+/**
+ * Number of buckets in g_site_classes.  Must be a power of 2.
+ */
+#define LKSMITH_SITE_CLASS_BUCKETS 1024
+
+/**
+ * Lock class nodes for initialization sites, hashed by site and chained
+ * through their next pointers.  The ptr of each node is its site.  Class nodes
+ * are never freed.  Protected by g_class_lock.
+ */
+static struct lksmith_lock *g_site_classes[LKSMITH_SITE_CLASS_BUCKETS];
+
+/**
+ * Mutex which protects g_classes and g_site_classes.
+ */
+static pthread_mutex_t g_class_lock;
+
+/**
+ * 1 if locks initialized at the same site should share a class.  Set from
+ * LKSMITH_CLASS_BY_SITE at startup.
+ */
+static int g_class_by_site;
+
+/**
+ * 1 if we should print the statistics when the process exits.  Set from
+ * LKSMITH_DUMP_STATS at startup.
+ */
+static int g_dump_stats;
+
+/**
+ * Number of condition variable hash buckets.  Must be a power of 2.
+ */
+#define LKSMITH_COND_BUCKETS 4096
+
+/**
+ * Condition variables, hashed by pointer.  Records are pushed onto the heads
+ * of the chains with compare-and-swap, and never removed.
+ */
+static struct lksmith_cond *g_conds[LKSMITH_COND_BUCKETS];
+
+/**
+ * What a graph search knows about a lock it has visited.
+ */
+struct lksmith_visit {
+	/** The search which last visited this lock; see g_visit_epoch */
+	uint32_t epoch;
+	/** ID of the lock from which the last forward search reached this
+	 * one, used to find the path of a cycle */
+	uint32_t parent;
+};
+
+/**
+ * The visit set of graph searches, indexed by lock ID.  Keeping it out of the
+ * lock records means that a search doesn't write to the cache lines of every
+ * lock it passes, which other threads are reading to look their locks up.
+ */
+static struct lksmith_visit *g_visits;
+
+/**
+ * Number of entries in g_visits.
+ */
+static uint32_t g_visits_cap;
+
+/**
+ * The current graph search.  A lock has been visited by this search if its
+ * entry in g_visits has this epoch.
+ */
+static uint32_t g_visit_epoch;
+
+/**
+ * The next ord to give to a new lock.  New locks have no edges, so they can
+ * go anywhere in the topological order; we put them at the end.
+ */
+static uint64_t g_next_ord;
+
+/**
+ * The next thread ID to hand out.
+ */
+static uint64_t g_next_tid = 1;
+
+/**
+ * Number of names in each chunk of the thread registry.
+ */
+#define LKSMITH_THREAD_NAMES_CHUNK 1024
+
+/**
+ * Maximum number of chunks in the thread registry.  Threads with higher IDs
+ * are reported by number.
+ */
+#define LKSMITH_THREAD_NAMES_MAX_CHUNKS 16384
+
+/**
+ * Mutex which protects g_thread_names.  Nothing else is ever locked while
+ * it is held.
+ */
+static pthread_mutex_t g_thread_names_lock;
+
+/**
+ * The thread registry: the name of every thread that has had thread-local
+ * storage, indexed by thread ID.  Names are kept after their threads exit,
+ * so that lock holders which outlive their threads can still be named.
+ */
+static char (*g_thread_names[LKSMITH_THREAD_NAMES_MAX_CHUNKS])
+	[LKSMITH_THREAD_NAME_MAX];
+
+/**
+ * Mutex which protects g_threads, g_num_threads, and g_exited_stats.
+ */
+static pthread_mutex_t g_threads_lock;
+
+/**
+ * List of the thread-local data of all threads which are still running.
+ */
+static struct lksmith_tls *g_threads;
+
+/**
+ * Number of threads in g_threads.
+ */
+static uint64_t g_num_threads;
+
+/**
+ * Sum of the statistics of threads which have exited.
+ */
+static struct lksmith_thread_stats g_exited_stats;
+
+/**
+ * Number of edges in the lock-order graph.  Protected by g_graph_lock.
+ */
+static uint64_t g_num_edges;
+
+/**
+ * Number of locks visited by graph searches.  Protected by g_graph_lock.
+ */
+static uint64_t g_search_steps;
+
+/**
+ * The file descriptors of the pipe which LKSMITH_STATS_SIGNAL uses to wake
+ * up the statistics thread.
+ */
+static int g_stats_pipe[2] = { -1, -1 };
+
+/**
+ * How often the merger folds deferred edges into the lock-order graph, in
+ * milliseconds, or 0 if edges are added to the graph as they are seen.  Set
+ * from LKSMITH_DEFER_EDGES at startup.
+ */
+static long g_defer_ms;
+
+/**
+ * 1 if we are writing lock events to a trace instead of checking them.  Set
+ * from LKSMITH_TRACE at startup.
+ */
+static int g_tracing;
+
+/**
+ * Scratch space for graph searches.
+ */
+static struct lk_vec g_search_stack, g_search_fwd, g_search_bwd;
+
+/**
+ * The path of the cycle found by the last graph_add_edge which returned
+ * EDEADLK, from the lock being taken to the lock which was held.
+ */
+static struct lk_vec g_search_path;
+
+/**
+ * The lock-order graph epoch.
+ *
+ * Once an edge is in the graph, taking the same two locks in the same order
+ * can never be an inversion, so threads cache the edges they have added.
+ * Edges only go away when a lock is destroyed, so that is when we bump the
+ * epoch, invalidating every cached edge.  Starts at 1 so that zeroed cache
+ * entries are never valid.
+ *
+ * Only modified with g_graph_lock held.
+ */
+static uint64_t g_graph_epoch = 1;
+
+/**
+ * When we capture backtraces for lock holders.
+ */
+enum lksmith_bt_mode {
+	/** On every acquisition */
+	LKSMITH_BT_ALWAYS = 0,
+	/** When an acquisition adds a new edge to the lock-order graph, or
+	 * reports an error */
+	LKSMITH_BT_FIRST_EDGE,
+	/** On one out of every g_bt_sample_period acquisitions */
+	LKSMITH_BT_SAMPLE,
+	/** Never */
+	LKSMITH_BT_NEVER,
+};
+
+/**
+ * The backtrace mode, from LKSMITH_BACKTRACE_MODE.
+ */
+static enum lksmith_bt_mode g_bt_mode;
+
+/**
+ * The sampling period for LKSMITH_BT_SAMPLE.
+ */
+static unsigned int g_bt_sample_period;
+
+/**
+ * Number of locks to report in the lock profile if LKSMITH_PROFILE doesn't
+ * make sense.
+ */
+#define LKSMITH_PROFILE_DEFAULT_TOP 20
+
+/**
+ * Number of locks to report in the lock profile, from LKSMITH_PROFILE, or 0
+ * if we are not profiling.
+ */
+static int g_prof_top;
+
+/**
+ * Pool of lock records
+ */
+static struct lksmith_pool g_lock_pool;
+
+/**
+ * Pool of lock holder records
+ */
+static struct lksmith_pool g_holder_pool;
+
+/**
+ * Pool of condition variable records
+ */
+static struct lksmith_pool g_cond_pool;
+
+/**
+ * A sorted list of frames to ignore.
+ */
+static char **g_ignored_frames;
+
+/**
+ * The number of ignored frames.
+ */
+static int g_num_ignored_frames;
+
+/**
+ * A list of frame patterns to ignore.
+ */
+static char **g_ignored_frame_patterns;
+
+/**
+ * The number of ignored frame patterns.
+ */
+static int g_num_ignored_frame_patterns;
+
+/**
+ * The ignored frames and frame patterns, compiled into one matcher.  NULL if
+ * there is nothing to ignore.
+ */
+static struct lksmith_matcher *g_ignore_matcher;
+
+/**
+ * Number of entries in the ignore verdict cache.  Must be a power of 2.
+ */
+#define LKSMITH_VERDICT_CACHE_SIZE 4096
+
+/**
+ * Cache of ignore verdicts, by return address.
+ *
+ * Each entry is (address << 1) | verdict, or 0 if it is empty.  Entries are
+ * read and written with atomic loads and stores, but no lock.  Losing a race
+ * just means that somebody matches the frame name again.  User-space
+ * addresses don't use the top bit, so the shift doesn't lose anything.
+ */
+static uint64_t g_verdict_cache[LKSMITH_VERDICT_CACHE_SIZE];
+
+/**
+ * The modules to ignore, and the modules to track, compiled into matchers.
+ * Set from LKSMITH_IGNORED_MODULES and LKSMITH_TRACKED_MODULES at startup.
+ * NULL if the list is empty.
+ */
+static struct lksmith_matcher *g_ignored_modules, *g_tracked_modules;
+
+/**
+ * The address ranges of the loaded modules, or NULL if there are no module
+ * filters.  When a call site isn't in any of them, a library has probably
+ * been loaded since, so we make a new map.  Old maps are never freed, since
+ * other threads may still be searching them.
+ */
+static struct module_map *g_modules;
+
+/**
+ * Mutex which protects replacing g_modules.
+ */
+static pthread_mutex_t g_modules_lock;
+
+/**
+ * Number of times g_modules has been replaced.
+ */
+static int g_modules_reloads;
+
+/**
+ * Maximum number of times to replace g_modules.  Call sites in code which
+ * isn't in any module, such as JIT-compiled code, would otherwise make a new
+ * map every time they missed the verdict cache.
+ */
+#define LKSMITH_MODULES_MAX_RELOADS 256
+
+/**
+ * Cache of call site verdicts for the module filters, in the same format as
+ * g_verdict_cache.
+ */
+static uint64_t g_site_verdicts[LKSMITH_VERDICT_CACHE_SIZE];
+
+/**
+ * Number of entries in g_once_done.  Must be a power of 2.
+ */
+#define LKSMITH_ONCE_CACHE_SIZE 1024
+
+/**
+ * Cache of pthread_once controls whose init routines have finished, so that
+ * checking one doesn't need a shard lock.  Each slot holds a control or NULL.
+ * A control which misses is looked up in the registry.
+ */
+static const void *g_once_done[LKSMITH_ONCE_CACHE_SIZE];
+
+/**
+ * Why the module filters skipped a lock.
+ */
+enum lksmith_filter {
+	/** The lock is tracked */
+	LKSMITH_FILTER_NONE = 0,
+	/** The lock is in an ignored module's data, so every operation on
+	 * it is skipped */
+	LKSMITH_FILTER_ADDR,
+	/** The lock was taken from code which isn't tracked */
+	LKSMITH_FILTER_SITE,
+};
+
+/******************************************************************
+ *  Initialization
+ *****************************************************************/
+static int compare_strings(const void *a, const void *b)
+{
+	const char *sa = *(const char **)a;
+	const char *sb = *(const char **)b;
+	return strcmp(sa, sb);
+}
+
+static int lksmith_init_ignored(const char *env, char ***out, int *out_len)
+{
+	int ret, num_ignored = 0;
+	const char *ignored_env;
+	char *ignored = NULL, **ignored_arr = 0, *saveptr = NULL;
+	const char *str;
+
+	ignored_env = getenv(env);
+	if (!ignored_env) {
+		ret = 0;
+		goto done;
+	}
+	ignored = strdup(ignored_env);
+	if (!ignored) {
+		ret = ENOMEM;
+		goto done;
+	}
+	for (str = strtok_r(ignored, ":", &saveptr);
+			str; str = strtok_r(NULL, ":", &saveptr)) {
+		num_ignored++;
+	}
+	strcpy(ignored, ignored_env);
+	ignored_arr = calloc(num_ignored, sizeof(char*));
+	if (!ignored_arr) {
+		ret = ENOMEM;
+		goto done;
+	}
+	num_ignored = 0;
+	for (str = strtok_r(ignored, ":", &saveptr);
+			str; str = strtok_r(NULL, ":", &saveptr)) {
+		ignored_arr[num_ignored] = strdup(str);
+		if (!ignored_arr[num_ignored]) {
+			ret = ENOMEM;
+			goto done;
+		}
+		num_ignored++;
+	}
+	qsort(ignored_arr, num_ignored, sizeof(char*), compare_strings);
+	ret = 0;
+
+done:
+	free(ignored);
+	if (ret) {
+		if (ignored_arr) {
+			char **i;
+			for (i = ignored_arr; *i; i++) {
+				free(*i);
+			}
+			free(ignored_arr);
+		}
+		return ret;
+	}
+	*out = ignored_arr;
+	*out_len = num_ignored;
+	return 0;
+}
+
+/**
+ * Add a thread's statistics to a total.
+ *
+ * @param total		The total.
+ * @param ts		The thread's statistics.
+ */
+static void thread_stats_add(struct lksmith_thread_stats *total,
+		const struct lksmith_thread_stats *ts)
+{
+	total->acquisitions += __atomic_load_n(&ts->acquisitions,
+		__ATOMIC_RELAXED);
+	total->fast += __atomic_load_n(&ts->fast, __ATOMIC_RELAXED);
+	total->backtraces += __atomic_load_n(&ts->backtraces,
+		__ATOMIC_RELAXED);
+	total->ignored += __atomic_load_n(&ts->ignored, __ATOMIC_RELAXED);
+	total->filtered += __atomic_load_n(&ts->filtered, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add up the statistics of every thread, running or exited.
+ *
+ * @param total		(out param) the sum
+ * @param num_threads	(out param) the number of running threads, or
+ *			NULL
+ */
+static void lksmith_sum_thread_stats(struct lksmith_thread_stats *total,
+		uint64_t *num_threads)
+{
+	struct lksmith_tls *tls;
+
+	memset(total, 0, sizeof(*total));
+	r_pthread_mutex_lock(&g_threads_lock);
+	thread_stats_add(total, &g_exited_stats);
+	for (tls = g_threads; tls; tls = tls->next)
+		thread_stats_add(total, &tls->stats);
+	if (num_threads)
+		*num_threads = g_num_threads;
+	r_pthread_mutex_unlock(&g_threads_lock);
+}
+
+/**
+ * Get the total size of a pool's records.
+ *
+ * @param pool		The pool.
+ *
+ * @return		The size in bytes.
+ */
+static uint64_t lksmith_pool_bytes(struct lksmith_pool *pool)
+{
+	uint64_t num_objs;
+
+	r_pthread_mutex_lock(&pool->lock);
+	num_objs = pool->num_objs;
+	r_pthread_mutex_unlock(&pool->lock);
+	return num_objs * pool->obj_size;
+}
+
+/**
+ * Gather up all of the statistics.
+ *
+ * @param st		(out param) the statistics
+ */
+static void lksmith_collect_stats(struct lksmith_stats *st)
+{
+	struct lksmith_thread_stats ts;
+
+	memset(st, 0, sizeof(*st));
+	lksmith_sum_thread_stats(&ts, &st->threads);
+	st->acquisitions = ts.acquisitions;
+	st->fast_acquisitions = ts.fast;
+	st->backtraces = ts.backtraces;
+	st->ignored = ts.ignored;
+	st->filtered = ts.filtered;
+	st->locks = __atomic_load_n(&g_num_locks, __ATOMIC_RELAXED);
+	st->evictions = __atomic_load_n(&g_num_evictions, __ATOMIC_RELAXED);
+	st->lock_bytes = __atomic_load_n(&g_lock_mem, __ATOMIC_RELAXED);
+	st->pool_bytes = lksmith_pool_bytes(&g_lock_pool) +
+		lksmith_pool_bytes(&g_holder_pool) +
+		lksmith_pool_bytes(&g_cond_pool);
+	r_pthread_mutex_lock(&g_graph_lock);
+	st->edges = g_num_edges;
+	st->search_steps = g_search_steps;
+	r_pthread_mutex_unlock(&g_graph_lock);
+	st->deadlock_errors = lksmith_error_count(EDEADLK);
+	st->unlock_errors = lksmith_error_count(EPERM);
+	st->busy_errors = lksmith_error_count(EBUSY);
+	st->perf_warnings = lksmith_error_count(EWOULDBLOCK);
+	st->total_errors = lksmith_error_count(-1);
+	st->stacks = depot_max_id();
+	st->stack_bytes = depot_bytes();
+}
+
+/**
+ * Describe how many locks are private to one thread, and how many are shared.
+ *
+ * @param buf		(out param) the buffer to write to
+ * @param off		(inout param) current position in the buffer
+ * @param buf_len	length of buf
+ */
+static void lksmith_dump_lock_classes(char *buf, size_t *off, size_t buf_len)
+{
+	struct lksmith_shard *shard;
+	struct lksmith_lock *lk;
+	struct lksmith_thread_stats ts;
+	uint64_t num_private = 0, num_shared = 0, num_unused = 0;
+	size_t i, b;
+
+	for (i = 0; i < LKSMITH_NUM_SHARDS; i++) {
+		shard = &g_shards[i];
+		r_pthread_mutex_lock(&shard->lock);
+		for (b = 0; b < shard->num_buckets; b++) {
+			for (lk = shard->buckets[b]; lk; lk = lk->next) {
+				if (lk->promoted)
+					num_shared++;
+				else if (lk->owner)
+					num_private++;
+				else
+					num_unused++;
+			}
+		}
+		r_pthread_mutex_unlock(&shard->lock);
+	}
+	lksmith_sum_thread_stats(&ts, NULL);
+	fwdprintf(buf, off, buf_len, "lock classes: %"PRIu64" private to one "
+		"thread, %"PRIu64" shared, %"PRIu64" never taken; %"PRIu64
+		" private fast path acquisitions", num_private, num_shared,
+		num_unused, ts.fast);
+}
+
+void lksmith_dump_stats(void)
+{
+	char buf[2048];
+	size_t off = 0;
+	struct lksmith_stats st;
+
+	fwdprintf(buf, &off, sizeof(buf), "Locksmith statistics for "
+		"process %lld:\n", (long long)getpid());
+	pool_dump(&g_lock_pool, buf, &off, sizeof(buf));
+	fwdprintf(buf, &off, sizeof(buf), "\n");
+	pool_dump(&g_holder_pool, buf, &off, sizeof(buf));
+	fwdprintf(buf, &off, sizeof(buf), "\n");
+	pool_dump(&g_cond_pool, buf, &off, sizeof(buf));
+	fwdprintf(buf, &off, sizeof(buf), "\n");
+	lksmith_dump_lock_classes(buf, &off, sizeof(buf));
+	fwdprintf(buf, &off, sizeof(buf), "\n");
+	lksmith_collect_stats(&st);
+	fwdprintf(buf, &off, sizeof(buf), "lock memory: %"PRIu64" locks, "
+		"%"PRIu64" bytes, %"PRIu64" evictions\n",
+		st.locks, st.lock_bytes, st.evictions);
+	fwdprintf(buf, &off, sizeof(buf), "counters: threads=%"PRIu64" "
+		"locks=%"PRIu64" edges=%"PRIu64" acquisitions=%"PRIu64" "
+		"fast_acquisitions=%"PRIu64" backtraces=%"PRIu64" "
+		"ignored=%"PRIu64" search_steps=%"PRIu64" evictions=%"PRIu64" "
+		"lock_bytes=%"PRIu64" pool_bytes=%"PRIu64" "
+		"deadlock_errors=%"PRIu64" unlock_errors=%"PRIu64" "
+		"busy_errors=%"PRIu64" perf_warnings=%"PRIu64" "
+		"total_errors=%"PRIu64" stacks=%"PRIu64" "
+		"stack_bytes=%"PRIu64" filtered=%"PRIu64"\n", st.threads,
+		st.locks, st.edges, st.acquisitions, st.fast_acquisitions,
+		st.backtraces, st.ignored, st.search_steps, st.evictions,
+		st.lock_bytes, st.pool_bytes, st.deadlock_errors,
+		st.unlock_errors, st.busy_errors, st.perf_warnings,
+		st.total_errors, st.stacks, st.stack_bytes, st.filtered);
+	lksmith_error(0, "%s", buf);
+}
+
+/**
+ * Initialize a record pool, or abort.
+ *
+ * @param pool		The pool.
+ * @param name		The name of the pool.
+ * @param obj_size	The size of each record.
+ */
+static void lksmith_init_pool(struct lksmith_pool *pool, const char *name,
+		size_t obj_size)
+{
+	int ret;
+
+	ret = pool_init(pool, name, obj_size);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pool_init(%s) failed: "
+			"error %d: %s\n", name, ret, terror(ret));
+		abort();
+	}
+}
+
+/**
+ * Parse LKSMITH_BACKTRACE_MODE.
+ */
+static void lksmith_init_backtrace_mode(void)
+{
+	const char *mode;
+	char *end;
+	unsigned long period;
+
+	mode = getenv("LKSMITH_BACKTRACE_MODE");
+	if ((!mode) || (!strcmp(mode, "always"))) {
+		g_bt_mode = LKSMITH_BT_ALWAYS;
+	} else if (!strcmp(mode, "first-edge")) {
+		g_bt_mode = LKSMITH_BT_FIRST_EDGE;
+	} else if (!strcmp(mode, "never")) {
+		g_bt_mode = LKSMITH_BT_NEVER;
+	} else if (!strncmp(mode, "sample:", 7)) {
+		errno = 0;
+		period = strtoul(mode + 7, &end, 10);
+		if (errno || (end == mode + 7) || (*end) || (period == 0) ||
+				(period > UINT32_MAX)) {
+			lksmith_error(EINVAL, "lksmith_init: invalid sampling "
+				"period in LKSMITH_BACKTRACE_MODE=%s.  Taking "
+				"backtraces on every acquisition.\n", mode);
+			g_bt_mode = LKSMITH_BT_ALWAYS;
+			return;
+		}
+		g_bt_mode = LKSMITH_BT_SAMPLE;
+		g_bt_sample_period = period;
+	} else {
+		lksmith_error(EINVAL, "lksmith_init: unable to understand "
+			"LKSMITH_BACKTRACE_MODE=%s.  Taking backtraces on "
+			"every acquisition.\n", mode);
+		g_bt_mode = LKSMITH_BT_ALWAYS;
+	}
+}
+
+/**
+ * Signal handler for LKSMITH_STATS_SIGNAL.
+ *
+ * We can't do much in a signal handler, so we just wake up the statistics
+ * thread.
+ */
+static void lksmith_stats_signal_handler(int sig __attribute__((unused)))
+{
+	int err = errno;
+	char c = 0;
+
+	if (write(g_stats_pipe[1], &c, 1) < 0) {
+		/* The pipe is full, so a dump is already on its way. */
+	}
+	errno = err;
+}
+
+/**
+ * The statistics thread, which dumps statistics whenever
+ * LKSMITH_STATS_SIGNAL is received.
+ */
+static void *lksmith_stats_thread(void *v __attribute__((unused)))
+{
+	char c;
+	ssize_t res;
+
+	while (1) {
+		res = read(g_stats_pipe[0], &c, 1);
+		if (res == 1)
+			lksmith_dump_stats();
+		else if ((res < 0) && (errno != EINTR))
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * Parse LKSMITH_DEFER_EDGES, and start the merger thread if it is set.
+ */
+static void lksmith_init_defer_edges(void)
+{
+	const char *str;
+	char *end;
+	long ms;
+	int ret;
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	str = getenv("LKSMITH_DEFER_EDGES");
+	if ((!str) || (!str[0]))
+		return;
+	errno = 0;
+	ms = strtol(str, &end, 10);
+	if (errno || (*end) || (ms <= 0)) {
+		lksmith_error(EINVAL, "lksmith_init: unable to understand "
+			"LKSMITH_DEFER_EDGES=%s.  It should be a number of "
+			"milliseconds.\n", str);
+		return;
+	}
+	g_defer_ms = ms;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, lksmith_merger_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		/* Without a merger, threads would never report anything. */
+		g_defer_ms = 0;
+		lksmith_error(ret, "lksmith_init: failed to create the "
+			"merger thread: error %d: %s\n", ret, terror(ret));
+		return;
+	}
+}
+
+/**
+ * Parse LKSMITH_TRACE, and open the trace file if it is set.
+ */
+static void lksmith_init_trace(void)
+{
+	const char *str;
+	int ret;
+
+	str = getenv("LKSMITH_TRACE");
+	if ((!str) || (!str[0]))
+		return;
+	if (strncmp(str, "file:", 5) || (!str[5])) {
+		lksmith_error(EINVAL, "lksmith_init: unable to understand "
+			"LKSMITH_TRACE=%s.  It should look like "
+			"file:/path/to/trace.\n", str);
+		return;
+	}
+	ret = trace_open(str + 5);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: failed to open trace file "
+			"%s: error %d: %s\n", str + 5, ret, terror(ret));
+		return;
+	}
+	g_tracing = 1;
+}
+
+/**
+ * Parse LKSMITH_STATS_SIGNAL.
+ */
+static void lksmith_init_stats_signal(void)
+{
+	const char *str;
+	char *end;
+	long sig;
+	int ret;
+	pthread_t thread;
+	pthread_attr_t attr;
+	struct sigaction act;
+
+	str = getenv("LKSMITH_STATS_SIGNAL");
+	if ((!str) || (!str[0]))
+		return;
+	errno = 0;
+	sig = strtol(str, &end, 10);
+	if (errno || (*end) || (sig <= 0) || (sig >= NSIG)) {
+		lksmith_error(EINVAL, "lksmith_init: unable to understand "
+			"LKSMITH_STATS_SIGNAL=%s.  It should be a signal "
+			"number.\n", str);
+		return;
+	}
+	if (pipe(g_stats_pipe)) {
+		ret = errno;
+		lksmith_error(ret, "lksmith_init: pipe failed: error %d: "
+			"%s\n", ret, terror(ret));
+		return;
+	}
+	fcntl(g_stats_pipe[1], F_SETFL, O_NONBLOCK);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, lksmith_stats_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: failed to create the "
+			"statistics thread: error %d: %s\n", ret, terror(ret));
+		return;
+	}
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = lksmith_stats_signal_handler;
+	act.sa_flags = SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	if (sigaction(sig, &act, NULL)) {
+		ret = errno;
+		lksmith_error(ret, "lksmith_init: sigaction(%ld) failed: "
+			"error %d: %s\n", sig, ret, terror(ret));
+	}
+}
+
+/**
+ * Parse a memory limit environment variable.
+ *
+ * @param env		The name of the environment variable.
+ * @param what		What the limit counts, for error messages.
+ *
+ * @return		The limit, or 0 if there is none.
+ */
+static uint64_t lksmith_init_limit(const char *env, const char *what)
+{
+	const char *str;
+	char *end;
+	unsigned long long val;
+
+	str = getenv(env);
+	if ((!str) || (!str[0]))
+		return 0;
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if (errno || (end == str) || (*end) || (str[0] == '-')) {
+		lksmith_error(EINVAL, "lksmith_init: unable to understand "
+			"%s=%s.  It should be a number of %s.  Not setting a "
+			"limit.\n", env, str, what);
+		return 0;
+	}
+	return val;
+}
+
+/**
+ * Parse LKSMITH_PROFILE.
+ */
+static void lksmith_init_profile(void)
+{
+	const char *top;
+	char *end;
+	long val;
+
+	top = getenv("LKSMITH_PROFILE");
+	if ((!top) || (!top[0]))
+		return;
+	errno = 0;
+	val = strtol(top, &end, 10);
+	if (errno || (*end) || (val < 0) || (val > INT32_MAX)) {
+		lksmith_error(EINVAL, "lksmith_init: unable to understand "
+			"LKSMITH_PROFILE=%s.  It should be the number of locks "
+			"to report.  Reporting %d.\n", top,
+			LKSMITH_PROFILE_DEFAULT_TOP);
+		val = LKSMITH_PROFILE_DEFAULT_TOP;
+	}
+	g_prof_top = val;
+}
+
+/**
+ * Compile one of the module lists.
+ *
+ * @param env		The environment variable which holds the list.
+ * @param out		(out param) the matcher, or NULL if the list is
+ *			empty.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+static int lksmith_init_module_list(const char *env,
+		struct lksmith_matcher **out)
+{
+	char **names = NULL, **literals = NULL, **patterns = NULL;
+	int i, ret, num_names = 0, num_literals = 0, num_patterns = 0;
+
+	*out = NULL;
+	ret = lksmith_init_ignored(env, &names, &num_names);
+	if (ret || (num_names == 0))
+		goto done;
+	literals = calloc(num_names, sizeof(char*));
+	patterns = calloc(num_names, sizeof(char*));
+	if ((!literals) || (!patterns)) {
+		ret = ENOMEM;
+		goto done;
+	}
+	for (i = 0; i < num_names; i++) {
+		if (strpbrk(names[i], "*?["))
+			patterns[num_patterns++] = names[i];
+		else
+			literals[num_literals++] = names[i];
+	}
+	ret = matcher_create(literals, num_literals, patterns, num_patterns,
+		out);
+done:
+	for (i = 0; i < num_names; i++)
+		free(names[i]);
+	free(names);
+	free(literals);
+	free(patterns);
+	return ret;
+}
+
+/**
+ * Read LKSMITH_IGNORED_MODULES and LKSMITH_TRACKED_MODULES, and find the
+ * address ranges of the loaded modules if either is set.
+ */
+static void lksmith_init_module_filters(void)
+{
+	int ret;
+
+	ret = r_pthread_mutex_init(&g_modules_lock, NULL);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_mutex_init("
+			"g_modules_lock) failed: error %d: %s\n", ret,
+			terror(ret));
+		abort();
+	}
+	ret = lksmith_init_module_list("LKSMITH_IGNORED_MODULES",
+			&g_ignored_modules);
+	if (!ret) {
+		ret = lksmith_init_module_list("LKSMITH_TRACKED_MODULES",
+			&g_tracked_modules);
+	}
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: failed to read the module "
+			"lists: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	if ((!g_ignored_modules) && (!g_tracked_modules))
+		return;
+	ret = module_map_create(g_ignored_modules, g_tracked_modules,
+			&g_modules);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: failed to find the loaded "
+			"modules, so LKSMITH_IGNORED_MODULES and "
+			"LKSMITH_TRACKED_MODULES will be ignored: error %d: "
+			"%s\n", ret, terror(ret));
+		g_modules = NULL;
+	}
+}
+
+/**
+ * Make the reports which are due when the process exits.
+ *
+ * This is registered with atexit if LKSMITH_PROFILE, LKSMITH_DEFER_EDGES, or
+ * LKSMITH_DUMP_STATS is set.  The report writer registers its own exit
+ * handler when it starts, which is usually after we do, so it has already
+ * run by now, and we have to flush what we add ourselves.
+ */
+static void lksmith_report_at_exit(void)
+{
+	if (g_prof_top > 0)
+		lksmith_profile_dump();
+	lksmith_flush_edges();
+	if (g_dump_stats)
+		lksmith_dump_stats();
+	lksmith_error_flush();
+}
+
+/**
+ * Initialize the locksmith library.
+ */
+static void lksmith_init(void)
+{
+	int i, ret;
+
+	ret = lksmith_handler_init();
+	if (ret) {
+		/* can't use lksmith_error before handler */
+		fprintf(stderr, "lksmith_init: lksmith_handler_init failed.  "
+			"Can't find the real pthreads functions.\n");
+		abort();
+	}
+	ret = lksmith_init_ignored("LKSMITH_IGNORED_FRAMES",
+			&g_ignored_frames, &g_num_ignored_frames);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: lksmith_init_ignored_frames("
+			"frames) failed: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	ret = lksmith_init_ignored("LKSMITH_IGNORED_FRAME_PATTERNS",
+			&g_ignored_frame_patterns,
+			&g_num_ignored_frame_patterns);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: lksmith_init_ignored_frames("
+			"patterns) failed: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	lksmith_init_backtrace_mode();
+	lksmith_init_profile();
+	if (g_num_ignored_frames || g_num_ignored_frame_patterns) {
+		ret = matcher_create(g_ignored_frames, g_num_ignored_frames,
+			g_ignored_frame_patterns, g_num_ignored_frame_patterns,
+			&g_ignore_matcher);
+		if (ret) {
+			lksmith_error(ret, "lksmith_init: matcher_create "
+				"failed: error %d: %s\n", ret, terror(ret));
+			abort();
+		}
+	}
+	lksmith_init_module_filters();
+	ret = pthread_key_create(&g_tls_key, lksmith_tls_destroy);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_key_create("
+			"g_tls_key) failed: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	for (i = 0; i < LKSMITH_NUM_SHARDS; i++) {
+		ret = r_pthread_mutex_init(&g_shards[i].lock, NULL);
+		if (ret) {
+			lksmith_error(ret, "lksmith_init: pthread_mutex_init("
+				"g_shards[%d].lock) failed: error %d: %s\n",
+				i, ret, terror(ret));
+			abort();
+		}
+	}
+	ret = r_pthread_mutex_init(&g_graph_lock, NULL);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_mutex_init("
+			"g_graph_lock) failed: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	ret = r_pthread_mutex_init(&g_id_lock, NULL);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_mutex_init("
+			"g_id_lock) failed: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	ret = r_pthread_mutex_init(&g_class_lock, NULL);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_mutex_init("
+			"g_class_lock) failed: error %d: %s\n", ret,
+			terror(ret));
+		abort();
+	}
+	ret = r_pthread_mutex_init(&g_threads_lock, NULL);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_mutex_init("
+			"g_threads_lock) failed: error %d: %s\n", ret,
+			terror(ret));
+		abort();
+	}
+	ret = r_pthread_mutex_init(&g_thread_names_lock, NULL);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_mutex_init("
+			"g_thread_names_lock) failed: error %d: %s\n", ret,
+			terror(ret));
+		abort();
+	}
+	ret = r_pthread_mutex_init(&g_evict_lock, NULL);
+	if (ret) {
+		lksmith_error(ret, "lksmith_init: pthread_mutex_init("
+			"g_evict_lock) failed: error %d: %s\n", ret, terror(ret));
+		abort();
+	}
+	g_max_locks = lksmith_init_limit("LKSMITH_MAX_LOCKS", "locks");
+	g_max_mem = lksmith_init_limit("LKSMITH_MAX_MEMORY", "bytes");
+	lksmith_init_pool(&g_lock_pool, "locks", sizeof(struct lksmith_lock));
+	lksmith_init_pool(&g_holder_pool, "holders",
+		sizeof(struct lksmith_holder));
+	lksmith_init_pool(&g_cond_pool, "conds", sizeof(struct lksmith_cond));
+	if (getenv("LKSMITH_DUMP_STATS"))
+		g_dump_stats = 1;
+	lksmith_init_stats_signal();
+	lksmith_init_defer_edges();
+	lksmith_init_trace();
+	if (g_dump_stats || g_defer_ms || (g_prof_top > 0))
+		atexit(lksmith_report_at_exit);
+	if (getenv("LKSMITH_CLASS_BY_SITE"))
+		g_class_by_site = 1;
+	lksmith_error(0, "Locksmith has been initialized for process %lld\n",
+		      (long long)getpid());
+	__atomic_store_n(&g_initialized, 1, __ATOMIC_RELEASE);
+}
+
+/******************************************************************
+ *  Thread registry
+ *****************************************************************/
+/**
+ * Set the name of a thread in the thread registry.
+ *
+ * @param tid		The thread ID.
+ * @param name		The name.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int thread_registry_set(uint64_t tid, const char *name)
+{
+	uint64_t c = tid / LKSMITH_THREAD_NAMES_CHUNK;
+	int ret = 0;
+
+	if (c >= LKSMITH_THREAD_NAMES_MAX_CHUNKS)
+		return 0;
+	r_pthread_mutex_lock(&g_thread_names_lock);
+	if (!g_thread_names[c]) {
+		g_thread_names[c] = calloc(LKSMITH_THREAD_NAMES_CHUNK,
+			LKSMITH_THREAD_NAME_MAX);
+		if (!g_thread_names[c]) {
+			ret = ENOMEM;
+			goto done;
+		}
+	}
+	snprintf(g_thread_names[c][tid % LKSMITH_THREAD_NAMES_CHUNK],
+		LKSMITH_THREAD_NAME_MAX, "%s", name);
+done:
+	r_pthread_mutex_unlock(&g_thread_names_lock);
+	return ret;
+}
+
+/**
+ * Look up the name of a thread in the thread registry.
+ *
+ * @param tid		The thread ID, or 0 for an unknown thread.
+ * @param name		(out param) the name.  If the thread isn't in the
+ *			registry, we make one up from the ID.
+ */
+static void thread_registry_get(uint64_t tid,
+		char name[LKSMITH_THREAD_NAME_MAX])
+{
+	uint64_t c = tid / LKSMITH_THREAD_NAMES_CHUNK;
+	size_t off = 0;
+
+	name[0] = '\0';
+	r_pthread_mutex_lock(&g_thread_names_lock);
+	if ((c < LKSMITH_THREAD_NAMES_MAX_CHUNKS) && g_thread_names[c]) {
+		memcpy(name, g_thread_names[c][tid %
+			LKSMITH_THREAD_NAMES_CHUNK], LKSMITH_THREAD_NAME_MAX);
+	}
+	r_pthread_mutex_unlock(&g_thread_names_lock);
+	if (tid == 0) {
+		snprintf(name, LKSMITH_THREAD_NAME_MAX, "(unknown)");
+	} else if (name[0] == '\0') {
+		fwdprintf(name, &off, LKSMITH_THREAD_NAME_MAX,
+			"thread#%"PRIu64, tid);
+	}
+}
+
+/******************************************************************
+ *  Thread-local storage
+ *****************************************************************/
+/**
+ * Callback which destroys thread-local storage.
+ *
+ * This callback will be invoked whenever a thread exits.
+ *
+ * @param v		The TLS object.
+ */
+static void lksmith_tls_destroy(void *v)
+{
+	struct lksmith_tls *tls = v;
+	pool_cache_drain(&g_lock_pool, &tls->lock_cache);
+	pool_cache_drain(&g_holder_pool, &tls->holder_cache);
+	if (tls->prof)
+		prof_table_release(tls->prof);
+	r_pthread_mutex_lock(&g_threads_lock);
+	if (tls->prev)
+		tls->prev->next = tls->next;
+	else
+		g_threads = tls->next;
+	if (tls->next)
+		tls->next->prev = tls->prev;
+	g_num_threads--;
+	thread_stats_add(&g_exited_stats, &tls->stats);
+	r_pthread_mutex_unlock(&g_threads_lock);
+	/* The merger can't find us any more, so we merge our own edges. */
+	lksmith_merge_thread_edges(tls);
+	r_pthread_mutex_destroy(&tls->edge_log_lock);
+	if (tls->held != tls->inline_held)
+		free(tls->held);
+	free(tls->skipped);
+	free(tls);
+}
+
+/**
+ * Get or create the thread-local storage associated with this thread.
+ *
+ * The problem with POSIX thread-local storage is that in order to use it,
+ * you must first initialize a 'key'.  But how do you initialize this key
+ * prior to use?  There's no good way to do it.
+ *
+ * gcc provides the non-portable __attribute__((constructor)), which seems like
+ * it could be useful.  Unfortunately, the order in which these constructor
+ * functions are called between shared libraries is not defined.
+ * If another shared library defines some constructor functions which invoke
+ * pthreads functions, and it gets run before we initialize, it's game over.
+ * C++ global constructors have the same issues.
+ *
+ * We could force Locksmith users to call an init function before calling any
+ * other Locksmith functions.  Then, this init function could initialize the
+ * key.  But that would be painful for many users.  This is especially true
+ * in C++, where global constructors often make use of mutexes long before
+ * main() runs.
+ *
+ * The other approach, which we have taken here, is to protect the key with a
+ * mutex.  This is somewhat slow, since it means that we have to take this
+ * mutex before every access to thread-local data.  Luckily, on platforms
+ * that support the __thread keyword, we can bypass this slowness.
+ * Thread-local variables declared using __thread don't need to be manually
+ * intialized before use.  They're ready to go before any code has been run.
+ *
+ * One advantage that POSIX thread-local variables have over __thread
+ * variables is that the former can declare "destructors" which are run when
+ * the thread is destroyed.  (These have no relation to the C++ concept of
+ * the same name.) We make use of that ability here, to clean up our
+ * malloc()ed thread-local data when the thread in question exits.
+ * By combining the __thread keyword and POSIX thread-local variables, we can
+ * get the best of each.
+ *
+ * @return			NULL on OOM, the TLS otherwise.
+ */
+static struct lksmith_tls *get_or_create_tls(void)
+{
+	int ret = 0;
+	struct lksmith_tls *tls;
+
+#ifdef HAVE_IMPROVED_TLS
+	static __thread struct lksmith_tls *t_improved_tls = NULL;
+	if (t_improved_tls) {
+		return t_improved_tls;
+	}
+#endif
+	/* Once we are initialized, we never go back, so only the first
+	 * callers need the lock. */
+	if (!__atomic_load_n(&g_initialized, __ATOMIC_ACQUIRE)) {
+		simple_spin_lock(&g_init_state_lock);
+		if (!g_initialized) {
+			lksmith_init();
+		}
+		simple_spin_unlock(&g_init_state_lock);
+	}
+#ifndef HAVE_IMPROVED_TLS
+	tls = pthread_getspecific(g_tls_key);
+	if (tls) {
+		return tls;
+	}
+#endif
+	tls = calloc(1, sizeof(*tls));
+	if (!tls) {
+		lksmith_error(ENOMEM,
+			"get_or_create_tls(): failed to allocate "
+			"memory for thread-local storage.\n");
+		return NULL;
+	}
+	tls->intercept = 1;
+	tls->tid = __sync_fetch_and_add(&g_next_tid, 1);
+	tls->held = tls->inline_held;
+	tls->held_cap = LKSMITH_INLINE_HELD;
+	platform_create_thread_name(tls->name, LKSMITH_THREAD_NAME_MAX);
+	ret = thread_registry_set(tls->tid, tls->name);
+	if (ret) {
+		free(tls);
+		lksmith_error(ret,
+			"get_or_create_tls(): failed to add the thread to "
+			"the thread registry.\n");
+		return NULL;
+	}
+	ret = r_pthread_mutex_init(&tls->edge_log_lock, NULL);
+	if (ret) {
+		free(tls);
+		lksmith_error(ret,
+			"get_or_create_tls(): pthread_mutex_init failed "
+			"with error %d: %s\n", ret, terror(ret));
+		return NULL;
+	}
+	ret = pthread_setspecific(g_tls_key, tls);
+	if (ret) {
+		r_pthread_mutex_destroy(&tls->edge_log_lock);
+		free(tls);
+		lksmith_error(ENOMEM,
+			"get_or_create_tls(): pthread_setspecific "
+			"failed with error %d: %s\n", ret, terror(ret));
+		return NULL;
+	}
+	r_pthread_mutex_lock(&g_threads_lock);
+	tls->next = g_threads;
+	if (g_threads)
+		g_threads->prev = tls;
+	g_threads = tls;
+	g_num_threads++;
+	r_pthread_mutex_unlock(&g_threads_lock);
+#ifdef HAVE_IMPROVED_TLS
+	t_improved_tls = tls;
+#endif
+	return tls;
+}
+
+/**
+ * The thread is inside one of the Locksmith hooks.
+ */
+#define LKSMITH_BUSY_HOOK 0x1
+
+/**
+ * The thread is between prelock and postlock, in the real lock function.
+ * The pending lock and holder state in the thread-local storage belongs to
+ * that acquisition, so nobody else may use it.
+ */
+#define LKSMITH_BUSY_ACQUIRING 0x2
+
+/**
+ * Enter one of the Locksmith hooks.
+ *
+ * A signal handler can interrupt a thread anywhere in Locksmith, while it
+ * holds our internal locks or is in the middle of malloc.  If the handler
+ * then calls something we intercept, such as sem_post, which is
+ * async-signal-safe, doing the bookkeeping could deadlock or corrupt the
+ * heap.  It would also charge the locks the interrupted thread holds to the
+ * handler.  So a call which re-enters Locksmith goes straight through.
+ *
+ * @param tls		(out param) the thread-local storage for the current
+ *			thread, or NULL if we couldn't allocate it.  The hook
+ *			reports that itself.
+ *
+ * @return		1 if the hook should do its bookkeeping; 0 if this
+ *			call re-entered Locksmith.
+ */
+static int lksmith_enter(struct lksmith_tls **tls)
+{
+	*tls = get_or_create_tls();
+	if (!*tls)
+		return 1;
+	if ((*tls)->busy)
+		return 0;
+	(*tls)->busy = LKSMITH_BUSY_HOOK;
+	return 1;
+}
+
+/**
+ * Leave one of the Locksmith hooks.
+ *
+ * @param tls		The thread-local storage returned by lksmith_enter.
+ */
+static void lksmith_exit(struct lksmith_tls *tls)
+{
+	if (tls)
+		tls->busy &= ~LKSMITH_BUSY_HOOK;
+}
+
+/**
+ * Enter prelock.
+ *
+ * Like lksmith_enter, except that a skipped prelock is remembered, so that
+ * its postlock is skipped too.
+ *
+ * @param tls		(out param) the thread-local storage for the current
+ *			thread, or NULL if we couldn't allocate it.
+ *
+ * @return		1 if prelock should do its bookkeeping; 0 otherwise.
+ */
+static int lksmith_enter_prelock(struct lksmith_tls **tls)
+{
+	if (lksmith_enter(tls))
+		return 1;
+	(*tls)->skipped_locks++;
+	return 0;
+}
+
+/**
+ * Leave prelock.  If the real lock function is next, the thread stays busy
+ * until postlock.
+ *
+ * @param tls		The thread-local storage from lksmith_enter_prelock.
+ * @param ret		The result of prelock.
+ */
+static void lksmith_exit_prelock(struct lksmith_tls *tls, int ret)
+{
+	if (!tls)
+		return;
+	tls->busy = ret ? 0 : LKSMITH_BUSY_ACQUIRING;
+}
+
+/**
+ * Enter postlock.
+ *
+ * @param tls		(out param) the thread-local storage for the current
+ *			thread, or NULL if we couldn't allocate it.
+ *
+ * @return		1 if postlock should do its bookkeeping; 0 if its
+ *			prelock was skipped.
+ */
+static int lksmith_enter_postlock(struct lksmith_tls **tls)
+{
+	*tls = get_or_create_tls();
+	if (!*tls)
+		return 1;
+	if ((*tls)->skipped_locks) {
+		(*tls)->skipped_locks--;
+		return 0;
+	}
+	(*tls)->busy = LKSMITH_BUSY_HOOK;
+	return 1;
+}
+
+int init_tls(void)
+{
+	struct lksmith_tls *tls;
+
+	tls = get_or_create_tls();
+	if (!tls)
+		return -ENOMEM;
+	return 0;
+}
+
+/**
+ * Increment one of this thread's statistics.
+ *
+ * @param ctr		The counter.  It must belong to the current thread.
+ */
+static void stat_inc(uint64_t *ctr)
+{
+	__atomic_store_n(ctr, *ctr + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add a lock ID to the end of the list of lock IDs we hold.
+ *
+ * NOTE: lock IDs can be added more than once to this list!
+ * This is so that we can support recursive mutexes.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		the lock to add to the list.
+ * @param shared	1 if the lock is held shared.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int tls_append_held(struct lksmith_tls *tls, struct lksmith_lock *lk,
+		int shared)
+{
+	struct lksmith_held *held;
+	unsigned int ncap;
+
+	if (tls->num_held == tls->held_cap) {
+		ncap = tls->held_cap * 2;
+		if (tls->held == tls->inline_held) {
+			held = malloc(sizeof(struct lksmith_held) * ncap);
+			if (held) {
+				memcpy(held, tls->inline_held,
+					sizeof(tls->inline_held));
+			}
+		} else {
+			held = realloc(tls->held,
+				sizeof(struct lksmith_held) * ncap);
+		}
+		if (!held)
+			return ENOMEM;
+		tls->held = held;
+		tls->held_cap = ncap;
+	}
+	tls->held[tls->num_held].ptr = lk->ptr;
+	tls->held[tls->num_held].shared = shared;
+	tls->held[tls->num_held].fast = 0;
+	tls->held[tls->num_held].lk = lk;
+	tls->held[tls->num_held].holder = NULL;
+	tls->held[tls->num_held].site = NULL;
+	tls->held[tls->num_held].acquired = 0;
+	tls->num_held++;
+	return 0;
+}
+
+/**
+ * Remove a lock ID from the list of lock IDs we hold.
+ *
+ * Locks are usually released in the opposite order they were taken, so we
+ * search from the end.  In that case, this is O(1).
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		the lock ID to add to the list.
+ * @param out		(out param) the entry we removed.
+ *
+ * @return		0 on success; ENOENT if we are not holding the
+ *			lock ID.
+ */
+static int tls_remove_held(struct lksmith_tls *tls, const void *ptr,
+		struct lksmith_held *out)
+{
+	signed int i;
+
+	for (i = tls->num_held - 1; i >= 0; i--) {
+		if (tls->held[i].ptr == ptr)
+			break;
+	}
+	if (i < 0)
+		return ENOENT;
+	*out = tls->held[i];
+	memmove(&tls->held[i], &tls->held[i + 1],
+		sizeof(struct lksmith_held) * (tls->num_held - i - 1));
+	tls->num_held--;
+	return 0;
+}
+
+/**
+ * Determine if we are holding a lock.
+ *
+ * We search from the end, since recently taken locks are the ones most
+ * likely to be asked about.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock ID to find.
+ *
+ * @return		1 if we hold the lock; 0 otherwise.
+ */
+static int tls_contains_lid(struct lksmith_tls *tls, const void *ptr)
+{
+	signed int i;
+
+	for (i = tls->num_held - 1; i >= 0; i--) {
+		if (tls->held[i].ptr == ptr)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Find the edge cache slot for a pair of locks.
+ *
+ * @param tls		The thread-local data.
+ * @param held		The lock that is held.
+ * @param ptr		The lock that is being taken.
+ *
+ * @return		The cache slot.
+ */
+static struct lksmith_edge *tls_edge_slot(struct lksmith_tls *tls,
+		const void *held, const void *ptr)
+{
+	uint64_t h = ptr_hash(held) ^ (ptr_hash(ptr) * 31);
+	return &tls->edge_cache[h & (LKSMITH_EDGE_CACHE_SIZE - 1)];
+}
+
+/**
+ * Determine if an edge is in our edge cache.
+ *
+ * @param tls		The thread-local data.
+ * @param held		The lock that is held.
+ * @param ptr		The lock that is being taken.
+ * @param epoch		The current graph epoch.
+ *
+ * @return		1 if the edge is cached; 0 otherwise.
+ */
+static int tls_edge_cached(struct lksmith_tls *tls, const void *held,
+		const void *ptr, uint64_t epoch)
+{
+	struct lksmith_edge *edge = tls_edge_slot(tls, held, ptr);
+
+	return (edge->held == held) && (edge->ptr == ptr) &&
+		(edge->epoch == epoch);
+}
+
+/**
+ * Add an edge to our edge cache, replacing whatever was in its slot.
+ *
+ * @param tls		The thread-local data.
+ * @param held		The lock that is held.
+ * @param ptr		The lock that is being taken.
+ * @param epoch		The current graph epoch.
+ */
+static void tls_edge_insert(struct lksmith_tls *tls, const void *held,
+		const void *ptr, uint64_t epoch)
+{
+	struct lksmith_edge *edge = tls_edge_slot(tls, held, ptr);
+
+	edge->held = held;
+	edge->ptr = ptr;
+	edge->epoch = epoch;
+}
+
+/**
+ * Determine if taking a lock would only add edges that we have already
+ * checked.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock that is being taken.
+ * @param recursive	1 if the lock is recursive.
+ * @param shared	1 if the lock is being taken shared.
+ *
+ * @return		1 if there is nothing new to check; 0 otherwise.
+ */
+static int tls_edges_cached(struct lksmith_tls *tls, const void *ptr,
+		int recursive, int shared)
+{
+	unsigned int i;
+	uint64_t epoch;
+	const struct lksmith_held *held;
+
+	epoch = __atomic_load_n(&g_graph_epoch, __ATOMIC_ACQUIRE);
+	for (i = 0; i < tls->num_held; i++) {
+		held = &tls->held[i];
+		if (held->shared && shared)
+			continue;
+		if (held->ptr == ptr) {
+			if (recursive)
+				continue;
+			return 0;
+		}
+		if (!tls_edge_cached(tls, held->ptr, ptr, epoch))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Determine if posting a semaphore would only add edges that we have already
+ * checked.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The semaphore.
+ *
+ * @return		1 if there is nothing new to check; 0 otherwise.
+ */
+static int tls_posts_cached(struct lksmith_tls *tls, const void *ptr)
+{
+	unsigned int i;
+	uint64_t epoch;
+
+	epoch = __atomic_load_n(&g_graph_epoch, __ATOMIC_ACQUIRE);
+	for (i = 0; i < tls->num_held; i++) {
+		if (tls->held[i].ptr == ptr)
+			continue;
+		if (!tls_edge_cached(tls, ptr, tls->held[i].ptr, epoch))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Find a lock in our cache of private locks, and claim it for the private
+ * fast path.
+ *
+ * Other threads can promote, destroy, evict, or reuse the lock record at
+ * any time.  Promotion is permanent, and destroying, evicting or reusing the
+ * record changes its generation, so we only trust the entry if neither has
+ * happened.  We claim the lock by bumping fast_held before checking the
+ * generation; see lksmith_try_evict.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock pointer.
+ *
+ * @return		The lock data if the lock is still private to this
+ *			thread; NULL otherwise.  If the lock data is
+ *			returned, its fast_held count includes us.
+ */
+static struct lksmith_lock *tls_private_find(struct lksmith_tls *tls,
+		const void *ptr)
+{
+	struct lksmith_private *ent;
+	struct lksmith_lock *lk;
+
+	ent = &tls->private_cache[ptr_hash(ptr) &
+		(LKSMITH_PRIVATE_CACHE_SIZE - 1)];
+	if (ent->ptr != ptr)
+		return NULL;
+	lk = ent->lk;
+	__atomic_store_n(&lk->fast_held, lk->fast_held + 1, __ATOMIC_SEQ_CST);
+	if ((__atomic_load_n(&lk->gen, __ATOMIC_SEQ_CST) != ent->gen) ||
+			(__atomic_load_n(&lk->promoted, __ATOMIC_ACQUIRE))) {
+		__atomic_store_n(&lk->fast_held, lk->fast_held - 1,
+			__ATOMIC_RELEASE);
+		ent->ptr = NULL;
+		return NULL;
+	}
+	if (!lk->referenced)
+		__atomic_store_n(&lk->referenced, 1, __ATOMIC_RELAXED);
+	return lk;
+}
+
+/**
+ * Add a lock to our cache of private locks.
+ * Note: you must call this function with the shard lock held.
+ *
+ * @param tls		The thread-local data.
+ * @param lk		The lock data.  We must be its owner.
+ */
+static void tls_private_insert(struct lksmith_tls *tls,
+		struct lksmith_lock *lk)
+{
+	struct lksmith_private *ent;
+
+	ent = &tls->private_cache[ptr_hash(lk->ptr) &
+		(LKSMITH_PRIVATE_CACHE_SIZE - 1)];
+	ent->ptr = lk->ptr;
+	ent->lk = lk;
+	ent->gen = lk->gen;
+}
+
+/**
+ * Find the entry for a lock in the list of locks we hold.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock ID to find.
+ *
+ * @return		The most recent entry for the lock, or NULL if we
+ *			don't hold it.
+ */
+static struct lksmith_held *tls_find_held(struct lksmith_tls *tls,
+		const void *ptr)
+{
+	signed int i;
+
+	for (i = tls->num_held - 1; i >= 0; i--) {
+		if (tls->held[i].ptr == ptr)
+			return &tls->held[i];
+	}
+	return NULL;
+}
+
+/**
+ * Add a lock to the list of locks we hold which were skipped because of
+ * where they were taken.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int tls_append_skipped(struct lksmith_tls *tls, const void *ptr)
+{
+	const void **skipped;
+	unsigned int ncap;
+
+	if (tls->num_skipped == tls->skipped_cap) {
+		ncap = tls->skipped_cap ? (tls->skipped_cap * 2) : 8;
+		skipped = realloc(tls->skipped, sizeof(*skipped) * ncap);
+		if (!skipped)
+			return ENOMEM;
+		tls->skipped = skipped;
+		tls->skipped_cap = ncap;
+	}
+	tls->skipped[tls->num_skipped++] = ptr;
+	return 0;
+}
+
+/**
+ * Find a lock in the list of skipped locks we hold.
+ *
+ * @param tls		The thread-local data.
+ * @param ptr		The lock.
+ *
+ * @return		The index of the last time we took the lock, or -1 if
+ *			it isn't in the list.
+ */
+static int tls_find_skipped(struct lksmith_tls *tls, const void *ptr)
+{
+	signed int i;
+
+	for (i = tls->num_skipped - 1; i >= 0; i--) {
+		if (tls->skipped[i] == ptr)
+			break;
+	}
+	return i;
+}
+
+static void lksmith_error_with_ti(struct lksmith_tls *tls, int err,
+				  const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/**
+ * Locksmith error with thread information (including a backtrace)
+ *
+ * @param tls		Our thread-local storage object
+ * @param err		the locksmith error code
+ * @param fmt		printf-style format string
+ */
+static void lksmith_error_with_ti(struct lksmith_tls *tls, int err,
+				  const char *fmt, ...)
+{
+	va_list ap;
+	int nframes, prev_intercept;
+
+	if (!tls) {
+		tls = get_or_create_tls();
+		if (!tls) {
+			va_start(ap, fmt);
+			lksmith_errora(err, fmt, ap);
+			va_end(ap);
+			return;
+		}
+	}
+	prev_intercept = tls->intercept;
+	tls->intercept = 0;
+	nframes = bt_frames_create(&tls->backtrace_scratch,
+			&tls->backtrace_scratch_len);
+	tls->backtrace_scratch_frames = -1;
+	if (nframes >= 0)
+		stat_inc(&tls->stats.backtraces);
+	va_start(ap, fmt);
+	// lksmith_errora_with_bt handles nframes < 0 (the error case)
+	lksmith_errora_with_bt(err, tls->backtrace_scratch, nframes, fmt, ap);
+	va_end(ap);
+	tls->intercept = prev_intercept;
+}
+
+/******************************************************************
+ *  Lock holder functions
+ *****************************************************************/
+/**
+ * Dump out the contents of a lock holder structure
+ *
+ * @param holder        The lock holder
+ * @param buf		(out param) the buffer to write to
+ * @param off		(inout param) current position in the buffer
+ * @param buf_len	length of buf
+ */
+static void holder_dump(const struct lksmith_holder *holder,
+		char *buf, size_t *off, size_t buf_len)
+{
+	const char *prefix = "";
+	char name[LKSMITH_THREAD_NAME_MAX];
+	void **frames;
+	int i, nframes;
+
+	nframes = depot_get(__atomic_load_n(&holder->stack, __ATOMIC_RELAXED),
+		&frames);
+	thread_registry_get(holder->tid, name);
+	fwdprintf(buf, off, buf_len, "{name=%s, "
+		"bt_frames=[", name);
+	for (i = 0; i < nframes; i++) {
+		fwdprintf(buf, off, buf_len, "%s%s", prefix,
+			  bt_frame_name(frames[i]));
+		prefix = ", ";
+	}
+	fwdprintf(buf, off, buf_len, "]}");
+}
+
+/**
+ * Decide whether to capture a backtrace for a new lock holder.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ *
+ * @return		1 if we should capture one now; 0 otherwise.
+ */
+static int holder_wants_backtrace(struct lksmith_tls *tls)
+{
+	switch (g_bt_mode) {
+	case LKSMITH_BT_ALWAYS:
+		return 1;
+	case LKSMITH_BT_SAMPLE:
+		return (tls->bt_sample_count++ % g_bt_sample_period) == 0;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Capture the current stack into the backtrace scratch area, unless it
+ * already holds the stack for this lock acquisition.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ *
+ * @return		The number of frames on success; a negative error
+ *			code otherwise.
+ */
+static int tls_capture_backtrace(struct lksmith_tls *tls)
+{
+	int intercept;
+
+	if (tls->backtrace_scratch_frames >= 0)
+		return tls->backtrace_scratch_frames;
+	intercept = tls->intercept;
+	tls->intercept = 0;
+	tls->backtrace_scratch_frames = bt_frames_create(
+		&tls->backtrace_scratch, &tls->backtrace_scratch_len);
+	tls->intercept = intercept;
+	if (tls->backtrace_scratch_frames >= 0)
+		stat_inc(&tls->stats.backtraces);
+	return tls->backtrace_scratch_frames;
+}
+
+/**
+ * Give a lock holder a stack.
+ *
+ * Stacks are interned in the depot, so most acquisitions don't allocate
+ * anything here.  Other threads may read the holder's stack ID at any time,
+ * so we set it atomically.
+ *
+ * @param holder	The lock holder.
+ * @param frames	The frames.
+ * @param nframes	The number of frames.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int holder_set_frames(struct lksmith_holder *holder,
+		void **frames, int nframes)
+{
+	uint32_t stack;
+
+	if (nframes <= 0)
+		return 0;
+	stack = depot_put(frames, nframes, NULL);
+	if (!stack)
+		return ENOMEM;
+	__atomic_store_n(&holder->stack, stack, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * Create a lock holder.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param capture	1 if we should capture the current stack.
+ *
+ * @return		The lock holder on success; NULL otherwise.
+ */
+static struct lksmith_holder* holder_create(struct lksmith_tls *tls,
+		int capture)
+{
+	struct lksmith_holder *holder;
+	int nframes;
+
+	holder = pool_alloc(&g_holder_pool, &tls->holder_cache);
+	if (!holder)
+		return NULL;
+	holder->stack = 0;
+	holder->next = NULL;
+	holder->prev = NULL;
+	holder->tid = tls->tid;
+	if (!capture)
+		return holder;
+	nframes = tls_capture_backtrace(tls);
+	if ((nframes < 0) ||
+		    holder_set_frames(holder, tls->backtrace_scratch, nframes)) {
+		pool_free(&g_holder_pool, &tls->holder_cache, holder);
+		return NULL;
+	}
+	return holder;
+}
+
+/**
+ * Free a lock holder structure.
+ *
+ * The holder goes back to this thread's holder cache, so that the next
+ * holder_create can reuse it.  Its stack stays in the depot.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param holder        The lock holder
+ */
+static void holder_free(struct lksmith_tls *tls,
+		struct lksmith_holder *holder)
+{
+	pool_free(&g_holder_pool, &tls->holder_cache, holder);
+}
+
+/******************************************************************
+ *  Lock functions
+ *****************************************************************/
+/**
+ * Find the position of an ID in a sorted array of IDs.
+ *
+ * @param arr		The array.
+ * @param num		The array length.
+ * @param id		The ID to find.
+ *
+ * @return		The index of the ID, or of the first larger ID if
+ *			it is not in the array.
+ */
+static uint32_t id_search(const uint32_t *arr, uint32_t num, uint32_t id)
+{
+	uint32_t lo = 0, hi = num, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if (arr[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Add an ID to a sorted array, if it's not already there.
+ *
+ * The array grows geometrically, so adding n IDs takes O(log n)
+ * reallocations.
+ *
+ * @param arr		(inout) the array
+ * @param edges	(inout) an array of edges parallel to arr, or NULL
+ * @param num		(inout) the array length
+ * @param cap		(inout) the array capacity
+ * @param id		The lock ID to add.
+ * @param edge		The edge to store in edges for the ID, or NULL.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int lk_add_sorted(uint32_t **arr, struct lksmith_edge_info **edges,
+		uint32_t *num, uint32_t *cap, uint32_t id,
+		const struct lksmith_edge_info *edge)
+{
+	uint32_t i, ncap, *narr;
+	struct lksmith_edge_info *nedges;
+
+	i = id_search(*arr, *num, id);
+	if ((i < *num) && ((*arr)[i] == id))
+		return 0;
+	if (*num == *cap) {
+		ncap = *cap ? (*cap * 2) : 4;
+		narr = realloc(*arr, sizeof(uint32_t) * ncap);
+		if (!narr)
+			return ENOMEM;
+		*arr = narr;
+		if (edges) {
+			/* If this fails, arr is just bigger than it needs to
+			 * be. */
+			nedges = realloc(*edges, sizeof(*nedges) * ncap);
+			if (!nedges)
+				return ENOMEM;
+			*edges = nedges;
+		}
+		__atomic_add_fetch(&g_lock_mem, (sizeof(uint32_t) +
+			(edges ? sizeof(struct lksmith_edge_info) : 0)) *
+			(ncap - *cap), __ATOMIC_RELAXED);
+		*cap = ncap;
+	}
+	memmove(&(*arr)[i + 1], &(*arr)[i], sizeof(uint32_t) * (*num - i));
+	(*arr)[i] = id;
+	if (edges) {
+		memmove(&(*edges)[i + 1], &(*edges)[i],
+			sizeof(struct lksmith_edge_info) * (*num - i));
+		(*edges)[i] = *edge;
+	}
+	*num = *num + 1;
+	return 0;
+}
+
+/**
+ * Remove an ID from a sorted array, if it's there.
+ *
+ * @param arr		The array
+ * @param edges	An array of edges parallel to arr, or NULL
+ * @param num		(inout) the array length
+ * @param id		The lock ID to remove.
+ */
+static void lk_remove_sorted(uint32_t *arr, struct lksmith_edge_info *edges,
+		uint32_t *num, uint32_t id)
+{
+	uint32_t i;
+
+	i = id_search(arr, *num, id);
+	if ((i == *num) || (arr[i] != id))
+		return;
+	memmove(&arr[i], &arr[i + 1], sizeof(uint32_t) * (*num - i - 1));
+	if (edges) {
+		memmove(&edges[i], &edges[i + 1],
+			sizeof(struct lksmith_edge_info) * (*num - i - 1));
+	}
+	*num = *num - 1;
+}
+
+/**
+ * Determine if a lock is in the 'before' set of this lock data.
+ * Note: you must call this function with g_graph_lock held.
+ *
+ * @param lk		The lock data.
+ * @param ak		The lock to look for.
+ *
+ * @return		1 if ak is in the before set; 0 otherwise.
+ */
+static int lk_has_before(struct lksmith_lock *lk, struct lksmith_lock *ak)
+{
+	uint32_t i;
+
+	i = id_search(lk->before, lk->before_size, ak->id);
+	return (i < lk->before_size) && (lk->before[i] == ak->id);
+}
+
+/**
+ * Find out how a lock was first taken while holding another lock.
+ * Note: you must call this function with g_graph_lock held.
+ *
+ * @param lk		The lock data.
+ * @param ak		The lock which was held.
+ *
+ * @return		The edge, or NULL if ak is not in the before set.
+ */
+static const struct lksmith_edge_info *lk_before_edge(struct lksmith_lock *lk,
+		struct lksmith_lock *ak)
+{
+	uint32_t i;
+
+	i = id_search(lk->before, lk->before_size, ak->id);
+	if ((i == lk->before_size) || (lk->before[i] != ak->id))
+		return NULL;
+	return &lk->before_edges[i];
+}
+
+/**
+ * Add a lock to the 'before' set of this lock data, and this lock to the
+ * 'after' set of that lock.
+ * Note: you must call this function with g_graph_lock held.
+ *
+ * @param lk		The lock data.
+ * @param ak		The lock to add.
+ * @param edge		The stacks which took ak and lk.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int lk_add_before(struct lksmith_lock *lk, struct lksmith_lock *ak,
+		const struct lksmith_edge_info *edge)
+{
+	int ret;
+
+	if (lk_has_before(lk, ak))
+		return 0;
+	ret = lk_add_sorted(&lk->before, &lk->before_edges, &lk->before_size,
+		&lk->before_cap, ak->id, edge);
+	if (ret)
+		return ret;
+	ret = lk_add_sorted(&ak->after, NULL, &ak->after_size, &ak->after_cap,
+		lk->id, NULL);
+	if (ret) {
+		lk_remove_sorted(lk->before, lk->before_edges,
+			&lk->before_size, ak->id);
+		return ret;
+	}
+	lk->in_graph = 1;
+	ak->in_graph = 1;
+	g_num_edges++;
+	return 0;
+}
+
+/**
+ * Remove a lock from the 'before' set of this lock data, and this lock from
+ * the 'after' set of that lock.
+ * Note: you must call this function with g_graph_lock held.
+ *
+ * @param lk		The lock data.
+ * @param ak		The lock to remove.
+ */
+static void lk_remove_before(struct lksmith_lock *lk, struct lksmith_lock *ak)
+{
+	if (!lk_has_before(lk, ak))
+		return;
+	lk_remove_sorted(lk->before, lk->before_edges, &lk->before_size,
+		ak->id);
+	lk_remove_sorted(ak->after, NULL, &ak->after_size, lk->id);
+	g_num_edges--;
+}
+
+/**
+ * Find a thread which holds a lock, for error reports.
+ * Note: you must call this function with the lock's shard lock held.
+ *
+ * @param lk		The lock data.
+ *
+ * @return		The ID of a thread which holds the lock, or 0 if we
+ *			don't know of one.
+ */
+static uint64_t lk_some_holder(const struct lksmith_lock *lk)
+{
+	if (lk->holders)
+		return lk->holders->tid;
+	if (lk->readers)
+		return lk->readers->tid;
+	/* A thread taking the lock through the private fast path doesn't
+	 * have a holder record, but it has to be the owner. */
+	if (__atomic_load_n(&lk->fast_held, __ATOMIC_ACQUIRE))
+		return lk->owner;
+	return 0;
+}
+
+/**
+ * Add a holder to a list of holders.
+ *
+ * @param list		The list.
+ * @param holder	The lock holder to add.
+ */
+static void holder_list_add(struct lksmith_holder **list,
+			struct lksmith_holder *holder)
+{
+	holder->prev = NULL;
+	holder->next = *list;
+	if (*list)
+		(*list)->prev = holder;
+	*list = holder;
+}
+
+/**
+ * Remove a holder from a list of holders and free it.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param list		The list.
+ * @param holder	The lock holder to remove.
+ */
+static void holder_list_remove(struct lksmith_tls *tls,
+			struct lksmith_holder **list,
+			struct lksmith_holder *holder)
+{
+	if (holder->prev)
+		holder->prev->next = holder->next;
+	else
+		*list = holder->next;
+	if (holder->next)
+		holder->next->prev = holder->prev;
+	holder_free(tls, holder);
+}
+
+/**
+ * Add a lock holder to the lock.
+ * Note: you must call this function with the shard lock held.
+ *
+ * @param lk		The lock data.
+ * @param holder	The lock holder to add.
+ */
+static void lk_holder_add(struct lksmith_lock *lk,
+			struct lksmith_holder *holder)
+{
+	holder_list_add(&lk->holders, holder);
+}
+
+/**
+ * Remove a lock holder from the lock and free it.
+ * Note: you must call this function with the shard lock held.
+ *
+ * Our held list remembers our holder record, so this is O(1), however many
+ * holders there are.
+ *
+ * @param lk		The lock data.
+ * @param tls		The thread-local storage for the current thread.
+ * @param holder	Our lock holder.
+ */
+static void lk_holder_remove(struct lksmith_lock *lk,
+			struct lksmith_tls *tls, struct lksmith_holder *holder)
+{
+	holder_list_remove(tls, &lk->holders, holder);
+}
+
+/**
+ * Add a shared holder to the lock.
+ * Note: you must call this function with the shard lock held.
+ *
+ * @param lk		The lock data.
+ * @param holder	The holder record to keep, or NULL if we are only
+ *			counting this reader.
+ */
+static void lk_reader_add(struct lksmith_lock *lk,
+			struct lksmith_holder *holder)
+{
+	lk->num_readers++;
+	if (!holder)
+		return;
+	holder_list_add(&lk->readers, holder);
+	lk->num_sampled++;
+}
+
+/**
+ * Remove a shared holder from the lock.
+ * Note: you must call this function with the shard lock held.
+ *
+ * @param lk		The lock data.
+ * @param tls		The thread-local storage for the current thread.
+ * @param holder	Our holder record, or NULL if we were only counted.
+ */
+static void lk_reader_remove(struct lksmith_lock *lk,
+			struct lksmith_tls *tls, struct lksmith_holder *holder)
+{
+	if (lk->num_readers > 0)
+		lk->num_readers--;
+	if (!holder)
+		return;
+	holder_list_remove(tls, &lk->readers, holder);
+	lk->num_sampled--;
+}
+
+/**
+ * Dump out the contents of a lock data structure.
+ *
+ * @param lk		The lock data
+ * @param buf		(out param) the buffer to write to
+ * @param off		(inout param) current position in the buffer
+ * @param buf_len	length of buf
+ */
+static void lk_dump(const struct lksmith_lock *lk,
+		char *buf, size_t *off, size_t buf_len)
+{
+	uint32_t i;
+	const char *prefix = "";
+	struct lksmith_holder *holder;
+
+	fwdprintf(buf, off, buf_len, "lk{ptr=%p, id=%"PRIu32", "
+		"nlock=%"PRIu64", recursive=%d, sleeper=%d, "
+		"ord=%"PRIu64", before={",
+		(void*)lk->ptr, lk->id, lk->nlock,
+		lk->props.recursive, lk->props.sleeper, lk->ord);
+	for (i = 0; i < lk->before_size; i++) {
+		fwdprintf(buf, off, buf_len, "%s%"PRIu32,
+			  prefix, lk->before[i]);
+		prefix = " ";
+	}
+	fwdprintf(buf, off, buf_len, "}, after={");
+	prefix = "";
+	for (i = 0; i < lk->after_size; i++) {
+		fwdprintf(buf, off, buf_len, "%s%"PRIu32,
+			  prefix, lk->after[i]);
+		prefix = " ";
+	}
+	fwdprintf(buf, off, buf_len, "}, holders=[");
+	prefix = "";
+	holder = lk->holders;
+	while (holder) {
+		fwdprintf(buf, off, buf_len, "%s", prefix);
+		holder_dump(holder, buf, off, buf_len);
+		prefix = ", ";
+		holder = holder->next;
+	}
+	fwdprintf(buf, off, buf_len, "], num_readers=%"PRId32", readers=[",
+		lk->num_readers);
+	prefix = "";
+	for (holder = lk->readers; holder; holder = holder->next) {
+		fwdprintf(buf, off, buf_len, "%s", prefix);
+		holder_dump(holder, buf, off, buf_len);
+		prefix = ", ";
+	}
+	fwdprintf(buf, off, buf_len, "]}");
+}
+
+static void lk_dump_to_stderr(struct lksmith_lock *lk)
+{
+	char buf[16384];
+	size_t off = 0;
+
+	lk_dump(lk, buf, &off, sizeof(buf));
+	fputs(buf, stderr);
+	fputs("\n", stderr);
+}
+
+static void tree_print(void)
+{
+	char buf[8196];
+	struct lksmith_lock *lk;
+	size_t off, b;
+	const char *prefix = "";
+	int i;
+
+	r_pthread_mutex_lock(&g_graph_lock);
+	fprintf(stderr, "g_shards: {");
+	for (i = 0; i < LKSMITH_NUM_SHARDS; i++) {
+		r_pthread_mutex_lock(&g_shards[i].lock);
+		for (b = 0; b < g_shards[i].num_buckets; b++) {
+			for (lk = g_shards[i].buckets[b]; lk; lk = lk->next) {
+				off = 0;
+				lk_dump(lk, buf, &off, sizeof(buf));
+				fprintf(stderr, "%s%s", prefix, buf);
+				prefix = ",\n";
+			}
+		}
+		r_pthread_mutex_unlock(&g_shards[i].lock);
+	}
+	fprintf(stderr, "\n}\n");
+	r_pthread_mutex_unlock(&g_graph_lock);
+}
+
+/******************************************************************
+ *  Lock registry functions
+ *****************************************************************/
+/**
+ * Find the registry shard a lock belongs in.
+ *
+ * @param ptr		The lock pointer.
+ *
+ * @return		The shard.
+ */
+static struct lksmith_shard *lksmith_shard_of(const void *ptr)
+{
+	return &g_shards[ptr_hash(ptr) & (LKSMITH_NUM_SHARDS - 1)];
+}
+
+/**
+ * Find the hash bucket a lock belongs in.
+ *
+ * We use the hash bits above the ones that picked the shard, so that the
+ * locks in a shard are spread across all of its buckets.
+ */
+static struct lksmith_lock **lksmith_bucket_of(struct lksmith_lock **buckets,
+		size_t num_buckets, const void *ptr)
+{
+	uint64_t h = ptr_hash(ptr) / LKSMITH_NUM_SHARDS;
+	return &buckets[h & (num_buckets - 1)];
+}
+
+/**
+ * Double the number of hash buckets in a shard.
+ * Note: you must call this function with the shard lock held.
+ *
+ * @param shard		The shard.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int lksmith_shard_grow(struct lksmith_shard *shard)
+{
+	size_t i, nsize;
+	struct lksmith_lock **nbuckets, **bucket, *lk, *next;
+
+	nsize = shard->num_buckets ? (shard->num_buckets * 2) :
+		LKSMITH_SHARD_INITIAL_BUCKETS;
+	nbuckets = calloc(nsize, sizeof(struct lksmith_lock*));
+	if (!nbuckets)
+		return ENOMEM;
+	for (i = 0; i < shard->num_buckets; i++) {
+		for (lk = shard->buckets[i]; lk; lk = next) {
+			next = lk->next;
+			bucket = lksmith_bucket_of(nbuckets, nsize, lk->ptr);
+			lk->next = *bucket;
+			*bucket = lk;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = nbuckets;
+	shard->num_buckets = nsize;
+	return 0;
+}
+
+/**
+ * Find a lock in the registry.
+ * Note: you must call this function with the shard lock held.
+ *
+ * @param shard		The shard returned by lksmith_shard_of(ptr).
+ * @param ptr		The lock pointer.
+ *
+ * @return		The lock data, or NULL if we don't know about the lock.
+ */
+static struct lksmith_lock *lksmith_find(struct lksmith_shard *shard,
+		const void *ptr)
+{
+	struct lksmith_lock *lk;
+
+	if (shard->num_buckets == 0)
 		return NULL;
+	lk = *lksmith_bucket_of(shard->buckets, shard->num_buckets, ptr);
+	while (lk) {
+		if (lk->ptr == ptr)
+			return lk;
+		lk = lk->next;
+	}
+	return NULL;
+}
+
+/**
+ * Find the lock data for a lock ID.
+ *
+ * The caller must make sure that the lock can't be destroyed while it is
+ * using the returned pointer, for example by holding the lock, or by
+ * holding g_graph_lock and having found the ID in the graph.
+ *
+ * @param id		The lock ID.
+ *
+ * @return		The lock data.
+ */
+static struct lksmith_lock *lk_of(uint32_t id)
+{
+	struct lksmith_lock **chunk;
+
+	chunk = __atomic_load_n(&g_id_chunks[id / LKSMITH_ID_CHUNK_SIZE],
+		__ATOMIC_ACQUIRE);
+	return chunk[id & (LKSMITH_ID_CHUNK_SIZE - 1)];
+}
+
+/**
+ * Give a lock a dense ID and put it in the ID table.
+ *
+ * @param lk		The lock data.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory or IDs.
+ */
+static int lock_id_alloc(struct lksmith_lock *lk)
+{
+	uint32_t id;
+	struct lksmith_lock **chunk;
+	int ret = 0;
+
+	r_pthread_mutex_lock(&g_id_lock);
+	if (g_num_free_ids > 0) {
+		id = g_free_ids[--g_num_free_ids];
+	} else {
+		id = g_next_id;
+		if (id / LKSMITH_ID_CHUNK_SIZE >= LKSMITH_ID_NUM_CHUNKS) {
+			ret = ENOMEM;
+			goto done;
+		}
+		chunk = g_id_chunks[id / LKSMITH_ID_CHUNK_SIZE];
+		if (!chunk) {
+			chunk = calloc(LKSMITH_ID_CHUNK_SIZE,
+				sizeof(struct lksmith_lock*));
+			if (!chunk) {
+				ret = ENOMEM;
+				goto done;
+			}
+			__atomic_store_n(&g_id_chunks[id / LKSMITH_ID_CHUNK_SIZE],
+				chunk, __ATOMIC_RELEASE);
+		}
+		g_next_id++;
+	}
+	g_id_chunks[id / LKSMITH_ID_CHUNK_SIZE]
+		[id & (LKSMITH_ID_CHUNK_SIZE - 1)] = lk;
+	lk->id = id;
+done:
+	r_pthread_mutex_unlock(&g_id_lock);
+	return ret;
+}
+
+/**
+ * Take a lock out of the ID table, so that its ID can be used again.
+ *
+ * If we run out of memory remembering the ID, we just don't reuse it.
+ *
+ * @param lk		The lock data.
+ */
+static void lock_id_free(struct lksmith_lock *lk)
+{
+	uint32_t ncap, *nids;
+
+	r_pthread_mutex_lock(&g_id_lock);
+	g_id_chunks[lk->id / LKSMITH_ID_CHUNK_SIZE]
+		[lk->id & (LKSMITH_ID_CHUNK_SIZE - 1)] = NULL;
+	if (g_num_free_ids == g_free_ids_cap) {
+		ncap = g_free_ids_cap ? (g_free_ids_cap * 2) : 64;
+		nids = realloc(g_free_ids, sizeof(uint32_t) * ncap);
+		if (!nids)
+			goto done;
+		g_free_ids = nids;
+		g_free_ids_cap = ncap;
+	}
+	g_free_ids[g_num_free_ids++] = lk->id;
+done:
+	r_pthread_mutex_unlock(&g_id_lock);
+	lk->id = 0;
+}
+
+/**
+ * Add a lock to the registry.
+ * Note: you must call this function with the shard lock held.
+ *
+ * @param shard		The shard returned by lksmith_shard_of(ptr).
+ * @param tls		The thread-local storage for the current thread.
+ * @param ptr		The lock pointer.
+ * @param recursive	1 to allow recursive locks; 0 otherwise
+ * @param sleeper	1 if this lock is a sleeper; 0 otherwise
+ * @param lk		(out param) the new lock data
+ *
+ * @return		0 on success; EEXIST if the lock is already
+ *			registered; ENOMEM if we ran out of memory.
+ */
+static int lksmith_insert(struct lksmith_shard *shard,
+		struct lksmith_tls *tls, const void *ptr,
+		int recursive, int sleeper, struct lksmith_lock **lk)
+{
+	struct lksmith_lock *ak, **bucket;
+	uint32_t gen;
+	int ret;
+
+	if (lksmith_find(shard, ptr))
+		return EEXIST;
+	if (shard->num_locks >= shard->num_buckets) {
+		ret = lksmith_shard_grow(shard);
+		if (ret)
+			return ret;
+	}
+	ak = pool_alloc(&g_lock_pool, &tls->lock_cache);
+	if (!ak) {
+		return ENOMEM;
+	}
+	gen = ak->gen;
+	memset(ak, 0, sizeof(*ak));
+	__atomic_store_n(&ak->gen, gen + 1, __ATOMIC_RELEASE);
+	ret = lock_id_alloc(ak);
+	if (ret) {
+		pool_free(&g_lock_pool, &tls->lock_cache, ak);
+		return ret;
+	}
+	ak->ptr = ptr;
+	ak->props.recursive = !!recursive;
+	ak->props.sleeper = !!sleeper;
+	ak->referenced = 1;
+	ak->holders = NULL;
+	ak->ord = __sync_fetch_and_add(&g_next_ord, 1);
+	bucket = lksmith_bucket_of(shard->buckets, shard->num_buckets, ptr);
+	ak->next = *bucket;
+	*bucket = ak;
+	shard->num_locks++;
+	__atomic_add_fetch(&g_num_locks, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g_lock_mem, sizeof(struct lksmith_lock),
+		__ATOMIC_RELAXED);
+	*lk = ak;
+	return 0;
+}
+
+/**
+ * Remove a lock from the registry.  This does not free it.
+ * Note: you must call this function with the shard lock held.
+ *
+ * @param shard		The shard returned by lksmith_shard_of(lk->ptr).
+ * @param lk		The lock data.
+ */
+static void lksmith_remove(struct lksmith_shard *shard,
+		struct lksmith_lock *lk)
+{
+	struct lksmith_lock **prev;
+
+	prev = lksmith_bucket_of(shard->buckets, shard->num_buckets, lk->ptr);
+	while (*prev != lk)
+		prev = &(*prev)->next;
+	*prev = lk->next;
+	shard->num_locks--;
+}
+
+/******************************************************************
+ *  Lock-order graph functions
+ *
+ *  We keep the graph in topological order, using the algorithm from
+ *  Pearce and Kelly, "A Dynamic Topological Sort Algorithm for Directed
+ *  Acyclic Graphs" (2006).  An edge which agrees with the current order
+ *  can't create a cycle, so adding it needs no search.  Otherwise, we only
+ *  need to search the locks whose ords lie between the edge's endpoints,
+ *  and then shuffle those locks so that the order is valid again.
+ *
+ *  All of these functions must be called with g_graph_lock held.
+ *****************************************************************/
+/**
+ * Append a lock to a lock array.
+ *
+ * @param vec		The lock array.
+ * @param lk		The lock to append.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int lk_vec_push(struct lk_vec *vec, struct lksmith_lock *lk)
+{
+	size_t ncap;
+	struct lksmith_lock **narr;
+
+	if (vec->len == vec->cap) {
+		ncap = vec->cap ? (vec->cap * 2) : 64;
+		narr = realloc(vec->arr, sizeof(struct lksmith_lock*) * ncap);
+		if (!narr)
+			return ENOMEM;
+		vec->arr = narr;
+		vec->cap = ncap;
+	}
+	vec->arr[vec->len++] = lk;
+	return 0;
+}
+
+static int compare_lock_ords(const void *a, const void *b)
+{
+	const struct lksmith_lock *la = *(struct lksmith_lock * const *)a;
+	const struct lksmith_lock *lb = *(struct lksmith_lock * const *)b;
+
+	if (la->ord < lb->ord)
+		return -1;
+	else if (la->ord > lb->ord)
+		return 1;
+	else
+		return 0;
+}
+
+/**
+ * Start a new graph search, with nothing visited.
+ */
+static void graph_visit_begin(void)
+{
+	g_visit_epoch++;
+	if (g_visit_epoch == 0) {
+		memset(g_visits, 0, sizeof(struct lksmith_visit) *
+			g_visits_cap);
+		g_visit_epoch = 1;
+	}
+}
+
+/**
+ * Mark a lock visited by the current graph search.
+ *
+ * @param lk		The lock.
+ * @param parent	ID of the lock the search reached it from, or 0.
+ *
+ * @return		0 if the lock is newly visited; EEXIST if the
+ *			search has already visited it; ENOMEM if we ran out
+ *			of memory.
+ */
+static int graph_visit(const struct lksmith_lock *lk, uint32_t parent)
+{
+	struct lksmith_visit *nvisits;
+	uint32_t ncap;
+
+	if (lk->id >= g_visits_cap) {
+		ncap = g_visits_cap ? g_visits_cap : 1024;
+		while (ncap <= lk->id)
+			ncap *= 2;
+		nvisits = realloc(g_visits,
+			sizeof(struct lksmith_visit) * ncap);
+		if (!nvisits)
+			return ENOMEM;
+		memset(nvisits + g_visits_cap, 0,
+			sizeof(struct lksmith_visit) * (ncap - g_visits_cap));
+		g_visits = nvisits;
+		g_visits_cap = ncap;
+	}
+	if (g_visits[lk->id].epoch == g_visit_epoch)
+		return EEXIST;
+	g_visits[lk->id].epoch = g_visit_epoch;
+	g_visits[lk->id].parent = parent;
+	return 0;
+}
+
+/**
+ * Record the path from 'first' to 'last' found by a forward search in
+ * g_search_path.
+ *
+ * @param first		The lock the search started from.
+ * @param prev		The lock from which the search reached 'last'.
+ * @param last		The lock which was reached.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int graph_record_path(struct lksmith_lock *first,
+		struct lksmith_lock *prev, struct lksmith_lock *last)
+{
+	struct lksmith_lock *lk, *tmp;
+	size_t i;
+
+	g_search_path.len = 0;
+	if (lk_vec_push(&g_search_path, last))
+		return ENOMEM;
+	for (lk = prev; lk != first; lk = lk_of(g_visits[lk->id].parent)) {
+		if (lk_vec_push(&g_search_path, lk))
+			return ENOMEM;
+	}
+	if (lk_vec_push(&g_search_path, first))
+		return ENOMEM;
+	for (i = 0; i < g_search_path.len / 2; i++) {
+		tmp = g_search_path.arr[i];
+		g_search_path.arr[i] =
+			g_search_path.arr[g_search_path.len - i - 1];
+		g_search_path.arr[g_search_path.len - i - 1] = tmp;
+	}
+	return 0;
+}
+
+/**
+ * Find all the locks reachable from 'first' through after lists, which
+ * are not already ordered after 'last'.  The result is left in
+ * g_search_fwd.  If 'last' is reachable, the path to it is left in
+ * g_search_path.
+ *
+ * @param first		The lock to start from.
+ * @param last		The lock we must not be able to reach.
+ *
+ * @return		0 on success; EDEADLK if 'last' is reachable;
+ *			ENOMEM if we ran out of memory.
+ */
+static int graph_search_forward(struct lksmith_lock *first,
+		struct lksmith_lock *last)
+{
+	struct lksmith_lock *lk, *ak;
+	uint32_t i;
+	int ret;
+
+	g_search_stack.len = 0;
+	g_search_fwd.len = 0;
+	graph_visit_begin();
+	if (graph_visit(first, 0) || lk_vec_push(&g_search_stack, first))
+		return ENOMEM;
+	while (g_search_stack.len > 0) {
+		lk = g_search_stack.arr[--g_search_stack.len];
+		g_search_steps++;
+		if (lk_vec_push(&g_search_fwd, lk))
+			return ENOMEM;
+		for (i = 0; i < lk->after_size; i++) {
+			ak = lk_of(lk->after[i]);
+			if (ak == last) {
+				if (graph_record_path(first, lk, last))
+					g_search_path.len = 0;
+				return EDEADLK;
+			}
+			if (ak->ord > last->ord)
+				continue;
+			ret = graph_visit(ak, lk->id);
+			if (ret == EEXIST)
+				continue;
+			if (ret || lk_vec_push(&g_search_stack, ak))
+				return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Find all the locks which can reach 'last' through before lists, which
+ * are not already ordered before 'first'.  The result is left in
+ * g_search_bwd.
+ *
+ * @param last		The lock to start from.
+ * @param first		The lower bound on the ords to search.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int graph_search_backward(struct lksmith_lock *last,
+		struct lksmith_lock *first)
+{
+	struct lksmith_lock *lk, *ak;
+	uint32_t i;
+	int ret;
+
+	g_search_stack.len = 0;
+	g_search_bwd.len = 0;
+	graph_visit_begin();
+	if (graph_visit(last, 0) || lk_vec_push(&g_search_stack, last))
+		return ENOMEM;
+	while (g_search_stack.len > 0) {
+		lk = g_search_stack.arr[--g_search_stack.len];
+		g_search_steps++;
+		if (lk_vec_push(&g_search_bwd, lk))
+			return ENOMEM;
+		for (i = 0; i < lk->before_size; i++) {
+			ak = lk_of(lk->before[i]);
+			if (ak->ord < first->ord)
+				continue;
+			ret = graph_visit(ak, lk->id);
+			if (ret == EEXIST)
+				continue;
+			if (ret || lk_vec_push(&g_search_stack, ak))
+				return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Reassign the ords of the locks found by the last forward and backward
+ * searches, so that all of the backward locks come before all of the
+ * forward locks.  We reuse the same set of ords, so no other lock is
+ * affected.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int graph_reorder(void)
+{
+	struct lksmith_lock **fwd = g_search_fwd.arr, **bwd = g_search_bwd.arr;
+	size_t i = 0, j = 0, k = 0;
+	size_t nf = g_search_fwd.len, nb = g_search_bwd.len;
+	uint64_t *ords;
+
+	ords = malloc(sizeof(uint64_t) * (nf + nb));
+	if (!ords)
+		return ENOMEM;
+	qsort(fwd, nf, sizeof(struct lksmith_lock*), compare_lock_ords);
+	qsort(bwd, nb, sizeof(struct lksmith_lock*), compare_lock_ords);
+	while ((i < nb) || (j < nf)) {
+		if ((j == nf) || ((i < nb) && (bwd[i]->ord < fwd[j]->ord)))
+			ords[k++] = bwd[i++]->ord;
+		else
+			ords[k++] = fwd[j++]->ord;
+	}
+	for (i = 0; i < nb; i++)
+		bwd[i]->ord = ords[i];
+	for (j = 0; j < nf; j++)
+		fwd[j]->ord = ords[nb + j];
+	free(ords);
+	return 0;
+}
+
+/**
+ * Record that ak was taken before lk, unless that would create a cycle.
+ *
+ * @param ak		The lock that was taken first.
+ * @param lk		The lock that was taken second.
+ * @param edge		The stacks which took ak and lk.
+ *
+ * @return		0 on success; EDEADLK if lk has already been taken
+ *			before ak, in which case the path from lk to ak is
+ *			left in g_search_path; ENOMEM if we ran out of
+ *			memory.
+ */
+static int graph_add_edge(struct lksmith_lock *ak, struct lksmith_lock *lk,
+		const struct lksmith_edge_info *edge)
+{
+	int ret;
+
+	if (ak->ord > lk->ord) {
+		ret = graph_search_forward(lk, ak);
+		if (ret)
+			return ret;
+		ret = graph_search_backward(ak, lk);
+		if (ret)
+			return ret;
+		ret = graph_reorder();
+		if (ret)
+			return ret;
+	}
+	return lk_add_before(lk, ak, edge);
+}
+
+/**
+ * Describe a node in the lock-order graph.
+ *
+ * @param lk		The graph node.
+ * @param buf		(out param) the buffer to write to
+ * @param off		(inout param) current position in the buffer
+ * @param buf_len	length of buf
+ */
+static void graph_node_dump(const struct lksmith_lock *lk, char *buf,
+		size_t *off, size_t buf_len)
+{
+	if (lk->class_id) {
+		fwdprintf(buf, off, buf_len, "lock class %"PRIu32,
+			lk->class_id);
+	} else if (lk->props.site_class) {
+		fwdprintf(buf, off, buf_len, "the locks initialized at %s",
+			bt_frame_name((void*)lk->ptr));
+	} else {
+		fwdprintf(buf, off, buf_len, "lock %p", lk->ptr);
+	}
+}
+
+/**
+ * Print out a stack from the depot, one frame per line.
+ *
+ * @param stack		The depot ID of the stack, or 0.
+ * @param buf		(out param) the buffer to write to
+ * @param off		(inout param) current position in the buffer
+ * @param buf_len	length of buf
+ */
+static void stack_dump(uint32_t stack, char *buf, size_t *off,
+		size_t buf_len)
+{
+	void **frames;
+	int i, nframes;
+
+	nframes = depot_get(stack, &frames);
+	if (nframes <= 0) {
+		fwdprintf(buf, off, buf_len, "    (no stack was recorded)\n");
+		return;
+	}
+	for (i = 0; i < nframes; i++) {
+		fwdprintf(buf, off, buf_len, "    %s\n",
+			bt_frame_name(frames[i]));
+	}
+}
+
+/**
+ * Describe the path of the cycle found by the last graph_add_edge, along
+ * with the stacks which first created each of its edges.
+ * Note: you must call this function with g_graph_lock held.
+ *
+ * The stacks come from the graph itself, so the threads which took the
+ * locks in the opposite order don't need to hold them any more.
+ *
+ * @param buf		(out param) the buffer to write to.  Set to the empty
+ *			string if there is no path.
+ * @param off		(inout param) current position in the buffer
+ * @param buf_len	length of buf
+ */
+static void graph_path_dump(char *buf, size_t *off, size_t buf_len)
+{
+	struct lksmith_lock **path = g_search_path.arr, *u, *v;
+	const struct lksmith_edge_info *edge;
+	size_t i;
+
+	buf[*off] = '\0';
+	if (g_search_path.len < 2)
+		return;
+	fwdprintf(buf, off, buf_len, "The opposite order was seen before: ");
+	for (i = 0; i < g_search_path.len; i++) {
+		if (i > 0)
+			fwdprintf(buf, off, buf_len, " -> ");
+		graph_node_dump(path[i], buf, off, buf_len);
+	}
+	fwdprintf(buf, off, buf_len, "\n");
+	for (i = 0; i + 1 < g_search_path.len; i++) {
+		u = path[i];
+		v = path[i + 1];
+		edge = lk_before_edge(v, u);
+		if (!edge)
+			continue;
+		graph_node_dump(u, buf, off, buf_len);
+		fwdprintf(buf, off, buf_len, " was taken here:\n");
+		stack_dump(edge->held_stack, buf, off, buf_len);
+		fwdprintf(buf, off, buf_len, "and then ");
+		graph_node_dump(v, buf, off, buf_len);
+		fwdprintf(buf, off, buf_len, " was taken here:\n");
+		stack_dump(edge->stack, buf, off, buf_len);
+	}
+}
+
+/******************************************************************
+ *  Cond functions
+ *****************************************************************/
+/**
+ * Search part of a condition variable hash chain.
+ *
+ * @param cnd		The first record to look at.
+ * @param stop		The record to stop at, or NULL to search the whole
+ *			chain.
+ * @param ptr		The condition variable.
+ *
+ * @return		The record, or NULL if it wasn't found.
+ */
+static struct lksmith_cond *lksmith_cond_search(struct lksmith_cond *cnd,
+		struct lksmith_cond *stop, const void *ptr)
+{
+	for (; cnd != stop; cnd = __atomic_load_n(&cnd->next,
+			__ATOMIC_ACQUIRE)) {
+		if (cnd->ptr == ptr)
+			return cnd;
+	}
+	return NULL;
+}
+
+static struct lksmith_cond **lksmith_cond_bucket(const void *ptr)
+{
+	return &g_conds[ptr_hash(ptr) & (LKSMITH_COND_BUCKETS - 1)];
+}
+
+static struct lksmith_cond *lksmith_cond_find(const void *ptr)
+{
+	return lksmith_cond_search(__atomic_load_n(lksmith_cond_bucket(ptr),
+		__ATOMIC_ACQUIRE), NULL, ptr);
+}
+
+/**
+ * Find the record for a condition variable, creating it if necessary.
+ *
+ * @param ptr		The condition variable.
+ * @param cond		(out param) the record.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int lksmith_cond_get(const void *ptr, struct lksmith_cond **cond)
+{
+	struct lksmith_cond **bucket, *head, *cnd, *found;
+
+	bucket = lksmith_cond_bucket(ptr);
+	head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+	found = lksmith_cond_search(head, NULL, ptr);
+	if (found)
+		goto done;
+	cnd = pool_alloc(&g_cond_pool, NULL);
+	if (!cnd) {
+		return ENOMEM;
+	}
+	memset(cnd, 0, sizeof(*cnd));
+	cnd->ptr = ptr;
+	do {
+		cnd->next = head;
+	} while (!__atomic_compare_exchange_n(bucket, &head, cnd, 0,
+			__ATOMIC_RELEASE, __ATOMIC_ACQUIRE) &&
+		(!(found = lksmith_cond_search(head, cnd->next, ptr))));
+	if (found) {
+		/* Someone else added it while we were trying to. */
+		pool_free(&g_cond_pool, NULL, cnd);
+		goto done;
+	}
+	found = cnd;
+done:
+	*cond = found;
+	return 0;
+}
+
+/**
+ * Free lock data which has been removed from the registry.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param lk		The lock data.
+ */
+static void lksmith_lock_free(struct lksmith_tls *tls,
+		struct lksmith_lock *lk)
+{
+	int removed;
+
+	/* Make sure the owner's private cache doesn't use this record
+	 * again, and that the merger drops any deferred edges to it. */
+	__atomic_store_n(&lk->gen, lk->gen + 1, __ATOMIC_SEQ_CST);
+	/* Edges are only added by threads which hold both locks, or by the
+	 * merger, which checks the generation under the graph lock.  Now that
+	 * the lock is out of the registry, nobody can hold it again, so its
+	 * edges can't change except through us.  Locks that never got any
+	 * edges, and aren't in any edge log which the merger might be
+	 * looking at, don't need the graph lock at all. */
+	if (__atomic_load_n(&lk->logged_edges, __ATOMIC_SEQ_CST) ||
+			lk->in_graph) {
+		r_pthread_mutex_lock(&g_graph_lock);
+		/* Threads cache the edges they have logged as well as the
+		 * ones in the graph, and the merger will drop the logged
+		 * ones now. */
+		removed = (lk->before_size > 0) || (lk->after_size > 0) ||
+			(lk->logged_edges > 0);
+		while (lk->before_size > 0) {
+			lk_remove_before(lk,
+				lk_of(lk->before[lk->before_size - 1]));
+		}
+		while (lk->after_size > 0) {
+			lk_remove_before(lk_of(lk->after[lk->after_size - 1]),
+				lk);
+		}
+		/* Another lock may be created at this address later.  Make
+		 * sure no thread thinks these edges are still there. */
+		if (removed) {
+			__atomic_store_n(&g_graph_epoch, g_graph_epoch + 1,
+				__ATOMIC_RELEASE);
+		}
+		r_pthread_mutex_unlock(&g_graph_lock);
+	}
+	__atomic_sub_fetch(&g_lock_mem, sizeof(struct lksmith_lock) +
+		(sizeof(uint32_t) * (lk->before_cap + lk->after_cap)) +
+		(sizeof(struct lksmith_edge_info) * lk->before_cap),
+		__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&g_num_locks, 1, __ATOMIC_RELAXED);
+	free(lk->before);
+	free(lk->before_edges);
+	free(lk->after);
+	lock_id_free(lk);
+	pool_free(&g_lock_pool, &tls->lock_cache, lk);
+}
+
+/******************************************************************
+ *  Eviction
+ *
+ *  Locks which are never destroyed, such as statically initialized mutexes
+ *  in memory that has been freed, would otherwise stay in the registry and
+ *  the lock-order graph forever.  If LKSMITH_MAX_LOCKS or
+ *  LKSMITH_MAX_MEMORY is set, we evict cold locks to stay under the limit,
+ *  using the clock algorithm over the ID table.  An evicted lock loses its
+ *  edges, so inversions which go through it can be missed; if it is taken
+ *  again, it starts over as a new lock.
+ *****************************************************************/
+/**
+ * Determine if we are over the memory limits.
+ *
+ * @return		1 if we should evict some locks; 0 otherwise.
+ */
+static int lksmith_over_limit(void)
+{
+	if (g_max_locks && (__atomic_load_n(&g_num_locks, __ATOMIC_RELAXED) >
+			g_max_locks))
+		return 1;
+	if (g_max_mem && (__atomic_load_n(&g_lock_mem, __ATOMIC_RELAXED) >
+			g_max_mem))
+		return 1;
+	return 0;
+}
+
+/**
+ * Try to evict a lock.
+ * Note: you must call this function with g_evict_lock held.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param id		The lock ID under the clock hand.
+ *
+ * @return		1 if we evicted the lock; 0 otherwise.
+ */
+static int lksmith_try_evict(struct lksmith_tls *tls, uint32_t id)
+{
+	struct lksmith_shard *shard;
+	struct lksmith_lock *lk;
+	const void *ptr;
+
+	/* The lock may be destroyed while we look at it.  Pool records stay
+	 * mapped, so we can still read it; we check that it's the same lock
+	 * once we hold the shard lock. */
+	lk = lk_of(id);
+	if (!lk)
+		return 0;
+	ptr = __atomic_load_n(&lk->ptr, __ATOMIC_RELAXED);
+	shard = lksmith_shard_of(ptr);
+	r_pthread_mutex_lock(&shard->lock);
+	if ((lksmith_find(shard, ptr) != lk) || (lk->id != id))
+		goto busy;
+	if (__atomic_load_n(&lk->referenced, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&lk->referenced, 0, __ATOMIC_RELAXED);
+		goto busy;
+	}
+	if ((lk->holders != NULL) || (lk->num_readers > 0) ||
+			(__atomic_load_n(&lk->fast_held, __ATOMIC_SEQ_CST)))
+		goto busy;
+	/* The owner may be taking the lock through the private fast path
+	 * right now.  It claims the lock before checking the generation, and
+	 * we change the generation before checking for claims, so one of us
+	 * will see the other. */
+	__atomic_store_n(&lk->gen, lk->gen + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&lk->fast_held, __ATOMIC_SEQ_CST))
+		goto busy;
+	lksmith_remove(shard, lk);
+	r_pthread_mutex_unlock(&shard->lock);
+	lksmith_lock_free(tls, lk);
+	__atomic_add_fetch(&g_num_evictions, 1, __ATOMIC_RELAXED);
+	return 1;
+busy:
+	r_pthread_mutex_unlock(&shard->lock);
+	return 0;
+}
+
+/**
+ * Evict cold locks until we are under the memory limits.
+ *
+ * Eviction is best-effort: if another thread is already evicting, or we
+ * can't find enough cold locks nearby, we give up and try again the next
+ * time a lock is created.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ */
+static void lksmith_evict(struct lksmith_tls *tls)
+{
+	uint32_t i, max_id;
+
+	if (r_pthread_mutex_trylock(&g_evict_lock))
+		return;
+	r_pthread_mutex_lock(&g_id_lock);
+	max_id = g_next_id;
+	r_pthread_mutex_unlock(&g_id_lock);
+	for (i = 0; (i < LKSMITH_EVICT_MAX_SCAN) && lksmith_over_limit(); i++) {
+		if (g_evict_hand >= max_id)
+			g_evict_hand = 1;
+		lksmith_try_evict(tls, g_evict_hand++);
+	}
+	r_pthread_mutex_unlock(&g_evict_lock);
+}
+
+/******************************************************************
+ *  Lock classes
+ *****************************************************************/
+/**
+ * Create a lock class node.
+ * Note: you must call this function with g_class_lock held.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param node		(out param) the new class node
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int lksmith_class_create(struct lksmith_tls *tls,
+		struct lksmith_lock **node)
+{
+	struct lksmith_lock *ck;
+	uint32_t gen;
+	int ret;
+
+	ck = pool_alloc(&g_lock_pool, &tls->lock_cache);
+	if (!ck)
+		return ENOMEM;
+	gen = ck->gen;
+	memset(ck, 0, sizeof(*ck));
+	__atomic_store_n(&ck->gen, gen + 1, __ATOMIC_RELEASE);
+	ret = lock_id_alloc(ck);
+	if (ret) {
+		pool_free(&g_lock_pool, &tls->lock_cache, ck);
+		return ret;
+	}
+	ck->ord = __sync_fetch_and_add(&g_next_ord, 1);
+	*node = ck;
+	return 0;
+}
+
+/**
+ * Find or create the graph node for a lock class.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param class_id	The class ID.  Must not be 0.
+ * @param level		The level of the class.
+ * @param node		(out param) the class node
+ *
+ * @return		0 on success; EINVAL if the class already exists
+ *			with a different level; ENOMEM if we ran out of
+ *			memory.
+ */
+static int lksmith_class_get(struct lksmith_tls *tls, uint32_t class_id,
+		uint32_t level, struct lksmith_lock **node)
+{
+	struct lksmith_lock *ck, **bucket;
+	int ret = 0;
+
+	r_pthread_mutex_lock(&g_class_lock);
+	bucket = &g_classes[class_id & (LKSMITH_CLASS_BUCKETS - 1)];
+	for (ck = *bucket; ck; ck = ck->next) {
+		if (ck->class_id == class_id) {
+			if (ck->level != level)
+				ret = EINVAL;
+			goto done;
+		}
+	}
+	ret = lksmith_class_create(tls, &ck);
+	if (ret)
+		goto done;
+	ck->class_id = class_id;
+	ck->level = level;
+	ck->next = *bucket;
+	*bucket = ck;
+done:
+	r_pthread_mutex_unlock(&g_class_lock);
+	*node = ck;
+	return ret;
+}
+
+/**
+ * Find or create the graph node for the locks initialized at a site.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param site		The initialization site.
+ * @param node		(out param) the class node
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int lksmith_site_class_get(struct lksmith_tls *tls, const void *site,
+		struct lksmith_lock **node)
+{
+	struct lksmith_lock *ck, **bucket;
+	int ret = 0;
+
+	r_pthread_mutex_lock(&g_class_lock);
+	bucket = &g_site_classes[ptr_hash(site) &
+		(LKSMITH_SITE_CLASS_BUCKETS - 1)];
+	for (ck = *bucket; ck; ck = ck->next) {
+		if (ck->ptr == site)
+			goto done;
+	}
+	ret = lksmith_class_create(tls, &ck);
+	if (ret)
+		goto done;
+	ck->ptr = site;
+	ck->props.site_class = 1;
+	ck->next = *bucket;
+	*bucket = ck;
+done:
+	r_pthread_mutex_unlock(&g_class_lock);
+	*node = ck;
+	return ret;
+}
+
+/******************************************************************
+ *  Tracing
+ *****************************************************************/
+/**
+ * Write a lock event to the trace.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param op		The lksmith_trace_op.
+ * @param ptr		The lock.
+ * @param site		The call site.
+ * @param flags		The flags.
+ * @param err		The error code.
+ * @param with_stack	1 if we should record the stack, subject to
+ *			LKSMITH_BACKTRACE_MODE.
+ */
+static void lksmith_trace_event(struct lksmith_tls *tls, int op,
+		const void *ptr, const void *site, int flags, int err,
+		int with_stack)
+{
+	uint32_t stack = 0;
+	int nframes;
+
+	if (with_stack && holder_wants_backtrace(tls)) {
+		tls->backtrace_scratch_frames = -1;
+		nframes = tls_capture_backtrace(tls);
+		if (nframes > 0) {
+			stack = trace_stack_id(&tls->trace, tls->tid,
+				tls->backtrace_scratch, nframes);
+		}
+	}
+	if (trace_emit(&tls->trace, op, ptr, site, tls->tid, stack, flags,
+			err)) {
+		/* Complaining about every event would be worse than
+		 * complaining once. */
+		if (__atomic_exchange_n(&g_tracing, 2, __ATOMIC_RELAXED) == 1) {
+			lksmith_error(ENOSPC, "lksmith_trace_event(thread=%s): "
+				"failed to write to the trace.  Some events "
+				"will be missing.\n", tls->name);
+		}
+	}
+}
+
+/******************************************************************
+ *  Deferred edges
+ *
+ *  With LKSMITH_DEFER_EDGES set, threads don't add the edges they see to the
+ *  lock-order graph.  They append them to their own edge log, and the merger
+ *  thread folds the logs into the graph every so often.  Taking locks never
+ *  writes to the graph or waits for g_graph_lock, at the cost of reporting
+ *  inversions late.
+ *****************************************************************/
+/**
+ * Add an edge to our edge log.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param from		The graph node of the lock which we hold.
+ * @param to		The graph node of the lock which we are taking.
+ * @param held		The lock which we hold.
+ * @param ptr		The lock which we are taking.
+ * @param info		The stacks which took held and ptr.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int tls_log_edge(struct lksmith_tls *tls, struct lksmith_lock *from,
+		struct lksmith_lock *to, const void *held, const void *ptr,
+		const struct lksmith_edge_info *info)
+{
+	struct lksmith_logged_edge *log, *edge;
+	unsigned int cap;
+	int ret = 0;
+
+	r_pthread_mutex_lock(&tls->edge_log_lock);
+	if (tls->edge_log_len == tls->edge_log_cap) {
+		cap = tls->edge_log_cap ? (tls->edge_log_cap * 2) : 16;
+		log = realloc(tls->edge_log, sizeof(*log) * cap);
+		if (!log) {
+			ret = ENOMEM;
+			goto done;
+		}
+		tls->edge_log = log;
+		tls->edge_log_cap = cap;
+	}
+	edge = &tls->edge_log[tls->edge_log_len++];
+	edge->from = from;
+	edge->to = to;
+	/* We hold both locks, so neither can be destroyed right now. */
+	edge->from_gen = from->gen;
+	edge->to_gen = to->gen;
+	__atomic_add_fetch(&from->logged_edges, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->logged_edges, 1, __ATOMIC_RELAXED);
+	edge->held = held;
+	edge->ptr = ptr;
+	edge->info = *info;
+done:
+	r_pthread_mutex_unlock(&tls->edge_log_lock);
+	return ret;
+}
+
+/**
+ * Add an edge from a thread's edge log to the lock-order graph, and report
+ * it if it makes an inversion.
+ * Note: you must call this function with g_graph_lock held, and both locks
+ * of the edge must still have the generations it was logged with.
+ *
+ * @param tls		The thread-local storage for the thread which
+ *			logged the edge.
+ * @param edge		The logged edge.
+ */
+static void lksmith_merge_edge(struct lksmith_tls *tls,
+		const struct lksmith_logged_edge *edge)
+{
+	char buf[4096];
+	size_t off;
+	int ret;
+
+	if (lk_has_before(edge->to, edge->from))
+		return;
+	ret = graph_add_edge(edge->from, edge->to, &edge->info);
+	if (ret == EDEADLK) {
+		off = 0;
+		graph_path_dump(buf, &off, sizeof(buf));
+		fwdprintf(buf, &off, sizeof(buf), "This thread took "
+			"lock %p while holding lock %p here:\n",
+			edge->ptr, edge->held);
+		stack_dump(edge->info.stack, buf, &off, sizeof(buf));
+		lksmith_error(EDEADLK, "lksmith_prelock(lock=%p, "
+			"thread=%s): lock inversion!  This lock should "
+			"have been taken before lock %p, which this "
+			"thread held.  (Found later, because "
+			"LKSMITH_DEFER_EDGES is set.)\n%s", edge->ptr,
+			tls->name, edge->held, buf);
+	} else if (ret) {
+		lksmith_error(ret, "lksmith_prelock(lock=%p, "
+			"thread=%s): failed to add lock %p to the "
+			"lock-order graph: error %d: %s\n", edge->ptr,
+			tls->name, edge->held, ret, terror(ret));
+	}
+}
+
+/**
+ * Merge a thread's edge log into the lock-order graph, and report any
+ * inversions.
+ *
+ * Note: the thread must not be able to exit while this runs.  Either it is
+ * the current thread, or we hold g_threads_lock.
+ *
+ * @param tls		The thread-local storage for the thread.
+ */
+static void lksmith_merge_thread_edges(struct lksmith_tls *tls)
+{
+	struct lksmith_logged_edge *log, *edge;
+	unsigned int i, len;
+	int from_live, to_live;
+
+	r_pthread_mutex_lock(&tls->edge_log_lock);
+	log = tls->edge_log;
+	len = tls->edge_log_len;
+	tls->edge_log = NULL;
+	tls->edge_log_len = 0;
+	tls->edge_log_cap = 0;
+	r_pthread_mutex_unlock(&tls->edge_log_lock);
+	if (!log)
+		return;
+	r_pthread_mutex_lock(&g_graph_lock);
+	for (i = 0; i < len; i++) {
+		edge = &log[i];
+		/* lksmith_lock_free bumps the generation before it checks
+		 * logged_edges, and takes g_graph_lock if it is set, so a
+		 * lock with the right generation keeps its record until we
+		 * are done with this entry. */
+		from_live = (__atomic_load_n(&edge->from->gen,
+			__ATOMIC_SEQ_CST) == edge->from_gen);
+		to_live = (__atomic_load_n(&edge->to->gen,
+			__ATOMIC_SEQ_CST) == edge->to_gen);
+		if (from_live && to_live)
+			lksmith_merge_edge(tls, edge);
+		/* A record whose generation has changed may already belong
+		 * to another lock, so we leave its count alone. */
+		if (from_live)
+			__atomic_sub_fetch(&edge->from->logged_edges, 1,
+				__ATOMIC_RELEASE);
+		if (to_live)
+			__atomic_sub_fetch(&edge->to->logged_edges, 1,
+				__ATOMIC_RELEASE);
+	}
+	r_pthread_mutex_unlock(&g_graph_lock);
+	free(log);
+}
+
+/**
+ * Merge every thread's edge log into the lock-order graph.
+ */
+static void lksmith_merge_edges(void)
+{
+	struct lksmith_tls *tls;
+
+	r_pthread_mutex_lock(&g_threads_lock);
+	for (tls = g_threads; tls; tls = tls->next)
+		lksmith_merge_thread_edges(tls);
+	r_pthread_mutex_unlock(&g_threads_lock);
+}
+
+/**
+ * The merger thread, which runs if LKSMITH_DEFER_EDGES is set.
+ *
+ * @param v		Unused.
+ *
+ * @return		Never returns.
+ */
+static void *lksmith_merger_thread(void *v __attribute__((unused)))
+{
+	struct timespec ts;
+
+	ts.tv_sec = g_defer_ms / 1000;
+	ts.tv_nsec = (g_defer_ms % 1000) * 1000000;
+	while (1) {
+		nanosleep(&ts, NULL);
+		lksmith_merge_edges();
+	}
+	return NULL;
+}
+
+/******************************************************************
+ *  Module filters
+ *
+ *  With LKSMITH_IGNORED_MODULES or LKSMITH_TRACKED_MODULES set, some locks
+ *  aren't tracked at all.  We decide before doing anything else, so a
+ *  skipped lock costs a search of the module map, or a lookup in the verdict
+ *  cache, and nothing more.
+ *****************************************************************/
+/**
+ * Make a new module map, if nobody else has since we found that a call site
+ * was missing from the old one.
+ *
+ * @param old		The map which the call site was missing from.
+ *
+ * @return		The new map, or the old one if we couldn't make one.
+ */
+static struct module_map *lksmith_modules_reload(struct module_map *old)
+{
+	struct module_map *map;
+
+	r_pthread_mutex_lock(&g_modules_lock);
+	map = g_modules;
+	if ((map == old) && (g_modules_reloads < LKSMITH_MODULES_MAX_RELOADS)) {
+		g_modules_reloads++;
+		if (module_map_create(g_ignored_modules, g_tracked_modules,
+				&map) == 0)
+			__atomic_store_n(&g_modules, map, __ATOMIC_RELEASE);
+		else
+			map = old;
+	}
+	r_pthread_mutex_unlock(&g_modules_lock);
+	return map;
+}
+
+/**
+ * Determine if a lock is in the data of an ignored module.
+ *
+ * The answer never changes for a given lock, so every operation on a lock
+ * that was skipped this way is skipped too.
+ *
+ * @param ptr		The lock.
+ *
+ * @return		1 if the lock should be skipped; 0 otherwise.
+ */
+static int lksmith_lock_filtered(const void *ptr)
+{
+	struct module_map *map;
+	int flags;
+
+	map = __atomic_load_n(&g_modules, __ATOMIC_ACQUIRE);
+	if (!map)
+		return 0;
+	flags = module_map_find(map, ptr);
+	return (flags > 0) && (flags & MODULE_IGNORED);
+}
+
+/**
+ * Determine if locks taken from a call site should be skipped.
+ *
+ * @param site		The call site, or NULL.
+ *
+ * @return		1 if the lock should be skipped; 0 otherwise.
+ */
+static int lksmith_site_filtered(const void *site)
+{
+	struct module_map *map;
+	uint64_t key, ent, *slot;
+	int flags, verdict;
+
+	if (!site)
+		return 0;
+	key = ((uint64_t)(uintptr_t)site) << 1;
+	slot = &g_site_verdicts[ptr_hash(site) &
+		(LKSMITH_VERDICT_CACHE_SIZE - 1)];
+	ent = __atomic_load_n(slot, __ATOMIC_RELAXED);
+	if ((ent & ~1ULL) == key)
+		return ent & 1;
+	map = __atomic_load_n(&g_modules, __ATOMIC_ACQUIRE);
+	flags = module_map_find(map, site);
+	if (flags < 0)
+		flags = module_map_find(lksmith_modules_reload(map), site);
+	if ((flags >= 0) && (flags & MODULE_IGNORED))
+		verdict = 1;
+	else if (g_tracked_modules)
+		verdict = !((flags >= 0) && (flags & MODULE_TRACKED));
+	else
+		verdict = 0;
+	__atomic_store_n(slot, key | verdict, __ATOMIC_RELAXED);
+	return verdict;
+}
+
+/**
+ * Decide whether the module filters skip a lock operation.
+ *
+ * @param ptr		The lock.
+ * @param site		The call site, or NULL.
+ *
+ * @return		A lksmith_filter value.
+ */
+static int lksmith_filtered(const void *ptr, const void *site)
+{
+	if (!__atomic_load_n(&g_modules, __ATOMIC_RELAXED))
+		return LKSMITH_FILTER_NONE;
+	if (lksmith_lock_filtered(ptr))
+		return LKSMITH_FILTER_ADDR;
+	if (lksmith_site_filtered(site))
+		return LKSMITH_FILTER_SITE;
+	return LKSMITH_FILTER_NONE;
+}
+
+/**
+ * Determine if a lock that we are releasing, or checking that we hold, was
+ * skipped by the module filters when we took it.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param ptr		The lock.
+ *
+ * @return		1 if it was skipped; 0 otherwise.
+ */
+static int lksmith_held_filtered(struct lksmith_tls *tls, const void *ptr)
+{
+	if (!__atomic_load_n(&g_modules, __ATOMIC_RELAXED))
+		return 0;
+	return lksmith_lock_filtered(ptr) || (tls_find_skipped(tls, ptr) >= 0);
+}
+
+/******************************************************************
+ *  API functions
+ *****************************************************************/
+static int lksmith_optional_init_impl(const void *ptr, int recursive,
+		int sleeper, const void *site)
+{
+	struct lksmith_tls *tls;
+	struct lksmith_shard *shard;
+	struct lksmith_lock *lk, *node = NULL;
+	int ret;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_optional_init(lock=%p): "
+			"failed to allocate thread-local storage.\n", ptr);
+		return ENOMEM;
+	}
+	if (!tls->intercept)
+		return 0;
+	if (lksmith_filtered(ptr, site))
+		return 0;
+	if (g_tracing) {
+		lksmith_trace_event(tls, LKSMITH_TRACE_INIT, ptr, site,
+			(recursive ? LKSMITH_TRACE_RECURSIVE : 0) |
+			(sleeper ? LKSMITH_TRACE_SLEEPER : 0), 0, 1);
+		return 0;
+	}
+	if (g_class_by_site && site) {
+		ret = lksmith_site_class_get(tls, site, &node);
+		if (ret) {
+			lksmith_error(ret, "lksmith_optional_init(lock=%p, "
+				"thread=%s): failed to allocate class data: "
+				"error %d: %s\n", ptr, tls->name, ret,
+				terror(ret));
+			return ret;
+		}
+	}
+	shard = lksmith_shard_of(ptr);
+	r_pthread_mutex_lock(&shard->lock);
+	ret = lksmith_insert(shard, tls, ptr, recursive, sleeper, &lk);
+	if (!ret)
+		lk->class_node = node;
+	r_pthread_mutex_unlock(&shard->lock);
+	if (ret) {
+		lksmith_error(ret, "lksmith_optional_init(lock=%p, "
+			"thread=%s): failed to allocate lock data: "
+			"error %d: %s\n", ptr, tls->name, ret, terror(ret));
+		return ret;
+	}
+	if (lksmith_over_limit())
+		lksmith_evict(tls);
+	return 0;
+}
+
+int lksmith_optional_init(const void *ptr, int recursive, int sleeper,
+		const void *site)
+{
+	struct lksmith_tls *tls;
+	int ret;
+
+	if (!lksmith_enter(&tls))
+		return 0;
+	ret = lksmith_optional_init_impl(ptr, recursive, sleeper, site);
+	lksmith_exit(tls);
+	return ret;
+}
+
+static int lksmith_set_lock_class_impl(const void *ptr, uint32_t class_id,
+		uint32_t level)
+{
+	struct lksmith_tls *tls;
+	struct lksmith_shard *shard;
+	struct lksmith_lock *lk, *node;
+	int ret;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_set_lock_class(lock=%p): "
+			"failed to allocate thread-local storage.\n", ptr);
+		return ENOMEM;
+	}
+	if (!tls->intercept)
+		return 0;
+	if (class_id == 0) {
+		lksmith_error(EINVAL, "lksmith_set_lock_class(lock=%p, "
+			"thread=%s): class 0 is reserved.\n", ptr, tls->name);
+		return EINVAL;
+	}
+	ret = lksmith_class_get(tls, class_id, level, &node);
+	if (ret == EINVAL) {
+		lksmith_error(EINVAL, "lksmith_set_lock_class(lock=%p, "
+			"thread=%s): class %"PRIu32" already has level "
+			"%"PRIu32", not %"PRIu32".\n", ptr, tls->name,
+			class_id, node->level, level);
+		return ret;
+	} else if (ret) {
+		lksmith_error(ret, "lksmith_set_lock_class(lock=%p, "
+			"thread=%s): failed to allocate class data: "
+			"error %d: %s\n", ptr, tls->name, ret, terror(ret));
+		return ret;
+	}
+	shard = lksmith_shard_of(ptr);
+	r_pthread_mutex_lock(&shard->lock);
+	lk = lksmith_find(shard, ptr);
+	if (!lk) {
+		/* Like a statically initialized lock, this might be
+		 * recursive. */
+		ret = lksmith_insert(shard, tls, ptr, 1, 1, &lk);
+		if (ret) {
+			r_pthread_mutex_unlock(&shard->lock);
+			lksmith_error(ret, "lksmith_set_lock_class(lock=%p, "
+				"thread=%s): failed to allocate lock data: "
+				"error %d: %s\n", ptr, tls->name, ret,
+				terror(ret));
+			return ret;
+		}
+	}
+	if ((lk->holders != NULL) || (lk->num_readers > 0) ||
+			(__atomic_load_n(&lk->fast_held, __ATOMIC_ACQUIRE))) {
+		r_pthread_mutex_unlock(&shard->lock);
+		lksmith_error(EBUSY, "lksmith_set_lock_class(lock=%p, "
+			"thread=%s): this lock is currently held, so its "
+			"class can't be changed.\n", ptr, tls->name);
+		return EBUSY;
+	}
+	lk->class_id = class_id;
+	lk->level = level;
+	lk->class_node = node;
+	r_pthread_mutex_unlock(&shard->lock);
+	/* Threads may have cached edges which they checked before the lock
+	 * had a class. */
+	r_pthread_mutex_lock(&g_graph_lock);
+	__atomic_store_n(&g_graph_epoch, g_graph_epoch + 1, __ATOMIC_RELEASE);
+	r_pthread_mutex_unlock(&g_graph_lock);
+	return 0;
+}
+
+int lksmith_set_lock_class(const void *ptr, uint32_t class_id,
+		uint32_t level)
+{
+	struct lksmith_tls *tls;
+	int ret;
+
+	if (!lksmith_enter(&tls))
+		return 0;
+	ret = lksmith_set_lock_class_impl(ptr, class_id, level);
+	lksmith_exit(tls);
+	return ret;
+}
+
+static int lksmith_destroy_impl(const void *ptr)
+{
+	int ret;
+	struct lksmith_shard *shard;
+	struct lksmith_lock *lk;
+	struct lksmith_tls *tls;
+	char name[LKSMITH_THREAD_NAME_MAX];
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_destroy(lock=%p): failed to "
+			"allocate thread-local storage.\n", ptr);
+		ret = ENOMEM;
+		goto done;
+	}
+	if (!tls->intercept)
+		return 0;
+	if (lksmith_lock_filtered(ptr))
+		return 0;
+	if (g_tracing) {
+		lksmith_trace_event(tls, LKSMITH_TRACE_DESTROY, ptr, NULL, 0,
+			0, 1);
+		return 0;
+	}
+	shard = lksmith_shard_of(ptr);
+	r_pthread_mutex_lock(&shard->lock);
+	lk = lksmith_find(shard, ptr);
+	if (!lk) {
+		/* This might not be an error, if we used
+		 * PTHREAD_MUTEX_INITIALIZER and then never did anything else
+		 * with the lock prior to destroying it. */
+		r_pthread_mutex_unlock(&shard->lock);
+		ret = ENOENT;
+		goto done;
 	}
-	tls->intercept = 1;
-	platform_create_thread_name(tls->name, LKSMITH_THREAD_NAME_MAX);
-	ret = pthread_setspecific(g_tls_key, tls);
-	if (ret) {
-		free(tls->held);
-		free(tls);
-		lksmith_error(ENOMEM,
-			"get_or_create_tls(): pthread_setspecific "
-			"failed with error %d: %s\n", ret, terror(ret));
-		return NULL;
+	if ((lk->holders != NULL) || (lk->num_readers > 0) ||
+			(__atomic_load_n(&lk->fast_held, __ATOMIC_ACQUIRE))) {
+		if (tls_contains_lid(tls, ptr) == 1) {
+			lksmith_error(EBUSY, "lksmith_destroy(lock=%p, "
+				"thread=%s): you must unlock this mutex "
+				"before destroying it.", ptr, tls->name);
+		} else {
+			thread_registry_get(lk_some_holder(lk), name);
+			lksmith_error(EBUSY, "lksmith_destroy(lock=%p, "
+				"thread=%s): this mutex is currently in use "
+				"by thread %s and so cannot be destroyed.", ptr,
+				tls->name, name);
+		}
+		r_pthread_mutex_unlock(&shard->lock);
+		ret = EBUSY;
+		goto done;
 	}
-#ifdef HAVE_IMPROVED_TLS
-	t_improved_tls = tls;
-#endif
-	return tls;
+	lksmith_remove(shard, lk);
+	r_pthread_mutex_unlock(&shard->lock);
+	lksmith_lock_free(tls, lk);
+	ret = 0;
+done:
+	return ret;
 }
 
-int init_tls(void)
+int lksmith_destroy(const void *ptr)
 {
 	struct lksmith_tls *tls;
+	int ret;
 
-	tls = get_or_create_tls();
-	if (!tls)
-		return -ENOMEM;
-	return 0;
+	if (!lksmith_enter(&tls))
+		return 0;
+	ret = lksmith_destroy_impl(ptr);
+	lksmith_exit(tls);
+	return ret;
 }
 
 /**
- * Add a lock ID to the end of the list of lock IDs we hold.
- *
- * NOTE: lock IDs can be added more than once to this list!
- * This is so that we can support recursive mutexes.
- *
- * @param tls		The thread-local data.
- * @param ptr		the lock to add to the list.
+ * Give a lock holder the current stack, if we didn't capture one when the
+ * holder was created and LKSMITH_BACKTRACE_MODE=first-edge.
  *
- * @return		0 on success; ENOMEM if we ran out of memory.
+ * @param tls		The thread-local storage for the current thread.
+ * @param holder	Our lock holder for lk, or NULL if we don't have
+ *			one.
  */
-static int tls_append_held(struct lksmith_tls *tls, const void *ptr)
+static void holder_attach_backtrace(struct lksmith_tls *tls,
+		struct lksmith_holder *holder)
 {
-	const void **held;
+	int nframes;
 
-	held = realloc(tls->held, sizeof(uintptr_t) * (tls->num_held + 1));
-	if (!held)
-		return ENOMEM;
-	tls->held = held;
-	held[tls->num_held++] = ptr;
-	return 0;
+	if ((g_bt_mode != LKSMITH_BT_FIRST_EDGE) || (!holder) ||
+			(holder->stack != 0))
+		return;
+	nframes = tls_capture_backtrace(tls);
+	if (nframes <= 0)
+		return;
+	/* The holder's stack is only informational, so we don't complain if
+	 * we can't allocate space for it. */
+	holder_set_frames(holder, tls->backtrace_scratch, nframes);
 }
 
 /**
- * Remove a lock ID from the list of lock IDs we hold.
- *
- * @param tls		The thread-local data.
- * @param ptr		the lock ID to add to the list.
+ * Describe the stacks of a new edge in the lock-order graph.
  *
- * @return		0 on success; ENOENT if we are not holding the
- *			lock ID.
+ * @param held		The lock which we hold.
+ * @param holder	Our lock holder for the lock we are taking, or NULL
+ *			if we don't have one.
+ * @param edge		(out param) the stacks which took the two locks
  */
-static int tls_remove_held(struct lksmith_tls *tls, const void *ptr)
+static void held_edge_info(const struct lksmith_held *held,
+		const struct lksmith_holder *holder, struct lksmith_edge_info *edge)
 {
-	signed int i;
-	const void **held;
-
-	for (i = tls->num_held - 1; i >= 0; i--) {
-		if (tls->held[i] == ptr)
-			break;
-	}
-	if (i < 0)
-		return ENOENT;
-	memmove(&tls->held[i], &tls->held[i + 1],
-		sizeof(struct lksmith_held*) * (tls->num_held - i - 1));
-	held = realloc(tls->held, sizeof(uintptr_t) * (--tls->num_held));
-	if (held || (tls->num_held == 0)) {
-		tls->held = held;
-	}
-	return 0;
+	edge->held_stack = held->holder ? held->holder->stack : 0;
+	edge->stack = holder ? holder->stack : 0;
 }
 
 /**
- * Determine if we are holding a lock.
+ * Update the lock-order graph for a lock we are about to take, and report any
+ * errors.
+ * Note: you must call this function with g_graph_lock held, unless
+ * LKSMITH_DEFER_EDGES is set.  In that case, new edges go into our edge log
+ * instead of the graph, and we don't touch the graph at all.
  *
- * @param tls		The thread-local data.
- * @param ptr		The lock ID to find.
+ * Taking a lock shared while holding another lock shared doesn't add an edge,
+ * since two threads can hold read locks in opposite orders without
+ * deadlocking.
  *
- * @return		1 if we hold the lock; 0 otherwise.
+ * @param tls		The thread-local storage for the current thread.
+ * @param lk		The lock data for the lock we are about to take.
+ * @param holder	Our lock holder for lk, or NULL if we don't have
+ *			one.
+ * @param ptr		The lock pointer.
+ * @param recursive	1 if the lock is recursive.
+ * @param shared	1 if we are taking the lock shared.
  */
-static int tls_contains_lid(struct lksmith_tls *tls, const void *ptr)
+static void lksmith_prelock_process_depends(struct lksmith_tls *tls,
+			struct lksmith_lock *lk, struct lksmith_holder *holder,
+			const void *ptr, int recursive, int shared)
 {
 	unsigned int i;
+	const void *held;
+	struct lksmith_lock *ak, *node;
+	struct lksmith_edge_info edge;
+	uint64_t epoch;
+	char buf[4096];
+	size_t off;
+	int ret;
 
+	epoch = __atomic_load_n(&g_graph_epoch, __ATOMIC_ACQUIRE);
 	for (i = 0; i < tls->num_held; i++) {
-		if (tls->held[i] == ptr)
-			return 1;
-	}
-	return 0;
-}
-
-static void lksmith_error_with_ti(struct lksmith_tls *tls, int err,
-				  const char *fmt, ...)
-	__attribute__((format(printf, 3, 4)));
-
-/**
- * Locksmith error with thread information (including a backtrace)
- *
- * @param tls		Our thread-local storage object
- * @param err		the locksmith error code
- * @param fmt		printf-style format string
- */
-static void lksmith_error_with_ti(struct lksmith_tls *tls, int err,
-				  const char *fmt, ...)
-{
-	va_list ap;
-	int nframes, prev_intercept;
-	char **frames = NULL;
-
-	if (!tls) {
-		tls = get_or_create_tls();
-		if (!tls) {
-			va_start(ap, fmt);
-			lksmith_errora(err, fmt, ap);
-			va_end(ap);
-			return;
+		if (tls->held[i].shared && shared)
+			continue;
+		held = tls->held[i].ptr;
+		ak = tls->held[i].lk;
+		if (tls_edge_cached(tls, held, ptr, epoch))
+			continue;
+		if (held == ptr) {
+			if (recursive)
+				continue;
+			holder_attach_backtrace(tls, holder);
+			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prelock("
+				"lock=%p, thread=%s): this thread already holds "
+				"this lock, and it is not a recursive lock.\n",
+				ptr, tls->name);
+			continue;
+		}
+		if (lk->class_id && ak->class_id) {
+			/* The order of classed locks is known in advance, so
+			 * they don't need the graph. */
+			if (ak->level < lk->level) {
+				tls_edge_insert(tls, held, ptr, epoch);
+				continue;
+			}
+			holder_attach_backtrace(tls, holder);
+			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prelock("
+				"lock=%p, thread=%s): lock level violation!  "
+				"This lock has class %"PRIu32" and level "
+				"%"PRIu32", but this thread already holds lock "
+				"%p, which has class %"PRIu32" and level "
+				"%"PRIu32".\n", ptr, tls->name, lk->class_id,
+				lk->level, held, ak->class_id, ak->level);
+			continue;
+		}
+		/* Locks with a class are all one node in the graph. */
+		node = lk->class_node ? lk->class_node : lk;
+		ak = ak->class_node ? ak->class_node : ak;
+		if (node == ak) {
+			/* Two locks initialized at the same site.  We don't
+			 * know how instances of a class are ordered. */
+			tls_edge_insert(tls, held, ptr, epoch);
+			continue;
+		}
+		if (g_defer_ms) {
+			/* We don't know whether this edge is new, so we
+			 * treat it as new. */
+			holder_attach_backtrace(tls, holder);
+			held_edge_info(&tls->held[i], holder, &edge);
+			ret = tls_log_edge(tls, ak, node, held, ptr, &edge);
+			if (ret) {
+				lksmith_error(ret, "lksmith_prelock(lock=%p, "
+					"thread=%s): failed to log the edge "
+					"from lock %p: error %d: %s\n", ptr,
+					tls->name, held, ret, terror(ret));
+				continue;
+			}
+			tls_edge_insert(tls, held, ptr, epoch);
+			continue;
+		}
+		if (lk_has_before(node, ak)) {
+			/* Some other thread already added this edge. */
+			tls_edge_insert(tls, held, ptr, epoch);
+			continue;
+		}
+		holder_attach_backtrace(tls, holder);
+		held_edge_info(&tls->held[i], holder, &edge);
+		ret = graph_add_edge(ak, node, &edge);
+		if (ret == EDEADLK) {
+			off = 0;
+			graph_path_dump(buf, &off, sizeof(buf));
+			fwdprintf(buf, &off, sizeof(buf), "This thread is "
+				"taking the locks in the opposite order "
+				"here:\n");
+			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prelock("
+				"lock=%p, thread=%s): lock inversion!  This "
+				"lock should have been taken before lock %p, "
+				"which this thread already holds.\n%s",
+				ptr, tls->name, held, buf);
+			continue;
+		} else if (ret) {
+			lksmith_error_with_ti(tls, ret, "lksmith_prelock("
+				"lock=%p, thread=%s): failed to add lock %p "
+				"to the lock-order graph: error %d: %s\n",
+				ptr, tls->name, held, ret, terror(ret));
+			continue;
 		}
+		tls_edge_insert(tls, held, ptr, epoch);
 	}
-	prev_intercept = tls->intercept;
-	tls->intercept = 0;
-	nframes = bt_frames_create(&tls->backtrace_scratch,
-			&tls->backtrace_scratch_len, &frames);
-	tls->intercept = prev_intercept;
-	va_start(ap, fmt);
-	// lksmith_errora_with_bt handles nframes < 0 (the error case)
-	lksmith_errora_with_bt(err, frames, nframes, fmt, ap);
-	va_end(ap);
-	bt_frames_free(frames);
 }
 
-/******************************************************************
- *  Lock holder functions
- *****************************************************************/
 /**
- * Dump out the contents of a lock holder structure
+ * Determine if a stack frame is in the ignore lists.
  *
- * @param holder        The lock holder
- * @param buf		(out param) the buffer to write to
- * @param off		(inout param) current position in the buffer
- * @param buf_len	length of buf
+ * @param frame		The return address.
+ *
+ * @return		1 if the frame should be ignored; 0 otherwise.
  */
-static void holder_dump(const struct lksmith_holder *holder,
-		char *buf, size_t *off, size_t buf_len)
+static int frame_is_ignored(void *frame)
 {
-	const char *prefix = "";
-	int i;
+	uint64_t key, ent, *slot;
+	int verdict;
 
-	fwdprintf(buf, off, buf_len, "{name=%s, "
-		"bt_frames=[", holder->name);
-	for (i = 0; i < holder->bt_len; i++) {
-		fwdprintf(buf, off, buf_len, "%s%s", prefix,
-			  holder->bt_frames[i]);
-		prefix = ", ";
-	}
-	fwdprintf(buf, off, buf_len, "]}");
+	key = ((uint64_t)(uintptr_t)frame) << 1;
+	slot = &g_verdict_cache[ptr_hash(frame) &
+		(LKSMITH_VERDICT_CACHE_SIZE - 1)];
+	ent = __atomic_load_n(slot, __ATOMIC_RELAXED);
+	if ((key != 0) && ((ent & ~1ULL) == key))
+		return ent & 1;
+	verdict = matcher_match(g_ignore_matcher, bt_frame_name(frame));
+	if (key != 0)
+		__atomic_store_n(slot, key | verdict, __ATOMIC_RELAXED);
+	return verdict;
 }
 
 /**
- * Create a lock holder.
+ * Returns true if lksmith_prelock should skip dependency processing.
  *
- * @param tls		The thread-local storage for the current thread.
+ * We search the current backtrace for any element that is in the ignore
+ * list.  This is the only place outside of error reporting where we need
+ * symbol names, so if there are no ignore lists, we don't look any up.
+ * Verdicts are cached by address, so we usually don't need to look at the
+ * names either.  If the holder has no backtrace (see
+ * LKSMITH_BACKTRACE_MODE), we capture one just for this check.
  *
- * @return		The lock holder on success; NULL otherwise.
+ * @param tls		The thread-local storage for the current thread.
+ * @param holder	The lock holder for the lock we are taking, or NULL
+ *			if we don't have one.
  */
-static struct lksmith_holder* holder_create(struct lksmith_tls *tls)
+static int should_skip_dependency_processing(struct lksmith_tls *tls,
+		struct lksmith_holder *holder)
 {
-	struct lksmith_holder *holder;
-	int intercept, ret;
+	int bt_idx, intercept, nframes, ret = 0;
+	void **frames;
 
-	holder = calloc(1, sizeof(*holder));
-	if (!holder)
-		return NULL;
-	snprintf(holder->name, sizeof(holder->name), "%s", tls->name);
+	if (!g_ignore_matcher)
+		return 0;
+	/* Only this thread ever changes our holder's stack, so we can read
+	 * it without the shard lock. */
+	nframes = holder ? depot_get(holder->stack, &frames) : 0;
+	if (nframes <= 0) {
+		nframes = tls_capture_backtrace(tls);
+		frames = tls->backtrace_scratch;
+	}
 	intercept = tls->intercept;
 	tls->intercept = 0;
-	ret = bt_frames_create(&tls->backtrace_scratch,
-		&tls->backtrace_scratch_len, &holder->bt_frames);
-	tls->intercept = intercept;
-	if (ret < 0) {
-		free(holder);
-		return NULL;
+	for (bt_idx = 0; bt_idx < nframes; bt_idx++) {
+		if (frame_is_ignored(frames[bt_idx])) {
+			ret = 1;
+			break;
+		}
 	}
-	holder->bt_len = ret;
-	return holder;
+	tls->intercept = intercept;
+	if (ret)
+		stat_inc(&tls->stats.ignored);
+	return ret;
 }
 
 /**
- * Free a lock holder structure
+ * Record a lock acquisition in the lock profile.
  *
- * @param holder        The lock holder
+ * @param tls		The thread-local storage for the current thread.
+ * @param ptr		The lock.
+ * @param wait_ns	How long we waited for the lock.
+ * @param failed	1 if we didn't get the lock.
  */
-static void holder_free(struct lksmith_holder *holder)
-{
-	bt_frames_free(holder->bt_frames);
-	free(holder);
-}
-
-/******************************************************************
- *  Lock functions
- *****************************************************************/
-static int lksmith_lock_compare(const struct lksmith_lock *a,
-		const struct lksmith_lock *b)
+static void lksmith_profile_acquire(struct lksmith_tls *tls, const void *ptr,
+		uint64_t wait_ns, int failed)
 {
-	const void *pa = a->ptr;
-	const void *pb = b->ptr;
-	if (pa < pb)
-		return -1;
-	else if (pa > pb)
-		return 1;
-	else
-		return 0;
+	if (!tls->prof) {
+		tls->prof = prof_table_create();
+		if (!tls->prof)
+			return;
+	}
+	prof_record_acquire(tls->prof, ptr, tls->prof_site, wait_ns, failed);
 }
 
 /**
- * Add an element to a sorted array, if it's not already there.
+ * Perform some error checking before taking a lock.
  *
- * @param arr		(inout) the array
- * @param num		(inout) the array length
- * @param lid		The lock ID to add.
+ * An exclusive holder always gets a holder record.  A shared holder only gets
+ * one if the lock has fewer than LKSMITH_READER_SAMPLES of them already.
  *
- * @return		0 on success; ENOMEM if we ran out of memory.
+ * @param ptr		pointer to the lock
+ * @param sleeper	1 if this lock is a sleeper; 0 otherwise
+ * @param shared	1 if we are taking the lock shared
+ * @param site		the call site
+ *
+ * @return		0 if we should continue with the lock; error code
+ *			otherwise.
  */
-static int lk_add_sorted(struct lksmith_lock ** __restrict * __restrict arr,
-			int * __restrict num, struct lksmith_lock *lk)
+static int lksmith_prelock_impl(const void *ptr, int sleeper, int shared,
+		const void *site)
 {
-	int i;
-	struct lksmith_lock **narr;
+	struct lksmith_shard *shard;
+	struct lksmith_lock *lk;
+	struct lksmith_tls *tls;
+	int ret, recursive, created = 0;
+	struct lksmith_holder *holder = NULL, *our_holder = NULL;
 
-	for (i = 0; i < *num; i++) {
-		if ((*arr)[i] == lk)
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_prelock(lock=%p): failed to "
+			"allocate thread-local storage.\n", ptr);
+		ret = ENOMEM;
+		goto done;
+	}
+	if (!tls->intercept)
+		return 0;
+	if (__atomic_load_n(&g_modules, __ATOMIC_RELAXED)) {
+		tls->skip_pending = lksmith_filtered(ptr, site);
+		if (tls->skip_pending) {
+			stat_inc(&tls->stats.filtered);
 			return 0;
-		else if ((*arr)[i] > lk)
-			break;
+		}
 	}
-	narr = realloc(*arr, sizeof(struct lksmith_lock*) * (*num + 1));
-	if (!narr)
-		return ENOMEM;
-	*arr = narr;
-	memmove(&narr[i + 1], &narr[i], sizeof(uintptr_t) * (*num - i));
-	narr[i] = lk;
-	*num = *num + 1;
-	return 0;
-}
-
-/**
- * Remove an element from a sorted array.
- * We assume it appears only once in that array.
- * TODO: be smarter here-- use bsearch
- *
- * @param arr		(inout) the array
- * @param num		(inout) the array length
- * @param lid		The lock ID to remove.
- */
-static void lk_remove_sorted(struct lksmith_lock ** __restrict * __restrict arr,
-			int * __restrict num, struct lksmith_lock *ak)
-{
-	int i;
-	struct lksmith_lock **narr;
-
-	if (*arr == NULL)
-		return;
-	for (i = 0; i < *num; i++) {
-		if ((*arr)[i] == ak)
-			break;
-		else if ((*arr)[i] > ak)
-			return;
+	if (g_tracing) {
+		lksmith_trace_event(tls, shared ? LKSMITH_TRACE_PRERDLOCK :
+			LKSMITH_TRACE_PRELOCK, ptr, site,
+			sleeper ? LKSMITH_TRACE_SLEEPER : 0, 0, 1);
+		return 0;
+	}
+	/* A lock that only this thread has ever taken, taken while holding
+	 * nothing else, can't add any edges or conflict with any other
+	 * holder.  So all we need is the TLS bookkeeping. */
+	if ((!shared) && (tls->num_held == 0)) {
+		lk = tls_private_find(tls, ptr);
+		if (lk) {
+			tls->fast_pending = lk;
+			goto done_ok;
+		}
+	}
+	tls->backtrace_scratch_frames = -1;
+	if (!shared) {
+		holder = holder_create(tls, holder_wants_backtrace(tls));
+		if (!holder) {
+			lksmith_error(ENOMEM, "lksmith_prelock(lock=%p): "
+				"failed to allocate lock holder data.\n", ptr);
+			ret = ENOMEM;
+			goto done;
+		}
+	}
+	shard = lksmith_shard_of(ptr);
+	r_pthread_mutex_lock(&shard->lock);
+	lk = lksmith_find(shard, ptr);
+	if (!lk) {
+		/* If the lock hasn't been explicitly initialized using
+		 * lksmith_optional_init, we allow it to be recursive.
+		 * It might have been statically initialized with
+		 * PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP.
+		 */
+		ret = lksmith_insert(shard, tls, ptr, 1, sleeper, &lk);
+		if (ret) {
+			lksmith_error(ret, "lksmith_prelock(lock=%p, "
+				"thread=%s): failed to allocate lock data: "
+				"error %d: %s\n", ptr, tls->name, ret, terror(ret));
+			r_pthread_mutex_unlock(&shard->lock);
+			goto done;
+		}
+		created = 1;
+	}
+	lk->referenced = 1;
+	if (lk->owner == 0) {
+		lk->owner = tls->tid;
+	} else if ((lk->owner != tls->tid) && (!lk->promoted)) {
+		__atomic_store_n(&lk->promoted, 1, __ATOMIC_RELEASE);
+	}
+	if ((!lk->promoted) && (!shared))
+		tls_private_insert(tls, lk);
+	/* Once we are a holder, the lock can't be destroyed out from under
+	 * us, so we can keep using lk after dropping the shard lock. */
+	if (shared) {
+		/* We don't capture a stack here, since that is slow and we
+		 * hold the shard lock.  It's filled in below. */
+		if (lk->num_sampled < LKSMITH_READER_SAMPLES)
+			holder = holder_create(tls, 0);
+		lk_reader_add(lk, holder);
+	} else {
+		lk_holder_add(lk, holder);
+	}
+	our_holder = holder;
+	holder = NULL;
+	recursive = lk->props.recursive;
+	r_pthread_mutex_unlock(&shard->lock);
+	/* Postlock and postunlock use these instead of looking the lock and
+	 * our holder record up again. */
+	tls->pending = lk;
+	tls->pending_holder = our_holder;
+	/* We are a holder, so the lock we just took can't be evicted. */
+	if (created && lksmith_over_limit())
+		lksmith_evict(tls);
+	if (shared && our_holder && holder_wants_backtrace(tls)) {
+		ret = tls_capture_backtrace(tls);
+		if (ret > 0) {
+			holder_set_frames(our_holder, tls->backtrace_scratch,
+				ret);
+		}
+	}
+	/* If we hold no other locks, or we have already added all of these
+	 * edges to the graph, there is nothing to check.  Symbol lookup can
+	 * be slow, so we check the ignore lists without holding any locks. */
+	if ((tls->num_held > 0) &&
+			(!tls_edges_cached(tls, ptr, recursive, shared)) &&
+			(!should_skip_dependency_processing(tls, our_holder))) {
+		if (g_defer_ms) {
+			lksmith_prelock_process_depends(tls, lk, our_holder,
+				ptr, recursive, shared);
+		} else {
+			r_pthread_mutex_lock(&g_graph_lock);
+			lksmith_prelock_process_depends(tls, lk, our_holder,
+				ptr, recursive, shared);
+			r_pthread_mutex_unlock(&g_graph_lock);
+		}
+	}
+done_ok:
+	if (g_prof_top) {
+		tls->prof_site = site;
+		tls->prof_start = prof_now();
 	}
-	if (i == *num)
-		return;
-	memmove(&(*arr)[i - 1], &(*arr)[i],
-		sizeof(struct lksmith_lock*) * (*num - i - 1));
-	narr = realloc(*arr, sizeof(struct lksmith_lock*) * (--*num));
-	if (narr || (*num == 0))
-		*arr = narr;
+	ret = 0;
+done:
+	if (holder) {
+		holder_free(tls, holder);
+	}
+	return ret;
 }
 
-/**
- * Add a lock to the 'before' set of this lock data.
- * Note: you must call this function with the info->lock held.
- *
- * @param lk		The lock data.
- * @param lid		The lock ID to add.
- *
- * @return		0 on success; ENOMEM if we ran out of memory.
- */
-static int lk_add_before(struct lksmith_lock *lk, struct lksmith_lock *ak)
+int lksmith_prelock(const void *ptr, int sleeper, const void *site)
 {
-	return lk_add_sorted(&lk->before, &lk->before_size, ak);
-}
+	struct lksmith_tls *tls;
+	int ret;
 
-/**
- * Remove a lock from the 'after' set of this lock data.
- * Note: you must call this function with the info->lock held.
- *
- * @param lk		The lock data.
- * @param lid		The lock ID to remove.
- */
-static void lk_remove_before(struct lksmith_lock *lk, struct lksmith_lock *ak)
-{
-	lk_remove_sorted(&lk->before, &lk->before_size, ak);
+	if (!lksmith_enter_prelock(&tls))
+		return 0;
+	ret = lksmith_prelock_impl(ptr, sleeper, 0, site);
+	lksmith_exit_prelock(tls, ret);
+	return ret;
 }
 
-/**
- * Add a lock holder to the lock.
- * Note: you must call this function with the info->lock held.
- *
- * @param lk		The lock data.
- * @param holder	The lock holder to add.
- */
-static void lk_holder_add(struct lksmith_lock *lk,
-			struct lksmith_holder *holder)
+int lksmith_prerdlock(const void *ptr, const void *site)
 {
-	holder->next = lk->holders;
-	lk->holders = holder;
+	struct lksmith_tls *tls;
+	int ret;
+
+	if (!lksmith_enter_prelock(&tls))
+		return 0;
+	ret = lksmith_prelock_impl(ptr, 1, 1, site);
+	lksmith_exit_prelock(tls, ret);
+	return ret;
 }
 
 /**
- * Remove a lock holder from the lock.
- * Note: you must call this function with the info->lock held.
+ * Finish taking a lock through the private fast path.
  *
- * @param lk		The lock data.
  * @param tls		The thread-local storage for the current thread.
- *
- * @return		0 on success; -ENOENT if the lock holder wasn't found.
+ * @param ptr		pointer to the lock
+ * @param error		the error code returned by the lock function
+ * @param now		the current time, if we are profiling; 0 otherwise
  */
-static int lk_holder_remove(struct lksmith_lock *lk,
-			struct lksmith_tls *tls)
+static void lksmith_postlock_fast(struct lksmith_tls *tls, const void *ptr,
+		int error, uint64_t now)
 {
-	struct lksmith_holder **holder, *next;
+	struct lksmith_lock *lk = tls->fast_pending;
+	struct lksmith_held *held;
 
-	/* By iterating forward through the list, we ensure that holders are
-	 * taken out in the reverse order that they were put in (since we also
-	 * insert to the head of the list.)  This is important when dealing
-	 * with recursive locks, where one thread can take the same lock over
-	 * and over. */
-	holder = &lk->holders;
-	while (*holder) {
-		if (!strcmp(tls->name, (*holder)->name))
-			break;
-		holder = &(*holder)->next;
+	tls->fast_pending = NULL;
+	if (error)
+		goto release;
+	if (tls_append_held(tls, lk, 0)) {
+		lksmith_error(ENOMEM, "lksmith_postlock(lock=%p, "
+			"thread=%s): failed to allocate space to store "
+			"another thread id.\n", ptr, tls->name);
+		goto release;
 	}
-	if (!holder)
-		return -ENOENT;
-	next = (*holder)->next;
-	holder_free(*holder);
-	*holder = next;
-	return 0;
+	held = &tls->held[tls->num_held - 1];
+	held->fast = 1;
+	if (now) {
+		held->site = tls->prof_site;
+		held->acquired = now;
+	}
+	stat_inc(&tls->stats.acquisitions);
+	stat_inc(&tls->stats.fast);
+	if (!lk->props.sleeper)
+		tls->num_spins++;
+	return;
+release:
+	/* Drop the claim that tls_private_find took. */
+	__atomic_store_n(&lk->fast_held, lk->fast_held - 1, __ATOMIC_RELEASE);
 }
 
 /**
- * Dump out the contents of a lock data structure.
+ * Finish taking a lock.
  *
- * @param lk		The lock data
- * @param buf		(out param) the buffer to write to
- * @param off		(inout param) current position in the buffer
- * @param buf_len	length of buf
+ * @param ptr		pointer to the lock
+ * @param error		the error code returned by the lock function
+ * @param shared	1 if we took the lock shared
  */
-static void lk_dump(const struct lksmith_lock *lk,
-		char *buf, size_t *off, size_t buf_len)
+static void lksmith_postlock_impl(const void *ptr, int error, int shared)
 {
-	int i;
-	const char *prefix = "";
+	struct lksmith_tls *tls;
+	struct lksmith_shard *shard;
+	struct lksmith_lock *lk;
 	struct lksmith_holder *holder;
+	int ret;
+	uint64_t now = 0;
 
-	fwdprintf(buf, off, buf_len, "lk{ptr=%p, "
-		"nlock=%"PRId64", recursive=%d, sleeper=%d,"
-		"color=%"PRId64", before={",
-		(void*)lk->ptr, (uint64_t)lk->props.nlock,
-		lk->props.recursive, lk->props.sleeper,
-		lk->color);
-	for (i = 0; i < lk->before_size; i++) {
-		fwdprintf(buf, off, buf_len, "%s%p",
-			  prefix, lk->before[i]);
-		prefix = " ";
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_postlock(lock=%p): failed "
+			"to allocate thread-local storage.\n", ptr);
+		goto done;
 	}
-	fwdprintf(buf, off, buf_len, "}, holders=[");
-	prefix = "";
-	holder = lk->holders;
-	while (holder) {
-		fwdprintf(buf, off, buf_len, "%s", prefix);
-		holder_dump(holder, buf, off, buf_len);
-		prefix = ", ";
-		holder = holder->next;
+	if (!tls->intercept)
+		return;
+	if (tls->skip_pending) {
+		/* Locks in ignored modules' data are recognized by their
+		 * address when they are released.  The others have to be
+		 * remembered. */
+		if ((tls->skip_pending == LKSMITH_FILTER_SITE) && (!error)) {
+			ret = tls_append_skipped(tls, ptr);
+			if (ret) {
+				lksmith_error(ret, "lksmith_postlock(lock=%p, "
+					"thread=%s): failed to allocate "
+					"memory.\n", ptr, tls->name);
+			}
+		}
+		tls->skip_pending = 0;
+		return;
 	}
-	fwdprintf(buf, off, buf_len, "]}");
+	if (g_tracing) {
+		lksmith_trace_event(tls, shared ? LKSMITH_TRACE_POSTRDLOCK :
+			LKSMITH_TRACE_POSTLOCK, ptr, NULL, 0, error, 0);
+		return;
+	}
+	if (g_prof_top) {
+		now = prof_now();
+		lksmith_profile_acquire(tls, ptr, now - tls->prof_start,
+			error);
+	}
+	if (tls->fast_pending) {
+		lksmith_postlock_fast(tls, ptr, error, now);
+		return;
+	}
+	lk = tls->pending;
+	holder = tls->pending_holder;
+	tls->pending = NULL;
+	tls->pending_holder = NULL;
+	if ((!lk) || (lk->ptr != ptr)) {
+		lksmith_error(EIO, "lksmith_postlock(lock=%p, thread=%s): "
+			"logic error: prelock didn't create the lock data?\n",
+			ptr, tls->name);
+		goto done;
+	}
+	shard = lksmith_shard_of(ptr);
+	r_pthread_mutex_lock(&shard->lock);
+	if (error) {
+		if (shared)
+			lk_reader_remove(lk, tls, holder);
+		else
+			lk_holder_remove(lk, tls, holder);
+		goto done_unlock;
+	}
+	lk->nlock++;
+	ret = tls_append_held(tls, lk, shared);
+	if (ret) {
+		lksmith_error(ENOMEM, "lksmith_postlock(lock=%p, "
+			"thread=%s): failed to allocate space to store "
+			"another thread id.\n", ptr, tls->name);
+		goto done_unlock;
+	}
+	tls->held[tls->num_held - 1].holder = holder;
+	stat_inc(&tls->stats.acquisitions);
+	if (now) {
+		tls->held[tls->num_held - 1].site = tls->prof_site;
+		tls->held[tls->num_held - 1].acquired = now;
+	}
+	if (!lk->props.sleeper) {
+		tls->num_spins++;
+	} else if ((tls->num_spins > 0) && (!lk->props.spin_warn)) {
+		lksmith_error_with_ti(tls, EWOULDBLOCK, "lksmith_postlock("
+			"lock=%p, thread=%s): performance problem: you are "
+			"taking a sleeping lock while holding a spin lock.\n",
+			ptr, tls->name);
+		lk->props.spin_warn = 1;
+	}
+done_unlock:
+	r_pthread_mutex_unlock(&shard->lock);
+done:
+	return;
 }
 
-static void lk_dump_to_stderr(struct lksmith_lock *lk)
+void lksmith_postlock(const void *ptr, int error)
 {
-	char buf[16384];
-	size_t off = 0;
+	struct lksmith_tls *tls;
 
-	lk_dump(lk, buf, &off, sizeof(buf));
-	fputs(buf, stderr);
-	fputs("\n", stderr);
+	if (!lksmith_enter_postlock(&tls))
+		return;
+	lksmith_postlock_impl(ptr, error, 0);
+	lksmith_exit(tls);
 }
 
-static void tree_print(void)
+void lksmith_postrdlock(const void *ptr, int error)
 {
-	char buf[8196];
-	struct lksmith_lock *lk;
-	size_t off;
-	const char *prefix = "";
+	struct lksmith_tls *tls;
 
-	fprintf(stderr, "g_lock_tree: {");
-	RB_FOREACH(lk, lock_tree, &g_tree) {
-		off = 0;
-		lk_dump(lk, buf, &off, sizeof(buf));
-		fprintf(stderr, "%s%s", prefix, buf);
-		prefix = ",\n";
-	}
-	fprintf(stderr, "\n}\n");
+	if (!lksmith_enter_postlock(&tls))
+		return;
+	lksmith_postlock_impl(ptr, error, 1);
+	lksmith_exit(tls);
 }
 
-static int lksmith_insert(const void *ptr, int recursive,
-		int sleeper, struct lksmith_lock **lk)
+static int lksmith_preunlock_impl(const void *ptr)
 {
-	struct lksmith_lock *ak, *bk;
-	ak = calloc(1, sizeof(*ak));
-	if (!ak) {
+	struct lksmith_tls *tls;
+	struct lksmith_shard *shard;
+	struct lksmith_lock *lk;
+	struct lksmith_held *held;
+
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_preunlock(lock=%p): failed "
+			"to allocate thread-local storage.\n", ptr);
 		return ENOMEM;
 	}
-	ak->ptr = ptr;
-	ak->props.recursive = !!recursive;
-	ak->props.sleeper = !!sleeper;
-	ak->holders = NULL;
-	bk = RB_INSERT(lock_tree, &g_tree, ak);
-	if (bk) {
-		free(ak);
-		return EEXIST;
+	if (!tls->intercept)
+		return 0;
+	if (lksmith_held_filtered(tls, ptr))
+		return 0;
+	if (g_tracing) {
+		lksmith_trace_event(tls, LKSMITH_TRACE_UNLOCK, ptr, NULL, 0, 0,
+			0);
+		return 0;
 	}
-	*lk = ak;
-	return 0;
-}
-
-static struct lksmith_lock *lksmith_find(const void *ptr)
-{
-	struct lksmith_lock exemplar;
-	memset(&exemplar, 0, sizeof(exemplar));
-	exemplar.ptr = ptr;
-	return RB_FIND(lock_tree, &g_tree, &exemplar);
-}
-
-/******************************************************************
- *  Cond functions
- *****************************************************************/
-static int lksmith_cond_compare(const struct lksmith_cond *a,
-		const struct lksmith_cond *b)
-{
-	const void *pa = a->ptr;
-	const void *pb = b->ptr;
-	if (pa < pb)
-		return -1;
-	else if (pa > pb)
-		return 1;
-	else
+	held = tls_find_held(tls, ptr);
+	if (held) {
+		/* We hold the lock, so it can't have been destroyed. */
+		if (!held->lk->props.sleeper)
+			tls->num_spins--;
 		return 0;
+	}
+	shard = lksmith_shard_of(ptr);
+	r_pthread_mutex_lock(&shard->lock);
+	lk = lksmith_find(shard, ptr);
+	if (!lk) {
+		lksmith_error_with_ti(tls, ENOENT, "lksmith_preunlock(lock=%p, "
+			"thread=%s): attempted to unlock an unknown lock.\n",
+			ptr, tls->name);
+		r_pthread_mutex_unlock(&shard->lock);
+		return ENOENT;
+	}
+	r_pthread_mutex_unlock(&shard->lock);
+	lksmith_error_with_ti(tls, EPERM, "lksmith_preunlock(lock=%p, "
+		"thread=%s): attempted to unlock a lock that this "
+		"thread does not currently hold.\n", ptr, tls->name);
+	return EPERM;
 }
 
-static struct lksmith_cond *lksmith_cond_find(const void *ptr)
+int lksmith_preunlock(const void *ptr)
 {
-	struct lksmith_cond exemplar;
-	memset(&exemplar, 0, sizeof(exemplar));
-	exemplar.ptr = ptr;
-	return RB_FIND(cond_tree, &g_cond_tree, &exemplar);
-}
+	struct lksmith_tls *tls;
+	int ret;
 
-static int lksmith_cond_insert(const void *ptr, struct lksmith_cond **cond)
-{
-	struct lksmith_cond *cnd, *and;
-	cnd = calloc(1, sizeof(*cnd));
-	if (!cnd) {
-		return ENOMEM;
-	}
-	cnd->ptr = ptr;
-	and = RB_INSERT(cond_tree, &g_cond_tree, cnd);
-	if (and) {
-		free(cnd);
-		return EEXIST;
-	}
-	*cond = cnd;
-	return 0;
+	if (!lksmith_enter(&tls))
+		return 0;
+	ret = lksmith_preunlock_impl(ptr);
+	lksmith_exit(tls);
+	return ret;
 }
 
-/******************************************************************
- *  API functions
- *****************************************************************/
-int lksmith_optional_init(const void *ptr, int recursive, int sleeper)
+static void lksmith_postunlock_impl(const void *ptr)
 {
 	struct lksmith_tls *tls;
-	struct lksmith_lock *lk;
+	struct lksmith_shard *shard;
+	struct lksmith_held held;
 	int ret;
 
 	tls = get_or_create_tls();
 	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_optional_init(lock=%p): "
-			"failed to allocate thread-local storage.\n", ptr);
-		return ENOMEM;
+		lksmith_error(ENOMEM, "lksmith_postunlock(lock=%p): failed "
+			"to allocate thread-local storage.\n", ptr);
+		return;
 	}
 	if (!tls->intercept)
-		return 0;
-	r_pthread_mutex_lock(&g_tree_lock);
-	ret = lksmith_insert(ptr, recursive, sleeper, &lk);
-	r_pthread_mutex_unlock(&g_tree_lock);
+		return;
+	if (__atomic_load_n(&g_modules, __ATOMIC_RELAXED)) {
+		if (lksmith_lock_filtered(ptr))
+			return;
+		ret = tls_find_skipped(tls, ptr);
+		if (ret >= 0) {
+			memmove(&tls->skipped[ret], &tls->skipped[ret + 1],
+				sizeof(tls->skipped[0]) *
+				(tls->num_skipped - ret - 1));
+			tls->num_skipped--;
+			return;
+		}
+	}
+	if (g_tracing)
+		return;
+	ret = tls_remove_held(tls, ptr, &held);
 	if (ret) {
-		lksmith_error(ret, "lksmith_optional_init(lock=%p, "
-			"thread=%s): failed to allocate lock data: "
-			"error %d: %s\n", ptr, tls->name, ret, terror(ret));
-		return ret;
+		lksmith_error(EIO, "lksmith_postunlock(lock=%p, "
+			"thread=%s): logic error: preunlock check told us "
+			"we had the lock, but we don't?\n", ptr, tls->name);
+		return;
 	}
-	return 0;
+	if (held.acquired && tls->prof) {
+		prof_record_release(tls->prof, ptr, held.site,
+			prof_now() - held.acquired);
+	}
+	if (held.fast) {
+		__atomic_store_n(&held.lk->fast_held,
+			held.lk->fast_held - 1, __ATOMIC_RELEASE);
+		return;
+	}
+	/* We are still a holder, so the lock can't have been destroyed.
+	 * Our held entry tells us where our holder record is. */
+	shard = lksmith_shard_of(ptr);
+	r_pthread_mutex_lock(&shard->lock);
+	if (held.shared)
+		lk_reader_remove(held.lk, tls, held.holder);
+	else if (held.holder)
+		lk_holder_remove(held.lk, tls, held.holder);
+	r_pthread_mutex_unlock(&shard->lock);
 }
 
-int lksmith_destroy(const void *ptr)
+void lksmith_postunlock(const void *ptr)
+{
+	struct lksmith_tls *tls;
+
+	if (!lksmith_enter(&tls))
+		return;
+	lksmith_postunlock_impl(ptr);
+	lksmith_exit(tls);
+}
+
+static int lksmith_prewait_impl(const void *ptr, const void *site)
 {
-	int ret;
-	struct lksmith_lock *lk, *ak;
 	struct lksmith_tls *tls;
+	int ret;
 
 	tls = get_or_create_tls();
 	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_destroy(lock=%p): failed to "
-			"allocate thread-local storage.\n", ptr);
-		ret = ENOMEM;
-		goto done;
+		lksmith_error(ENOMEM, "lksmith_prewait(lock=%p): failed "
+			"to allocate thread-local storage.\n", ptr);
+		return ENOMEM;
 	}
 	if (!tls->intercept)
 		return 0;
-	r_pthread_mutex_lock(&g_tree_lock);
-	lk = lksmith_find(ptr);
-	if (!lk) {
-		/* This might not be an error, if we used
-		 * PTHREAD_MUTEX_INITIALIZER and then never did anything else
-		 * with the lock prior to destroying it. */
-		ret = ENOENT;
-		goto done_unlock;
-	}
-	if (lk->holders != NULL) {
-		if (tls_contains_lid(tls, ptr) == 1) {
-			lksmith_error(EBUSY, "lksmith_destroy(lock=%p, "
-				"thread=%s): you must unlock this mutex "
-				"before destroying it.", ptr, tls->name);
-		} else {
-			lksmith_error(EBUSY, "lksmith_destroy(lock=%p, "
-				"thread=%s): this mutex is currently in use "
-				"and so cannot be destroyed.", ptr, tls->name);
-		}
-		ret = EBUSY;
-		goto done_unlock;
-	}
-	RB_REMOVE(lock_tree, &g_tree, lk);
-	/* TODO: could probably avoid traversing the whole tree by using both
-	 * before and after pointers inside locks, or some such? */
-	RB_FOREACH(ak, lock_tree, &g_tree) {
-		lk_remove_before(ak, lk);
-	}
-	free(lk->before);
-	free(lk);
-	ret = 0;
-done_unlock:
-	r_pthread_mutex_unlock(&g_tree_lock);
-done:
-	return ret;
+	if (g_tracing) {
+		lksmith_trace_event(tls, LKSMITH_TRACE_WAIT, ptr, site, 0, 0,
+			1);
+		return 0;
+	}
+	/* Waiting while holding nothing can't block anyone else, so most
+	 * waits stop here without touching the registry. */
+	if ((tls->num_held == 0) || tls_edges_cached(tls, ptr, 1, 0))
+		return 0;
+	/* A wait is like taking ptr and letting it go straight away.  That
+	 * adds an edge from each lock we hold to ptr, and warns about
+	 * sleeping while holding a spin lock. */
+	ret = lksmith_prelock_impl(ptr, 1, 0, site);
+	if (ret)
+		return ret;
+	lksmith_postlock_impl(ptr, 0, 0);
+	if (lksmith_preunlock_impl(ptr) == 0)
+		lksmith_postunlock_impl(ptr);
+	return 0;
 }
 
-static int lksmith_search(struct lksmith_lock *lk, const void *start)
+int lksmith_prewait(const void *ptr, const void *site)
 {
-	int ret, i;
+	struct lksmith_tls *tls;
+	int ret;
 
-	if (lk->ptr == start)
-		return 1;
-	if (lk->color == g_color)
+	if (!lksmith_enter(&tls))
 		return 0;
-	lk->color = g_color;
-	for (i = 0; i < lk->before_size; i++) {
-		ret = lksmith_search(lk->before[i], start);
-		if (ret)
-			return ret;
-	}
-	return 0;
+	ret = lksmith_prewait_impl(ptr, site);
+	lksmith_exit(tls);
+	return ret;
 }
 
-static void lksmith_prelock_process_depends(struct lksmith_tls *tls,
-			struct lksmith_lock *lk, const void *ptr)
+/**
+ * Update the lock-order graph for a semaphore we are about to post, and
+ * report any errors.
+ * Note: you must call this function with g_graph_lock held, unless
+ * LKSMITH_DEFER_EDGES is set.  You must also hold the shard lock of the
+ * semaphore, since we don't become a holder of it.
+ *
+ * A waiter which holds one of our locks would never see the post, so each
+ * lock we hold must come after the semaphore.
+ *
+ * @param tls		The thread-local storage for the current thread.
+ * @param lk		The lock data for the semaphore.
+ * @param ptr		The semaphore.
+ * @param stack		Our stack, or 0.
+ */
+static void lksmith_prepost_process_depends(struct lksmith_tls *tls,
+		struct lksmith_lock *lk, const void *ptr, uint32_t stack)
 {
 	unsigned int i;
 	const void *held;
-	struct lksmith_lock *ak;
+	struct lksmith_lock *ak, *node;
+	struct lksmith_edge_info edge;
+	uint64_t epoch;
+	char buf[4096];
+	size_t off;
+	int ret;
 
-	g_color++;
+	epoch = __atomic_load_n(&g_graph_epoch, __ATOMIC_ACQUIRE);
+	node = lk->class_node ? lk->class_node : lk;
 	for (i = 0; i < tls->num_held; i++) {
-		held = tls->held[i];
-		ak = lksmith_find(held);
-		if (!ak) {
-			lksmith_error_with_ti(tls, ENOMEM, "lksmith_prelock("
-				"lock=%p, thread=%s): thread holds unknown "
-				"lock %p.\n", ptr, tls->name, held);
+		held = tls->held[i].ptr;
+		if ((held == ptr) || tls_edge_cached(tls, ptr, held, epoch))
+			continue;
+		ak = tls->held[i].lk;
+		ak = ak->class_node ? ak->class_node : ak;
+		if (node == ak) {
+			tls_edge_insert(tls, ptr, held, epoch);
 			continue;
 		}
-		if (ak == lk) {
-			if (ak->props.recursive)
+		edge.held_stack = stack;
+		edge.stack = tls->held[i].holder ?
+			tls->held[i].holder->stack : 0;
+		if (g_defer_ms) {
+			ret = tls_log_edge(tls, node, ak, ptr, held, &edge);
+			if (ret) {
+				lksmith_error_with_ti(tls, ret, "lksmith_prepost("
+					"lock=%p, thread=%s): failed to log the "
+					"edge to lock %p: error %d: %s\n", ptr,
+					tls->name, held, ret, terror(ret));
 				continue;
-			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prelock("
-				"lock=%p, thread=%s): this thread already holds "
-				"this lock, and it is not a recursive lock.\n",
-				ptr, tls->name);
+			}
+			tls_edge_insert(tls, ptr, held, epoch);
 			continue;
 		}
-		if (lksmith_search(ak, ptr)) {
-			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prelock("
-				"lock=%p, thread=%s): lock inversion!  This "
-				"lock should have been taken before lock %p, "
-				"which this thread already holds.\n",
-				ptr, tls->name, held);
+		if (lk_has_before(ak, node)) {
+			tls_edge_insert(tls, ptr, held, epoch);
 			continue;
 		}
-		lk_add_before(lk, ak);
-	}
-}
-
-/**
- * Returns true if lksmith_prelock should skip dependency processing.
- *
- * We search the current backtrace for any element that is in the ignore
- * list.
- */
-static int should_skip_dependency_processing(struct lksmith_holder *holder)
-{
-	int bt_idx, ip_idx;
-	char *match;
-
-	for (bt_idx = 0; bt_idx < holder->bt_len; bt_idx++) {
-		const char *frame = holder->bt_frames[bt_idx];
-		match = bsearch(&frame, g_ignored_frames, g_num_ignored_frames,
-				sizeof(char*), compare_strings);
-		if (match) {
-			return 1;
-		}
-		for (ip_idx = 0; ip_idx < g_num_ignored_frame_patterns;
-			     ip_idx++) {
-			if (!fnmatch(g_ignored_frame_patterns[ip_idx],
-				     frame, 0)) {
-				return 1;
-			}
+		ret = graph_add_edge(node, ak, &edge);
+		if (ret == EDEADLK) {
+			off = 0;
+			graph_path_dump(buf, &off, sizeof(buf));
+			fwdprintf(buf, &off, sizeof(buf), "This thread is "
+				"posting while holding lock %p here:\n", held);
+			lksmith_error_with_ti(tls, EDEADLK, "lksmith_prepost("
+				"lock=%p, thread=%s): lock inversion!  This "
+				"thread holds lock %p while posting, but a "
+				"thread has waited for this post while holding "
+				"that lock, or one taken after it.\n%s",
+				ptr, tls->name, held, buf);
+			continue;
+		} else if (ret) {
+			lksmith_error_with_ti(tls, ret, "lksmith_prepost("
+				"lock=%p, thread=%s): failed to add lock %p "
+				"to the lock-order graph: error %d: %s\n",
+				ptr, tls->name, held, ret, terror(ret));
+			continue;
 		}
+		tls_edge_insert(tls, ptr, held, epoch);
 	}
-	return 0;
 }
 
-int lksmith_prelock(const void *ptr, int sleeper)
+static int lksmith_prepost_impl(const void *ptr, const void *site)
 {
-	struct lksmith_lock *lk;
 	struct lksmith_tls *tls;
-	int ret;
-	struct lksmith_holder *holder = NULL;
+	struct lksmith_shard *shard;
+	struct lksmith_lock *lk;
+	uint32_t stack = 0;
+	int ret, nframes, created = 0;
 
 	tls = get_or_create_tls();
 	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_prelock(lock=%p): failed to "
-			"allocate thread-local storage.\n", ptr);
-		ret = ENOMEM;
-		goto done;
+		lksmith_error(ENOMEM, "lksmith_prepost(lock=%p): failed "
+			"to allocate thread-local storage.\n", ptr);
+		return ENOMEM;
 	}
 	if (!tls->intercept)
 		return 0;
-	holder = holder_create(tls);
-	if (!holder) {
-		lksmith_error(ENOMEM, "lksmith_prelock(lock=%p): failed to "
-			"allocate lock holder data.\n", ptr);
-		ret = ENOMEM;
-		goto done;
+	if (lksmith_filtered(ptr, site))
+		return 0;
+	if (g_tracing) {
+		lksmith_trace_event(tls, LKSMITH_TRACE_POST, ptr, site, 0, 0,
+			1);
+		return 0;
+	}
+	/* Nearly every post is made holding nothing, or adds edges we have
+	 * already checked.  Those don't take any locks at all. */
+	if ((tls->num_held == 0) || tls_posts_cached(tls, ptr))
+		return 0;
+	tls->backtrace_scratch_frames = -1;
+	if (should_skip_dependency_processing(tls, NULL))
+		return 0;
+	if (g_bt_mode != LKSMITH_BT_NEVER) {
+		nframes = tls_capture_backtrace(tls);
+		if (nframes > 0)
+			stack = depot_put(tls->backtrace_scratch, nframes, NULL);
 	}
-	r_pthread_mutex_lock(&g_tree_lock);
-	lk = lksmith_find(ptr);
+	if (!g_defer_ms)
+		r_pthread_mutex_lock(&g_graph_lock);
+	shard = lksmith_shard_of(ptr);
+	r_pthread_mutex_lock(&shard->lock);
+	lk = lksmith_find(shard, ptr);
 	if (!lk) {
-		/* If the lock hasn't been explicitly initialized using
-		 * lksmith_optional_init, we allow it to be recursive.
-		 * It might have been statically initialized with
-		 * PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP.
-		 */
-		ret = lksmith_insert(ptr, 1, sleeper, &lk);
+		ret = lksmith_insert(shard, tls, ptr, 1, 1, &lk);
 		if (ret) {
-			lksmith_error(ret, "lksmith_prelock(lock=%p, "
+			r_pthread_mutex_unlock(&shard->lock);
+			if (!g_defer_ms)
+				r_pthread_mutex_unlock(&g_graph_lock);
+			lksmith_error(ret, "lksmith_prepost(lock=%p, "
 				"thread=%s): failed to allocate lock data: "
-				"error %d: %s\n", ptr, tls->name, ret, terror(ret));
-			goto done_unlock;
+				"error %d: %s\n", ptr, tls->name, ret,
+				terror(ret));
+			return ret;
 		}
+		created = 1;
 	}
-	if (!should_skip_dependency_processing(holder)) {
-		lksmith_prelock_process_depends(tls, lk, ptr);
-	}
-	lk_holder_add(lk, holder);
-
-	holder = NULL;
-	ret = 0;
-done_unlock:
-	r_pthread_mutex_unlock(&g_tree_lock);
-done:
-	if (holder) {
-		holder_free(holder);
-	}
-	return ret;
+	lk->referenced = 1;
+	lksmith_prepost_process_depends(tls, lk, ptr, stack);
+	r_pthread_mutex_unlock(&shard->lock);
+	if (!g_defer_ms)
+		r_pthread_mutex_unlock(&g_graph_lock);
+	if (created && lksmith_over_limit())
+		lksmith_evict(tls);
+	return 0;
 }
 
-void lksmith_postlock(const void *ptr, int error)
+int lksmith_prepost(const void *ptr, const void *site)
 {
 	struct lksmith_tls *tls;
-	struct lksmith_lock *lk;
 	int ret;
 
-	tls = get_or_create_tls();
-	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_postlock(lock=%p): failed "
-			"to allocate thread-local storage.\n", ptr);
-		goto done;
-	}
-	if (!tls->intercept)
-		return;
-	r_pthread_mutex_lock(&g_tree_lock);
-	lk = lksmith_find(ptr);
-	if (!lk) {
-		lksmith_error(EIO, "lksmith_postlock(lock=%p, thread=%s): "
-			"logic error: prelock didn't create the lock data?\n",
-			ptr, tls->name);
-		goto done_unlock;
-	}
-	if (error) {
-		lk_holder_remove(lk, tls);
-		goto done_unlock;
-	}
-	if (lk->props.nlock < MAX_NLOCK) {
-		lk->props.nlock++;
-	}
-	ret = tls_append_held(tls, ptr);
-	if (ret) {
-		lksmith_error(ENOMEM, "lksmith_postlock(lock=%p, "
-			"thread=%s): failed to allocate space to store "
-			"another thread id.\n", ptr, tls->name);
-		goto done_unlock;
-	}
-	if (!lk->props.sleeper) {
-		tls->num_spins++;
-	} else if ((tls->num_spins > 0) && (!lk->props.spin_warn)) {
-		lksmith_error_with_ti(tls, EWOULDBLOCK, "lksmith_postlock("
-			"lock=%p, thread=%s): performance problem: you are "
-			"taking a sleeping lock while holding a spin lock.\n",
-			ptr, tls->name);
-		lk->props.spin_warn = 1;
-	}
-done_unlock:
-	r_pthread_mutex_unlock(&g_tree_lock);
-done:
-	return;
+	if (!lksmith_enter(&tls))
+		return 0;
+	ret = lksmith_prepost_impl(ptr, site);
+	lksmith_exit(tls);
+	return ret;
 }
 
-int lksmith_preunlock(const void *ptr)
+static int lksmith_barrier_wait_impl(const void *ptr, const void *site)
 {
 	struct lksmith_tls *tls;
-	struct lksmith_lock *lk;
-	int sleeper;
+	unsigned int i;
+	uint64_t epoch;
+	const void *held;
 
 	tls = get_or_create_tls();
 	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_preunlock(lock=%p): failed "
-			"to allocate thread-local storage.\n", ptr);
+		lksmith_error(ENOMEM, "lksmith_barrier_wait(barrier=%p): "
+			"failed to allocate thread-local storage.\n", ptr);
 		return ENOMEM;
 	}
 	if (!tls->intercept)
 		return 0;
-	r_pthread_mutex_lock(&g_tree_lock);
-	lk = lksmith_find(ptr);
-	if (!lk) {
-		lksmith_error_with_ti(tls, ENOENT, "lksmith_preunlock(lock=%p, "
-			"thread=%s): attempted to unlock an unknown lock.\n",
-			ptr, tls->name);
-		r_pthread_mutex_unlock(&g_tree_lock);
-		return ENOENT;
-	}
-	sleeper = lk->props.sleeper;
-	r_pthread_mutex_unlock(&g_tree_lock);
-	if (tls_contains_lid(tls, ptr) == 0) {
-		lksmith_error_with_ti(tls, EPERM, "lksmith_preunlock(lock=%p, "
-			"thread=%s): attempted to unlock a lock that this "
-			"thread does not currently hold.\n", ptr, tls->name);
-		return EPERM;
+	if (tls->num_held == 0)
+		return 0;
+	if (lksmith_filtered(ptr, site))
+		return 0;
+	if (g_tracing) {
+		lksmith_trace_event(tls, LKSMITH_TRACE_BARRIER, ptr, site,
+			0, 0, 1);
+		return 0;
 	}
-	if (!sleeper) {
-		tls->num_spins--;
+	/* A barrier has no order of its own to check: any lock held while
+	 * waiting at it is a problem, so we report each one directly.  The
+	 * edge cache keeps us from reporting the same pair over and over. */
+	epoch = __atomic_load_n(&g_graph_epoch, __ATOMIC_ACQUIRE);
+	for (i = 0; i < tls->num_held; i++) {
+		held = tls->held[i].ptr;
+		if (tls_edge_cached(tls, held, ptr, epoch))
+			continue;
+		tls_edge_insert(tls, held, ptr, epoch);
+		lksmith_error_with_ti(tls, EDEADLK, "lksmith_barrier_wait("
+			"barrier=%p, thread=%s): waiting at a barrier while "
+			"holding lock %p.  A thread which takes that lock "
+			"before arriving at the barrier will never get "
+			"there.\n", ptr, tls->name, held);
 	}
 	return 0;
 }
 
-void lksmith_postunlock(const void *ptr)
+int lksmith_barrier_wait(const void *ptr, const void *site)
 {
 	struct lksmith_tls *tls;
+	int ret;
+
+	if (!lksmith_enter(&tls))
+		return 0;
+	ret = lksmith_barrier_wait_impl(ptr, site);
+	lksmith_exit(tls);
+	return ret;
+}
+
+/**
+ * Get the slot of a pthread_once control in g_once_done.
+ *
+ * @param ptr		pointer to the once control
+ *
+ * @return		The slot.
+ */
+static const void **lksmith_once_slot(const void *ptr)
+{
+	return &g_once_done[ptr_hash(ptr) & (LKSMITH_ONCE_CACHE_SIZE - 1)];
+}
+
+static int lksmith_once_done_impl(const void *ptr)
+{
+	struct lksmith_shard *shard;
 	struct lksmith_lock *lk;
+	const void **slot = lksmith_once_slot(ptr);
+	int done;
+
+	if (__atomic_load_n(slot, __ATOMIC_RELAXED) == ptr)
+		return 1;
+	/* When tracing, there are no records; the cache is all we have. */
+	if (g_tracing)
+		return 0;
+	shard = lksmith_shard_of(ptr);
+	r_pthread_mutex_lock(&shard->lock);
+	lk = lksmith_find(shard, ptr);
+	done = lk && lk->props.once_done;
+	r_pthread_mutex_unlock(&shard->lock);
+	if (done)
+		__atomic_store_n(slot, ptr, __ATOMIC_RELAXED);
+	return done;
+}
+
+int lksmith_once_done(const void *ptr)
+{
+	struct lksmith_tls *tls;
 	int ret;
 
-	tls = get_or_create_tls();
-	if (!tls) {
-		lksmith_error(ENOMEM, "lksmith_postunlock(lock=%p): failed "
-			"to allocate thread-local storage.\n", ptr);
-		return;
-	}
-	if (!tls->intercept)
-		return;
-	ret = tls_remove_held(tls, ptr);
-	if (ret) {
-		lksmith_error(EIO, "lksmith_postunlock(lock=%p, "
-			"thread=%s): logic error: preunlock check told us "
-			"we had the lock, but we don't?\n", ptr, tls->name);
-		return;
+	if (!lksmith_enter(&tls))
+		return 0;
+	ret = (tls && tls->intercept) ? lksmith_once_done_impl(ptr) : 0;
+	lksmith_exit(tls);
+	return ret;
+}
+
+static void lksmith_once_finish_impl(const void *ptr)
+{
+	struct lksmith_shard *shard;
+	struct lksmith_lock *lk;
+
+	if (!g_tracing) {
+		shard = lksmith_shard_of(ptr);
+		r_pthread_mutex_lock(&shard->lock);
+		lk = lksmith_find(shard, ptr);
+		if (lk)
+			lk->props.once_done = 1;
+		r_pthread_mutex_unlock(&shard->lock);
 	}
-	r_pthread_mutex_lock(&g_tree_lock);
-	lk = lksmith_find(ptr);
-	if (!lk) {
-		lksmith_error_with_ti(tls, EIO, "lksmith_preunlock(lock=%p, "
-			"thread=%s): logic error: attempted to unlock an "
-			"unknown lock.\n", ptr, tls->name);
-		r_pthread_mutex_unlock(&g_tree_lock);
+	__atomic_store_n(lksmith_once_slot(ptr), ptr, __ATOMIC_RELAXED);
+}
+
+void lksmith_once_finish(const void *ptr)
+{
+	struct lksmith_tls *tls;
+
+	if (!lksmith_enter(&tls))
 		return;
-	}
-	ret = lk_holder_remove(lk, tls);
-	if (ret) {
-		lksmith_error(EIO, "lksmith_preunlock(lock=%p, thread=%s): "
-			"logic error: failed to find backtrace for this "
-			"thread in the list of stored backtraces for this "
-			"lock (error %d).\n", ptr, tls->name, ret);
-		r_pthread_mutex_unlock(&g_tree_lock);
+	if (tls && tls->intercept)
+		lksmith_once_finish_impl(ptr);
+	lksmith_exit(tls);
+}
+
+void lksmith_flush_edges(void)
+{
+	if (!g_defer_ms)
 		return;
-	}
-	r_pthread_mutex_unlock(&g_tree_lock);
+	lksmith_merge_edges();
+}
+
+int lksmith_get_stats(struct lksmith_stats *stats, size_t stats_len)
+{
+	struct lksmith_stats st;
+
+	if (!stats)
+		return EINVAL;
+	/* Make sure we are initialized. */
+	if (!get_or_create_tls())
+		return ENOMEM;
+	lksmith_collect_stats(&st);
+	if (stats_len > sizeof(st))
+		memset(stats, 0, stats_len);
+	memcpy(stats, &st, (stats_len < sizeof(st)) ? stats_len : sizeof(st));
+	return 0;
+}
+
+void lksmith_profile_dump(void)
+{
+	prof_dump(g_prof_top ? g_prof_top : LKSMITH_PROFILE_DEFAULT_TOP);
 }
 
 int lksmith_check_locked(const void *ptr)
@@ -1253,69 +5520,119 @@ int lksmith_check_locked(const void *ptr)
 			"to allocate thread-local storage.\n", ptr);
 		return ENOMEM;
 	}
-	if (!tls->intercept)
+	/* When tracing, we don't know what we hold. */
+	if ((!tls->intercept) || g_tracing)
+		return 0;
+	if (lksmith_held_filtered(tls, ptr))
 		return 0;
 	return tls_contains_lid(tls, ptr) ? 0 : -1;
 }
 
-int lksmith_cond_prewait(const void *cond, const void *mutex,
+static int lksmith_cond_prewait_impl(const void *cond, const void *mutex,
 			struct lksmith_cond **out)
 {
+	struct lksmith_tls *tls;
+	struct lksmith_held *held;
 	struct lksmith_cond *cnd;
+	struct lksmith_lock *other;
+	uint64_t state, nstate;
+	uint32_t id;
 	int ret;
 
-	r_pthread_mutex_lock(&g_cond_tree_lock);
-	cnd = lksmith_cond_find(cond);
-	if (!cnd) {
-		ret = lksmith_cond_insert(cond, &cnd);
-		if (ret) {
-			r_pthread_mutex_unlock(&g_cond_tree_lock);
-			lksmith_error(ret, "lksmith_cond_insert(cond=%p,"
-				"mutex=%p): failed ", cond, mutex);
-			return ret;
-		}
+	*out = NULL;
+	tls = get_or_create_tls();
+	if (!tls) {
+		lksmith_error(ENOMEM, "lksmith_cond_prewait(cond=%p, "
+			"mutex=%p): failed to allocate thread-local storage.\n",
+			cond, mutex);
+		return ENOMEM;
 	}
-	if (!cnd->lock) {
-		cnd->lock = mutex;
-	} else if (cnd->lock != mutex) {
-		r_pthread_mutex_unlock(&g_cond_tree_lock);
-		ret = EINVAL;
-		lksmith_error_with_ti(NULL, ret, "lksmith_cond_prewait(cond=%p,"
-		      "mutex=%p): you are currently waiting (or are about "
-		      "to wait) on this condition variable with a different "
-		      "lock, %p.", cond, mutex, cnd->lock);
+	/* When tracing, we don't know what we hold, and so we don't know
+	 * which lock record the mutex has. */
+	if ((!tls->intercept) || g_tracing)
+		return 0;
+	held = tls_find_held(tls, mutex);
+	if (!held)
+		return 0;
+	/* We hold the mutex, so its ID can't change. */
+	id = held->lk->id;
+	ret = lksmith_cond_get(cond, &cnd);
+	if (ret) {
+		lksmith_error(ret, "lksmith_cond_prewait(cond=%p, "
+			"mutex=%p): failed to allocate condition variable "
+			"data.\n", cond, mutex);
 		return ret;
 	}
-	cnd->refcnt++;
+	state = __atomic_load_n(&cnd->state, __ATOMIC_RELAXED);
+	do {
+		if ((state != 0) && ((state >> 32) != id)) {
+			/* The other waiters are still lock holders, so the
+			 * record stays mapped even if it has just been
+			 * freed.  We only want its pointer for the message. */
+			other = lk_of(state >> 32);
+			ret = EINVAL;
+			lksmith_error_with_ti(tls, ret, "lksmith_cond_prewait("
+				"cond=%p, mutex=%p): you are currently waiting "
+				"(or are about to wait) on this condition "
+				"variable with a different lock, %p.", cond,
+				mutex, other ? other->ptr : NULL);
+			return ret;
+		}
+		nstate = (((uint64_t)id) << 32) | ((state & 0xffffffff) + 1);
+	} while (!__atomic_compare_exchange_n(&cnd->state, &state, nstate, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 	*out = cnd;
-	r_pthread_mutex_unlock(&g_cond_tree_lock);
 	return 0;
 }
 
-void lksmith_cond_postwait(struct lksmith_cond *cnd)
+int lksmith_cond_prewait(const void *cond, const void *mutex,
+			struct lksmith_cond **out)
 {
-	r_pthread_mutex_lock(&g_cond_tree_lock);
-	if (--cnd->refcnt == 0) {
-		cnd->lock = NULL;
+	struct lksmith_tls *tls;
+	int ret;
+
+	if (!lksmith_enter(&tls)) {
+		*out = NULL;
+		return 0;
 	}
-	r_pthread_mutex_unlock(&g_cond_tree_lock);
+	ret = lksmith_cond_prewait_impl(cond, mutex, out);
+	lksmith_exit(tls);
+	return ret;
 }
 
-int lksmith_cond_predestroy(const void *cond)
+static void lksmith_cond_postwait_impl(struct lksmith_cond *cnd)
+{
+	uint64_t state, nstate;
+
+	if (!cnd)
+		return;
+	state = __atomic_load_n(&cnd->state, __ATOMIC_RELAXED);
+	do {
+		/* The last waiter unbinds the mutex. */
+		nstate = ((state & 0xffffffff) == 1) ? 0 : (state - 1);
+	} while (!__atomic_compare_exchange_n(&cnd->state, &state, nstate, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+}
+
+void lksmith_cond_postwait(struct lksmith_cond *cnd)
+{
+	struct lksmith_tls *tls;
+
+	if (!lksmith_enter(&tls))
+		return;
+	lksmith_cond_postwait_impl(cnd);
+	lksmith_exit(tls);
+}
+
+static int lksmith_cond_predestroy_impl(const void *cond)
 {
 	struct lksmith_cond *cnd;
-	uint64_t refcnt;
+	uint64_t state;
 	int ret;
 
-	r_pthread_mutex_lock(&g_cond_tree_lock);
 	cnd = lksmith_cond_find(cond);
-	if (cnd) {
-		refcnt = cnd->refcnt;
-	} else {
-		refcnt = 0;
-	}
-	r_pthread_mutex_unlock(&g_cond_tree_lock);
-	if (refcnt != 0) {
+	state = cnd ? __atomic_load_n(&cnd->state, __ATOMIC_ACQUIRE) : 0;
+	if (state != 0) {
 		ret = EINVAL;
 		lksmith_error_with_ti(NULL, ret, "lksmith_cond_predestroy(cond=%p): "
 			"you are trying to destroy a condition variable "
@@ -1325,6 +5642,18 @@ int lksmith_cond_predestroy(const void *cond)
 	return 0;
 }
 
+int lksmith_cond_predestroy(const void *cond)
+{
+	struct lksmith_tls *tls;
+	int ret;
+
+	if (!lksmith_enter(&tls))
+		return 0;
+	ret = lksmith_cond_predestroy_impl(cond);
+	lksmith_exit(tls);
+	return ret;
+}
+
 int lksmith_set_thread_name(const char *const name)
 {
 	struct lksmith_tls *tls = get_or_create_tls();
@@ -1335,7 +5664,7 @@ int lksmith_set_thread_name(const char *const name)
 		return ENOMEM;
 	}
 	snprintf(tls->name, LKSMITH_THREAD_NAME_MAX, "%s", name);
-	return 0;
+	return thread_registry_set(tls->tid, tls->name);
 }
 
 const char* lksmith_get_thread_name(void)
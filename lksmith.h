@@ -94,10 +94,44 @@ int init_tls(void);
  * @param ptr		pointer to the lock to initialize
  * @param recursive	1 to allow recursive locks; 0 otherwise
  * @param sleeper	1 if this lock is a sleeper; 0 otherwise
+ * @param site		the return address of the pthreads init call, or
+ *			NULL.  If LKSMITH_CLASS_BY_SITE is set, all the locks
+ *			initialized at a site share one node in the
+ *			lock-order graph.
  *
  * @return		0 on success; error code otherwise
  */
-int lksmith_optional_init(const void *ptr, int recursive, int sleeper);
+int lksmith_optional_init(const void *ptr, int recursive, int sleeper,
+		const void *site);
+
+/**
+ * Declare the class and level of a lock.
+ *
+ * Many programs have a lock hierarchy which is known in advance: for
+ * example, connection locks are always taken before session locks, which are
+ * always taken before the global table lock.  Locks with a class are checked
+ * against the hierarchy rather than the lock-order graph: while holding a
+ * lock with a class, a thread may only take locks with a class that have a
+ * higher level.  Taking a lock with the same or a lower level is reported as
+ * a deadlock, even if it is another lock of the same class.
+ *
+ * All the locks of a class are a single node in the lock-order graph, which
+ * is used to check their ordering against locks without a class.
+ *
+ * If Locksmith doesn't know about the lock yet, it is treated as if it had
+ * been statically initialized.
+ *
+ * @param ptr		pointer to the lock
+ * @param class_id	The class.  Must not be 0.
+ * @param level		The level of the class.  Every lock of a class must
+ *			have the same level.
+ *
+ * @return		0 on success; EINVAL if the class ID is 0 or the class
+ *			has a different level; EBUSY if the lock is held;
+ *			ENOMEM if we ran out of memory.
+ */
+int lksmith_set_lock_class(const void *ptr, uint32_t class_id,
+		uint32_t level);
 
 /**
  * Destroy a lock.
@@ -121,12 +155,14 @@ void lksmith_postdestroy(const void *ptr);
  *
  * @param ptr		pointer to the lock
  * @param sleeper	1 if this lock is a sleeper; 0 otherwise
+ * @param site		the return address of the pthreads call, which
+ *			identifies the call site in the lock profile
  *
  * @return		0 if we should continue with the lock; error code
  *			otherwise.  We may print an error even if 0 is
  *			returned.
  */
-int lksmith_prelock(const void *ptr, int sleeper);
+int lksmith_prelock(const void *ptr, int sleeper, const void *site);
 
 /**
  * Take a lock.
@@ -135,6 +171,126 @@ int lksmith_prelock(const void *ptr, int sleeper);
  */
 void lksmith_postlock(const void *ptr, int error);
 
+/**
+ * Perform some error checking before taking a lock shared, as a read lock on
+ * a rwlock is.
+ *
+ * Taking a lock shared while holding another lock shared is never treated as
+ * a lock ordering problem.
+ *
+ * @param ptr		pointer to the lock
+ * @param site		the return address of the pthreads call, which
+ *			identifies the call site in the lock profile
+ *
+ * @return		0 if we should continue with the lock; error code
+ *			otherwise.  We may print an error even if 0 is
+ *			returned.
+ */
+int lksmith_prerdlock(const void *ptr, const void *site);
+
+/**
+ * Take a lock shared.
+ *
+ * @param ptr		pointer to the lock.
+ * @param error		the error code returned by the lock function.
+ */
+void lksmith_postrdlock(const void *ptr, int error);
+
+/**
+ * Locksmith statistics.
+ *
+ * New fields are only ever added at the end.
+ */
+struct lksmith_stats {
+	/** Number of threads which are running */
+	uint64_t threads;
+	/** Number of locks being tracked */
+	uint64_t locks;
+	/** Number of edges in the lock-order graph */
+	uint64_t edges;
+	/** Number of lock acquisitions */
+	uint64_t acquisitions;
+	/** Number of lock acquisitions that took the fast path for locks
+	 * which only one thread has ever taken */
+	uint64_t fast_acquisitions;
+	/** Number of backtraces captured */
+	uint64_t backtraces;
+	/** Number of acquisitions whose ordering checks were skipped
+	 * because of the ignore lists */
+	uint64_t ignored;
+	/** Number of locks visited while searching the lock-order graph */
+	uint64_t search_steps;
+	/** Number of locks evicted to stay under LKSMITH_MAX_LOCKS or
+	 * LKSMITH_MAX_MEMORY */
+	uint64_t evictions;
+	/** Bytes used by lock data and lock-order graph edges; this is what
+	 * LKSMITH_MAX_MEMORY limits */
+	uint64_t lock_bytes;
+	/** Bytes of lock, lock holder, and condition variable records that
+	 * have been allocated, including free ones */
+	uint64_t pool_bytes;
+	/** Number of lock inversions and self-deadlocks reported */
+	uint64_t deadlock_errors;
+	/** Number of unlocks of locks which weren't held */
+	uint64_t unlock_errors;
+	/** Number of attempts to destroy a lock which was in use */
+	uint64_t busy_errors;
+	/** Number of performance warnings, such as taking a sleeping lock
+	 * while holding a spin lock */
+	uint64_t perf_warnings;
+	/** Number of errors and warnings of any kind */
+	uint64_t total_errors;
+	/** Number of distinct stacks in the stack depot */
+	uint64_t stacks;
+	/** Bytes used by the stack depot */
+	uint64_t stack_bytes;
+	/** Number of acquisitions which weren't tracked at all, because of
+	 * LKSMITH_IGNORED_MODULES or LKSMITH_TRACKED_MODULES */
+	uint64_t filtered;
+};
+
+/**
+ * Get Locksmith's statistics.
+ *
+ * Each thread keeps its own counters, which are added up here, so keeping
+ * statistics doesn't slow down locking.
+ *
+ * @param stats		(out param) the statistics
+ * @param stats_len	sizeof(struct lksmith_stats).  Programs built
+ *			against an older Locksmith get the fields they know
+ *			about; newer ones get zeroes for the fields they
+ *			know about but this Locksmith doesn't.
+ *
+ * @return		0 on success; error code otherwise
+ */
+int lksmith_get_stats(struct lksmith_stats *stats, size_t stats_len);
+
+/**
+ * Print out Locksmith's statistics through the error reporting mechanism.
+ *
+ * This also happens when the process exits if LKSMITH_DUMP_STATS is set, and
+ * when signal number LKSMITH_STATS_SIGNAL is received, if that is set.
+ */
+void lksmith_dump_stats(void);
+
+/**
+ * Merge the lock-order edges which threads have seen into the lock-order
+ * graph now, and report any inversions among them.
+ *
+ * This only does anything if LKSMITH_DEFER_EDGES is set.  Otherwise, edges
+ * are merged as they are seen.  It also happens every LKSMITH_DEFER_EDGES
+ * milliseconds, and when the process exits.
+ */
+void lksmith_flush_edges(void);
+
+/**
+ * Report the most contended locks in the lock profile.
+ *
+ * Locks are only profiled if LKSMITH_PROFILE is set.  It gives the number of
+ * locks to report.  The profile is also reported when the process exits.
+ */
+void lksmith_profile_dump(void);
+
 /**
  * Determine if it's safe to release a lock.
  *
@@ -151,6 +307,75 @@ int lksmith_preunlock(const void *ptr);
  */
 void lksmith_postunlock(const void *ptr);
 
+/**
+ * Perform some error checking before waiting on a semaphore.
+ *
+ * Waiting is treated like taking the semaphore and releasing it again, so
+ * each lock we hold is ordered before it.  Nothing is checked if we hold no
+ * locks.
+ *
+ * @param ptr		pointer to the semaphore
+ * @param site		the return address of the pthreads call
+ *
+ * @return		0 if we should continue with the wait; error code
+ *			otherwise.  We may print an error even if 0 is
+ *			returned.
+ */
+int lksmith_prewait(const void *ptr, const void *site);
+
+/**
+ * Perform some error checking before posting a semaphore.
+ *
+ * A thread waiting for the post while holding one of our locks would never
+ * see it, so the semaphore is ordered before each lock we hold.  Nothing is
+ * checked if we hold no locks.
+ *
+ * @param ptr		pointer to the semaphore
+ * @param site		the return address of the pthreads call
+ *
+ * @return		0 if we should continue with the post; error code
+ *			otherwise.  We may print an error even if 0 is
+ *			returned.
+ */
+int lksmith_prepost(const void *ptr, const void *site);
+
+/**
+ * Perform some error checking before waiting at a barrier.
+ *
+ * Every thread must arrive before any of them can leave, so a thread which
+ * needs one of our locks to get there would never arrive.  Each lock we hold
+ * is reported.
+ *
+ * @param ptr		pointer to the barrier
+ * @param site		the return address of the pthreads call
+ *
+ * @return		0 if we should continue with the wait; error code
+ *			otherwise.  We may print an error even if 0 is
+ *			returned.
+ */
+int lksmith_barrier_wait(const void *ptr, const void *site);
+
+/**
+ * Determine if a pthread_once control's init routine has finished.
+ *
+ * Once it has, pthread_once never waits again, so there is nothing left to
+ * check.  The control's record is kept, along with the lock orderings it
+ * took part in.
+ *
+ * @param ptr		pointer to the once control
+ *
+ * @return		1 if lksmith_once_finish has been called for the
+ *			control; 0 otherwise.
+ */
+int lksmith_once_done(const void *ptr);
+
+/**
+ * Note that a pthread_once control's init routine has finished.
+ *
+ * @param ptr		pointer to the once control
+ */
+void lksmith_once_finish(const void *ptr);
+
 /**
  * Check if the current thread holds the given lock.
  *
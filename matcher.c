@@ -0,0 +1,421 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "matcher.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The matcher is a nondeterministic automaton which we simulate with bitsets.
+ *
+ * Each token of each pattern gets a position: a literal character, a '?',
+ * a bracket expression, or a run of '*'s.  There is one more position at
+ * the end of each pattern, which means "the whole pattern has matched."  A
+ * set bit means "we could be about to match the token at this position."
+ * After each character of the input, every active position whose token
+ * matches the character moves forward by one, and every active '*' both
+ * stays put and lets the position after it become active.  Since all
+ * patterns are laid out one after another, one shift of the bitset advances
+ * all of them at once.
+ *
+ * Character classes like [:alpha:] depend on the locale, so patterns which
+ * use them (or which we otherwise don't understand) are left to fnmatch.
+ */
+
+#define MATCHER_WORD_BITS 64
+
+struct matcher_token {
+	/** 1 if this token is a '*' */
+	int star;
+	/** The bytes this token matches, if it isn't a '*' */
+	uint64_t set[256 / MATCHER_WORD_BITS];
+};
+
+struct matcher_tokens {
+	struct matcher_token *arr;
+	size_t len;
+	size_t cap;
+};
+
+struct lksmith_matcher {
+	/** Number of 64-bit words in a set of positions */
+	size_t num_words;
+	/** For each byte value, the positions whose token matches that
+	 * byte.  256 * num_words words. */
+	uint64_t *char_mask;
+	/** Positions whose token is a '*' */
+	uint64_t *star;
+	/** Positions at the end of a pattern */
+	uint64_t *accept;
+	/** The positions which are active before we have seen any input */
+	uint64_t *start;
+	/** Patterns we match with fnmatch instead */
+	char **fallback;
+	/** Number of fallback patterns */
+	int num_fallback;
+};
+
+static void set_add(uint64_t *set, unsigned int b)
+{
+	set[b / MATCHER_WORD_BITS] |= 1ULL << (b % MATCHER_WORD_BITS);
+}
+
+static int set_contains(const uint64_t *set, unsigned int b)
+{
+	return !!(set[b / MATCHER_WORD_BITS] & (1ULL << (b % MATCHER_WORD_BITS)));
+}
+
+static struct matcher_token *tokens_push(struct matcher_tokens *toks)
+{
+	size_t ncap;
+	struct matcher_token *narr;
+
+	if (toks->len == toks->cap) {
+		ncap = toks->cap ? (toks->cap * 2) : 32;
+		narr = realloc(toks->arr, sizeof(struct matcher_token) * ncap);
+		if (!narr)
+			return NULL;
+		toks->arr = narr;
+		toks->cap = ncap;
+	}
+	memset(&toks->arr[toks->len], 0, sizeof(struct matcher_token));
+	return &toks->arr[toks->len++];
+}
+
+/**
+ * Parse a literal string into tokens.
+ *
+ * @param str		The string.
+ * @param toks		(inout) the tokens.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int parse_literal(const char *str, struct matcher_tokens *toks)
+{
+	struct matcher_token *tok;
+
+	for (; *str; str++) {
+		tok = tokens_push(toks);
+		if (!tok)
+			return ENOMEM;
+		set_add(tok->set, (unsigned char)*str);
+	}
+	return 0;
+}
+
+/**
+ * Parse a bracket expression.
+ *
+ * @param pat		(inout) pointer to the character after the '['.  On
+ *			success, it is advanced past the closing ']'.
+ * @param set		(out param) the set of bytes the expression matches.
+ *
+ * @return		0 on success; EINVAL if we can't handle this
+ *			expression.
+ */
+static int parse_bracket(const char **pat, uint64_t *set)
+{
+	const char *p = *pat;
+	int neg = 0, first = 1;
+	unsigned int lo, hi, b, i;
+
+	if ((*p == '!') || (*p == '^')) {
+		neg = 1;
+		p++;
+	}
+	while (1) {
+		if (*p == '\0')
+			return EINVAL;
+		if ((*p == ']') && (!first))
+			break;
+		first = 0;
+		if ((p[0] == '[') && ((p[1] == ':') || (p[1] == '=') ||
+				(p[1] == '.')))
+			return EINVAL;
+		if (*p == '\\') {
+			p++;
+			if (*p == '\0')
+				return EINVAL;
+		}
+		lo = (unsigned char)*p++;
+		hi = lo;
+		if ((p[0] == '-') && (p[1] != ']') && (p[1] != '\0')) {
+			p++;
+			if ((*p == '[') || (*p == '\\'))
+				return EINVAL;
+			hi = (unsigned char)*p++;
+			if (hi < lo)
+				return EINVAL;
+		}
+		for (b = lo; b <= hi; b++) {
+			set_add(set, b);
+		}
+	}
+	*pat = p + 1;
+	if (neg) {
+		for (i = 0; i < 256 / MATCHER_WORD_BITS; i++) {
+			set[i] = ~set[i];
+		}
+	}
+	/* The terminating NUL never matches anything. */
+	set[0] &= ~1ULL;
+	return 0;
+}
+
+/**
+ * Parse a glob pattern into tokens.
+ *
+ * @param pat		The pattern.
+ * @param toks		(inout) the tokens.  On error, toks->len may have
+ *			changed.
+ *
+ * @return		0 on success; EINVAL if we can't handle this pattern;
+ *			ENOMEM if we ran out of memory.
+ */
+static int parse_glob(const char *pat, struct matcher_tokens *toks)
+{
+	struct matcher_token *tok;
+	size_t start = toks->len;
+	int ret;
+
+	while (*pat) {
+		if ((*pat == '*') && (toks->len > start) &&
+				toks->arr[toks->len - 1].star) {
+			/* '**' is the same as '*' */
+			pat++;
+			continue;
+		}
+		tok = tokens_push(toks);
+		if (!tok)
+			return ENOMEM;
+		switch (*pat) {
+		case '*':
+			tok->star = 1;
+			pat++;
+			break;
+		case '?':
+			memset(tok->set, 0xff, sizeof(tok->set));
+			tok->set[0] &= ~1ULL;
+			pat++;
+			break;
+		case '[':
+			pat++;
+			ret = parse_bracket(&pat, tok->set);
+			if (ret)
+				return ret;
+			break;
+		case '\\':
+			pat++;
+			if (*pat == '\0')
+				return EINVAL;
+			/* fall through */
+		default:
+			set_add(tok->set, (unsigned char)*pat);
+			pat++;
+			break;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Add one parsed pattern to the matcher's bitsets.
+ *
+ * @param matcher	The matcher.
+ * @param toks		The pattern's tokens.
+ * @param num_toks	The number of tokens.
+ * @param base		The position of the pattern's first token.
+ */
+static void matcher_add_tokens(struct lksmith_matcher *matcher,
+		const struct matcher_token *toks, size_t num_toks, size_t base)
+{
+	size_t i, pos, nw = matcher->num_words;
+	unsigned int b;
+
+	for (i = 0; i < num_toks; i++) {
+		pos = base + i;
+		if (toks[i].star) {
+			set_add(matcher->star, pos);
+			continue;
+		}
+		for (b = 0; b < 256; b++) {
+			if (set_contains(toks[i].set, b))
+				set_add(matcher->char_mask + (b * nw), pos);
+		}
+	}
+	set_add(matcher->start, base);
+	if ((num_toks > 0) && toks[0].star)
+		set_add(matcher->start, base + 1);
+	set_add(matcher->accept, base + num_toks);
+}
+
+int matcher_create(char **literals, int num_literals,
+		char **patterns, int num_patterns,
+		struct lksmith_matcher **out)
+{
+	struct lksmith_matcher *matcher;
+	struct matcher_tokens toks;
+	size_t *lens = NULL, pos, first, num_pos = 0, nw;
+	int i, ret, num = num_literals + num_patterns;
+
+	memset(&toks, 0, sizeof(toks));
+	matcher = calloc(1, sizeof(*matcher));
+	if (!matcher)
+		return ENOMEM;
+	lens = calloc(num + 1, sizeof(size_t));
+	matcher->fallback = calloc(num_patterns + 1, sizeof(char*));
+	if ((!lens) || (!matcher->fallback)) {
+		ret = ENOMEM;
+		goto done;
+	}
+	/* Parse everything into one token array.  lens[i] is the number of
+	 * tokens in the i'th string, or SIZE_MAX if we gave up on it. */
+	for (i = 0; i < num; i++) {
+		size_t prev = toks.len;
+		if (i < num_literals) {
+			ret = parse_literal(literals[i], &toks);
+		} else {
+			ret = parse_glob(patterns[i - num_literals], &toks);
+		}
+		if (ret == EINVAL) {
+			toks.len = prev;
+			lens[i] = SIZE_MAX;
+			matcher->fallback[matcher->num_fallback] =
+				strdup(patterns[i - num_literals]);
+			if (!matcher->fallback[matcher->num_fallback]) {
+				ret = ENOMEM;
+				goto done;
+			}
+			matcher->num_fallback++;
+			continue;
+		} else if (ret) {
+			goto done;
+		}
+		lens[i] = toks.len - prev;
+		num_pos += lens[i] + 1;
+	}
+	nw = (num_pos + MATCHER_WORD_BITS - 1) / MATCHER_WORD_BITS;
+	matcher->num_words = nw;
+	matcher->char_mask = calloc((256 + 3) * nw + 1, sizeof(uint64_t));
+	if (!matcher->char_mask) {
+		ret = ENOMEM;
+		goto done;
+	}
+	matcher->star = matcher->char_mask + (256 * nw);
+	matcher->accept = matcher->star + nw;
+	matcher->start = matcher->accept + nw;
+	pos = 0;
+	first = 0;
+	for (i = 0; i < num; i++) {
+		if (lens[i] == SIZE_MAX)
+			continue;
+		matcher_add_tokens(matcher, toks.arr + first, lens[i], pos);
+		first += lens[i];
+		pos += lens[i] + 1;
+	}
+	ret = 0;
+done:
+	free(toks.arr);
+	free(lens);
+	if (ret) {
+		matcher_free(matcher);
+		return ret;
+	}
+	*out = matcher;
+	return 0;
+}
+
+int matcher_match(const struct lksmith_matcher *matcher, const char *str)
+{
+	size_t w, nw = matcher->num_words;
+	uint64_t cur[nw + 1], next[nw + 1], x, y, carry, any, *tmp;
+	uint64_t *pcur = cur, *pnext = next;
+	const uint64_t *mask;
+	const unsigned char *s;
+	int i;
+
+	if (nw > 0) {
+		memcpy(pcur, matcher->start, sizeof(uint64_t) * nw);
+		for (s = (const unsigned char*)str; *s; s++) {
+			mask = matcher->char_mask + ((*s) * nw);
+			carry = 0;
+			for (w = 0; w < nw; w++) {
+				x = pcur[w] & mask[w];
+				pnext[w] = (x << 1) | carry |
+					(pcur[w] & matcher->star[w]);
+				carry = x >> (MATCHER_WORD_BITS - 1);
+			}
+			/* A '*' can match nothing, so the token after an active
+			 * '*' is active too.  We never have two '*' tokens in a
+			 * row, so one pass is enough. */
+			carry = 0;
+			any = 0;
+			for (w = 0; w < nw; w++) {
+				y = pnext[w] & matcher->star[w];
+				pnext[w] |= (y << 1) | carry;
+				carry = y >> (MATCHER_WORD_BITS - 1);
+				any |= pnext[w];
+			}
+			if (!any)
+				break;
+			tmp = pcur;
+			pcur = pnext;
+			pnext = tmp;
+		}
+		if (!*s) {
+			for (w = 0; w < nw; w++) {
+				if (pcur[w] & matcher->accept[w])
+					return 1;
+			}
+		}
+	}
+	for (i = 0; i < matcher->num_fallback; i++) {
+		if (!fnmatch(matcher->fallback[i], str, 0))
+			return 1;
+	}
+	return 0;
+}
+
+void matcher_free(struct lksmith_matcher *matcher)
+{
+	int i;
+
+	if (!matcher)
+		return;
+	for (i = 0; i < matcher->num_fallback; i++) {
+		free(matcher->fallback[i]);
+	}
+	free(matcher->fallback);
+	free(matcher->char_mask);
+	free(matcher);
+}
@@ -0,0 +1,73 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_MATCHER_H
+#define LKSMITH_MATCHER_H
+
+struct lksmith_matcher;
+
+/**
+ * Compile a set of literal strings and glob patterns into one matcher.
+ *
+ * Matching a string against the matcher gives the same answer as comparing
+ * it against each literal with strcmp, and against each pattern with
+ * fnmatch(pattern, str, 0), but it looks at each character of the string
+ * only once, no matter how many patterns there are.
+ *
+ * @param literals	The literal strings.
+ * @param num_literals	Number of literal strings.
+ * @param patterns	The glob patterns.
+ * @param num_patterns	Number of glob patterns.
+ * @param out		(out param) the new matcher.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+int matcher_create(char **literals, int num_literals,
+		char **patterns, int num_patterns,
+		struct lksmith_matcher **out);
+
+/**
+ * Match a string against a matcher.
+ *
+ * @param matcher	The matcher.
+ * @param str		The string.
+ *
+ * @return		1 if the string matches any literal or pattern; 0
+ *			otherwise.
+ */
+int matcher_match(const struct lksmith_matcher *matcher, const char *str);
+
+/**
+ * Free a matcher.
+ *
+ * @param matcher	The matcher.
+ */
+void matcher_free(struct lksmith_matcher *matcher);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "matcher.h"
+#include "test.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char *g_literals[] = {
+	"./foo(bar+0x12) [0x4005d]",
+	"exact",
+	"",
+};
+
+static char *g_patterns[] = {
+	"*ignore1*",
+	"a?c",
+	"[abc]x",
+	"[!abc]y",
+	"[a-cx-z]z*",
+	"*end",
+	"pre**fix",
+	"\\*star",
+	"[]]w",
+	"*[[:digit:]]q",
+	"[unterminated",
+	"*(libfoo.so*)*",
+};
+
+static const char *g_strings[] = {
+	"", "exact", "exac", "exactly", "./foo(bar+0x12) [0x4005d]",
+	"xignore1y", "ignore1", "ignore", "abc", "ac", "abbc", "ax", "dx",
+	"ay", "dy", "zz", "bzzz", "dz", "theend", "end", "endx", "prefix",
+	"pre--fix", "*star", "xstar", "]w", "w", "abc5q", "abcq",
+	"[unterminated", "/lib/libfoo.so.1(func+0x1) [0x7f]",
+	"/lib/libbar.so.1(func+0x1) [0x7f]",
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+/**
+ * Check the matcher against strcmp and fnmatch.
+ */
+static int test_matcher_agrees_with_fnmatch(void)
+{
+	struct lksmith_matcher *matcher;
+	unsigned int i, j;
+	int expect;
+
+	EXPECT_ZERO(matcher_create(g_literals, ARRAY_SIZE(g_literals),
+		g_patterns, ARRAY_SIZE(g_patterns), &matcher));
+	for (i = 0; i < ARRAY_SIZE(g_strings); i++) {
+		expect = 0;
+		for (j = 0; j < ARRAY_SIZE(g_literals); j++) {
+			if (!strcmp(g_literals[j], g_strings[i]))
+				expect = 1;
+		}
+		for (j = 0; j < ARRAY_SIZE(g_patterns); j++) {
+			if (!fnmatch(g_patterns[j], g_strings[i], 0))
+				expect = 1;
+		}
+		if (matcher_match(matcher, g_strings[i]) != expect) {
+			fprintf(stderr, "matcher_match(\"%s\") should have "
+				"returned %d\n", g_strings[i], expect);
+			return EINVAL;
+		}
+	}
+	matcher_free(matcher);
+	return 0;
+}
+
+/**
+ * Check each pattern on its own, so that one pattern can't hide another's
+ * mistakes.
+ */
+static int test_each_pattern(void)
+{
+	struct lksmith_matcher *matcher;
+	unsigned int i, j;
+	int expect;
+
+	for (j = 0; j < ARRAY_SIZE(g_patterns); j++) {
+		EXPECT_ZERO(matcher_create(NULL, 0, &g_patterns[j], 1,
+			&matcher));
+		for (i = 0; i < ARRAY_SIZE(g_strings); i++) {
+			expect = !fnmatch(g_patterns[j], g_strings[i], 0);
+			if (matcher_match(matcher, g_strings[i]) != expect) {
+				fprintf(stderr, "matcher_match(\"%s\", "
+					"\"%s\") should have returned %d\n",
+					g_patterns[j], g_strings[i], expect);
+				return EINVAL;
+			}
+		}
+		matcher_free(matcher);
+	}
+	return 0;
+}
+
+static int test_empty_matcher(void)
+{
+	struct lksmith_matcher *matcher;
+
+	EXPECT_ZERO(matcher_create(NULL, 0, NULL, 0, &matcher));
+	EXPECT_ZERO(matcher_match(matcher, ""));
+	EXPECT_ZERO(matcher_match(matcher, "foo"));
+	matcher_free(matcher);
+	return 0;
+}
+
+int main(void)
+{
+	EXPECT_ZERO(test_matcher_agrees_with_fnmatch());
+	EXPECT_ZERO(test_each_pattern());
+	EXPECT_ZERO(test_empty_matcher());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,156 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "matcher.h"
+#include "module.h"
+#include "platform.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct module_range {
+	/** The first address of the segment */
+	uintptr_t start;
+	/** One past the last address of the segment */
+	uintptr_t end;
+	/** The MODULE_* flags of the segment's module */
+	int flags;
+};
+
+struct module_map {
+	/** Number of ranges */
+	size_t num;
+	/** Number of ranges there is room for */
+	size_t cap;
+	/** The ignore and tracking lists */
+	const struct lksmith_matcher *ignored, *tracked;
+	/** ENOMEM if we ran out of memory while building the map */
+	int err;
+	/** The segments, sorted by start address */
+	struct module_range *ranges;
+};
+
+static int module_match(const struct lksmith_matcher *matcher,
+		const char *name)
+{
+	const char *base;
+
+	if (!matcher)
+		return 0;
+	base = strrchr(name, '/');
+	base = base ? (base + 1) : name;
+	return matcher_match(matcher, name) || matcher_match(matcher, base);
+}
+
+static void module_map_add(const char *name, uintptr_t start, uintptr_t end,
+		void *data)
+{
+	struct module_map *map = data;
+	struct module_range *ranges;
+	size_t cap;
+
+	if (map->err || (start >= end))
+		return;
+	if (map->num == map->cap) {
+		cap = map->cap ? (map->cap * 2) : 64;
+		ranges = realloc(map->ranges, sizeof(*ranges) * cap);
+		if (!ranges) {
+			map->err = ENOMEM;
+			return;
+		}
+		map->ranges = ranges;
+		map->cap = cap;
+	}
+	map->ranges[map->num].start = start;
+	map->ranges[map->num].end = end;
+	map->ranges[map->num].flags =
+		(module_match(map->ignored, name) ? MODULE_IGNORED : 0) |
+		(module_match(map->tracked, name) ? MODULE_TRACKED : 0);
+	map->num++;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+	const struct module_range *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return (ra->start < rb->start) ? -1 : 1;
+	return 0;
+}
+
+int module_map_create(const struct lksmith_matcher *ignored,
+		const struct lksmith_matcher *tracked, struct module_map **out)
+{
+	struct module_map *map;
+	int ret;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return ENOMEM;
+	map->ignored = ignored;
+	map->tracked = tracked;
+	ret = platform_for_each_segment(module_map_add, map);
+	if (!ret)
+		ret = map->err;
+	if (ret) {
+		module_map_free(map);
+		return ret;
+	}
+	qsort(map->ranges, map->num, sizeof(*map->ranges), compare_ranges);
+	*out = map;
+	return 0;
+}
+
+int module_map_find(const struct module_map *map, const void *addr)
+{
+	uintptr_t a = (uintptr_t)addr;
+	size_t lo = 0, hi = map->num, mid;
+
+	/* Find the last range which starts at or before the address. */
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2);
+		if (map->ranges[mid].start <= a)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if ((lo == 0) || (a >= map->ranges[lo - 1].end))
+		return -1;
+	return map->ranges[lo - 1].flags;
+}
+
+void module_map_free(struct module_map *map)
+{
+	if (!map)
+		return;
+	free(map->ranges);
+	free(map);
+}
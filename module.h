@@ -0,0 +1,86 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_MODULE_H
+#define LKSMITH_MODULE_H
+
+/*
+ * The address ranges of the loaded modules, for deciding which locks to
+ * track.
+ */
+
+#include <stdint.h>
+
+struct lksmith_matcher;
+struct module_map;
+
+/**
+ * The address is in a module which matched the ignore list.
+ */
+#define MODULE_IGNORED 0x1
+
+/**
+ * The address is in a module which matched the tracking list.
+ */
+#define MODULE_TRACKED 0x2
+
+/**
+ * Find the segments of every loaded module, and match each module against
+ * the lists.  A module matches a list if either its path or the last
+ * component of its path does.
+ *
+ * @param ignored	The ignore list, or NULL.
+ * @param tracked	The tracking list, or NULL.
+ * @param out		(out param) the new map.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory;
+ *			ENOTSUP if the platform can't list the modules.
+ */
+int module_map_create(const struct lksmith_matcher *ignored,
+		const struct lksmith_matcher *tracked, struct module_map **out);
+
+/**
+ * Find the module which an address belongs to.
+ *
+ * @param map		The map.
+ * @param addr		The address.
+ *
+ * @return		-1 if the address isn't in any module's segments;
+ *			otherwise, the MODULE_* flags of its module.
+ */
+int module_map_find(const struct module_map *map, const void *addr);
+
+/**
+ * Free a module map.
+ *
+ * @param map		The map.
+ */
+void module_map_free(struct module_map *map);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Take two locks in both orders.
+ *
+ * @param a		The first lock.
+ * @param b		The second lock.
+ *
+ * @return		0 on success; error code otherwise.
+ */
+static int invert(pthread_mutex_t *a, pthread_mutex_t *b)
+{
+	EXPECT_ZERO(pthread_mutex_lock(a));
+	EXPECT_ZERO(pthread_mutex_lock(b));
+	EXPECT_ZERO(pthread_mutex_unlock(b));
+	EXPECT_ZERO(pthread_mutex_unlock(a));
+	EXPECT_ZERO(pthread_mutex_lock(b));
+	EXPECT_ZERO(pthread_mutex_lock(a));
+	EXPECT_ZERO(pthread_mutex_unlock(a));
+	EXPECT_ZERO(pthread_mutex_unlock(b));
+	lksmith_flush_edges();
+	return 0;
+}
+
+/**
+ * Test that a lock inversion is reported only when the module filters don't
+ * skip the locks, and that skipped locks can still be unlocked and waited on
+ * without any complaints.
+ *
+ * @param filtered	1 if the module filters skip every lock taken from
+ *			this program.
+ */
+static int test_filters(int filtered)
+{
+	struct lksmith_stats before, after;
+	pthread_mutex_t *heap, *heap2;
+	struct timespec ts;
+
+	heap = calloc(2, sizeof(*heap));
+	EXPECT_NOT_EQ(heap, NULL);
+	heap2 = heap + 1;
+	EXPECT_ZERO(pthread_mutex_init(heap, NULL));
+	EXPECT_ZERO(pthread_mutex_init(heap2, NULL));
+	EXPECT_ZERO(lksmith_get_stats(&before, sizeof(before)));
+	EXPECT_ZERO(invert(&g_lock, &g_lock2));
+	EXPECT_EQ(find_recorded_error(EDEADLK), !filtered);
+	EXPECT_ZERO(invert(heap, heap2));
+	EXPECT_EQ(find_recorded_error(EDEADLK), !filtered);
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock));
+	EXPECT_ZERO(clock_gettime(CLOCK_REALTIME, &ts));
+	EXPECT_EQ(pthread_cond_timedwait(&g_cond, &g_lock, &ts), ETIMEDOUT);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock));
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.filtered != before.filtered, filtered);
+	EXPECT_ZERO(pthread_mutex_destroy(heap2));
+	EXPECT_ZERO(pthread_mutex_destroy(heap));
+	free(heap);
+	EXPECT_EQ(num_recorded_errors(), 0);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int filtered = 0;
+
+	set_error_cb(record_error);
+	if ((argc > 1) && (strcmp(argv[1], "module_unit")))
+		filtered = 1;
+	EXPECT_ZERO(test_filters(filtered));
+
+	return EXIT_SUCCESS;
+}
@@ -34,6 +34,7 @@
  * Interface for making platform-specific calls.
  */
 
+#include <stdint.h>
 #include <unistd.h> /* for size_t */
 
 /**
@@ -65,4 +66,28 @@ void platform_create_thread_name(char * __restrict out, size_t out_len);
  */
 void* get_dlsym_next(const char *fname);
 
+/**
+ * Called for each loadable segment by platform_for_each_segment.
+ *
+ * @param name		The path of the module which the segment belongs to.
+ * @param start		The first address of the segment.
+ * @param end		One past the last address of the segment.
+ * @param data		The data passed to platform_for_each_segment.
+ */
+typedef void (*platform_segment_cb_t)(const char *name, uintptr_t start,
+		uintptr_t end, void *data);
+
+/**
+ * Find the code and data segments of the program and each shared library
+ * which is loaded.  Uninitialized data is included in its module's data
+ * segment.
+ *
+ * @param cb		The function to call for each segment.
+ * @param data		Passed to cb.
+ *
+ * @return		0 on success; ENOTSUP if the platform can't list the
+ *			loaded modules.
+ */
+int platform_for_each_segment(platform_segment_cb_t cb, void *data);
+
 #endif
@@ -0,0 +1,220 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "handler.h"
+#include "pool.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Approximate size of each slab.
+ */
+#define POOL_SLAB_SIZE 65536
+
+/**
+ * Number of records moved between a thread cache and the shared free list at
+ * once.
+ */
+#define POOL_CACHE_BATCH 32
+
+/**
+ * Once a thread cache holds this many records, it gives a batch back.
+ */
+#define POOL_CACHE_MAX (2 * POOL_CACHE_BATCH)
+
+/**
+ * Get the free list link of a free record.
+ */
+static inline void **obj_next(void *obj)
+{
+	return (void**)obj;
+}
+
+int pool_init(struct lksmith_pool *pool, const char *name, size_t obj_size)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->name = name;
+	if (obj_size < sizeof(void*))
+		obj_size = sizeof(void*);
+	/* Keep each record pointer-aligned. */
+	pool->obj_size = (obj_size + sizeof(void*) - 1) &
+		~(sizeof(void*) - 1);
+	return r_pthread_mutex_init(&pool->lock, NULL);
+}
+
+/**
+ * Allocate a new slab and put all of its records on the shared free list.
+ * Note: you must call this function with the pool lock held.
+ *
+ * @param pool		The pool.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int pool_grow(struct lksmith_pool *pool)
+{
+	size_t i, num;
+	char *slab;
+
+	num = POOL_SLAB_SIZE / pool->obj_size;
+	if (num < 1)
+		num = 1;
+	/* Records whose size is a multiple of the cache line size start on
+	 * cache line boundaries. */
+	if (posix_memalign((void**)&slab, LKSMITH_CACHE_LINE,
+			num * pool->obj_size))
+		return ENOMEM;
+	memset(slab, 0, num * pool->obj_size);
+	for (i = 0; i < num; i++) {
+		void *obj = slab + (i * pool->obj_size);
+		*obj_next(obj) = pool->free;
+		pool->free = obj;
+	}
+	pool->num_free += num;
+	pool->num_objs += num;
+	pool->num_slabs++;
+	return 0;
+}
+
+/**
+ * Take a record off the shared free list.
+ * Note: you must call this function with the pool lock held.
+ *
+ * @param pool		The pool.
+ *
+ * @return		The record, or NULL if we ran out of memory.
+ */
+static void *pool_take(struct lksmith_pool *pool)
+{
+	void *obj;
+
+	if ((!pool->free) && pool_grow(pool))
+		return NULL;
+	obj = pool->free;
+	pool->free = *obj_next(obj);
+	pool->num_free--;
+	return obj;
+}
+
+void *pool_alloc(struct lksmith_pool *pool, struct lksmith_pool_cache *cache)
+{
+	void *obj;
+	int i;
+
+	if (cache && cache->free) {
+		obj = cache->free;
+		cache->free = *obj_next(obj);
+		cache->num_free--;
+		return obj;
+	}
+	r_pthread_mutex_lock(&pool->lock);
+	obj = pool_take(pool);
+	if (obj && cache) {
+		/* Refill the cache while we have the lock. */
+		for (i = 1; i < POOL_CACHE_BATCH; i++) {
+			void *extra = pool_take(pool);
+			if (!extra)
+				break;
+			*obj_next(extra) = cache->free;
+			cache->free = extra;
+			cache->num_free++;
+		}
+	}
+	r_pthread_mutex_unlock(&pool->lock);
+	return obj;
+}
+
+/**
+ * Move some records from a thread's cache back to the shared free list.
+ *
+ * @param pool		The pool.
+ * @param cache		The thread's cache.
+ * @param num		Maximum number of records to move.
+ */
+static void pool_cache_flush(struct lksmith_pool *pool,
+		struct lksmith_pool_cache *cache, int num)
+{
+	void *obj;
+
+	r_pthread_mutex_lock(&pool->lock);
+	while ((num-- > 0) && cache->free) {
+		obj = cache->free;
+		cache->free = *obj_next(obj);
+		cache->num_free--;
+		*obj_next(obj) = pool->free;
+		pool->free = obj;
+		pool->num_free++;
+	}
+	r_pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(struct lksmith_pool *pool, struct lksmith_pool_cache *cache,
+		void *obj)
+{
+	if (!cache) {
+		r_pthread_mutex_lock(&pool->lock);
+		*obj_next(obj) = pool->free;
+		pool->free = obj;
+		pool->num_free++;
+		r_pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+	*obj_next(obj) = cache->free;
+	cache->free = obj;
+	cache->num_free++;
+	if (cache->num_free >= POOL_CACHE_MAX)
+		pool_cache_flush(pool, cache, POOL_CACHE_BATCH);
+}
+
+void pool_cache_drain(struct lksmith_pool *pool,
+		struct lksmith_pool_cache *cache)
+{
+	pool_cache_flush(pool, cache, cache->num_free);
+}
+
+void pool_dump(struct lksmith_pool *pool, char *buf, size_t *off,
+		size_t buf_len)
+{
+	uint64_t num_objs, num_free, num_slabs;
+
+	r_pthread_mutex_lock(&pool->lock);
+	num_objs = pool->num_objs;
+	num_free = pool->num_free;
+	num_slabs = pool->num_slabs;
+	r_pthread_mutex_unlock(&pool->lock);
+	fwdprintf(buf, off, buf_len, "%s: %"PRId64" records of %zd bytes in "
+		"%"PRId64" slabs; %"PRId64" in use or cached by threads, "
+		"%"PRId64" free", pool->name, num_objs, pool->obj_size,
+		num_slabs, num_objs - num_free, num_free);
+}
@@ -0,0 +1,137 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_POOL_H
+#define LKSMITH_POOL_H
+
+#include <pthread.h> /* for pthread_mutex_t */
+#include <stdint.h> /* for uint64_t */
+#include <unistd.h> /* for size_t */
+
+/**
+ * A pool of fixed-size records.
+ *
+ * Locksmith creates and frees a record on nearly every lock operation.
+ * Going to malloc for each of them would be slow, and would disturb the
+ * allocator behavior of the very program we are trying to debug.  Instead,
+ * we carve records out of large slabs, and keep freed records on free lists.
+ *
+ * Each thread keeps a small cache of free records, so that most allocations
+ * and frees don't need the pool lock.  When a thread's cache runs dry or
+ * gets too big, records move to or from the shared free list in batches.
+ *
+ * Records are not cleared when they are freed or allocated, except that the
+ * first pointer-sized word is used to link free records together.  Callers
+ * can use this to keep buffers attached to records across reuse.  Records
+ * from a new slab are zeroed.  Slabs are never returned to the system.
+ * Slabs are cache-line aligned, so records whose size is a multiple of
+ * LKSMITH_CACHE_LINE never share a cache line with each other.
+ */
+struct lksmith_pool {
+	/** Name of the pool, for statistics */
+	const char *name;
+	/** Size of each record */
+	size_t obj_size;
+	/** Protects everything below */
+	pthread_mutex_t lock;
+	/** Shared free list */
+	void *free;
+	/** Number of records on the shared free list */
+	uint64_t num_free;
+	/** Number of records that have been carved out of slabs */
+	uint64_t num_objs;
+	/** Number of slabs allocated */
+	uint64_t num_slabs;
+};
+
+/**
+ * A thread's cache of free records from one pool.
+ */
+struct lksmith_pool_cache {
+	/** Free records */
+	void *free;
+	/** Number of records on the free list */
+	int num_free;
+};
+
+/**
+ * Initialize a pool.
+ *
+ * @param pool		The pool.
+ * @param name		The name of the pool.  Not copied.
+ * @param obj_size	The size of each record.
+ *
+ * @return		0 on success; an error code otherwise.
+ */
+int pool_init(struct lksmith_pool *pool, const char *name, size_t obj_size);
+
+/**
+ * Allocate a record from a pool.
+ *
+ * @param pool		The pool.
+ * @param cache		The calling thread's cache for this pool, or NULL to
+ *			use the shared free list directly.
+ *
+ * @return		The record, or NULL if we ran out of memory.
+ */
+void *pool_alloc(struct lksmith_pool *pool, struct lksmith_pool_cache *cache);
+
+/**
+ * Return a record to a pool.
+ *
+ * @param pool		The pool.
+ * @param cache		The calling thread's cache for this pool, or NULL to
+ *			use the shared free list directly.
+ * @param obj		The record.
+ */
+void pool_free(struct lksmith_pool *pool, struct lksmith_pool_cache *cache,
+		void *obj);
+
+/**
+ * Move all the records in a thread's cache back to the shared free list.
+ * This should be called when the thread exits.
+ *
+ * @param pool		The pool.
+ * @param cache		The thread's cache.
+ */
+void pool_cache_drain(struct lksmith_pool *pool,
+		struct lksmith_pool_cache *cache);
+
+/**
+ * Describe how full a pool is.
+ *
+ * @param pool		The pool.
+ * @param buf		(out param) the buffer to write to
+ * @param off		(inout param) current position in the buffer
+ * @param buf_len	length of buf
+ */
+void pool_dump(struct lksmith_pool *pool, char *buf, size_t *off,
+		size_t buf_len);
+
+#endif
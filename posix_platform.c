@@ -30,6 +30,7 @@
 #include "platform.h"
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <sys/syscall.h>
@@ -62,3 +63,10 @@ void* get_dlsym_next(const char *fname)
 	}
 	return v;
 }
+
+int platform_for_each_segment(platform_segment_cb_t cb __attribute__((unused)),
+		void *data __attribute__((unused)))
+{
+	/* There is no portable way to list the loaded modules. */
+	return ENOTSUP;
+}
@@ -0,0 +1,455 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "backtrace.h"
+#include "error.h"
+#include "handler.h"
+#include "profile.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Number of histogram buckets.  Bucket b counts durations of less than
+ * 2^(b+1) nanoseconds that didn't fit in bucket b-1.
+ */
+#define PROF_HIST_BUCKETS 40
+
+/**
+ * Number of slots in a new profiling table.  Must be a power of 2.
+ */
+#define PROF_INITIAL_SLOTS 64
+
+/**
+ * Maximum number of call sites to report for each lock.
+ */
+#define PROF_MAX_SITES 5
+
+struct prof_stats {
+	/** Number of attempts to take the lock */
+	uint64_t acquisitions;
+	/** Number of attempts which didn't get the lock */
+	uint64_t failures;
+	/** Total time spent waiting for the lock */
+	uint64_t wait_total;
+	/** Longest wait */
+	uint64_t wait_max;
+	/** Total time the lock was held */
+	uint64_t hold_total;
+	/** Longest hold */
+	uint64_t hold_max;
+	/** Histogram of wait times */
+	uint64_t wait_hist[PROF_HIST_BUCKETS];
+	/** Histogram of hold times */
+	uint64_t hold_hist[PROF_HIST_BUCKETS];
+};
+
+struct prof_entry {
+	/** The lock, or NULL if this slot is empty */
+	const void *ptr;
+	/** The call site which took the lock */
+	const void *site;
+	/** Measurements */
+	struct prof_stats st;
+};
+
+struct prof_table {
+	/** Next table in g_prof_tables */
+	struct prof_table *next;
+	/** 1 if a thread is using this table.  Protected by g_prof_lock. */
+	int owned;
+	/** Protects the slots.  Only contended when the profile is being
+	 * dumped. */
+	pthread_mutex_t lock;
+	/** Open-addressed hash table of entries */
+	struct prof_entry *slots;
+	/** Number of slots.  Always a power of 2. */
+	size_t num_slots;
+	/** Number of slots in use */
+	size_t num_entries;
+};
+
+/**
+ * Measurements for one lock, summed over all its call sites.
+ */
+struct prof_lock_sum {
+	/** The lock */
+	const void *ptr;
+	/** Measurements */
+	struct prof_stats st;
+	/** The lock's entries, sorted by wait time */
+	struct prof_entry **sites;
+	/** Number of entries */
+	size_t num_sites;
+};
+
+/**
+ * Every profiling table which has ever been created.  Tables are never
+ * freed.
+ */
+static struct prof_table *g_prof_tables;
+
+/**
+ * Protects g_prof_tables and the owned flags.
+ */
+static pthread_mutex_t g_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t)ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * Find the histogram bucket for a duration.
+ */
+static int prof_bucket(uint64_t ns)
+{
+	int b;
+
+	if (ns < 2)
+		return 0;
+	b = 63 - __builtin_clzll(ns);
+	return (b >= PROF_HIST_BUCKETS) ? (PROF_HIST_BUCKETS - 1) : b;
+}
+
+/**
+ * Find the slot for a lock and call site in a table.
+ *
+ * @return		The slot, which may be empty.
+ */
+static struct prof_entry *prof_slot(struct prof_entry *slots,
+		size_t num_slots, const void *ptr, const void *site)
+{
+	size_t i;
+
+	i = (ptr_hash(ptr) ^ (ptr_hash(site) * 31)) & (num_slots - 1);
+	while (slots[i].ptr) {
+		if ((slots[i].ptr == ptr) && (slots[i].site == site))
+			break;
+		i = (i + 1) & (num_slots - 1);
+	}
+	return &slots[i];
+}
+
+/**
+ * Double the size of a table.
+ * Note: you must call this function with the table lock held.
+ *
+ * @return		0 on success; ENOMEM if we ran out of memory.
+ */
+static int prof_table_grow(struct prof_table *table)
+{
+	struct prof_entry *slots, *ent;
+	size_t i, num_slots;
+
+	num_slots = table->num_slots ? (table->num_slots * 2) :
+		PROF_INITIAL_SLOTS;
+	slots = calloc(num_slots, sizeof(*slots));
+	if (!slots)
+		return ENOMEM;
+	for (i = 0; i < table->num_slots; i++) {
+		if (!table->slots[i].ptr)
+			continue;
+		ent = prof_slot(slots, num_slots, table->slots[i].ptr,
+			table->slots[i].site);
+		memcpy(ent, &table->slots[i], sizeof(*ent));
+	}
+	free(table->slots);
+	table->slots = slots;
+	table->num_slots = num_slots;
+	return 0;
+}
+
+/**
+ * Find the entry for a lock and call site, creating it if needed.
+ * Note: you must call this function with the table lock held.
+ *
+ * @return		The entry, or NULL if we ran out of memory.
+ */
+static struct prof_entry *prof_get(struct prof_table *table,
+		const void *ptr, const void *site)
+{
+	struct prof_entry *ent;
+
+	if ((table->num_entries + 1) * 2 > table->num_slots) {
+		if (prof_table_grow(table))
+			return NULL;
+	}
+	ent = prof_slot(table->slots, table->num_slots, ptr, site);
+	if (!ent->ptr) {
+		ent->ptr = ptr;
+		ent->site = site;
+		table->num_entries++;
+	}
+	return ent;
+}
+
+struct prof_table *prof_table_create(void)
+{
+	struct prof_table *table;
+
+	r_pthread_mutex_lock(&g_prof_lock);
+	for (table = g_prof_tables; table; table = table->next) {
+		if (!table->owned)
+			break;
+	}
+	if (!table) {
+		table = calloc(1, sizeof(*table));
+		if (!table)
+			goto done;
+		if (r_pthread_mutex_init(&table->lock, NULL)) {
+			free(table);
+			table = NULL;
+			goto done;
+		}
+		table->next = g_prof_tables;
+		g_prof_tables = table;
+	}
+	table->owned = 1;
+done:
+	r_pthread_mutex_unlock(&g_prof_lock);
+	return table;
+}
+
+void prof_table_release(struct prof_table *table)
+{
+	r_pthread_mutex_lock(&g_prof_lock);
+	table->owned = 0;
+	r_pthread_mutex_unlock(&g_prof_lock);
+}
+
+void prof_record_acquire(struct prof_table *table, const void *ptr,
+		const void *site, uint64_t wait_ns, int failed)
+{
+	struct prof_entry *ent;
+
+	r_pthread_mutex_lock(&table->lock);
+	ent = prof_get(table, ptr, site);
+	if (ent) {
+		ent->st.acquisitions++;
+		ent->st.failures += !!failed;
+		ent->st.wait_total += wait_ns;
+		if (wait_ns > ent->st.wait_max)
+			ent->st.wait_max = wait_ns;
+		ent->st.wait_hist[prof_bucket(wait_ns)]++;
+	}
+	r_pthread_mutex_unlock(&table->lock);
+}
+
+void prof_record_release(struct prof_table *table, const void *ptr,
+		const void *site, uint64_t hold_ns)
+{
+	struct prof_entry *ent;
+
+	r_pthread_mutex_lock(&table->lock);
+	ent = prof_get(table, ptr, site);
+	if (ent) {
+		ent->st.hold_total += hold_ns;
+		if (hold_ns > ent->st.hold_max)
+			ent->st.hold_max = hold_ns;
+		ent->st.hold_hist[prof_bucket(hold_ns)]++;
+	}
+	r_pthread_mutex_unlock(&table->lock);
+}
+
+/**
+ * Add one set of measurements to another.
+ */
+static void prof_stats_add(struct prof_stats *dst,
+		const struct prof_stats *src)
+{
+	int i;
+
+	dst->acquisitions += src->acquisitions;
+	dst->failures += src->failures;
+	dst->wait_total += src->wait_total;
+	if (src->wait_max > dst->wait_max)
+		dst->wait_max = src->wait_max;
+	dst->hold_total += src->hold_total;
+	if (src->hold_max > dst->hold_max)
+		dst->hold_max = src->hold_max;
+	for (i = 0; i < PROF_HIST_BUCKETS; i++) {
+		dst->wait_hist[i] += src->wait_hist[i];
+		dst->hold_hist[i] += src->hold_hist[i];
+	}
+}
+
+/**
+ * Find an upper bound on a percentile of a histogram.
+ *
+ * @param hist		The histogram.
+ * @param pct		The percentile.
+ * @param max		The largest value in the histogram.
+ *
+ * @return		The upper bound, in nanoseconds.
+ */
+static uint64_t prof_percentile(const uint64_t *hist, int pct, uint64_t max)
+{
+	uint64_t total = 0, seen = 0;
+	int i;
+
+	for (i = 0; i < PROF_HIST_BUCKETS; i++)
+		total += hist[i];
+	if (total == 0)
+		return 0;
+	for (i = 0; i < PROF_HIST_BUCKETS - 1; i++) {
+		seen += hist[i];
+		if (seen * 100 >= total * pct)
+			break;
+	}
+	return ((2ULL << i) < max) ? (2ULL << i) : max;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct prof_entry *ea = *(struct prof_entry * const *)a;
+	const struct prof_entry *eb = *(struct prof_entry * const *)b;
+
+	if ((uintptr_t)ea->ptr != (uintptr_t)eb->ptr)
+		return ((uintptr_t)ea->ptr < (uintptr_t)eb->ptr) ? -1 : 1;
+	if (ea->st.wait_total != eb->st.wait_total)
+		return (ea->st.wait_total > eb->st.wait_total) ? -1 : 1;
+	return 0;
+}
+
+static int compare_lock_sums(const void *a, const void *b)
+{
+	const struct prof_lock_sum *la = a, *lb = b;
+
+	if (la->st.wait_total != lb->st.wait_total)
+		return (la->st.wait_total > lb->st.wait_total) ? -1 : 1;
+	if (la->st.acquisitions != lb->st.acquisitions)
+		return (la->st.acquisitions > lb->st.acquisitions) ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Describe a set of measurements.
+ */
+static void prof_stats_dump(const struct prof_stats *st,
+		char *buf, size_t *off, size_t buf_len)
+{
+	fwdprintf(buf, off, buf_len, "%"PRIu64" acquisitions, %"PRIu64
+		" failed (%.1f%%), wait total %.1fus max %.1fus p50 <=%.1fus "
+		"p99 <=%.1fus, hold total %.1fus max %.1fus p50 <=%.1fus "
+		"p99 <=%.1fus", st->acquisitions, st->failures,
+		st->acquisitions ? (100.0 * st->failures /
+			st->acquisitions) : 0.0,
+		st->wait_total / 1000.0, st->wait_max / 1000.0,
+		prof_percentile(st->wait_hist, 50, st->wait_max) / 1000.0,
+		prof_percentile(st->wait_hist, 99, st->wait_max) / 1000.0,
+		st->hold_total / 1000.0, st->hold_max / 1000.0,
+		prof_percentile(st->hold_hist, 50, st->hold_max) / 1000.0,
+		prof_percentile(st->hold_hist, 99, st->hold_max) / 1000.0);
+}
+
+void prof_dump(int top_n)
+{
+	struct prof_table merged, *table;
+	struct prof_entry **ents = NULL, *ent;
+	struct prof_lock_sum *sums = NULL;
+	size_t i, j, num_ents = 0, num_sums = 0;
+	char buf[4096];
+	size_t off;
+
+	memset(&merged, 0, sizeof(merged));
+	r_pthread_mutex_lock(&g_prof_lock);
+	for (table = g_prof_tables; table; table = table->next) {
+		r_pthread_mutex_lock(&table->lock);
+		for (i = 0; i < table->num_slots; i++) {
+			if (!table->slots[i].ptr)
+				continue;
+			ent = prof_get(&merged, table->slots[i].ptr,
+				table->slots[i].site);
+			if (ent)
+				prof_stats_add(&ent->st, &table->slots[i].st);
+		}
+		r_pthread_mutex_unlock(&table->lock);
+	}
+	r_pthread_mutex_unlock(&g_prof_lock);
+
+	ents = malloc(sizeof(*ents) * (merged.num_entries + 1));
+	sums = calloc(merged.num_entries + 1, sizeof(*sums));
+	if ((!ents) || (!sums)) {
+		lksmith_error(ENOMEM, "prof_dump: out of memory.\n");
+		goto done;
+	}
+	for (i = 0; i < merged.num_slots; i++) {
+		if (merged.slots[i].ptr)
+			ents[num_ents++] = &merged.slots[i];
+	}
+	qsort(ents, num_ents, sizeof(*ents), compare_entries);
+	for (i = 0; i < num_ents; i = j) {
+		sums[num_sums].ptr = ents[i]->ptr;
+		sums[num_sums].sites = &ents[i];
+		for (j = i; (j < num_ents) && (ents[j]->ptr == ents[i]->ptr);
+				j++) {
+			prof_stats_add(&sums[num_sums].st, &ents[j]->st);
+		}
+		sums[num_sums].num_sites = j - i;
+		num_sums++;
+	}
+	qsort(sums, num_sums, sizeof(*sums), compare_lock_sums);
+	lksmith_error(0, "Locksmith lock profile: the %d most contended of "
+		"%zu locks, by total wait time.\n",
+		((size_t)top_n < num_sums) ? top_n : (int)num_sums, num_sums);
+	for (i = 0; (i < num_sums) && (i < (size_t)top_n); i++) {
+		off = 0;
+		fwdprintf(buf, &off, sizeof(buf), "lock %p: ", sums[i].ptr);
+		prof_stats_dump(&sums[i].st, buf, &off, sizeof(buf));
+		fwdprintf(buf, &off, sizeof(buf), "\n");
+		for (j = 0; (j < sums[i].num_sites) && (j < PROF_MAX_SITES);
+				j++) {
+			ent = sums[i].sites[j];
+			fwdprintf(buf, &off, sizeof(buf), "    at %s: ",
+				ent->site ? bt_frame_name((void*)ent->site) :
+				"(unknown)");
+			prof_stats_dump(&ent->st, buf, &off, sizeof(buf));
+			fwdprintf(buf, &off, sizeof(buf), "\n");
+		}
+		if (sums[i].num_sites > PROF_MAX_SITES) {
+			fwdprintf(buf, &off, sizeof(buf), "    ... and %zu "
+				"more call sites\n",
+				sums[i].num_sites - PROF_MAX_SITES);
+		}
+		lksmith_error(0, "%s", buf);
+	}
+done:
+	free(ents);
+	free(sums);
+	free(merged.slots);
+}
@@ -0,0 +1,102 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_PROFILE_H
+#define LKSMITH_PROFILE_H
+
+#include <stdint.h> /* for uint64_t */
+
+/**
+ * The lock profiler.
+ *
+ * When LKSMITH_PROFILE is set, Locksmith measures how long each lock
+ * acquisition waited for the lock and how long the lock was then held.  It
+ * also counts acquisitions and failed trylocks.  Measurements are kept per
+ * lock and per call site, in a table owned by each thread, so recording
+ * one never contends with other threads.  The tables are merged when the
+ * profile is dumped.
+ */
+struct prof_table;
+
+/**
+ * Get the current time for profiling.
+ *
+ * @return		A monotonic time in nanoseconds.
+ */
+uint64_t prof_now(void);
+
+/**
+ * Create a profiling table for the current thread.
+ *
+ * @return		The new table, or NULL if we ran out of memory.
+ */
+struct prof_table *prof_table_create(void);
+
+/**
+ * Release a thread's profiling table when the thread exits.
+ *
+ * The data stays around until it has been dumped, and the table is reused by
+ * a later thread.
+ *
+ * @param table		The table.
+ */
+void prof_table_release(struct prof_table *table);
+
+/**
+ * Record a lock acquisition.
+ *
+ * @param table		The current thread's table.
+ * @param ptr		The lock.
+ * @param site		The call site.
+ * @param wait_ns	How long we waited for the lock.
+ * @param failed	1 if we didn't get the lock (for example, because a
+ *			trylock found it busy.)
+ */
+void prof_record_acquire(struct prof_table *table, const void *ptr,
+		const void *site, uint64_t wait_ns, int failed);
+
+/**
+ * Record a lock release.
+ *
+ * @param table		The current thread's table.
+ * @param ptr		The lock.
+ * @param site		The call site that took the lock.
+ * @param hold_ns	How long we held the lock.
+ */
+void prof_record_release(struct prof_table *table, const void *ptr,
+		const void *site, uint64_t hold_ns);
+
+/**
+ * Merge every thread's measurements and report the most contended locks.
+ *
+ * @param top_n		The number of locks to report.
+ */
+void prof_dump(int top_n);
+
+#endif
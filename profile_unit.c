@@ -0,0 +1,129 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_THREADS 4
+#define NUM_ITERS 50
+
+static pthread_mutex_t g_hot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_cold_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char g_profile[65536];
+static size_t g_profile_len;
+
+/**
+ * Error callback which saves the lock profile.  Only the main thread dumps
+ * the profile, so this doesn't need a lock.
+ */
+static void save_profile(int code, const char *msg)
+{
+	size_t len;
+
+	if (code != 0) {
+		fprintf(stderr, "save_profile: got error %d: %s\n", code, msg);
+		abort();
+	}
+	len = strlen(msg);
+	if (g_profile_len + len >= sizeof(g_profile))
+		return;
+	memcpy(g_profile + g_profile_len, msg, len + 1);
+	g_profile_len += len;
+}
+
+static void *hot_thread(void *v __attribute__((unused)))
+{
+	struct timespec ts = { 0, 100000 };
+	int i;
+
+	for (i = 0; i < NUM_ITERS; i++) {
+		pthread_mutex_lock(&g_hot_lock);
+		nanosleep(&ts, NULL);
+		pthread_mutex_unlock(&g_hot_lock);
+	}
+	return NULL;
+}
+
+static void *trylock_thread(void *v __attribute__((unused)))
+{
+	return (void*)(intptr_t)pthread_mutex_trylock(&g_hot_lock);
+}
+
+static int test_profile(void)
+{
+	pthread_t threads[NUM_THREADS], thread;
+	void *rval;
+	unsigned long long acq, failed;
+	char *line;
+	int i;
+
+	pthread_mutex_lock(&g_cold_lock);
+	pthread_mutex_unlock(&g_cold_lock);
+	for (i = 0; i < NUM_THREADS; i++) {
+		EXPECT_ZERO(pthread_create(&threads[i], NULL,
+			hot_thread, NULL));
+	}
+	for (i = 0; i < NUM_THREADS; i++) {
+		EXPECT_ZERO(pthread_join(threads[i], NULL));
+	}
+	EXPECT_ZERO(pthread_mutex_lock(&g_hot_lock));
+	EXPECT_ZERO(pthread_create(&thread, NULL, trylock_thread, NULL));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ((int)(intptr_t)rval, EBUSY);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_hot_lock));
+
+	lksmith_profile_dump();
+	line = strstr(g_profile, "\nlock ");
+	EXPECT_NOT_EQ(line, NULL);
+	/* The hot lock is the most contended, so it comes first. */
+	EXPECT_EQ(sscanf(line, "\nlock %*p: %llu acquisitions, %llu failed",
+		&acq, &failed), 2);
+	EXPECT_EQ(acq, NUM_THREADS * NUM_ITERS + 2);
+	EXPECT_EQ(failed, 1);
+	EXPECT_NOT_EQ(strstr(line, "    at "), NULL);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(save_profile);
+	EXPECT_ZERO(test_profile());
+
+	return EXIT_SUCCESS;
+}
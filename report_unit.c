@@ -0,0 +1,139 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "error.h"
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_THREADS 4
+#define NUM_INVERSIONS 25
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+
+static char g_log_path[] = "/tmp/lksmith_report_unit.XXXXXX";
+static char g_log_env[sizeof(g_log_path) + 32];
+
+static void invert(void)
+{
+	pthread_mutex_lock(&g_lock2);
+	pthread_mutex_lock(&g_lock1);
+	pthread_mutex_unlock(&g_lock1);
+	pthread_mutex_unlock(&g_lock2);
+}
+
+static void *invert_thread(void *v __attribute__((unused)))
+{
+	int i;
+
+	for (i = 0; i < NUM_INVERSIONS; i++) {
+		invert();
+	}
+	return NULL;
+}
+
+/**
+ * Count the inversion reports in the log, and the duplicates which were
+ * suppressed.
+ */
+static int count_reports(int *reports, int *suppressed)
+{
+	FILE *fp;
+	char line[4096];
+	unsigned long long n;
+
+	*reports = 0;
+	*suppressed = 0;
+	fp = fopen(g_log_path, "r");
+	EXPECT_NOT_EQ(fp, NULL);
+	while (fgets(line, sizeof(line), fp)) {
+		if (strstr(line, "lksmith_prelock(") == line) {
+			if (strstr(line, "lock inversion"))
+				(*reports)++;
+		} else if (sscanf(line, "Locksmith suppressed %llu more copies "
+				"of: lksmith_prelock(", &n) == 1) {
+			*suppressed += n;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int test_duplicate_reports(void)
+{
+	pthread_t threads[NUM_THREADS];
+	int i, reports, suppressed, total = NUM_THREADS * NUM_INVERSIONS;
+
+	pthread_mutex_lock(&g_lock1);
+	pthread_mutex_lock(&g_lock2);
+	pthread_mutex_unlock(&g_lock2);
+	pthread_mutex_unlock(&g_lock1);
+	for (i = 0; i < NUM_THREADS; i++) {
+		EXPECT_ZERO(pthread_create(&threads[i], NULL,
+			invert_thread, NULL));
+	}
+	for (i = 0; i < NUM_THREADS; i++) {
+		EXPECT_ZERO(pthread_join(threads[i], NULL));
+	}
+	lksmith_error_flush();
+	EXPECT_ZERO(count_reports(&reports, &suppressed));
+	if (getenv("LKSMITH_LOG_SYNC")) {
+		EXPECT_EQ(reports, total);
+		EXPECT_EQ(suppressed, 0);
+	} else {
+		EXPECT_EQ(reports, 1);
+		EXPECT_EQ(suppressed, total - 1);
+	}
+	return 0;
+}
+
+int main(void)
+{
+	int fd, ret;
+
+	fd = mkstemp(g_log_path);
+	EXPECT_GE(fd, 0);
+	close(fd);
+	snprintf(g_log_env, sizeof(g_log_env), "LKSMITH_LOG=file://%s",
+		g_log_path);
+	putenv(g_log_env);
+	ret = test_duplicate_reports();
+	unlink(g_log_path);
+	EXPECT_ZERO(ret);
+
+	return EXIT_SUCCESS;
+}
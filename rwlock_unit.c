@@ -0,0 +1,168 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_READERS 32
+
+static pthread_rwlock_t g_rw1 = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t g_rw2 = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t g_rw3 = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t g_rw4 = PTHREAD_RWLOCK_INITIALIZER;
+
+static int test_read_read_orders(void)
+{
+	EXPECT_ZERO(pthread_rwlock_rdlock(&g_rw1));
+	EXPECT_ZERO(pthread_rwlock_rdlock(&g_rw2));
+	EXPECT_ZERO(pthread_rwlock_unlock(&g_rw2));
+	EXPECT_ZERO(pthread_rwlock_unlock(&g_rw1));
+	EXPECT_ZERO(pthread_rwlock_rdlock(&g_rw2));
+	EXPECT_ZERO(pthread_rwlock_tryrdlock(&g_rw1));
+	EXPECT_ZERO(pthread_rwlock_unlock(&g_rw1));
+	EXPECT_ZERO(pthread_rwlock_unlock(&g_rw2));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_write_inversion(void)
+{
+	EXPECT_ZERO(pthread_rwlock_rdlock(&g_rw3));
+	EXPECT_ZERO(pthread_rwlock_wrlock(&g_rw4));
+	EXPECT_ZERO(pthread_rwlock_unlock(&g_rw4));
+	EXPECT_ZERO(pthread_rwlock_unlock(&g_rw3));
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(pthread_rwlock_rdlock(&g_rw4));
+	EXPECT_ZERO(pthread_rwlock_wrlock(&g_rw3));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_rwlock_unlock(&g_rw3));
+	EXPECT_ZERO(pthread_rwlock_unlock(&g_rw4));
+	clear_recorded_errors();
+	return 0;
+}
+
+static int test_recursive_read(void)
+{
+	pthread_rwlock_t rw;
+
+	EXPECT_ZERO(pthread_rwlock_init(&rw, NULL));
+	EXPECT_ZERO(pthread_rwlock_rdlock(&rw));
+	EXPECT_ZERO(pthread_rwlock_rdlock(&rw));
+	EXPECT_ZERO(pthread_rwlock_unlock(&rw));
+	EXPECT_ZERO(pthread_rwlock_unlock(&rw));
+	EXPECT_ZERO(pthread_rwlock_wrlock(&rw));
+	EXPECT_EQ(pthread_rwlock_trywrlock(&rw), EBUSY);
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_rwlock_unlock(&rw));
+	EXPECT_ZERO(pthread_rwlock_destroy(&rw));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static pthread_rwlock_t g_shared_rw;
+static sem_t g_readers_in;
+static sem_t g_readers_out;
+
+static int reader_thread(void)
+{
+	EXPECT_ZERO(pthread_rwlock_rdlock(&g_shared_rw));
+	EXPECT_ZERO(sem_post(&g_readers_in));
+	EXPECT_ZERO(sem_wait(&g_readers_out));
+	EXPECT_ZERO(pthread_rwlock_unlock(&g_shared_rw));
+	return 0;
+}
+
+static void *reader_thread_wrap(void *v __attribute__((unused)))
+{
+	return (void*)(intptr_t)reader_thread();
+}
+
+static int test_many_readers(void)
+{
+	pthread_t threads[NUM_READERS];
+	void *rval;
+	int i;
+
+	EXPECT_ZERO(sem_init(&g_readers_in, 0, 0));
+	EXPECT_ZERO(sem_init(&g_readers_out, 0, 0));
+	EXPECT_ZERO(pthread_rwlock_init(&g_shared_rw, NULL));
+	for (i = 0; i < NUM_READERS; i++) {
+		EXPECT_ZERO(pthread_create(&threads[i], NULL,
+			reader_thread_wrap, NULL));
+	}
+	for (i = 0; i < NUM_READERS; i++) {
+		EXPECT_ZERO(sem_wait(&g_readers_in));
+	}
+	/* Every reader still holds the lock. */
+	EXPECT_EQ(pthread_rwlock_destroy(&g_shared_rw), EBUSY);
+	EXPECT_EQ(find_recorded_error(EBUSY), 1);
+	for (i = 0; i < NUM_READERS; i++) {
+		EXPECT_ZERO(sem_post(&g_readers_out));
+	}
+	for (i = 0; i < NUM_READERS; i++) {
+		EXPECT_ZERO(pthread_join(threads[i], &rval));
+		EXPECT_EQ(rval, NULL);
+	}
+	EXPECT_ZERO(pthread_rwlock_destroy(&g_shared_rw));
+	EXPECT_ZERO(sem_destroy(&g_readers_in));
+	EXPECT_ZERO(sem_destroy(&g_readers_out));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_unlock_unheld(void)
+{
+	pthread_rwlock_t rw;
+
+	EXPECT_ZERO(pthread_rwlock_init(&rw, NULL));
+	EXPECT_EQ(pthread_rwlock_unlock(&rw), EPERM);
+	EXPECT_EQ(find_recorded_error(EPERM), 1);
+	EXPECT_ZERO(pthread_rwlock_destroy(&rw));
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(record_error);
+	EXPECT_ZERO(test_read_read_orders());
+	EXPECT_ZERO(test_write_inversion());
+	EXPECT_ZERO(test_recursive_read());
+	EXPECT_ZERO(test_many_readers());
+	EXPECT_ZERO(test_unlock_unheld());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,333 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define THREAD_WRAPPER_VOID(fn) \
+static void *fn##_wrap(void *v __attribute__((unused))) { \
+	return (void*)(intptr_t)fn(); \
+}
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock3 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_once_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_once_outer = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static sem_t g_sem;
+static sem_t g_sem2;
+static pthread_mutex_t g_sig_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_handler_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t g_sig_sem;
+static sem_t g_sig_ready;
+static pthread_t g_sig_target;
+static volatile sig_atomic_t g_handled;
+
+static char g_last_report[4096];
+
+static void save_report(int code, const char *msg)
+{
+	record_error(code, msg);
+	if (code == EDEADLK)
+		snprintf(g_last_report, sizeof(g_last_report), "%s", msg);
+}
+
+static int run_thread(void *(*fn)(void *))
+{
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(pthread_create(&thread, NULL, fn, NULL));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	return 0;
+}
+
+static int post_unlocked(void)
+{
+	int i;
+
+	for (i = 0; i < 100; i++)
+		EXPECT_ZERO(sem_post(&g_sem));
+	return 0;
+}
+
+THREAD_WRAPPER_VOID(post_unlocked);
+
+/**
+ * Test that posting and waiting without holding any locks is never a
+ * problem.
+ */
+static int test_post_unlocked(void)
+{
+	pthread_t thread;
+	void *rval;
+	int i;
+
+	EXPECT_ZERO(sem_init(&g_sem, 0, 0));
+	EXPECT_ZERO(pthread_create(&thread, NULL, post_unlocked_wrap, NULL));
+	for (i = 0; i < 100; i++)
+		EXPECT_ZERO(sem_wait(&g_sem));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	EXPECT_EQ(sem_trywait(&g_sem), -1);
+	EXPECT_EQ(errno, EAGAIN);
+	EXPECT_ZERO(sem_destroy(&g_sem));
+	lksmith_flush_edges();
+	EXPECT_EQ(num_recorded_errors(), 0);
+	return 0;
+}
+
+__attribute__((noinline)) int sem_unit_wait_holding(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock));
+	EXPECT_ZERO(sem_wait(&g_sem));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock));
+	return 0;
+}
+
+THREAD_WRAPPER_VOID(sem_unit_wait_holding);
+
+__attribute__((noinline)) int sem_unit_post_holding(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock));
+	EXPECT_ZERO(sem_post(&g_sem));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock));
+	return 0;
+}
+
+THREAD_WRAPPER_VOID(sem_unit_post_holding);
+
+/**
+ * Test that posting a semaphore while holding a lock that a waiter held is
+ * reported, along with the stack of the wait.  The semaphore starts at 1, so
+ * the wait doesn't block.
+ */
+static int test_wait_then_post(void)
+{
+	EXPECT_ZERO(sem_init(&g_sem, 0, 1));
+	EXPECT_ZERO(run_thread(sem_unit_wait_holding_wrap));
+	EXPECT_ZERO(run_thread(sem_unit_post_holding_wrap));
+	lksmith_flush_edges();
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_NOT_EQ(strstr(g_last_report, "sem_unit_wait_holding"), NULL);
+	EXPECT_ZERO(sem_destroy(&g_sem));
+	EXPECT_EQ(num_recorded_errors(), 0);
+	return 0;
+}
+
+/**
+ * Test that waiting on a semaphore while holding a lock that a poster held is
+ * reported.
+ */
+static int test_post_then_wait(void)
+{
+	EXPECT_ZERO(sem_init(&g_sem2, 0, 0));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+	EXPECT_ZERO(sem_post(&g_sem2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	lksmith_flush_edges();
+	EXPECT_EQ(num_recorded_errors(), 0);
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+	EXPECT_ZERO(sem_wait(&g_sem2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	lksmith_flush_edges();
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(sem_destroy(&g_sem2));
+	EXPECT_EQ(num_recorded_errors(), 0);
+	return 0;
+}
+
+/**
+ * Test that waiting at a barrier while holding a lock is reported, and that
+ * waiting at one while holding nothing is not.
+ */
+static int test_barrier(void)
+{
+	pthread_barrier_t barrier;
+	struct lksmith_stats before, after;
+
+	EXPECT_ZERO(pthread_barrier_init(&barrier, NULL, 1));
+	EXPECT_EQ(pthread_barrier_wait(&barrier),
+		PTHREAD_BARRIER_SERIAL_THREAD);
+	lksmith_flush_edges();
+	EXPECT_EQ(num_recorded_errors(), 0);
+	EXPECT_ZERO(lksmith_get_stats(&before, sizeof(before)));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock3));
+	EXPECT_EQ(pthread_barrier_wait(&barrier),
+		PTHREAD_BARRIER_SERIAL_THREAD);
+	EXPECT_EQ(pthread_barrier_wait(&barrier),
+		PTHREAD_BARRIER_SERIAL_THREAD);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock3));
+	lksmith_flush_edges();
+	/* Reported once, and without adding any orderings. */
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_EQ(num_recorded_errors(), 0);
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.edges, before.edges);
+	EXPECT_ZERO(pthread_barrier_destroy(&barrier));
+	EXPECT_EQ(num_recorded_errors(), 0);
+	return 0;
+}
+
+static void once_init(void)
+{
+	pthread_mutex_lock(&g_once_lock);
+	pthread_mutex_unlock(&g_once_lock);
+}
+
+static int call_once(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_once_outer));
+	EXPECT_ZERO(pthread_once(&g_once, once_init));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_once_outer));
+	return 0;
+}
+
+THREAD_WRAPPER_VOID(call_once);
+
+/**
+ * Test that pthread_once checks nothing once the init routine has finished,
+ * since it will never wait again, but that the orderings it saw before that
+ * are kept.
+ */
+static int test_once(void)
+{
+	struct lksmith_stats before, mid, after;
+	int i;
+
+	EXPECT_ZERO(lksmith_get_stats(&before, sizeof(before)));
+	EXPECT_ZERO(run_thread(call_once_wrap));
+	lksmith_flush_edges();
+	EXPECT_ZERO(lksmith_get_stats(&mid, sizeof(mid)));
+	/* g_once_outer, the once control, and g_once_lock. */
+	EXPECT_EQ(mid.locks, before.locks + 3);
+	EXPECT_ZERO(pthread_mutex_lock(&g_once_lock));
+	for (i = 0; i < 100; i++)
+		EXPECT_ZERO(pthread_once(&g_once, once_init));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_once_lock));
+	lksmith_flush_edges();
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.locks, mid.locks);
+	EXPECT_EQ(after.edges, mid.edges);
+	EXPECT_EQ(num_recorded_errors(), 0);
+	/* g_once_outer was held while the routine took g_once_lock. */
+	EXPECT_ZERO(pthread_mutex_lock(&g_once_lock));
+	EXPECT_ZERO(pthread_mutex_lock(&g_once_outer));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_once_outer));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_once_lock));
+	lksmith_flush_edges();
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_EQ(num_recorded_errors(), 0);
+	return 0;
+}
+
+static void take_lock_in_handler(int sig __attribute__((unused)))
+{
+	pthread_mutex_lock(&g_handler_lock);
+	pthread_mutex_unlock(&g_handler_lock);
+	sem_post(&g_sig_sem);
+	g_handled = 1;
+}
+
+static void *interrupt_locker(void *v __attribute__((unused)))
+{
+	struct timespec ts = { 0, 50000000 };
+
+	if (pthread_mutex_lock(&g_sig_lock))
+		return (void*)(intptr_t)1;
+	if (sem_post(&g_sig_ready))
+		return (void*)(intptr_t)1;
+	/* Give the main thread time to get into pthread_mutex_lock, between
+	 * prelock and postlock. */
+	nanosleep(&ts, NULL);
+	if (pthread_kill(g_sig_target, SIGUSR1))
+		return (void*)(intptr_t)1;
+	while (!g_handled)
+		nanosleep(&ts, NULL);
+	if (pthread_mutex_unlock(&g_sig_lock))
+		return (void*)(intptr_t)1;
+	return NULL;
+}
+
+/**
+ * Test that a signal handler which takes a lock and posts a semaphore while
+ * the thread it interrupted is waiting for a lock doesn't confuse the
+ * bookkeeping of the interrupted acquisition.
+ */
+static int test_signal_between_hooks(void)
+{
+	struct sigaction act;
+	pthread_t thread;
+	void *rval;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = take_lock_in_handler;
+	EXPECT_ZERO(sigaction(SIGUSR1, &act, NULL));
+	EXPECT_ZERO(sem_init(&g_sig_sem, 0, 0));
+	EXPECT_ZERO(sem_init(&g_sig_ready, 0, 0));
+	g_sig_target = pthread_self();
+	EXPECT_ZERO(pthread_create(&thread, NULL, interrupt_locker, NULL));
+	EXPECT_ZERO(sem_wait(&g_sig_ready));
+	EXPECT_ZERO(pthread_mutex_lock(&g_sig_lock));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_sig_lock));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	EXPECT_EQ(g_handled, 1);
+	EXPECT_ZERO(sem_wait(&g_sig_sem));
+	EXPECT_ZERO(sem_destroy(&g_sig_ready));
+	EXPECT_ZERO(sem_destroy(&g_sig_sem));
+	lksmith_flush_edges();
+	EXPECT_EQ(num_recorded_errors(), 0);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(save_report);
+	EXPECT_ZERO(test_post_unlocked());
+	EXPECT_ZERO(test_wait_then_post());
+	EXPECT_ZERO(test_post_then_wait());
+	EXPECT_ZERO(test_barrier());
+	EXPECT_ZERO(test_once());
+	EXPECT_ZERO(test_signal_between_hooks());
+
+	return EXIT_SUCCESS;
+}
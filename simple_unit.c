@@ -118,6 +118,56 @@ static int test_recursive_mutex(void)
 	return 0;
 }
 
+#define RECURSION_DEPTH 1000
+
+static int test_deep_recursion(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutex_t mutex;
+	int i;
+
+	EXPECT_ZERO(pthread_mutexattr_init(&attr));
+	EXPECT_ZERO(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE));
+	EXPECT_ZERO(pthread_mutex_init(&mutex, &attr));
+	for (i = 0; i < RECURSION_DEPTH; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&mutex));
+	}
+	for (i = 0; i < RECURSION_DEPTH; i++) {
+		EXPECT_ZERO(pthread_mutex_unlock(&mutex));
+	}
+	EXPECT_ZERO(pthread_mutexattr_destroy(&attr));
+	/* This fails if any holder record was left behind. */
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex));
+	return 0;
+}
+
+#define NUM_MANY_HELD 20
+
+static int test_many_held_locks(void)
+{
+	pthread_mutex_t mutex[NUM_MANY_HELD];
+	int i;
+
+	for (i = 0; i < NUM_MANY_HELD; i++) {
+		EXPECT_ZERO(pthread_mutex_init(&mutex[i], NULL));
+	}
+	for (i = 0; i < NUM_MANY_HELD; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&mutex[i]));
+	}
+	/* release the even locks out of order, then the rest in order */
+	for (i = 0; i < NUM_MANY_HELD; i += 2) {
+		EXPECT_ZERO(pthread_mutex_unlock(&mutex[i]));
+	}
+	for (i = NUM_MANY_HELD - 1; i >= 0; i--) {
+		if (i % 2)
+			EXPECT_ZERO(pthread_mutex_unlock(&mutex[i]));
+	}
+	for (i = 0; i < NUM_MANY_HELD; i++) {
+		EXPECT_ZERO(pthread_mutex_destroy(&mutex[i]));
+	}
+	return 0;
+}
+
 int main(void)
 {
 	set_error_cb(die_on_error);
@@ -129,6 +179,8 @@ int main(void)
 	EXPECT_ZERO(test_mutex_lock_simple_static());
 	EXPECT_ZERO(test_spin_lock_simple());
 	EXPECT_ZERO(test_recursive_mutex());
+	EXPECT_ZERO(test_deep_recursion());
+	EXPECT_ZERO(test_many_held_locks());
 
 	return EXIT_SUCCESS;
 }
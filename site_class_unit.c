@@ -0,0 +1,141 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* This test is run with LKSMITH_CLASS_BY_SITE=1. */
+
+#define NUM_OBJS 1000
+
+struct obj {
+	pthread_mutex_t lock;
+};
+
+static struct obj g_objs[NUM_OBJS];
+
+static pthread_mutex_t g_table;
+
+/* The init site is the return address of pthread_mutex_init, so these
+ * helpers must not turn it into a tail call.  Otherwise the site would be
+ * wherever the helper was called from.  The compiler barrier after the call
+ * keeps it a real call. */
+static int __attribute__((noinline)) obj_init(struct obj *obj)
+{
+	int ret;
+
+	ret = pthread_mutex_init(&obj->lock, NULL);
+	__asm__ __volatile__("" : : : "memory");
+	return ret;
+}
+
+static int __attribute__((noinline)) table_init(void)
+{
+	int ret;
+
+	ret = pthread_mutex_init(&g_table, NULL);
+	__asm__ __volatile__("" : : : "memory");
+	return ret;
+}
+
+static int test_objects_share_a_node(void)
+{
+	struct lksmith_stats before, after;
+	int i;
+
+	EXPECT_ZERO(lksmith_get_stats(&before, sizeof(before)));
+	for (i = 0; i < NUM_OBJS; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&g_objs[i].lock));
+		EXPECT_ZERO(pthread_mutex_lock(&g_table));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_table));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_objs[i].lock));
+	}
+	EXPECT_ZERO(num_recorded_errors());
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.edges - before.edges, 1);
+	return 0;
+}
+
+static int test_class_inversion(void)
+{
+	/* The class remembers its ordering after g_table is destroyed, and
+	 * this object has never been taken with g_table, but other objects
+	 * initialized at the same place have. */
+	EXPECT_ZERO(table_init());
+	EXPECT_ZERO(pthread_mutex_lock(&g_table));
+	EXPECT_ZERO(pthread_mutex_lock(&g_objs[7].lock));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_objs[7].lock));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_table));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int test_same_class_nesting(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_objs[1].lock));
+	EXPECT_ZERO(pthread_mutex_lock(&g_objs[2].lock));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_objs[2].lock));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_objs[1].lock));
+	EXPECT_ZERO(pthread_mutex_lock(&g_objs[2].lock));
+	EXPECT_ZERO(pthread_mutex_lock(&g_objs[1].lock));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_objs[1].lock));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_objs[2].lock));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+int main(void)
+{
+	int i;
+
+	set_error_cb(record_error);
+	for (i = 0; i < NUM_OBJS; i++) {
+		EXPECT_ZERO(obj_init(&g_objs[i]));
+	}
+	EXPECT_ZERO(table_init());
+	EXPECT_ZERO(test_objects_share_a_node());
+	EXPECT_ZERO(pthread_mutex_destroy(&g_table));
+	EXPECT_ZERO(test_class_inversion());
+	EXPECT_ZERO(test_same_class_nesting());
+	for (i = 0; i < NUM_OBJS; i++) {
+		EXPECT_ZERO(pthread_mutex_destroy(&g_objs[i].lock));
+	}
+	EXPECT_ZERO(pthread_mutex_destroy(&g_table));
+	EXPECT_ZERO(num_recorded_errors());
+
+	return EXIT_SUCCESS;
+}
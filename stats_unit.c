@@ -0,0 +1,150 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* This test is run with LKSMITH_STATS_SIGNAL=10 (SIGUSR1). */
+
+#define NUM_ITERS 100
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+
+static int g_num_dumps;
+
+static void save_stats_dump(int code, const char *msg)
+{
+	if (strstr(msg, "counters: "))
+		__atomic_add_fetch(&g_num_dumps, 1, __ATOMIC_SEQ_CST);
+	record_error(code, msg);
+}
+
+static int lock_many_times(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_ITERS; i++) {
+		EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+		EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	}
+	return 0;
+}
+
+static void *lock_many_times_wrap(void *v __attribute__((unused)))
+{
+	return (void*)(intptr_t)lock_many_times();
+}
+
+static int test_counters(void)
+{
+	struct lksmith_stats before, after;
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(lksmith_get_stats(&before, sizeof(before)));
+	EXPECT_ZERO(lock_many_times());
+	/* Counters from threads which have exited are kept. */
+	EXPECT_ZERO(pthread_create(&thread, NULL, lock_many_times_wrap, NULL));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_EQ(find_recorded_error(EDEADLK), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	EXPECT_EQ(pthread_mutex_unlock(&g_lock1), EPERM);
+	EXPECT_EQ(find_recorded_error(EPERM), 1);
+	EXPECT_ZERO(lksmith_get_stats(&after, sizeof(after)));
+	EXPECT_EQ(after.acquisitions - before.acquisitions,
+		(2 * NUM_ITERS) + 4);
+	EXPECT_EQ(after.edges - before.edges, 1);
+	EXPECT_EQ(after.locks - before.locks, 2);
+	EXPECT_EQ(after.deadlock_errors - before.deadlock_errors, 1);
+	EXPECT_EQ(after.unlock_errors - before.unlock_errors, 1);
+	EXPECT_EQ(after.total_errors - before.total_errors, 2);
+	EXPECT_GE(after.threads, 1);
+	EXPECT_GT(after.lock_bytes, 0);
+	EXPECT_GT(after.pool_bytes, 0);
+	return 0;
+}
+
+static int test_short_stats(void)
+{
+	uint64_t buf[3];
+
+	/* A program which only knows about the first two fields only gets
+	 * those. */
+	buf[2] = 0xdeadbeef;
+	EXPECT_ZERO(lksmith_get_stats((struct lksmith_stats *)buf,
+		2 * sizeof(uint64_t)));
+	EXPECT_EQ(buf[2], 0xdeadbeef);
+	EXPECT_GE(buf[1], 2);
+	EXPECT_EQ(lksmith_get_stats(NULL, 0), EINVAL);
+	return 0;
+}
+
+static int test_dump_on_signal(void)
+{
+	struct timespec ts = { 0, 1000000 };
+	int i;
+
+	EXPECT_ZERO(raise(SIGUSR1));
+	for (i = 0; i < 10000; i++) {
+		if (__atomic_load_n(&g_num_dumps, __ATOMIC_SEQ_CST) > 0)
+			break;
+		nanosleep(&ts, NULL);
+	}
+	EXPECT_EQ(__atomic_load_n(&g_num_dumps, __ATOMIC_SEQ_CST), 1);
+	return 0;
+}
+
+int main(void)
+{
+	set_error_cb(save_stats_dump);
+	EXPECT_ZERO(test_counters());
+	EXPECT_ZERO(test_short_stats());
+	EXPECT_ZERO(test_dump_on_signal());
+	EXPECT_ZERO(num_recorded_errors());
+
+	return EXIT_SUCCESS;
+}
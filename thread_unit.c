@@ -32,6 +32,7 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,16 +55,62 @@ static void* test_thread_name_set_and_get(void *v __attribute__((unused)))
 	return (void*)(uintptr_t)test_thread_name_set_and_get_impl();
 }
 
+static pthread_mutex_t g_busy_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t g_busy_sem1, g_busy_sem2;
+static char g_busy_report[4096];
+
+static void save_busy_report(int code, const char *msg)
+{
+	if (code != EBUSY) {
+		die_on_error(code, msg);
+		return;
+	}
+	snprintf(g_busy_report, sizeof(g_busy_report), "%s", msg);
+}
+
+static void *busy_holder(void *v __attribute__((unused)))
+{
+	pthread_mutex_lock(&g_busy_lock);
+	/* Thread names are looked up when they are reported, so renaming
+	 * ourselves after taking the lock still counts. */
+	lksmith_set_thread_name("busy_holder");
+	sem_post(&g_busy_sem1);
+	sem_wait(&g_busy_sem2);
+	pthread_mutex_unlock(&g_busy_lock);
+	return NULL;
+}
+
+static int test_report_names_holder(void)
+{
+	pthread_t pthread;
+	void *rval;
+
+	EXPECT_ZERO(sem_init(&g_busy_sem1, 0, 0));
+	EXPECT_ZERO(sem_init(&g_busy_sem2, 0, 0));
+	EXPECT_ZERO(pthread_create(&pthread, NULL, busy_holder, NULL));
+	EXPECT_ZERO(sem_wait(&g_busy_sem1));
+	EXPECT_EQ(pthread_mutex_destroy(&g_busy_lock), EBUSY);
+	EXPECT_NOT_EQ(strstr(g_busy_report, "in use by thread busy_holder"),
+		NULL);
+	EXPECT_ZERO(sem_post(&g_busy_sem2));
+	EXPECT_ZERO(pthread_join(pthread, &rval));
+	EXPECT_EQ(rval, NULL);
+	EXPECT_ZERO(sem_destroy(&g_busy_sem1));
+	EXPECT_ZERO(sem_destroy(&g_busy_sem2));
+	return 0;
+}
+
 int main(void)
 {
 	pthread_t pthread;
 	void *rval;
 
-	set_error_cb(die_on_error);
+	set_error_cb(save_busy_report);
 	EXPECT_ZERO(pthread_create(&pthread, NULL,
 		test_thread_name_set_and_get, NULL));
 	EXPECT_ZERO(pthread_join(pthread, &rval));
 	EXPECT_EQ(rval, 0); 
+	EXPECT_ZERO(test_report_names_holder());
 
 	return EXIT_SUCCESS;
 }
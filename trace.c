@@ -0,0 +1,251 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "backtrace.h"
+#include "depot.h"
+#include "error.h"
+#include "profile.h"
+#include "trace.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Number of stack IDs whose frames we keep track of writing out.  Stacks
+ * with higher IDs are written out every time they are used.
+ */
+#define TRACE_EMITTED_MAX (1 << 20)
+
+/**
+ * The trace file, or -1 if we aren't tracing.
+ */
+static int g_trace_fd = -1;
+
+/**
+ * The path of the symbol file.
+ */
+static char g_trace_syms_path[PATH_MAX];
+
+/**
+ * Number of segments which have been claimed.
+ */
+static uint64_t g_trace_num_segs;
+
+/**
+ * Bitmap of the stack IDs whose frames have been written to the trace.  The
+ * stacks themselves live in the depot.
+ */
+static uint64_t g_trace_emitted[TRACE_EMITTED_MAX / 64];
+
+int trace_open(const char *path)
+{
+	struct lksmith_trace_header hdr;
+	int fd, ret;
+
+	if (strlen(path) + sizeof(".syms") > sizeof(g_trace_syms_path))
+		return ENAMETOOLONG;
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return errno;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = LKSMITH_TRACE_MAGIC;
+	hdr.version = LKSMITH_TRACE_VERSION;
+	hdr.rec_size = sizeof(struct lksmith_trace_rec);
+	hdr.header_size = LKSMITH_TRACE_HEADER_SIZE;
+	hdr.segment_size = LKSMITH_TRACE_SEGMENT_SIZE;
+	errno = 0;
+	if ((pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+			ftruncate(fd, LKSMITH_TRACE_HEADER_SIZE)) {
+		ret = errno ? errno : EIO;
+		close(fd);
+		return ret;
+	}
+	strcpy(g_trace_syms_path, path);
+	strcat(g_trace_syms_path, ".syms");
+	g_trace_fd = fd;
+	atexit(trace_write_symbols);
+	return 0;
+}
+
+/**
+ * Claim and map a new segment for the current thread.
+ *
+ * Segments are never unmapped.  Whatever a thread has written stays in the
+ * file, even if the process crashes.
+ *
+ * @param w		The current thread's writer.
+ *
+ * @return		0 on success; error code otherwise
+ */
+static int trace_writer_refill(struct trace_writer *w)
+{
+	uint64_t seg;
+	off_t off;
+	void *addr;
+	int ret;
+
+	seg = __atomic_fetch_add(&g_trace_num_segs, 1, __ATOMIC_RELAXED);
+	off = LKSMITH_TRACE_HEADER_SIZE + (seg * LKSMITH_TRACE_SEGMENT_SIZE);
+	/* Unlike ftruncate, this never shrinks the file out from under a
+	 * thread which has claimed a later segment. */
+	ret = posix_fallocate(g_trace_fd, off, LKSMITH_TRACE_SEGMENT_SIZE);
+	if (ret)
+		return ret;
+	addr = mmap(NULL, LKSMITH_TRACE_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED, g_trace_fd, off);
+	if (addr == MAP_FAILED)
+		return errno;
+	w->next = addr;
+	w->end = w->next + (LKSMITH_TRACE_SEGMENT_SIZE /
+		sizeof(struct lksmith_trace_rec));
+	return 0;
+}
+
+int trace_emit(struct trace_writer *w, int op, const void *ptr,
+		const void *site, uint32_t tid, uint32_t stack, int flags,
+		int err)
+{
+	struct lksmith_trace_rec *rec;
+	int ret;
+
+	if (w->next == w->end) {
+		ret = trace_writer_refill(w);
+		if (ret)
+			return ret;
+	}
+	rec = w->next++;
+	rec->ptr = (uintptr_t)ptr;
+	rec->ts = prof_now();
+	rec->site = (uintptr_t)site;
+	rec->tid = tid;
+	rec->stack = stack;
+	rec->flags = flags;
+	rec->err = err;
+	/* A zero op ends the segment, so it goes in last. */
+	__atomic_store_n(&rec->op, op, __ATOMIC_RELEASE);
+	return 0;
+}
+
+uint32_t trace_stack_id(struct trace_writer *w, uint32_t tid,
+		void **frames, int nframes)
+{
+	uint64_t bit;
+	uint32_t id;
+	int i;
+
+	id = depot_put(frames, nframes, NULL);
+	if (!id)
+		return 0;
+	/* The stack may have gone into the depot without being traced, so we
+	 * keep track of which ones we have written out ourselves. */
+	if (id < TRACE_EMITTED_MAX) {
+		bit = 1ULL << (id % 64);
+		if (__atomic_fetch_or(&g_trace_emitted[id / 64], bit,
+				__ATOMIC_RELAXED) & bit)
+			return id;
+	}
+	/* lksmith-analyze reads all of the frames before any events, so it
+	 * doesn't matter if another thread uses this ID before we are
+	 * done. */
+	for (i = 0; i < nframes; i++) {
+		if (trace_emit(w, LKSMITH_TRACE_FRAME, frames[i], NULL, tid,
+				id, nframes, i))
+			break;
+	}
+	return id;
+}
+
+/**
+ * Compare two return addresses, for qsort.
+ *
+ * @param a		Pointer to the first address.
+ * @param b		Pointer to the second address.
+ *
+ * @return		-1, 0, or 1.
+ */
+static int trace_compare_frames(const void *a, const void *b)
+{
+	uintptr_t fa = (uintptr_t)*(void * const *)a;
+	uintptr_t fb = (uintptr_t)*(void * const *)b;
+
+	return (fa < fb) ? -1 : ((fa > fb) ? 1 : 0);
+}
+
+void trace_write_symbols(void)
+{
+	void **frames = NULL, **nf, **st;
+	size_t i, num = 0, cap = 0;
+	uint32_t id, max_id;
+	int j, nframes;
+	FILE *fp;
+
+	/* We write out every stack in the depot, even ones which were never
+	 * traced.  There usually aren't many of those. */
+	max_id = depot_max_id();
+	for (id = 1; id <= max_id; id++) {
+		nframes = depot_get(id, &st);
+		for (j = 0; j < nframes; j++) {
+			if (num == cap) {
+				cap = cap ? (cap * 2) : 256;
+				nf = realloc(frames, sizeof(void*) * cap);
+				if (!nf)
+					goto oom;
+				frames = nf;
+			}
+			frames[num++] = st[j];
+		}
+	}
+	qsort(frames, num, sizeof(void*), trace_compare_frames);
+	fp = fopen(g_trace_syms_path, "w");
+	if (!fp) {
+		lksmith_error(errno, "trace_write_symbols: failed to open "
+			"%s: %s\n", g_trace_syms_path, terror(errno));
+		free(frames);
+		return;
+	}
+	for (i = 0; i < num; i++) {
+		if ((i > 0) && (frames[i] == frames[i - 1]))
+			continue;
+		fprintf(fp, "%p %s\n", frames[i], bt_frame_name(frames[i]));
+	}
+	fclose(fp);
+	free(frames);
+	return;
+oom:
+	free(frames);
+	lksmith_error(ENOMEM, "trace_write_symbols: out of memory.\n");
+}
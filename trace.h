@@ -0,0 +1,186 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2013, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LKSMITH_TRACE_H
+#define LKSMITH_TRACE_H
+
+#include <stdint.h> /* for uint64_t */
+
+/**
+ * The lock event trace.
+ *
+ * When LKSMITH_TRACE=file:/path is set, Locksmith doesn't check anything
+ * while the program runs.  Instead, it writes a fixed-size record for every
+ * lock event to the trace file, and lksmith-analyze checks the trace later.
+ *
+ * The file starts with a struct lksmith_trace_header, padded out to
+ * header_size bytes.  After that come segments of segment_size bytes, each
+ * holding records from a single thread, in the order they happened.  A
+ * record with op LKSMITH_TRACE_NONE ends a segment early.  Threads claim a
+ * segment at a time and write to it through a shared mapping, so tracing a
+ * lock event doesn't need any system calls.
+ *
+ * Stacks are stored only once.  The first thread to see a stack writes it
+ * out as LKSMITH_TRACE_FRAME records, and events refer to it by its ID.
+ * When the process exits, the names of all of the frames are written to
+ * /path.syms, one "address name" pair per line.
+ */
+
+#define LKSMITH_TRACE_MAGIC 0x4543415254534b4cULL /* "LKSTRACE" */
+
+#define LKSMITH_TRACE_VERSION 1
+
+#define LKSMITH_TRACE_HEADER_SIZE 4096
+
+#define LKSMITH_TRACE_SEGMENT_SIZE (1024 * 1024)
+
+enum lksmith_trace_op {
+	/** Not a record; the rest of the segment is unused */
+	LKSMITH_TRACE_NONE = 0,
+	/** One frame of a stack.  ptr is the return address, err is its
+	 * index, and flags is the number of frames in the stack. */
+	LKSMITH_TRACE_FRAME = 1,
+	/** pthread_*_init.  flags holds LKSMITH_TRACE_RECURSIVE and
+	 * LKSMITH_TRACE_SLEEPER. */
+	LKSMITH_TRACE_INIT = 2,
+	/** pthread_*_destroy */
+	LKSMITH_TRACE_DESTROY = 3,
+	/** About to take a lock.  flags holds LKSMITH_TRACE_SLEEPER. */
+	LKSMITH_TRACE_PRELOCK = 4,
+	/** Finished taking a lock.  err is the lock function's result. */
+	LKSMITH_TRACE_POSTLOCK = 5,
+	/** About to take a lock shared */
+	LKSMITH_TRACE_PRERDLOCK = 6,
+	/** Finished taking a lock shared.  err is the lock function's
+	 * result. */
+	LKSMITH_TRACE_POSTRDLOCK = 7,
+	/** About to release a lock */
+	LKSMITH_TRACE_UNLOCK = 8,
+	/** About to wait on a semaphore */
+	LKSMITH_TRACE_WAIT = 9,
+	/** About to post a semaphore */
+	LKSMITH_TRACE_POST = 10,
+	/** About to wait at a barrier */
+	LKSMITH_TRACE_BARRIER = 11,
+};
+
+#define LKSMITH_TRACE_RECURSIVE 0x1
+#define LKSMITH_TRACE_SLEEPER 0x2
+
+struct lksmith_trace_header {
+	/** LKSMITH_TRACE_MAGIC */
+	uint64_t magic;
+	/** LKSMITH_TRACE_VERSION */
+	uint32_t version;
+	/** sizeof(struct lksmith_trace_rec) */
+	uint32_t rec_size;
+	/** Offset of the first segment */
+	uint32_t header_size;
+	/** Size of each segment */
+	uint32_t segment_size;
+};
+
+struct lksmith_trace_rec {
+	/** The lock, or the return address for LKSMITH_TRACE_FRAME */
+	uint64_t ptr;
+	/** When the event happened, in nanoseconds; see prof_now */
+	uint64_t ts;
+	/** The call site */
+	uint64_t site;
+	/** The thread's Locksmith thread ID */
+	uint32_t tid;
+	/** The ID of the stack, or 0 if we didn't capture one */
+	uint32_t stack;
+	/** An lksmith_trace_op */
+	uint16_t op;
+	/** Flags; see lksmith_trace_op */
+	uint16_t flags;
+	/** Error code; see lksmith_trace_op */
+	int32_t err;
+};
+
+/**
+ * A thread's position in the trace.  This lives in the thread-local storage.
+ */
+struct trace_writer {
+	/** The next record to write, or NULL if we don't have a segment */
+	struct lksmith_trace_rec *next;
+	/** The end of our segment */
+	struct lksmith_trace_rec *end;
+};
+
+/**
+ * Open the trace file and write its header.
+ *
+ * @param path		The path of the trace file.
+ *
+ * @return		0 on success; error code otherwise
+ */
+int trace_open(const char *path);
+
+/**
+ * Write a record to the trace.
+ *
+ * @param w		The current thread's writer.
+ * @param op		The lksmith_trace_op.
+ * @param ptr		The lock.
+ * @param site		The call site.
+ * @param tid		The current thread's Locksmith thread ID.
+ * @param stack		The stack ID, or 0.
+ * @param flags		The flags.
+ * @param err		The error code.
+ *
+ * @return		0 on success; error code otherwise
+ */
+int trace_emit(struct trace_writer *w, int op, const void *ptr,
+		const void *site, uint32_t tid, uint32_t stack, int flags,
+		int err);
+
+/**
+ * Get the depot ID of a stack, writing the stack to the trace if this is the
+ * first time it has been traced.
+ *
+ * @param w		The current thread's writer.
+ * @param tid		The current thread's Locksmith thread ID.
+ * @param frames	The return addresses.
+ * @param nframes	The number of return addresses.
+ *
+ * @return		The stack ID, or 0 if we ran out of memory.
+ */
+uint32_t trace_stack_id(struct trace_writer *w, uint32_t tid,
+		void **frames, int nframes);
+
+/**
+ * Write the names of all of the frames in the trace to the symbol file.
+ *
+ * This is registered with atexit when the trace is opened.
+ */
+void trace_write_symbols(void);
+
+#endif
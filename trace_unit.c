@@ -0,0 +1,174 @@
+/*
+ * vim: ts=8:sw=8:tw=79:noet
+ *
+ * Copyright (c) 2011-2012, the Locksmith authors.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lksmith.h"
+#include "test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * We run ourselves with LKSMITH_TRACE set, and then check the trace with
+ * lksmith-analyze, which LKSMITH_ANALYZE points to.
+ */
+
+#define TRACE_FILE "trace_unit.trace"
+
+#define THREAD_WRAPPER_VOID(fn) \
+static void *fn##_wrap(void *v __attribute__((unused))) { \
+	return (void*)(intptr_t)fn(); \
+}
+
+static pthread_mutex_t g_lock1 = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_lock2 = PTHREAD_MUTEX_INITIALIZER;
+
+static int take_1_then_2(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	return 0;
+}
+
+THREAD_WRAPPER_VOID(take_1_then_2);
+
+static int take_2_then_1(void)
+{
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock2));
+	EXPECT_ZERO(pthread_mutex_lock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock1));
+	EXPECT_ZERO(pthread_mutex_unlock(&g_lock2));
+	return 0;
+}
+
+THREAD_WRAPPER_VOID(take_2_then_1);
+
+static int run_thread(void *(*fn)(void *))
+{
+	pthread_t thread;
+	void *rval;
+
+	EXPECT_ZERO(pthread_create(&thread, NULL, fn, NULL));
+	EXPECT_ZERO(pthread_join(thread, &rval));
+	EXPECT_EQ(rval, NULL);
+	return 0;
+}
+
+/**
+ * The traced program.  None of its mistakes are caught while it runs.
+ */
+static int traced_main(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutex_t mutex;
+
+	set_error_cb(record_error);
+	EXPECT_ZERO(run_thread(take_1_then_2_wrap));
+	EXPECT_ZERO(run_thread(take_2_then_1_wrap));
+	EXPECT_ZERO(pthread_mutexattr_init(&attr));
+	EXPECT_ZERO(pthread_mutexattr_settype(&attr,
+		PTHREAD_MUTEX_ERRORCHECK));
+	EXPECT_ZERO(pthread_mutex_init(&mutex, &attr));
+	EXPECT_ZERO(pthread_mutexattr_destroy(&attr));
+	EXPECT_EQ(pthread_mutex_unlock(&mutex), EPERM);
+	EXPECT_ZERO(pthread_mutex_lock(&mutex));
+	EXPECT_EQ(pthread_mutex_destroy(&mutex), EBUSY);
+	/* That was pthreads itself complaining, not the lock checking. */
+	EXPECT_EQ(find_recorded_error(EBUSY), 1);
+	EXPECT_ZERO(pthread_mutex_unlock(&mutex));
+	EXPECT_ZERO(pthread_mutex_destroy(&mutex));
+	EXPECT_ZERO(num_recorded_errors());
+	return 0;
+}
+
+static int run_traced(const char *self)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	EXPECT_NOT_EQ(pid, -1);
+	if (pid == 0) {
+		setenv("LKSMITH_TRACE", "file:" TRACE_FILE, 1);
+		execl(self, self, "traced", (char*)NULL);
+		_exit(127);
+	}
+	EXPECT_EQ(waitpid(pid, &status, 0), pid);
+	EXPECT_NONZERO(WIFEXITED(status));
+	EXPECT_ZERO(WEXITSTATUS(status));
+	return 0;
+}
+
+static int test_analyze(const char *self)
+{
+	char cmd[4096], line[4096];
+	const char *analyze;
+	int inversions = 0, bad_unlocks = 0, bad_destroys = 0, summary = 0;
+	FILE *fp;
+
+	analyze = getenv("LKSMITH_ANALYZE");
+	EXPECT_NOT_EQ(analyze, NULL);
+	EXPECT_ZERO(run_traced(self));
+	snprintf(cmd, sizeof(cmd), "%s %s", analyze, TRACE_FILE);
+	fp = popen(cmd, "r");
+	EXPECT_NOT_EQ(fp, NULL);
+	while (fgets(line, sizeof(line), fp)) {
+		fputs(line, stdout);
+		if (strstr(line, "lock inversion!"))
+			inversions++;
+		if (strstr(line, "does not currently hold"))
+			bad_unlocks++;
+		if (strstr(line, "before destroying it"))
+			bad_destroys++;
+		if (strstr(line, "Found 3 problems."))
+			summary++;
+	}
+	EXPECT_ZERO(pclose(fp));
+	EXPECT_EQ(inversions, 1);
+	EXPECT_EQ(bad_unlocks, 1);
+	EXPECT_EQ(bad_destroys, 1);
+	EXPECT_EQ(summary, 1);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if ((argc > 1) && (!strcmp(argv[1], "traced")))
+		return traced_main() ? EXIT_FAILURE : EXIT_SUCCESS;
+	EXPECT_ZERO(test_analyze(argv[0]));
+	return EXIT_SUCCESS;
+}
@@ -63,14 +63,44 @@ void fwdprintf(char *buf, size_t *off, size_t buf_len, const char *fmt, ...)
 		*off = o + res;
 }
 
+/**
+ * The longest we busy-wait between attempts to take a simple spin lock, in
+ * pause instructions.  After that, we sleep between attempts.
+ */
+#define SPIN_MAX_PAUSES 1024
+
+/**
+ * Tell the CPU that we are busy-waiting.
+ */
+static inline void cpu_pause(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
 void simple_spin_lock(int *lock)
 {
 	struct timespec ts;
+	unsigned int i, pauses = 1;
 
 	while (1) {
-		if (__sync_bool_compare_and_swap(lock, 0, 1)) {
+		/* Only try the atomic operation when the lock looks free, so
+		 * waiters don't keep stealing the cache line. */
+		if ((__atomic_load_n(lock, __ATOMIC_RELAXED) == 0) &&
+				__sync_bool_compare_and_swap(lock, 0, 1)) {
 			return;
 		}
+		if (pauses <= SPIN_MAX_PAUSES) {
+			for (i = 0; i < pauses; i++)
+				cpu_pause();
+			pauses *= 2;
+			continue;
+		}
 		ts.tv_sec = 0;
 		ts.tv_nsec = 10000;
 		nanosleep(&ts, NULL);
@@ -79,5 +109,5 @@ void simple_spin_lock(int *lock)
 
 void simple_spin_unlock(int *lock)
 {
-	__sync_bool_compare_and_swap(lock, 1, 0);
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
 }
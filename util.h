@@ -30,8 +30,15 @@
 #ifndef LKSMITH_UTIL_H
 #define LKSMITH_UTIL_H
 
+#include <stdint.h> /* for uint64_t, uintptr_t */
 #include <unistd.h> /* for size_t */
 
+/**
+ * The size of a cache line.  We align hot, independently written structures
+ * to this so that they don't share cache lines.
+ */
+#define LKSMITH_CACHE_LINE 64
+
 /** Write a formatted string to the next available position in a
  * fixed-length buffer
  *
@@ -44,8 +51,44 @@
 void fwdprintf(char *buf, size_t *off, size_t buf_len,
 	const char *fmt, ...) __attribute__((format(printf, 4, 5)));
 
+/**
+ * Hash a pointer.
+ *
+ * Pointers tend to be aligned, so their low bits are mostly zero.  This mixes
+ * all the bits together so that any subset of the result can be used as a
+ * hash table index.
+ *
+ * @param ptr		the pointer
+ *
+ * @return		the hash
+ */
+static inline uint64_t ptr_hash(const void *ptr)
+{
+	uint64_t h = (uintptr_t)ptr;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/**
+ * Take a simple spin lock.
+ *
+ * Waiters busy-wait with exponential backoff, and only start sleeping if the
+ * lock stays busy for a while.
+ *
+ * @param lock		The lock.  0 means unlocked.
+ */
 void simple_spin_lock(int *lock);
 
+/**
+ * Release a simple spin lock.
+ *
+ * @param lock		The lock.
+ */
 void simple_spin_unlock(int *lock);
 
 #endif